@@ -34,6 +34,7 @@ struct aio_t {
   boost::container::small_vector<iovec,4> iov;
   uint64_t offset, length;
   long rval;
+  int fixed_buf = -1;     ///< io_uring registered buffer index, if one is used
   ceph::buffer::list bl;  ///< write payload (so that it remains stable for duration)
 
   boost::intrusive::list_member_hook<> queue_item;
@@ -97,6 +98,12 @@ typedef boost::intrusive::list<
 struct io_queue_t {
   typedef std::list<aio_t>::iterator aio_iter;
 
+  /// the aios of a single IOContext, as handed over by aio_submit()
+  struct aio_range_t {
+    aio_iter begin, end;
+    void *priv;
+  };
+
   virtual ~io_queue_t() {};
 
   virtual int init(std::vector<int> &fds) = 0;
@@ -104,6 +111,20 @@ struct io_queue_t {
   virtual int submit_batch(aio_iter begin, aio_iter end,
 			   void *priv, int *retries) = 0;
   virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+
+  // submit aios of several IOContexts at once.  backends that can
+  // coalesce them into a single syscall override this.
+  virtual int submit_ranges(std::vector<aio_range_t>& ranges, int *retries) {
+    int done = 0;
+    for (auto& r : ranges) {
+      int n = submit_batch(r.begin, r.end, r.priv, retries);
+      if (n < 0) {
+	return n;
+      }
+      done += n;
+    }
+    return done;
+  }
 };
 
 struct aio_queue_t final : public io_queue_t {
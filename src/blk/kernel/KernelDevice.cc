@@ -78,7 +78,12 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   if (use_ioring && ioring_queue_t::supported()) {
     bool use_ioring_hipri = cct->_conf.get_val<bool>("bdev_ioring_hipri");
     bool use_ioring_sqthread_poll = cct->_conf.get_val<bool>("bdev_ioring_sqthread_poll");
-    io_queue = std::make_unique<ioring_queue_t>(iodepth, use_ioring_hipri, use_ioring_sqthread_poll);
+    auto q = std::make_unique<ioring_queue_t>(iodepth, use_ioring_hipri, use_ioring_sqthread_poll);
+    q->fixed_buffers = cct->_conf.get_val<uint64_t>("bdev_ioring_fixed_buffers");
+    q->fixed_buffer_size = cct->_conf.get_val<Option::size_t>("bdev_ioring_fixed_buffer_size");
+    q->reap_spin_us = cct->_conf.get_val<uint64_t>("bdev_ioring_reap_spin_us");
+    io_queue = std::move(q);
+    batch_submit = cct->_conf.get_val<bool>("bdev_ioring_batch_submit");
   } else {
     static bool once;
     if (use_ioring && !once) {
@@ -96,6 +101,8 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   b.set_prio_default(PerfCountersBuilder::PRIO_USEFUL);
   b.add_u64_counter(l_blk_kernel_device_discard_op, "discard_op",
             "Number of discard ops issued to kernel device");
+  b.add_u64_avg(l_blk_kernel_device_submit_batch, "submit_batch",
+            "IOContexts coalesced per batched submission");
 
   logger.reset(b.create_perf_counters());
   cct->get_perfcounters_collection()->add(logger.get());
@@ -961,6 +968,11 @@ void KernelDevice::aio_submit(IOContext *ioc)
   }
 
   void *priv = static_cast<void*>(ioc);
+  if (batch_submit) {
+    _aio_submit_batched({ioc->running_aios.begin(), e, priv});
+    return;
+  }
+
   int r, retries = 0;
   r = io_queue->submit_batch(ioc->running_aios.begin(), e,
 			     priv, &retries);
@@ -973,6 +985,45 @@ void KernelDevice::aio_submit(IOContext *ioc)
   }
 }
 
+/*
+ * Group submission: the first caller to arrive becomes the submitter
+ * and drains the queue, handing everything queued in the meantime to
+ * the kernel at once.  Other callers only enqueue their aios and
+ * return; completion is reported through the usual aio callback or
+ * aio_wait(), so they do not need to wait for the submitter.
+ */
+void KernelDevice::_aio_submit_batched(io_queue_t::aio_range_t&& range)
+{
+  std::unique_lock l(submit_lock);
+  submit_queue.push_back(std::move(range));
+  if (submitting) {
+    return;
+  }
+  submitting = true;
+
+  std::vector<io_queue_t::aio_range_t> batch;
+  while (!submit_queue.empty()) {
+    batch.swap(submit_queue);
+    l.unlock();
+
+    int retries = 0;
+    int r = io_queue->submit_ranges(batch, &retries);
+    logger->inc(l_blk_kernel_device_submit_batch, batch.size());
+    dout(20) << __func__ << " submitted " << r << " aios from "
+	     << batch.size() << " iocs" << dendl;
+    if (retries)
+      derr << __func__ << " retries " << retries << dendl;
+    if (r < 0) {
+      derr << " aio submit got " << cpp_strerror(r) << dendl;
+      ceph_assert(r == 0);
+    }
+    batch.clear();
+
+    l.lock();
+  }
+  submitting = false;
+}
+
 int KernelDevice::_sync_write(uint64_t off, bufferlist &bl, bool buffered, int write_hint)
 {
   uint64_t len = bl.length();
@@ -32,6 +32,7 @@
 enum {
   l_blk_kernel_device_first = 1000,
   l_blk_kernel_device_discard_op,
+  l_blk_kernel_device_submit_batch,
   l_blk_kernel_device_last,
 };
 
@@ -55,6 +56,13 @@ private:
   ceph::mutex flush_mutex = ceph::make_mutex("KernelDevice::flush_mutex");
 
   std::unique_ptr<io_queue_t> io_queue;
+
+  // batched submission, see bdev_ioring_batch_submit
+  bool batch_submit = false;
+  ceph::mutex submit_lock = ceph::make_mutex("KernelDevice::submit_lock");
+  std::vector<io_queue_t::aio_range_t> submit_queue;
+  bool submitting = false;
+
   aio_callback_t discard_callback;
   void *discard_callback_priv;
   bool aio_stop;
@@ -99,6 +107,7 @@ private:
 
   int _aio_start();
   void _aio_stop();
+  void _aio_submit_batched(io_queue_t::aio_range_t&& range);
 
   void _discard_update_threads(bool discard_stop = false);
   void _discard_stop();
@@ -8,6 +8,8 @@
 #include "liburing.h"
 #include <sys/epoll.h>
 
+#include "common/ceph_time.h"
+
 using std::list;
 using std::make_unique;
 
@@ -17,8 +19,33 @@ struct ioring_data {
   pthread_mutex_t sq_mutex;
   int epoll_fd = -1;
   std::map<int, int> fixed_fds_map;
+
+  // registered buffers; free_bufs is protected by buf_mutex as buffers
+  // are taken on the submission side and returned on the completion side
+  std::vector<struct iovec> bufs;
+  std::vector<int> free_bufs;
+  pthread_mutex_t buf_mutex;
 };
 
+static int get_fixed_buf(struct ioring_data *d)
+{
+  int idx = -1;
+  pthread_mutex_lock(&d->buf_mutex);
+  if (!d->free_bufs.empty()) {
+    idx = d->free_bufs.back();
+    d->free_bufs.pop_back();
+  }
+  pthread_mutex_unlock(&d->buf_mutex);
+  return idx;
+}
+
+static void put_fixed_buf(struct ioring_data *d, int idx)
+{
+  pthread_mutex_lock(&d->buf_mutex);
+  d->free_bufs.push_back(idx);
+  pthread_mutex_unlock(&d->buf_mutex);
+}
+
 static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
 			  struct aio_t **paio)
 {
@@ -30,6 +57,10 @@ static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
   io_uring_for_each_cqe(ring, head, cqe) {
     struct aio_t *io = (struct aio_t *)(uintptr_t) io_uring_cqe_get_data(cqe);
     io->rval = cqe->res;
+    if (io->fixed_buf >= 0) {
+      put_fixed_buf(d, io->fixed_buf);
+      io->fixed_buf = -1;
+    }
 
     paio[nr++] = io;
 
@@ -50,6 +81,31 @@ static int find_fixed_fd(struct ioring_data *d, int real_fd)
   return it->second;
 }
 
+/*
+ * Small writes are copied into a pre-registered buffer so the kernel
+ * does not have to pin and map the user pages on every submission.
+ */
+static bool prep_write_fixed(struct ioring_data *d, struct io_uring_sqe *sqe,
+			     int fixed_fd, struct aio_t *io)
+{
+  if (d->bufs.empty() || io->length > d->bufs[0].iov_len)
+    return false;
+
+  int idx = get_fixed_buf(d);
+  if (idx < 0)
+    return false;
+
+  char *p = (char *)d->bufs[idx].iov_base;
+  for (auto& v : io->iov) {
+    memcpy(p, v.iov_base, v.iov_len);
+    p += v.iov_len;
+  }
+  io->fixed_buf = idx;
+  io_uring_prep_write_fixed(sqe, fixed_fd, d->bufs[idx].iov_base,
+			    io->length, io->offset, idx);
+  return true;
+}
+
 static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 		     struct aio_t *io)
 {
@@ -57,10 +113,11 @@ static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 
   ceph_assert(fixed_fd != -1);
 
-  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
-    io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
-			 io->iov.size(), io->offset);
-  else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
+  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV) {
+    if (!prep_write_fixed(d, sqe, fixed_fd, io))
+      io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
+			   io->iov.size(), io->offset);
+  } else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
     io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
 			io->iov.size(), io->offset);
   else
@@ -97,6 +154,57 @@ static int ioring_queue(struct ioring_data *d, void *priv,
   return io_uring_submit(ring);
 }
 
+/*
+ * Queue the aios of several IOContexts and hand them to the kernel with
+ * as few io_uring_enter() calls as possible.  The SQ is only flushed
+ * early when it runs out of free entries.
+ */
+static int ioring_queue_ranges(struct ioring_data *d,
+			       std::vector<io_queue_t::aio_range_t>& ranges,
+			       int *retries)
+{
+  struct io_uring *ring = &d->io_uring;
+  int done = 0;
+  int queued = 0;
+
+  for (auto& r : ranges) {
+    for (auto p = r.begin; p != r.end; ++p) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+      // 2^16 * 125us = ~8 seconds, same as the libaio backend
+      int attempts = 16;
+      int delay = 125;
+      while (!sqe) {
+	int ret = io_uring_submit(ring);
+	if (ret < 0)
+	  return ret;
+	done += ret;
+	queued -= ret;
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+	  if (attempts-- == 0)
+	    return -EAGAIN;
+	  usleep(delay);
+	  delay *= 2;
+	  (*retries)++;
+	}
+      }
+      struct aio_t *io = &*p;
+      io->priv = r.priv;
+      init_sqe(d, sqe, io);
+      ++queued;
+    }
+  }
+
+  while (queued > 0) {
+    int ret = io_uring_submit(ring);
+    if (ret < 0)
+      return ret;
+    done += ret;
+    queued -= ret;
+  }
+  return done;
+}
+
 static void build_fixed_fds_map(struct ioring_data *d,
 				std::vector<int> &fds)
 {
@@ -106,6 +214,42 @@ static void build_fixed_fds_map(struct ioring_data *d,
   }
 }
 
+static void free_fixed_bufs(struct ioring_data *d)
+{
+  if (d->bufs.empty())
+    return;
+  io_uring_unregister_buffers(&d->io_uring);
+  for (auto& v : d->bufs)
+    free(v.iov_base);
+  d->bufs.clear();
+  d->free_bufs.clear();
+}
+
+static int init_fixed_bufs(struct ioring_data *d, unsigned count, size_t size)
+{
+  d->bufs.reserve(count);
+  for (unsigned i = 0; i < count; ++i) {
+    void *p = nullptr;
+    if (posix_memalign(&p, CEPH_PAGE_SIZE, size) != 0) {
+      for (auto& v : d->bufs)
+	free(v.iov_base);
+      d->bufs.clear();
+      return -ENOMEM;
+    }
+    d->bufs.push_back({p, size});
+    d->free_bufs.push_back(i);
+  }
+  int ret = io_uring_register_buffers(&d->io_uring, d->bufs.data(),
+				      d->bufs.size());
+  if (ret < 0) {
+    for (auto& v : d->bufs)
+      free(v.iov_base);
+    d->bufs.clear();
+    d->free_bufs.clear();
+  }
+  return ret;
+}
+
 ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_) :
   d(make_unique<ioring_data>()),
   iodepth(iodepth_),
@@ -124,6 +268,7 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
   pthread_mutex_init(&d->cq_mutex, NULL);
   pthread_mutex_init(&d->sq_mutex, NULL);
+  pthread_mutex_init(&d->buf_mutex, NULL);
 
   if (hipri)
     flags |= IORING_SETUP_IOPOLL;
@@ -143,10 +288,16 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
   build_fixed_fds_map(d.get(), fds);
 
+  if (fixed_buffers && fixed_buffer_size) {
+    ret = init_fixed_bufs(d.get(), fixed_buffers, fixed_buffer_size);
+    if (ret < 0)
+      goto unregister_files;
+  }
+
   d->epoll_fd = epoll_create1(0);
   if (d->epoll_fd < 0) {
     ret = -errno;
-    goto unregister_files;
+    goto free_bufs;
   }
 
   struct epoll_event ev;
@@ -161,6 +312,8 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
 close_epoll_fd:
   close(d->epoll_fd);
+free_bufs:
+  free_fixed_bufs(d.get());
 unregister_files:
   io_uring_unregister_files(&d->io_uring);
 close_ring_fd:
@@ -171,6 +324,7 @@ close_ring_fd:
 
 void ioring_queue_t::shutdown()
 {
+  free_fixed_bufs(d.get());
   d->fixed_fds_map.clear();
   close(d->epoll_fd);
   d->epoll_fd = -1;
@@ -191,13 +345,31 @@ int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
   return rc;
 }
 
+int ioring_queue_t::submit_ranges(std::vector<aio_range_t>& ranges,
+                                  int *retries)
+{
+  pthread_mutex_lock(&d->sq_mutex);
+  int rc = ioring_queue_ranges(d.get(), ranges, retries);
+  pthread_mutex_unlock(&d->sq_mutex);
+
+  return rc;
+}
+
 int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
 {
+  auto spin_until = ceph::mono_clock::now() +
+    std::chrono::microseconds(reap_spin_us);
 get_cqe:
   pthread_mutex_lock(&d->cq_mutex);
   int events = ioring_get_cqe(d.get(), max, paio);
   pthread_mutex_unlock(&d->cq_mutex);
 
+  if (events == 0 && reap_spin_us &&
+      ceph::mono_clock::now() < spin_until) {
+    /* Busy-poll the CQ rather than paying for a sleep and a wakeup */
+    goto get_cqe;
+  }
+
   if (events == 0) {
     struct epoll_event ev;
     int ret = TEMP_FAILURE_RETRY(epoll_wait(d->epoll_fd, &ev, 1, timeout_ms));
@@ -253,6 +425,12 @@ int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
   ceph_assert(0);
 }
 
+int ioring_queue_t::submit_ranges(std::vector<aio_range_t>& ranges,
+                                  int *retries)
+{
+  ceph_assert(0);
+}
+
 int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
 {
   ceph_assert(0);
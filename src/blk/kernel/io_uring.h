@@ -16,6 +16,12 @@ struct ioring_queue_t final : public io_queue_t {
   bool hipri = false;
   bool sq_thread = false;
 
+  // registered buffer pool for small writes, see bdev_ioring_fixed_buffers
+  unsigned fixed_buffers = 0;
+  size_t fixed_buffer_size = 0;
+  // how long to busy-poll the CQ before sleeping in epoll_wait
+  unsigned reap_spin_us = 0;
+
   typedef std::list<aio_t>::iterator aio_iter;
 
   // Returns true if arch is x86-64 and kernel supports io_uring
@@ -29,5 +35,6 @@ struct ioring_queue_t final : public io_queue_t {
 
   int submit_batch(aio_iter begin, aio_iter end,
                    void *priv, int *retries) final;
+  int submit_ranges(std::vector<aio_range_t>& ranges, int *retries) final;
   int get_next_completed(int timeout_ms, aio_t **paio, int max) final;
 };
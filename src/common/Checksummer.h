@@ -7,6 +7,7 @@
 #include "include/buffer.h"
 #include "include/byteorder.h"
 #include "include/ceph_assert.h"
+#include "include/crc32c.h"
 
 #include "xxHash/xxhash.h"
 
@@ -90,6 +91,16 @@ public:
       ) {
       return p.crc32c(len, init_value);
     }
+    static void calc_multi(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t n,
+      const char *data,
+      init_value_t *out
+      ) {
+      ceph_crc32c_multi(init_value, (const unsigned char*)data, len, n, out);
+    }
   };
 
   struct crc32c_16 {
@@ -111,6 +122,19 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xffff;
     }
+    static void calc_multi(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t n,
+      const char *data,
+      init_value_t *out
+      ) {
+      ceph_crc32c_multi(init_value, (const unsigned char*)data, len, n, out);
+      for (size_t i = 0; i < n; ++i) {
+	out[i] &= 0xffff;
+      }
+    }
   };
 
   struct crc32c_8 {
@@ -132,6 +156,19 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xff;
     }
+    static void calc_multi(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t n,
+      const char *data,
+      init_value_t *out
+      ) {
+      ceph_crc32c_multi(init_value, (const unsigned char*)data, len, n, out);
+      for (size_t i = 0; i < n; ++i) {
+	out[i] &= 0xff;
+      }
+    }
   };
 
   struct xxhash32 {
@@ -161,6 +198,19 @@ public:
       }
       return XXH32_digest(state);
     }
+    static void calc_multi(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t n,
+      const char *data,
+      init_value_t *out
+      ) {
+      // the one-shot variant skips the streaming state entirely
+      for (size_t i = 0; i < n; ++i, data += len) {
+	out[i] = XXH32(data, len, init_value);
+      }
+    }
   };
 
   struct xxhash64 {
@@ -190,8 +240,53 @@ public:
       }
       return XXH64_digest(state);
     }
+    static void calc_multi(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      size_t n,
+      const char *data,
+      init_value_t *out
+      ) {
+      // the one-shot variant skips the streaming state entirely
+      for (size_t i = 0; i < n; ++i, data += len) {
+	out[i] = XXH64(data, len, init_value);
+      }
+    }
   };
 
+  /// blocks checksummed per calc_blocks() call by calculate and verify
+  static constexpr size_t BATCH_BLOCKS = 64;
+
+  /// checksum the next n blocks at p into out; runs of whole blocks that
+  /// are contiguous in memory go to Alg::calc_multi() together
+  template<class Alg>
+  static void calc_blocks(
+    typename Alg::state_t state,
+    typename Alg::init_value_t init_value,
+    size_t csum_block_size,
+    size_t n,
+    ceph::buffer::list::const_iterator& p,
+    typename Alg::init_value_t *out) {
+    while (n > 0) {
+      size_t k = std::min<size_t>(
+	n, p.get_current_ptr().length() / csum_block_size);
+      if (k == 0) {
+	// straddles buffers
+	*out++ = Alg::calc(state, init_value, csum_block_size, p);
+	--n;
+	continue;
+      }
+      const char *data;
+      [[maybe_unused]] size_t l =
+	p.get_ptr_and_advance(k * csum_block_size, &data);
+      ceph_assert(l == k * csum_block_size);
+      Alg::calc_multi(state, init_value, csum_block_size, k, data, out);
+      out += k;
+      n -= k;
+    }
+  }
+
   template<class Alg>
   static int calculate(
     size_t csum_block_size,
@@ -225,9 +320,14 @@ public:
     typename Alg::value_t *pv =
       reinterpret_cast<typename Alg::value_t*>(csum_data->c_str());
     pv += offset / csum_block_size;
-    while (blocks--) {
-      *pv = Alg::calc(state, init_value, csum_block_size, p);
-      ++pv;
+    typename Alg::init_value_t v[BATCH_BLOCKS];
+    while (blocks > 0) {
+      size_t n = std::min(blocks, BATCH_BLOCKS);
+      calc_blocks<Alg>(state, init_value, csum_block_size, n, p, v);
+      for (size_t i = 0; i < n; ++i) {
+	*pv++ = v[i];
+      }
+      blocks -= n;
     }
     Alg::fini(&state);
     return 0;
@@ -253,18 +353,23 @@ public:
       reinterpret_cast<const typename Alg::value_t*>(csum_data.c_str());
     pv += offset / csum_block_size;
     size_t pos = offset;
-    while (length > 0) {
-      typename Alg::init_value_t v = Alg::calc(state, -1, csum_block_size, p);
-      if (*pv != v) {
-	if (bad_csum) {
-	  *bad_csum = v;
+    size_t blocks = length / csum_block_size;
+    typename Alg::init_value_t v[BATCH_BLOCKS];
+    while (blocks > 0) {
+      size_t n = std::min(blocks, BATCH_BLOCKS);
+      calc_blocks<Alg>(state, -1, csum_block_size, n, p, v);
+      for (size_t i = 0; i < n; ++i) {
+	if (*pv != v[i]) {
+	  if (bad_csum) {
+	    *bad_csum = v[i];
+	  }
+	  Alg::fini(&state);
+	  return pos;
 	}
-	Alg::fini(&state);
-	return pos;
+	++pv;
+	pos += csum_block_size;
       }
-      ++pv;
-      pos += csum_block_size;
-      length -= csum_block_size;
+      blocks -= n;
     }
     Alg::fini(&state);
     return -1;  // no errors
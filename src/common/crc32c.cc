@@ -9,6 +9,7 @@
 #include "arch/s390x.h"
 #include "common/sctp_crc32.h"
 #include "common/crc32c_intel_fast.h"
+#include "common/crc32c_intel_multi.h"
 #include "common/crc32c_aarch64.h"
 #include "common/crc32c_ppc.h"
 #include "common/crc32c_s390x.h"
@@ -62,6 +63,34 @@ ceph_crc32c_func_t ceph_choose_crc32(void)
 ceph_crc32c_func_t ceph_crc32c_func = ceph_choose_crc32();
 
 
+static void ceph_crc32c_multi_generic(uint32_t crc, unsigned char const *data,
+				      unsigned block_len, unsigned nblocks,
+				      uint32_t *out)
+{
+  for (unsigned i = 0; i < nblocks; ++i) {
+    out[i] = ceph_crc32c_func(crc, data, block_len);
+    data += block_len;
+  }
+}
+
+/*
+ * choose best implementation for checksumming many blocks at once.
+ */
+ceph_crc32c_multi_func_t ceph_choose_crc32_multi(void)
+{
+  ceph_arch_probe();
+
+#if defined(__x86_64__)
+  if (ceph_arch_intel_sse42 && ceph_crc32c_intel_multi_exists()) {
+    return ceph_crc32c_intel_multi;
+  }
+#endif
+  return ceph_crc32c_multi_generic;
+}
+
+ceph_crc32c_multi_func_t ceph_crc32c_multi_func = ceph_choose_crc32_multi();
+
+
 /*
  * Look: http://crcutil.googlecode.com/files/crc-doc.1.0.pdf
  * Here is implementation that goes 1 logical step further,
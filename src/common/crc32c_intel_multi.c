@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "include/crc32c.h"
+#include "common/crc32c_intel_multi.h"
+
+#if defined(__x86_64__) && defined(__SSE4_2__)
+
+#include <nmmintrin.h>
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but can issue every
+ * cycle, so a single stream leaves most of it idle unless it is split
+ * and recombined, which is what the isa-l code does within a buffer.
+ * When there are many equally sized blocks to checksum, each block is
+ * an independent stream already: run four of them side by side and
+ * skip the recombination altogether.
+ */
+#define STREAMS 4
+
+void ceph_crc32c_intel_multi(uint32_t crc, unsigned char const *data,
+			     unsigned block_len, unsigned nblocks,
+			     uint32_t *out)
+{
+	unsigned i, s;
+
+	for (; nblocks >= STREAMS; nblocks -= STREAMS) {
+		uint64_t c[STREAMS];
+		unsigned char const *p[STREAMS];
+
+		for (s = 0; s < STREAMS; s++) {
+			c[s] = crc;
+			p[s] = data + s * block_len;
+		}
+		for (i = 0; i + 8 <= block_len; i += 8) {
+			for (s = 0; s < STREAMS; s++) {
+				uint64_t v;
+				memcpy(&v, p[s] + i, sizeof(v));
+				c[s] = _mm_crc32_u64(c[s], v);
+			}
+		}
+		for (; i < block_len; i++) {
+			for (s = 0; s < STREAMS; s++) {
+				c[s] = _mm_crc32_u8((uint32_t)c[s], p[s][i]);
+			}
+		}
+		for (s = 0; s < STREAMS; s++) {
+			*out++ = (uint32_t)c[s];
+		}
+		data += STREAMS * block_len;
+	}
+	for (; nblocks > 0; nblocks--) {
+		*out++ = ceph_crc32c_func(crc, data, block_len);
+		data += block_len;
+	}
+}
+
+int ceph_crc32c_intel_multi_exists(void)
+{
+	return 1;
+}
+
+#else
+
+int ceph_crc32c_intel_multi_exists(void)
+{
+	return 0;
+}
+
+#ifdef __x86_64__
+void ceph_crc32c_intel_multi(uint32_t crc, unsigned char const *data,
+			     unsigned block_len, unsigned nblocks,
+			     uint32_t *out)
+{
+}
+#endif
+
+#endif
@@ -466,9 +466,12 @@ void PG::prepare_write(pg_info_t &info,
       this);
     ceph_assert(ret == 0);
   }
+  // crimson never sets CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH, keep
+  // one key per dup
   pglog.write_log_and_missing(
     t, &km, coll_ref->get_cid(), pgmeta_oid,
-    peering_state.get_pgpool().info.require_rollback());
+    peering_state.get_pgpool().info.require_rollback(),
+    false);
   if (!km.empty()) {
     t.omap_setkeys(coll_ref->get_cid(), pgmeta_oid, km);
   }
@@ -143,10 +143,9 @@ size_t PGRecovery::start_primary_recovery_ops(
     hobject_t soid;
     version_t v = p->first;
 
-    auto it_objects = pg->get_peering_state().get_pg_log().get_log().objects.find(p->second);
-    if (it_objects != pg->get_peering_state().get_pg_log().get_log().objects.end()) {
+    if (pg_log_entry_t *latest =
+          pg->get_peering_state().get_pg_log().get_log().get_object_entry(p->second)) {
       // look at log!
-      pg_log_entry_t *latest = it_objects->second;
       assert(latest->is_update() || latest->is_delete());
       soid = latest->soid;
     } else {
@@ -389,7 +388,7 @@ PGRecovery::on_local_recover(
       log.get_missing().is_missing(recovery_info.soid) &&
       log.get_missing().get_items().find(recovery_info.soid)->second.need > recovery_info.version) {
     assert(pg->is_primary());
-    if (const auto* latest = log.get_log().objects.find(recovery_info.soid)->second;
+    if (const auto* latest = log.get_log().get_object_entry(recovery_info.soid);
         latest->op == pg_log_entry_t::LOST_REVERT) {
       ceph_abort("mark_unfound_lost (LOST_REVERT) is not implemented yet");
     }
@@ -447,6 +447,21 @@ namespace ceph {
      */
     virtual const std::vector<int> &get_chunk_mapping() const = 0;
 
+    /**
+     * Return true if every coding chunk is a linear function of the
+     * data chunks over XOR, i.e. encoding the XOR of two inputs gives
+     * the XOR of their coding chunks.  Overwriting part of a stripe can
+     * then update the coding chunks from the changed data chunks alone:
+     *
+     *   new_coding = old_coding ^ encode(new_data ^ old_data)
+     *
+     * where the chunks the overwrite leaves alone are zero in the
+     * encoded delta.
+     *
+     * @return **true** if coding chunks can be updated by delta
+     */
+    virtual bool supports_parity_delta_writes() const = 0;
+
     /**
      * Decode the first **get_data_chunk_count()** **chunks** and
      * concatenate them into **decoded**.
@@ -78,6 +78,10 @@ public:
 
   unsigned int get_chunk_size(unsigned int stripe_width) const override;
 
+  bool supports_parity_delta_writes() const override {
+    return true;
+  }
+
   int encode_chunks(const std::set<int> &want_to_encode,
                     std::map<int, ceph::buffer::list> *encoded) override;
 
@@ -56,6 +56,11 @@ public:
 
   unsigned int get_chunk_size(unsigned int stripe_width) const override;
 
+  bool supports_parity_delta_writes() const override {
+    // Reed-Solomon matrices and XOR bit-matrices alike are linear codes
+    return true;
+  }
+
   int encode_chunks(const std::set<int> &want_to_encode,
 		    std::map<int, ceph::buffer::list> *encoded) override;
 
@@ -17,6 +17,18 @@ extern ceph_crc32c_func_t ceph_crc32c_func;
 
 extern ceph_crc32c_func_t ceph_choose_crc32(void);
 
+typedef void (*ceph_crc32c_multi_func_t)(uint32_t crc, unsigned char const *data,
+					 unsigned block_len, unsigned nblocks,
+					 uint32_t *out);
+
+/*
+ * static global with the chosen implementation for checksumming many
+ * equally sized blocks at once.
+ */
+extern ceph_crc32c_multi_func_t ceph_crc32c_multi_func;
+
+extern ceph_crc32c_multi_func_t ceph_choose_crc32_multi(void);
+
 /**
  * calculate crc32c for data that is entirely 0 (ZERO)
  *
@@ -50,6 +62,25 @@ static inline uint32_t ceph_crc32c(uint32_t crc, unsigned char const *data, unsi
   return ceph_crc32c_func(crc, data, length);
 }
 
+/**
+ * calculate crc32c of each of nblocks consecutive blocks
+ *
+ * Same as calling ceph_crc32c(crc, data + i * block_len, block_len) for
+ * every block, but faster where blocks can be done in parallel.
+ *
+ * @param crc initial value for every block
+ * @param data pointer to the first block
+ * @param block_len length of each block
+ * @param nblocks number of blocks
+ * @param out receives nblocks crc values
+ */
+static inline void ceph_crc32c_multi(uint32_t crc, unsigned char const *data,
+				     unsigned block_len, unsigned nblocks,
+				     uint32_t *out)
+{
+  ceph_crc32c_multi_func(crc, data, block_len, nblocks, out);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -196,6 +196,20 @@ public:
 		  ceph::buffer::list *value) {
     return get(prefix, std::string(key, keylen), value);
   }
+  /// Retrieve a batch of keys with a single lookup where the backend
+  /// supports it.  (*values)[i] and (*rs)[i] (0 or -ENOENT) belong to keys[i].
+  virtual void multi_get(
+    const std::string &prefix,                  ///< [in] prefix or CF name
+    const std::vector<std::string> &keys,       ///< [in] keys, in any order
+    std::vector<ceph::buffer::list> *values,    ///< [out] values
+    std::vector<int> *rs) {                     ///< [out] per key results
+    values->clear();
+    values->resize(keys.size());
+    rs->resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      (*rs)[i] = get(prefix, keys[i], &(*values)[i]);
+    }
+  }
 
   // This superclass is used both by kv iterators *and* by the ObjectMap
   // omap iterator.  The class hierarchies are unfortunately tied together
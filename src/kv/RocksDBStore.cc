@@ -7,6 +7,7 @@
 #include <set>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -22,6 +23,7 @@
 #include "rocksdb/utilities/table_properties_collectors.h"
 #include "rocksdb/merge_operator.h"
 
+#include "common/admin_socket.h"
 #include "common/perf_counters.h"
 #include "common/PriorityCache.h"
 #include "include/common_fwd.h"
@@ -55,12 +57,78 @@ using std::vector;
 using ceph::bufferlist;
 using ceph::bufferptr;
 using ceph::Formatter;
+using ceph::common::cmd_getval;
 
 static const char* sharding_def_dir = "sharding";
 static const char* sharding_def_file = "sharding/def";
 static const char* sharding_recreate = "sharding/recreate_columns";
+static const char* sharding_online_reshard = "sharding/online_reshard";
 static const char* resharding_column_lock = "reshardingXcommencingXlocked";
 
+/// name of the column a single column definition refers to
+static std::string_view sharding_column_name(std::string_view column_def)
+{
+  return column_def.substr(0, column_def.find_first_of("(="));
+}
+
+class RocksDBStore::SocketHook : public AdminSocketHook {
+  RocksDBStore* store;
+public:
+  static RocksDBStore::SocketHook* create(RocksDBStore* store)
+  {
+    RocksDBStore::SocketHook* hook = nullptr;
+    AdminSocket* admin_socket = store->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new RocksDBStore::SocketHook(store);
+      int r = admin_socket->register_command("rocksdb reshard online "
+					     "name=column,type=CephString",
+					     hook,
+					     "Reshard one column of the store in the "
+					     "background, e.g. \"O(6,0-8)\"");
+      if (r != 0) {
+	ldout(store->cct, 1) << __func__ << " cannot register SocketHook" << dendl;
+	delete hook;
+	hook = nullptr;
+      } else {
+	r = admin_socket->register_command("rocksdb reshard status",
+					   hook,
+					   "Show progress of online resharding");
+	ceph_assert(r == 0);
+      }
+    }
+    return hook;
+  }
+
+  ~SocketHook() {
+    AdminSocket* admin_socket = store->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  SocketHook(RocksDBStore* store) :
+    store(store) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   const bufferlist&,
+	   Formatter *f,
+	   std::ostream& errss,
+	   bufferlist& out) override {
+    if (command == "rocksdb reshard online") {
+      std::string column;
+      cmd_getval(cmdmap, "column", column);
+      int r = store->start_online_reshard(column, errss);
+      if (r < 0) {
+	return r;
+      }
+      store->dump_online_reshard(f);
+    } else if (command == "rocksdb reshard status") {
+      store->dump_online_reshard(f);
+    } else {
+      errss << "Invalid command" << std::endl;
+      return -ENOSYS;
+    }
+    return 0;
+  }
+};
+
 static bufferlist to_bufferlist(rocksdb::Slice in) {
   bufferlist bl;
   bl.append(bufferptr(in.data(), in.size()));
@@ -650,25 +718,68 @@ rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& pref
   if (iter == cf_handles.end()) {
     return nullptr;
   } else {
-    if (iter->second.handles.size() == 1) {
-      return iter->second.handles[0];
-    } else {
-      return get_key_cf(iter->second, key.data(), key.size());
-    }
+    return get_shard_cf(iter->second, key.data(), key.size());
   }
 }
 
-rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& prefix, const char* key, size_t keylen) {
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& prefix, const char* key, size_t keylen,
+							 rocksdb::ColumnFamilyHandle **stale) {
   auto iter = cf_handles.find(prefix);
   if (iter == cf_handles.end()) {
+    if (stale) {
+      *stale = nullptr;
+    }
     return nullptr;
   } else {
-    if (iter->second.handles.size() == 1) {
-      return iter->second.handles[0];
+    return get_shard_cf(iter->second, key, keylen, stale);
+  }
+}
+
+/**
+ * Returns the column family the key is to be written to. If the column is
+ * being resharded online and the key may still sit in its shard of the old
+ * layout, that shard is returned in stale; nullptr otherwise.
+ */
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_shard_cf(const prefix_shards& shards, const char* key, size_t keylen,
+							rocksdb::ColumnFamilyHandle **stale) {
+  if (stale) {
+    *stale = nullptr;
+  }
+  auto r = shards.reshard.load(std::memory_order_acquire);
+  if (r == nullptr) {
+    if (shards.handles.size() == 1) {
+      return shards.handles[0];
     } else {
-      return get_key_cf(iter->second, key, keylen);
+      return get_key_cf(shards, key, keylen);
     }
   }
+  auto cf = r->target.handles.size() == 1 ?
+    r->target.handles[0] : get_key_cf(r->target, key, keylen);
+  if (stale && !r->done.load(std::memory_order_acquire)) {
+    auto old = shards.handles.size() == 1 ?
+      shards.handles[0] : get_key_cf(shards, key, keylen);
+    if (old != cf) {
+      *stale = old;
+    }
+  }
+  return cf;
+}
+
+/// all column families that may currently hold keys of the column
+const std::vector<rocksdb::ColumnFamilyHandle *>& RocksDBStore::get_shard_handles(const prefix_shards& shards) const {
+  auto r = shards.reshard.load(std::memory_order_acquire);
+  if (r == nullptr) {
+    return shards.handles;
+  }
+  return r->done.load(std::memory_order_acquire) ? r->target.handles : r->both;
+}
+
+RocksDBStore::online_reshard_t* RocksDBStore::get_running_reshard(const prefix_shards& shards) {
+  auto r = shards.reshard.load(std::memory_order_acquire);
+  if (r && !r->done.load(std::memory_order_acquire)) {
+    return r;
+  }
+  return nullptr;
 }
 
 /**
@@ -677,20 +788,19 @@ rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& pref
  * CF handle. In all other cases, we return a nullptr to indicate that the specified bounds cannot necessarily be mapped
  * to a single CF.
  */
-rocksdb::ColumnFamilyHandle *RocksDBStore::check_cf_handle_bounds(const cf_handles_iterator& iter, const IteratorBounds& bounds) {
+rocksdb::ColumnFamilyHandle *RocksDBStore::check_cf_handle_bounds(const prefix_shards& shards, const IteratorBounds& bounds) {
   if (!bounds.lower_bound || !bounds.upper_bound) {
     return nullptr;
   }
-  ceph_assert(iter != cf_handles.end());
-  ceph_assert(iter->second.handles.size() != 1);
-  if (iter->second.hash_l != 0) {
+  ceph_assert(shards.handles.size() != 1);
+  if (shards.hash_l != 0) {
     return nullptr;
   }
-  auto lower_bound_hash_str = get_key_hash_view(iter->second, bounds.lower_bound->data(), bounds.lower_bound->size());
-  auto upper_bound_hash_str = get_key_hash_view(iter->second, bounds.upper_bound->data(), bounds.upper_bound->size());
+  auto lower_bound_hash_str = get_key_hash_view(shards, bounds.lower_bound->data(), bounds.lower_bound->size());
+  auto upper_bound_hash_str = get_key_hash_view(shards, bounds.upper_bound->data(), bounds.upper_bound->size());
   if (lower_bound_hash_str == upper_bound_hash_str) {
     auto key = *bounds.lower_bound;
-    return get_key_cf(iter->second, key.data(), key.size());
+    return get_key_cf(shards, key.data(), key.size());
   } else {
     return nullptr;
   }
@@ -1025,7 +1135,9 @@ int RocksDBStore::verify_sharding(const rocksdb::Options& opt,
 				  std::vector<rocksdb::ColumnFamilyDescriptor>& existing_cfs,
 				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& existing_cfs_shard,
 				  std::vector<rocksdb::ColumnFamilyDescriptor>& missing_cfs,
-				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard)
+				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard,
+				  const std::string& pending_column,
+				  std::vector<rocksdb::ColumnFamilyDescriptor>& pending_cfs)
 {
   rocksdb::Status status;
   std::string stored_sharding_text;
@@ -1086,7 +1198,21 @@ int RocksDBStore::verify_sharding(const rocksdb::Options& opt,
 	emplace_cf(column, i, cf_name, cf_opt);
       }
     }
+    if (column.name == pending_column) {
+      // shards of the column in the other layout of an interrupted
+      // online reshard
+      for (auto& cf_name : rocksdb_cfs) {
+	if (cf_name.substr(0, cf_name.find('-')) == column.name &&
+	    std::find_if(existing_cfs.begin(), existing_cfs.end(),
+			 [&](const rocksdb::ColumnFamilyDescriptor& c) {
+			   return c.name == cf_name;
+			 }) == existing_cfs.end()) {
+	  pending_cfs.emplace_back(cf_name, cf_opt);
+	}
+      }
+    }
   }
+  existing_cfs.insert(existing_cfs.end(), pending_cfs.begin(), pending_cfs.end());
   existing_cfs.emplace_back("default", opt);
 
  if (existing_cfs.size() != rocksdb_cfs.size()) {
@@ -1129,7 +1255,10 @@ int RocksDBStore::do_open(ostream &out,
     dout(1) << __func__ << " load rocksdb options failed" << dendl;
     return r;
   }
+  multiget_async_io = cct->_conf.get_val<bool>("rocksdb_multiget_async_io");
   rocksdb::Status status;
+  std::string pending_reshard;
+  std::vector<rocksdb::ColumnFamilyHandle*> pending_handles;
   if (create_if_missing) {
     status = rocksdb::DB::Open(opt, path, &db);
     if (!status.ok()) {
@@ -1146,10 +1275,23 @@ int RocksDBStore::do_open(ostream &out,
     std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> > existing_cfs_shard;
     std::vector<rocksdb::ColumnFamilyDescriptor> missing_cfs;
     std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> > missing_cfs_shard;
+    std::vector<rocksdb::ColumnFamilyDescriptor> pending_cfs;
 
+    if (opt.env->FileExists(sharding_online_reshard).ok()) {
+      status = rocksdb::ReadFileToString(opt.env, sharding_online_reshard,
+					 &pending_reshard);
+      if (!status.ok()) {
+	derr << __func__ << " cannot read from " << sharding_online_reshard << dendl;
+	return -EIO;
+      }
+      dout(1) << __func__ << " online reshard to " << pending_reshard
+	      << " was interrupted" << dendl;
+    }
     r = verify_sharding(opt,
 			existing_cfs, existing_cfs_shard,
-			missing_cfs, missing_cfs_shard);
+			missing_cfs, missing_cfs_shard,
+			std::string(sharding_column_name(pending_reshard)),
+			pending_cfs);
     if (r < 0) {
       return r;
     }
@@ -1199,7 +1341,8 @@ int RocksDBStore::do_open(ostream &out,
 	derr << status.ToString() << dendl;
 	return -EINVAL;
       }
-      ceph_assert(existing_cfs.size() == existing_cfs_shard.size() + 1);
+      ceph_assert(existing_cfs.size() ==
+		  existing_cfs_shard.size() + pending_cfs.size() + 1);
       ceph_assert(handles.size() == existing_cfs.size());
       dout(10) << __func__ << " existing_cfs=" << existing_cfs.size() << dendl;
       for (size_t i = 0; i < existing_cfs_shard.size(); i++) {
@@ -1209,6 +1352,8 @@ int RocksDBStore::do_open(ostream &out,
 			  existing_cfs_shard[i].first,
 			  handles[i]);
       }
+      pending_handles.assign(handles.begin() + existing_cfs_shard.size(),
+			     handles.end() - 1);
       default_cf = handles[handles.size() - 1];
       must_close_default_cf = true;
 
@@ -1242,6 +1387,10 @@ int RocksDBStore::do_open(ostream &out,
   
   PerfCountersBuilder plb(cct, "rocksdb", l_rocksdb_first, l_rocksdb_last);
   plb.add_time_avg(l_rocksdb_get_latency, "get_latency", "Get latency");
+  plb.add_time_avg(l_rocksdb_multiget_latency, "multiget_latency",
+		   "MultiGet latency");
+  plb.add_u64_counter(l_rocksdb_multiget_keys, "multiget_keys",
+		      "Keys looked up by MultiGet");
   plb.add_time_avg(l_rocksdb_submit_latency, "submit_latency", "Submit Latency");
   plb.add_time_avg(l_rocksdb_submit_sync_latency, "submit_sync_latency", "Submit Sync Latency");
   plb.add_u64_counter(l_rocksdb_compact, "compact", "Compactions");
@@ -1255,9 +1404,29 @@ int RocksDBStore::do_open(ostream &out,
   plb.add_time_avg(l_rocksdb_write_delay_time, "rocksdb_write_delay_time", "Rocksdb write delay time");
   plb.add_time_avg(l_rocksdb_write_pre_and_post_process_time, 
       "rocksdb_write_pre_and_post_time", "total time spent on writing a record, excluding write process");
+  plb.add_u64_counter(l_rocksdb_reshard_keys_scanned, "reshard_keys_scanned",
+		      "Keys scanned by online resharding");
+  plb.add_u64_counter(l_rocksdb_reshard_keys_moved, "reshard_keys_moved",
+		      "Keys moved to another shard by online resharding");
+  plb.add_u64_counter(l_rocksdb_reshard_bytes_moved, "reshard_bytes_moved",
+		      "Bytes moved to another shard by online resharding",
+		      NULL, 0, unit_t(UNIT_BYTES));
+  plb.add_u64(l_rocksdb_reshard_running, "reshard_running",
+	      "Online reshard in progress");
   logger = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 
+  if (!pending_reshard.empty()) {
+    r = resume_online_reshard(pending_reshard, pending_handles, open_readonly);
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  if (!open_readonly) {
+    asok_hook = SocketHook::create(this);
+  }
+
   if (compact_on_mount) {
     derr << "Compacting rocksdb store..." << dendl;
     compact();
@@ -1300,6 +1469,10 @@ void RocksDBStore::close()
     compact_queue_lock.unlock();
   }
 
+  delete asok_hook;
+  asok_hook = nullptr;
+  stop_online_reshard();
+
   if (logger) {
     cct->get_perfcounters_collection()->remove(logger);
     delete logger;
@@ -1313,6 +1486,13 @@ void RocksDBStore::close()
     }
   }
   cf_handles.clear();
+  for (auto& r : online_reshards) {
+    for (auto cf : r->created) {
+      db->DestroyColumnFamilyHandle(cf);
+    }
+  }
+  online_reshards.clear();
+  reshard_active = false;
   if (must_close_default_cf) {
     db->DestroyColumnFamilyHandle(default_cf);
     must_close_default_cf = false;
@@ -1406,7 +1586,7 @@ int64_t RocksDBStore::estimate_prefix_size(const string& prefix,
   uint64_t size = 0;
   auto p_iter = cf_handles.find(prefix);
   if (p_iter != cf_handles.end()) {
-    for (auto cf : p_iter->second.handles) {
+    for (auto cf : get_shard_handles(p_iter->second)) {
       uint64_t s = 0;
       string start = key_prefix + string(1, '\x00');
       string limit = key_prefix + string("\xff\xff\xff\xff");
@@ -1439,8 +1619,8 @@ void RocksDBStore::get_statistics(Formatter *f)
   if (cct->_conf->rocksdb_collect_compaction_stats) {
     vector<rocksdb::ColumnFamilyHandle*> handles;
     handles.push_back(default_cf);
-    for (auto cf : cf_handles) {
-      for (auto shard_cf : cf.second.handles) {
+    for (const auto& cf : cf_handles) {
+      for (auto shard_cf : get_shard_handles(cf.second)) {
         handles.push_back(shard_cf);
       }
     }
@@ -1518,8 +1698,19 @@ struct RocksDBStore::RocksWBHandler: public rocksdb::WriteBatch::Handler {
       db.split_key(key_in, &prefix, &key);
     } else {
       auto it = db.cf_ids_to_prefix.find(column_family_id);
-      ceph_assert(it != db.cf_ids_to_prefix.end());
-      prefix = it->second;
+      if (it != db.cf_ids_to_prefix.end()) {
+	prefix = it->second;
+      } else {
+	// shard created by an online reshard
+	for (auto& r : db.online_reshards) {
+	  for (auto cf : r->created) {
+	    if (cf->GetID() == column_family_id) {
+	      prefix = r->prefix;
+	    }
+	  }
+	}
+	ceph_assert(!prefix.empty());
+      }
       key = key_in.ToString();
     }
     seen << " prefix = " << prefix;
@@ -1564,6 +1755,135 @@ struct RocksDBStore::RocksWBHandler: public rocksdb::WriteBatch::Handler {
   bool Continue() override { return num_seen < 50; }
 };
 
+/**
+ * Re-routes a batch that was built before the layout of a column changed.
+ * Operations on a resharded column that did not go to the key's current
+ * target shard are issued again against the current layout, everything else
+ * is copied as is.
+ *
+ * A batch routed with the target layout already holds, right after each
+ * operation on a key, the delete of that key from its old shard. Such a
+ * delete must stay on the old shard: moved to the target it would erase the
+ * key just written.
+ */
+struct RocksDBStore::RocksWBRerouter: public rocksdb::WriteBatch::Handler {
+  RocksDBStore& db;
+  rocksdb::WriteBatch bat;
+  std::unordered_map<uint32_t, rocksdb::ColumnFamilyHandle*> cfs;
+  std::unordered_map<uint32_t, const std::string*> resharded;
+  /// target shard and key of the previous operation, if it went there
+  rocksdb::ColumnFamilyHandle* last_cf = nullptr;
+  std::string last_key;
+
+  RocksWBRerouter(RocksDBStore& db) : db(db) {
+    cfs.emplace(db.default_cf->GetID(), db.default_cf);
+    for (auto& [prefix, shards] : db.cf_handles) {
+      for (auto cf : shards.handles) {
+	cfs.emplace(cf->GetID(), cf);
+      }
+      if (auto r = shards.reshard.load(std::memory_order_acquire); r) {
+	for (auto cf : r->both) {
+	  cfs.emplace(cf->GetID(), cf);
+	  resharded.emplace(cf->GetID(), &prefix);
+	}
+      }
+    }
+  }
+
+  rocksdb::ColumnFamilyHandle* get_cf(uint32_t column_family_id) {
+    auto it = cfs.find(column_family_id);
+    ceph_assert(it != cfs.end());
+    return it->second;
+  }
+  const std::string* get_resharded(uint32_t column_family_id) {
+    auto it = resharded.find(column_family_id);
+    return it == resharded.end() ? nullptr : it->second;
+  }
+  void set_last(rocksdb::ColumnFamilyHandle* cf, const rocksdb::Slice& key) {
+    last_cf = cf;
+    if (cf) {
+      last_key.assign(key.data(), key.size());
+    }
+  }
+  rocksdb::Status PutCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			const rocksdb::Slice& value) override {
+    if (auto prefix = get_resharded(column_family_id); prefix) {
+      rocksdb::ColumnFamilyHandle* stale;
+      auto cf = db.get_cf_handle(*prefix, key.data(), key.size(), &stale);
+      bat.Put(cf, key, value);
+      if (cf->GetID() == column_family_id) {
+	set_last(cf, key);
+	return rocksdb::Status::OK();
+      }
+      if (stale) {
+	bat.Delete(stale, key);
+      }
+    } else {
+      bat.Put(get_cf(column_family_id), key, value);
+    }
+    set_last(nullptr, key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteCF(uint32_t column_family_id,
+			   const rocksdb::Slice& key) override {
+    if (auto prefix = get_resharded(column_family_id); prefix) {
+      rocksdb::ColumnFamilyHandle* stale;
+      auto cf = db.get_cf_handle(*prefix, key.data(), key.size(), &stale);
+      if (cf->GetID() == column_family_id) {
+	bat.Delete(cf, key);
+	set_last(cf, key);
+	return rocksdb::Status::OK();
+      }
+      if (last_cf == cf && key == rocksdb::Slice(last_key)) {
+	// the old shard delete that goes with the previous operation; once
+	// the move is done the old shards are empty and may be dropped
+	if (stale) {
+	  bat.Delete(get_cf(column_family_id), key);
+	}
+      } else {
+	bat.Delete(cf, key);
+	if (stale) {
+	  bat.Delete(stale, key);
+	}
+      }
+    } else {
+      bat.Delete(get_cf(column_family_id), key);
+    }
+    set_last(nullptr, key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status SingleDeleteCF(uint32_t column_family_id,
+				 const rocksdb::Slice& key) override {
+    if (get_resharded(column_family_id)) {
+      return DeleteCF(column_family_id, key);
+    }
+    bat.SingleDelete(get_cf(column_family_id), key);
+    set_last(nullptr, key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status DeleteRangeCF(uint32_t column_family_id,
+				const rocksdb::Slice& begin_key,
+				const rocksdb::Slice& end_key) override {
+    if (auto prefix = get_resharded(column_family_id); prefix) {
+      for (auto cf : db.get_shard_handles(db.cf_handles.at(*prefix))) {
+	bat.DeleteRange(cf, begin_key, end_key);
+      }
+    } else {
+      bat.DeleteRange(get_cf(column_family_id), begin_key, end_key);
+    }
+    set_last(nullptr, begin_key);
+    return rocksdb::Status::OK();
+  }
+  rocksdb::Status MergeCF(uint32_t column_family_id, const rocksdb::Slice& key,
+			  const rocksdb::Slice& value) override {
+    // columns with a merge operator are never resharded online
+    ceph_assert(!get_resharded(column_family_id));
+    bat.Merge(get_cf(column_family_id), key, value);
+    set_last(nullptr, key);
+    return rocksdb::Status::OK();
+  }
+};
+
 int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t) 
 {
   // enable rocksdb breakdown
@@ -1576,11 +1896,32 @@ int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Tra
   RocksDBTransactionImpl * _t =
     static_cast<RocksDBTransactionImpl *>(t.get());
   woptions.disableWAL = disableWAL;
+  // without an online reshard moving keys a batch routed with the current
+  // layout goes in unlocked; a layout change waits for such submits first
+  std::shared_lock l{reshard_lock, std::defer_lock};
+  unlocked_submits++;
+  if (reshard_active.load() ||
+      _t->reshard_epoch != reshard_epoch.load()) {
+    unlocked_submits--;
+    l.lock();
+  }
+  auto unlocked = make_scope_guard([&] {
+    if (!l.owns_lock()) {
+      unlocked_submits--;
+    }
+  });
   lgeneric_subdout(cct, rocksdb, 30) << __func__;
   RocksWBHandler bat_txc(*this);
   _t->bat.Iterate(&bat_txc);
   *_dout << " Rocksdb transaction: " << bat_txc.seen.str() << dendl;
-  
+
+  if (_t->reshard_epoch != reshard_epoch.load(std::memory_order_relaxed)) {
+    RocksWBRerouter rerouter(*this);
+    rocksdb::Status s = _t->bat.Iterate(&rerouter);
+    ceph_assert(s.ok());
+    _t->bat = std::move(rerouter.bat);
+    _t->reshard_epoch = reshard_epoch.load(std::memory_order_relaxed);
+  }
   rocksdb::Status s = db->Write(woptions, &_t->bat);
   if (!s.ok()) {
     RocksWBHandler rocks_txc(*this);
@@ -1643,6 +1984,18 @@ int RocksDBStore::submit_transaction_sync(KeyValueDB::Transaction t)
 RocksDBStore::RocksDBTransactionImpl::RocksDBTransactionImpl(RocksDBStore *_db)
 {
   db = _db;
+  reshard_epoch = db->reshard_epoch.load(std::memory_order_acquire);
+}
+
+/**
+ * A batch is routed with the layout in effect when its first operation is
+ * added, a layout change before that does not make it stale.
+ */
+void RocksDBStore::RocksDBTransactionImpl::note_layout()
+{
+  if (bat.Count() == 0) {
+    reshard_epoch = db->reshard_epoch.load(std::memory_order_acquire);
+  }
 }
 
 void RocksDBStore::RocksDBTransactionImpl::put_bat(
@@ -1671,9 +2024,14 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const string &k,
   const bufferlist &to_set_bl)
 {
-  auto cf = db->get_cf_handle(prefix, k);
+  note_layout();
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = db->get_cf_handle(prefix, k.data(), k.size(), &stale);
   if (cf) {
     put_bat(bat, cf, k, to_set_bl);
+    if (stale) {
+      bat.Delete(stale, rocksdb::Slice(k));
+    }
   } else {
     string key = combine_strings(prefix, k);
     put_bat(bat, db->default_cf, key, to_set_bl);
@@ -1685,10 +2043,15 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   const char *k, size_t keylen,
   const bufferlist &to_set_bl)
 {
-  auto cf = db->get_cf_handle(prefix, k, keylen);
+  note_layout();
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = db->get_cf_handle(prefix, k, keylen, &stale);
   if (cf) {
     string key(k, keylen);  // fixme?
     put_bat(bat, cf, key, to_set_bl);
+    if (stale) {
+      bat.Delete(stale, rocksdb::Slice(key));
+    }
   } else {
     string key;
     combine_strings(prefix, k, keylen, &key);
@@ -1699,9 +2062,14 @@ void RocksDBStore::RocksDBTransactionImpl::set(
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const string &k)
 {
-  auto cf = db->get_cf_handle(prefix, k);
+  note_layout();
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = db->get_cf_handle(prefix, k.data(), k.size(), &stale);
   if (cf) {
     bat.Delete(cf, rocksdb::Slice(k));
+    if (stale) {
+      bat.Delete(stale, rocksdb::Slice(k));
+    }
   } else {
     bat.Delete(db->default_cf, combine_strings(prefix, k));
   }
@@ -1711,9 +2079,14 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const char *k,
 						 size_t keylen)
 {
-  auto cf = db->get_cf_handle(prefix, k, keylen);
+  note_layout();
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = db->get_cf_handle(prefix, k, keylen, &stale);
   if (cf) {
     bat.Delete(cf, rocksdb::Slice(k, keylen));
+    if (stale) {
+      bat.Delete(stale, rocksdb::Slice(k, keylen));
+    }
   } else {
     string key;
     combine_strings(prefix, k, keylen, &key);
@@ -1724,9 +2097,14 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
 					                 const string &k)
 {
-  auto cf = db->get_cf_handle(prefix, k);
+  note_layout();
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = db->get_cf_handle(prefix, k.data(), k.size(), &stale);
   if (cf) {
     bat.SingleDelete(cf, k);
+    if (stale) {
+      bat.Delete(stale, k);
+    }
   } else {
     bat.SingleDelete(db->default_cf, combine_strings(prefix, k));
   }
@@ -1734,6 +2112,7 @@ void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
 
 void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
 {
+  note_layout();
   auto p_iter = db->cf_handles.find(prefix);
   if (p_iter == db->cf_handles.end()) {
     uint64_t cnt = db->get_delete_range_threshold();
@@ -1752,9 +2131,12 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
     } else {
       bat.PopSavePoint();
     }
+  } else if (auto r = db->get_running_reshard(p_iter->second); r) {
+    rm_range_resharding(prefix, *r, string(), "\xff\xff\xff\xff");
   } else {
-    ceph_assert(p_iter->second.handles.size() >= 1);
-    for (auto cf : p_iter->second.handles) {
+    auto& handles = db->get_shard_handles(p_iter->second);
+    ceph_assert(handles.size() >= 1);
+    for (auto cf : handles) {
       uint64_t cnt = db->get_delete_range_threshold();
       bat.SetSavePoint();
       auto it = db->new_shard_iterator(cf);
@@ -1776,6 +2158,7 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
                                                          const string &start,
                                                          const string &end)
 {
+  note_layout();
   ldout(db->cct, 10) << __func__
                      << " enter prefix=" << prefix
                      << " start=" << pretty_binary_string(start)
@@ -1805,18 +2188,22 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
       bat.PopSavePoint();
     }
   } else if (cnt == 0) {
-    ceph_assert(p_iter->second.handles.size() >= 1);
-    for (auto cf : p_iter->second.handles) {
+    auto& handles = db->get_shard_handles(p_iter->second);
+    ceph_assert(handles.size() >= 1);
+    for (auto cf : handles) {
       ldout(db->cct, 10) << __func__ << " p_iter != end(), resorting to DeleteRange"
 			   << dendl;
 	bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
     }
+  } else if (auto r = db->get_running_reshard(p_iter->second); r) {
+    rm_range_resharding(prefix, *r, start, end);
   } else {
     auto bounds = KeyValueDB::IteratorBounds();
     bounds.lower_bound = start;
     bounds.upper_bound = end;
-    ceph_assert(p_iter->second.handles.size() >= 1);
-    for (auto cf : p_iter->second.handles) {
+    auto& handles = db->get_shard_handles(p_iter->second);
+    ceph_assert(handles.size() >= 1);
+    for (auto cf : handles) {
       cnt = db->get_delete_range_threshold();
       uint64_t cnt0 = cnt;
       bat.SetSavePoint();
@@ -1842,11 +2229,43 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
   ldout(db->cct, 10) << __func__ << " end" << dendl;
 }
 
+/**
+ * Range removal for a column that is being resharded online. Keys may be
+ * moved to their new shard before this batch is applied, so they are
+ * removed by key from both layouts rather than from the shard they were
+ * found in.
+ */
+void RocksDBStore::RocksDBTransactionImpl::rm_range_resharding(
+  const string &prefix,
+  const online_reshard_t& r,
+  const string &start,
+  const string &end)
+{
+  uint64_t cnt = db->get_delete_range_threshold();
+  bat.SetSavePoint();
+  auto it = db->get_iterator(prefix);
+  for (it->lower_bound(start);
+       it->valid() && db->comparator->Compare(it->key(), end) < 0 && (--cnt) != 0;
+       it->next()) {
+    rmkey(prefix, it->key());
+  }
+  if (cnt == 0) {
+    ldout(db->cct, 10) << __func__ << " resorting to DeleteRange" << dendl;
+    bat.RollbackToSavePoint();
+    for (auto cf : r.both) {
+      bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
+    }
+  } else {
+    bat.PopSavePoint();
+  }
+}
+
 void RocksDBStore::RocksDBTransactionImpl::merge(
   const string &prefix,
   const string &k,
   const bufferlist &to_set_bl)
 {
+  note_layout();
   auto cf = db->get_cf_handle(prefix, k);
   if (cf) {
     // bufferlist::c_str() is non-constant, so we can't call c_str()
@@ -1887,40 +2306,100 @@ int RocksDBStore::get(
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
-  rocksdb::PinnableSlice value;
+  vector<string> kv(keys.begin(), keys.end());
+  vector<bufferlist> values;
+  vector<int> rs;
+  multi_get(prefix, kv, &values, &rs);
+  for (size_t i = 0; i < kv.size(); ++i) {
+    if (rs[i] == 0) {
+      (*out)[kv[i]] = std::move(values[i]);
+    }
+  }
+  return 0;
+}
+
+void RocksDBStore::multi_get(
+    const string &prefix,
+    const vector<string> &keys,
+    vector<bufferlist> *values,
+    vector<int> *rs)
+{
+  size_t n = keys.size();
+  values->clear();
+  values->resize(n);
+  rs->assign(n, -ENOENT);
+  if (n == 0) {
+    return;
+  }
+  if (n == 1) {
+    (*rs)[0] = get(prefix, keys[0], &(*values)[0]);
+    return;
+  }
   utime_t start = ceph_clock_now();
-  if (cf_handles.count(prefix) > 0) {
-    for (auto& key : keys) {
-      auto cf_handle = get_cf_handle(prefix, key);
-      auto status = db->Get(rocksdb::ReadOptions(),
-			    cf_handle,
-			    rocksdb::Slice(key),
-			    &value);
-      if (status.ok()) {
-	(*out)[key].append(value.data(), value.size());
-      } else if (status.IsIOError()) {
-	ceph_abort_msg(status.getState());
-      }
-      value.Reset();
+  vector<rocksdb::ColumnFamilyHandle*> cfs(n);
+  vector<rocksdb::Slice> slices;
+  slices.reserve(n);
+  // backing store for prefixed keys, reserved so that slices stay valid
+  vector<string> combined;
+  auto p_iter = cf_handles.find(prefix);
+  bool sharded = p_iter != cf_handles.end();
+  if (!sharded) {
+    combined.reserve(n);
+  } else if (get_running_reshard(p_iter->second)) {
+    // keys may be in either layout, look them up one by one
+    for (size_t i = 0; i < n; ++i) {
+      (*rs)[i] = get(prefix, keys[i], &(*values)[i]);
     }
-  } else {
-    for (auto& key : keys) {
-      string k = combine_strings(prefix, key);
-      auto status = db->Get(rocksdb::ReadOptions(),
-			    default_cf,
-			    rocksdb::Slice(k),
-			    &value);
-      if (status.ok()) {
-	(*out)[key].append(value.data(), value.size());
-      } else if (status.IsIOError()) {
-	ceph_abort_msg(status.getState());
-      }
-      value.Reset();
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (sharded) {
+      cfs[i] = get_cf_handle(prefix, keys[i]);
+      slices.emplace_back(keys[i]);
+    } else {
+      cfs[i] = default_cf;
+      combined.push_back(combine_strings(prefix, keys[i]));
+      slices.emplace_back(combined.back());
+    }
+  }
+  vector<rocksdb::PinnableSlice> pinned(n);
+  vector<rocksdb::Status> statuses(n);
+  rocksdb::ReadOptions opts;
+  opts.async_io = multiget_async_io;
+  db->MultiGet(opts, n, cfs.data(), slices.data(), pinned.data(),
+	       statuses.data());
+  for (size_t i = 0; i < n; ++i) {
+    if (statuses[i].ok()) {
+      (*values)[i].append(pinned[i].data(), pinned[i].size());
+      (*rs)[i] = 0;
+    } else if (!statuses[i].IsNotFound()) {
+      ceph_abort_msg(statuses[i].getState());
     }
   }
   utime_t lat = ceph_clock_now() - start;
-  logger->tinc(l_rocksdb_get_latency, lat);
-  return 0;
+  logger->tinc(l_rocksdb_multiget_latency, lat);
+  logger->inc(l_rocksdb_multiget_keys, n);
+}
+
+/**
+ * Point lookup in a column that may be resharded online: a key not found in
+ * its shard may still be in its old one, or have been moved out of there
+ * after the first lookup.
+ */
+rocksdb::Status RocksDBStore::get_from_shard(
+  rocksdb::ColumnFamilyHandle *cf,
+  rocksdb::ColumnFamilyHandle *stale,
+  const rocksdb::Slice& key,
+  rocksdb::PinnableSlice *value)
+{
+  rocksdb::Status s = db->Get(rocksdb::ReadOptions(), cf, key, value);
+  if (s.IsNotFound() && stale) {
+    s = db->Get(rocksdb::ReadOptions(), stale, key, value);
+    if (s.IsNotFound()) {
+      s = db->Get(rocksdb::ReadOptions(), cf, key, value);
+    }
+  }
+  return s;
 }
 
 int RocksDBStore::get(
@@ -1933,12 +2412,10 @@ int RocksDBStore::get(
   int r = 0;
   rocksdb::PinnableSlice value;
   rocksdb::Status s;
-  auto cf = get_cf_handle(prefix, key);
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = get_cf_handle(prefix, key.data(), key.size(), &stale);
   if (cf) {
-    s = db->Get(rocksdb::ReadOptions(),
-		cf,
-		rocksdb::Slice(key),
-		&value);
+    s = get_from_shard(cf, stale, rocksdb::Slice(key), &value);
   } else {
     string k = combine_strings(prefix, key);
     s = db->Get(rocksdb::ReadOptions(),
@@ -1969,12 +2446,10 @@ int RocksDBStore::get(
   int r = 0;
   rocksdb::PinnableSlice value;
   rocksdb::Status s;
-  auto cf = get_cf_handle(prefix, key, keylen);
+  rocksdb::ColumnFamilyHandle *stale;
+  auto cf = get_cf_handle(prefix, key, keylen, &stale);
   if (cf) {
-    s = db->Get(rocksdb::ReadOptions(),
-		cf,
-		rocksdb::Slice(key, keylen),
-		&value);
+    s = get_from_shard(cf, stale, rocksdb::Slice(key, keylen), &value);
   } else {
     string k;
     combine_strings(prefix, key, keylen, &k);
@@ -2042,8 +2517,8 @@ void RocksDBStore::compact()
   logger->inc(l_rocksdb_compact);
   rocksdb::CompactRangeOptions options;
   db->CompactRange(options, default_cf, nullptr, nullptr);
-  for (auto cf : cf_handles) {
-    for (auto shard_cf : cf.second.handles) {
+  for (const auto& cf : cf_handles) {
+    for (auto shard_cf : get_shard_handles(cf.second)) {
       db->CompactRange(
 	options,
 	shard_cf,
@@ -2151,7 +2626,7 @@ void RocksDBStore::compact_range(const string& start, const string& end)
 			    const std::string& end) {
     rocksdb::Slice cstart(start);
     rocksdb::Slice cend(end);
-    for (const auto& shard_it : column_it->second.handles) {
+    for (const auto& shard_it : get_shard_handles(column_it->second)) {
       db->CompactRange(options, shard_it, &cstart, &cend);
     }
   };
@@ -2925,18 +3400,23 @@ private:
   const KeyValueDB::IteratorBounds bounds;
   const rocksdb::Slice iterate_lower_bound;
   const rocksdb::Slice iterate_upper_bound;
+  const rocksdb::Snapshot* snapshot;
   std::vector<rocksdb::Iterator*> iters;
 public:
+  /// takes ownership of snapshot, if any
   explicit ShardMergeIteratorImpl(const RocksDBStore* db,
 				  const std::string& prefix,
 				  const std::vector<rocksdb::ColumnFamilyHandle*>& shards,
-                  KeyValueDB::IteratorBounds bounds_)
+                  KeyValueDB::IteratorBounds bounds_,
+				  const rocksdb::Snapshot* snapshot = nullptr)
     : db(db), keyless(db->comparator), prefix(prefix), bounds(std::move(bounds_)),
       iterate_lower_bound(make_slice(bounds.lower_bound)),
-      iterate_upper_bound(make_slice(bounds.upper_bound))
+      iterate_upper_bound(make_slice(bounds.upper_bound)),
+      snapshot(snapshot)
   {
     iters.reserve(shards.size());
     auto options = rocksdb::ReadOptions();
+    options.snapshot = snapshot;
     if (db->cct->_conf->osd_rocksdb_iterator_bounds_enabled) {
       if (bounds.lower_bound) {
         options.iterate_lower_bound = &iterate_lower_bound;
@@ -2953,6 +3433,9 @@ public:
     for (auto& it : iters) {
       delete it;
     }
+    if (snapshot) {
+      db->db->ReleaseSnapshot(snapshot);
+    }
   }
   int seek_to_first() override {
     for (auto& it : iters) {
@@ -3131,11 +3614,25 @@ KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix, Itera
 {
   auto cf_it = cf_handles.find(prefix);
   if (cf_it != cf_handles.end()) {
+    const prefix_shards* shards = &cf_it->second;
+    if (auto r = shards->reshard.load(std::memory_order_acquire); r) {
+      if (!r->done.load(std::memory_order_acquire)) {
+	// every key is in exactly one shard of either layout at any
+	// snapshot, so merging all of them under one snapshot is exact
+	return std::make_shared<ShardMergeIteratorImpl>(
+	  this,
+	  prefix,
+	  r->both,
+	  std::move(bounds),
+	  db->GetSnapshot());
+      }
+      shards = &r->target;
+    }
     rocksdb::ColumnFamilyHandle* cf = nullptr;
-    if (cf_it->second.handles.size() == 1) {
-      cf = cf_it->second.handles[0];
+    if (shards->handles.size() == 1) {
+      cf = shards->handles[0];
     } else if (cct->_conf->osd_rocksdb_iterator_bounds_enabled) {
-      cf = check_cf_handle_bounds(cf_it, bounds);
+      cf = check_cf_handle_bounds(*shards, bounds);
     }
     if (cf) {
       return std::make_shared<CFIteratorImpl>(
@@ -3147,7 +3644,7 @@ KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix, Itera
       return std::make_shared<ShardMergeIteratorImpl>(
         this,
         prefix,
-        cf_it->second.handles,
+        shards->handles,
         std::move(bounds));
     }
   } else {
@@ -3586,6 +4083,9 @@ int RocksDBStore::reshard(const std::string& new_sharding, const RocksDBStore::r
     derr << __func__ << " cannot write to " << sharding_def_file << dendl;
     return -EIO;
   }
+  // every column is in its final layout, including one that was being
+  // resharded online
+  env->DeleteFile(sharding_online_reshard);
 
   return r;
 }
@@ -3608,3 +4108,545 @@ bool RocksDBStore::get_sharding(std::string& sharding) {
   }
   return result;
 }
+
+/**
+ * Replaces the definition of one column in the stored sharding. During an
+ * online reshard the stored sharding keeps the old layout and
+ * sharding_online_reshard holds the target one until every key is moved.
+ */
+int RocksDBStore::write_sharding_column(const std::string& column_def)
+{
+  rocksdb::Env* db_env = db->GetEnv();
+  std::string stored_sharding_text;
+  rocksdb::ReadFileToString(db_env, sharding_def_file, &stored_sharding_text);
+  auto name = sharding_column_name(column_def);
+  std::string sharding_text;
+  for (auto& column : get_str_list(stored_sharding_text, " ")) {
+    if (!sharding_text.empty()) {
+      sharding_text += " ";
+    }
+    sharding_text += sharding_column_name(column) == name ? column_def : column;
+  }
+  db_env->CreateDir(sharding_def_dir);
+  rocksdb::Status status = rocksdb::WriteStringToFile(db_env, sharding_text,
+						      sharding_def_file, true);
+  if (!status.ok()) {
+    derr << __func__ << " cannot write to " << sharding_def_file << dendl;
+    return -EIO;
+  }
+  dout(5) << __func__ << " sharding=" << sharding_text << dendl;
+  return 0;
+}
+
+/// whether shards are laid out as column describes
+static bool same_sharding(const std::vector<rocksdb::ColumnFamilyHandle *>& handles,
+			  uint32_t hash_l, uint32_t hash_h,
+			  const RocksDBStore::ColumnFamily& column)
+{
+  return handles.size() == column.shard_cnt &&
+    (column.shard_cnt == 1 ||
+     (hash_l == column.hash_l && hash_h == column.hash_h));
+}
+
+int RocksDBStore::start_online_reshard(const std::string& column_def, std::ostream& ss)
+{
+  std::vector<ColumnFamily> def;
+  char const* error_position;
+  std::string error_msg;
+  if (!parse_sharding_def(column_def, def, &error_position, &error_msg)) {
+    ss << "bad column definition at " << (error_position - column_def.data())
+       << ": " << error_msg;
+    return -EINVAL;
+  }
+  if (def.size() != 1) {
+    ss << "expecting exactly one column definition";
+    return -EINVAL;
+  }
+  auto& column = def[0];
+  if (!column.options.empty()) {
+    ss << "column options can only be changed by offline resharding";
+    return -EINVAL;
+  }
+  if (column.shard_cnt < 1 || column.hash_l >= column.hash_h) {
+    ss << "bad shard count or hash range";
+    return -EINVAL;
+  }
+  auto p_iter = cf_handles.find(column.name);
+  if (p_iter == cf_handles.end()) {
+    ss << "column " << column.name << " is not sharded, "
+       << "moving it out of the default column family requires offline resharding";
+    return -ENOTSUP;
+  }
+  for (auto& [prefix, mop] : merge_ops) {
+    if (prefix == column.name) {
+      ss << "column " << column.name << " has a merge operator, "
+	 << "it can only be resharded offline";
+      return -ENOTSUP;
+    }
+  }
+  auto& shards = p_iter->second;
+
+  std::lock_guard l{online_reshard_thread_lock};
+  if (shards.reshard.load(std::memory_order_acquire)) {
+    ss << "column " << column.name << " was already resharded online, "
+       << "it must be reopened before resharding it again";
+    return -EBUSY;
+  }
+  if (online_reshard_running) {
+    ss << "online reshard of " << online_reshards.back()->prefix
+       << " in progress";
+    return -EBUSY;
+  }
+  if (same_sharding(shards.handles, shards.hash_l, shards.hash_h, column)) {
+    ss << "column " << column.name << " already has this sharding";
+    return -EEXIST;
+  }
+
+  dout(1) << __func__ << " " << column_def << dendl;
+  // recorded before any shard is created, so that an interrupted reshard
+  // is resumed at the next open
+  rocksdb::Env* db_env = db->GetEnv();
+  db_env->CreateDir(sharding_def_dir);
+  rocksdb::Status status = rocksdb::WriteStringToFile(
+    db_env, column_def, sharding_online_reshard, true);
+  if (!status.ok()) {
+    derr << __func__ << " cannot write to " << sharding_online_reshard << dendl;
+    return -EIO;
+  }
+  std::unique_ptr<online_reshard_t> reshard;
+  int r = prepare_online_reshard(shards, column, column_def, {}, true, &reshard);
+  if (r < 0) {
+    db_env->DeleteFile(sharding_online_reshard);
+    return r;
+  }
+  run_online_reshard(std::move(reshard), true);
+  return 0;
+}
+
+/**
+ * Builds the layouts of an online reshard of shards to column. Target
+ * shards are taken from the existing ones, from opened (which the reshard
+ * then owns) or, if create is set, created; otherwise a missing target
+ * shard fails with -ENOENT.
+ */
+int RocksDBStore::prepare_online_reshard(
+  prefix_shards& shards,
+  const ColumnFamily& column,
+  const std::string& column_def,
+  const std::vector<rocksdb::ColumnFamilyHandle *>& opened,
+  bool create,
+  std::unique_ptr<online_reshard_t>* out)
+{
+  auto reshard = std::make_unique<online_reshard_t>();
+  reshard->prefix = column.name;
+  reshard->column_def = column_def;
+  reshard->target.hash_l = column.hash_l;
+  reshard->target.hash_h = column.hash_h;
+  reshard->both = shards.handles;
+  std::vector<rocksdb::ColumnFamilyHandle *> new_cfs;
+  auto cleanup = [&] {
+    for (auto cf : new_cfs) {
+      db->DropColumnFamily(cf);
+      db->DestroyColumnFamilyHandle(cf);
+    }
+  };
+  for (size_t idx = 0; idx < column.shard_cnt; idx++) {
+    std::string cf_name = column.shard_cnt == 1 ?
+      column.name : column.name + "-" + std::to_string(idx);
+    auto by_name = [&](rocksdb::ColumnFamilyHandle* h) {
+      return h->GetName() == cf_name;
+    };
+    auto found = std::find_if(shards.handles.begin(), shards.handles.end(), by_name);
+    if (found != shards.handles.end()) {
+      reshard->target.handles.push_back(*found);
+      continue;
+    }
+    rocksdb::ColumnFamilyHandle *cf;
+    if (auto o = std::find_if(opened.begin(), opened.end(), by_name);
+	o != opened.end()) {
+      cf = *o;
+    } else if (!create) {
+      cleanup();
+      return -ENOENT;
+    } else {
+      // new shards take the options of the existing ones
+      rocksdb::ColumnFamilyDescriptor desc;
+      rocksdb::Status status = shards.handles[0]->GetDescriptor(&desc);
+      if (status.ok()) {
+	status = db->CreateColumnFamily(desc.options, cf_name, &cf);
+      }
+      if (!status.ok()) {
+	derr << __func__ << " Failed to create rocksdb column family: "
+	     << cf_name << ": " << status.ToString() << dendl;
+	cleanup();
+	return -EIO;
+      }
+      dout(10) << __func__ << " created column " << cf_name << dendl;
+      new_cfs.push_back(cf);
+    }
+    reshard->target.handles.push_back(cf);
+    reshard->created.push_back(cf);
+    reshard->both.push_back(cf);
+  }
+  for (auto cf : opened) {
+    if (std::find(reshard->created.begin(), reshard->created.end(), cf) ==
+	reshard->created.end()) {
+      derr << __func__ << " column " << cf->GetName() << " is not part of "
+	   << column_def << dendl;
+      cleanup();
+      return -EIO;
+    }
+  }
+  for (auto cf : shards.handles) {
+    if (std::find(reshard->target.handles.begin(), reshard->target.handles.end(), cf) ==
+	reshard->target.handles.end()) {
+      reshard->dropped.push_back(cf);
+    }
+  }
+  *out = std::move(reshard);
+  return 0;
+}
+
+/// publishes the layouts of reshard and, if move is set, starts moving keys
+void RocksDBStore::run_online_reshard(std::unique_ptr<online_reshard_t> reshard,
+				      bool move)
+{
+  ceph_assert(ceph_mutex_is_locked(online_reshard_thread_lock));
+  auto& shards = cf_handles.at(reshard->prefix);
+  reshard->started = ceph_clock_now();
+  // submits take reshard_lock from now on, let those already past that
+  // decision finish before the layout changes under them
+  reshard_active = true;
+  while (unlocked_submits.load()) {
+    std::this_thread::yield();
+  }
+  {
+    // batches routed with the old layout are re-routed at submit
+    std::unique_lock rl{reshard_lock};
+    shards.reshard.store(reshard.get(), std::memory_order_release);
+    online_reshards.push_back(std::move(reshard));
+    reshard_epoch++;
+  }
+  if (!move) {
+    return;
+  }
+  logger->set(l_rocksdb_reshard_running, 1);
+  online_reshard_running = true;
+  if (online_reshard_thread.is_started()) {
+    online_reshard_thread.join();
+  }
+  online_reshard_thread.create("rocksdb_reshard");
+}
+
+/**
+ * Picks up an online reshard to column_def that was interrupted by close
+ * or a crash. opened holds the shards of the column that exist but are
+ * not in the stored sharding; it is consumed.
+ *
+ * Until the move completes the stored sharding describes the old layout
+ * and keys sit in exactly one shard of either layout, so the move can
+ * simply run again. If the stored sharding already describes the target
+ * layout the move completed and only the emptied old shards are left.
+ * Read-only opens use both layouts without moving anything.
+ */
+int RocksDBStore::resume_online_reshard(
+  const std::string& column_def,
+  std::vector<rocksdb::ColumnFamilyHandle *>& opened,
+  bool open_readonly)
+{
+  auto release_opened = [&] {
+    for (auto cf : opened) {
+      db->DestroyColumnFamilyHandle(cf);
+    }
+    opened.clear();
+  };
+  std::vector<ColumnFamily> def;
+  if (!parse_sharding_def(column_def, def) || def.size() != 1) {
+    derr << __func__ << " bad online reshard " << column_def << dendl;
+    release_opened();
+    return -EIO;
+  }
+  auto& column = def[0];
+  auto p_iter = cf_handles.find(column.name);
+  if (p_iter == cf_handles.end()) {
+    derr << __func__ << " online reshard of unknown column " << column_def << dendl;
+    release_opened();
+    return -EIO;
+  }
+  auto& shards = p_iter->second;
+  rocksdb::Env* db_env = db->GetEnv();
+
+  if (same_sharding(shards.handles, shards.hash_l, shards.hash_h, column)) {
+    dout(1) << __func__ << " online reshard to " << column_def
+	    << " had completed" << dendl;
+    if (!open_readonly) {
+      for (auto cf : opened) {
+	std::unique_ptr<rocksdb::Iterator> it{
+	  db->NewIterator(rocksdb::ReadOptions(), cf)};
+	ceph_assert(it);
+	it->SeekToFirst();
+	if (it->Valid()) {
+	  derr << __func__ << " column " << cf->GetName()
+	       << " of the old sharding is not empty" << dendl;
+	  release_opened();
+	  return -EIO;
+	}
+	dout(5) << __func__ << " dropping column " << cf->GetName() << dendl;
+	if (rocksdb::Status status = db->DropColumnFamily(cf); !status.ok()) {
+	  derr << __func__ << " Failed to drop column: " << cf->GetName() << dendl;
+	  release_opened();
+	  return -EIO;
+	}
+      }
+      db_env->DeleteFile(sharding_online_reshard);
+    }
+    release_opened();
+    return 0;
+  }
+
+  std::unique_ptr<online_reshard_t> reshard;
+  int r = prepare_online_reshard(shards, column, column_def, opened,
+				 !open_readonly, &reshard);
+  if (r == -ENOENT) {
+    // interrupted before all target shards were created, so before the
+    // first key was moved
+    ceph_assert(open_readonly);
+    dout(1) << __func__ << " online reshard to " << column_def
+	    << " had not started moving keys" << dendl;
+    release_opened();
+    return 0;
+  }
+  if (r < 0) {
+    release_opened();
+    return r;
+  }
+  opened.clear();
+  dout(1) << __func__ << " resuming online reshard to " << column_def << dendl;
+  std::lock_guard l{online_reshard_thread_lock};
+  run_online_reshard(std::move(reshard), !open_readonly);
+  return 0;
+}
+
+void RocksDBStore::stop_online_reshard()
+{
+  {
+    std::lock_guard l{online_reshard_thread_lock};
+    online_reshard_stop = true;
+    online_reshard_cond.notify_all();
+  }
+  if (online_reshard_thread.is_started()) {
+    dout(1) << __func__ << " waiting for online reshard thread to stop" << dendl;
+    online_reshard_thread.join();
+  }
+  online_reshard_stop = false;
+}
+
+void RocksDBStore::online_reshard_thread_entry()
+{
+  online_reshard_t* r;
+  {
+    std::lock_guard l{online_reshard_thread_lock};
+    r = online_reshards.back().get();
+  }
+  dout(5) << __func__ << " resharding " << r->column_def << dendl;
+  int ret = online_reshard_move(*r);
+  if (ret == 0) {
+    ret = online_reshard_finish(*r);
+  }
+  std::lock_guard l{online_reshard_thread_lock};
+  r->result = ret;
+  r->finished = ceph_clock_now();
+  online_reshard_running = false;
+  if (ret == -ECANCELED) {
+    dout(1) << __func__ << " online reshard of " << r->prefix
+	    << " interrupted, it resumes when the store is opened again"
+	    << dendl;
+  } else if (ret < 0) {
+    derr << __func__ << " online reshard of " << r->prefix
+	 << " failed: " << cpp_strerror(ret) << dendl;
+  } else {
+    dout(1) << __func__ << " resharded " << r->column_def
+	    << ", moved " << r->keys_moved.load() << " keys in "
+	    << (r->finished - r->started) << dendl;
+  }
+  logger->set(l_rocksdb_reshard_running, 0);
+}
+
+/**
+ * Moves every key of the old layout that belongs to another shard in the
+ * target layout. Each batch is read from a snapshot without holding off
+ * submits; with submits held off the batch is then checked against the
+ * current state of its keys, so that no concurrent update can be
+ * overwritten by an old value, and written. Only deletes reach the old
+ * shards meanwhile, so one pass is enough.
+ */
+int RocksDBStore::online_reshard_move(online_reshard_t& r)
+{
+  auto& shards = cf_handles.at(r.prefix);
+  for (auto cf : shards.handles) {
+    dout(10) << __func__ << " processing column " << cf->GetName() << dendl;
+    std::string cursor;
+    bool end = false;
+    while (!end) {
+      uint64_t keys_per_batch =
+	cct->_conf.get_val<uint64_t>("rocksdb_online_reshard_keys_per_batch");
+      uint64_t bytes_per_sec =
+	cct->_conf.get_val<Option::size_t>("rocksdb_online_reshard_bytes_per_sec");
+      uint64_t scanned = 0;
+      uint64_t moved = 0;
+      uint64_t bytes = 0;
+      const rocksdb::Snapshot* snapshot = db->GetSnapshot();
+      auto release_snapshot = make_scope_guard([&] {
+	db->ReleaseSnapshot(snapshot);
+      });
+      struct move_t {
+	rocksdb::ColumnFamilyHandle* target;
+	std::string key;
+	std::string value;
+      };
+      std::vector<move_t> batch;
+      {
+	rocksdb::ReadOptions ropts;
+	ropts.snapshot = snapshot;
+	std::unique_ptr<rocksdb::Iterator> it{db->NewIterator(ropts, cf)};
+	ceph_assert(it);
+	for (it->Seek(cursor); it->Valid() && scanned < keys_per_batch; it->Next()) {
+	  ++scanned;
+	  rocksdb::Slice key = it->key();
+	  auto target = get_shard_cf(r.target, key.data(), key.size());
+	  if (target == cf) {
+	    continue;
+	  }
+	  batch.push_back({target, key.ToString(), it->value().ToString()});
+	}
+	if (!it->status().ok()) {
+	  derr << __func__ << " iterating " << cf->GetName() << " failed: "
+	       << it->status().ToString() << dendl;
+	  return -EIO;
+	}
+	if (it->Valid()) {
+	  cursor = it->key().ToString();
+	} else {
+	  end = true;
+	}
+      }
+      if (!batch.empty()) {
+	rocksdb::WriteBatch bat;
+	std::unique_lock l{reshard_lock};
+	// any write since the snapshot may have moved or deleted keys of
+	// the batch; submits move keys out of the old shards, never into them
+	bool recheck =
+	  db->GetLatestSequenceNumber() != snapshot->GetSequenceNumber();
+	for (auto& m : batch) {
+	  if (recheck) {
+	    rocksdb::PinnableSlice value;
+	    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), cf, m.key, &value);
+	    if (s.IsNotFound()) {
+	      continue;
+	    }
+	    if (!s.ok()) {
+	      derr << __func__ << " reading " << cf->GetName() << " failed: "
+		   << s.ToString() << dendl;
+	      return -EIO;
+	    }
+	    m.value.assign(value.data(), value.size());
+	  }
+	  bat.Put(m.target, m.key, m.value);
+	  bat.Delete(cf, m.key);
+	  ++moved;
+	  bytes += m.key.size() + m.value.size();
+	}
+	if (moved) {
+	  rocksdb::WriteOptions woptions;
+	  woptions.disableWAL = disableWAL;
+	  rocksdb::Status s = db->Write(woptions, &bat);
+	  if (!s.ok()) {
+	    derr << __func__ << " moving keys failed: " << s.ToString() << dendl;
+	    return -EIO;
+	  }
+	}
+      }
+      r.keys_scanned += scanned;
+      r.keys_moved += moved;
+      r.bytes_moved += bytes;
+      logger->inc(l_rocksdb_reshard_keys_scanned, scanned);
+      logger->inc(l_rocksdb_reshard_keys_moved, moved);
+      logger->inc(l_rocksdb_reshard_bytes_moved, bytes);
+
+      std::unique_lock l{online_reshard_thread_lock};
+      if (bytes_per_sec && bytes) {
+	online_reshard_cond.wait_for(
+	  l, std::chrono::microseconds(bytes * 1000000 / bytes_per_sec),
+	  [this] { return online_reshard_stop; });
+      }
+      if (online_reshard_stop) {
+	return -ECANCELED;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Retires the old layout. The stored sharding is switched to the target
+ * before the emptied old shards are dropped, and the record of the online
+ * reshard goes last, so that an open after a crash in between finds
+ * either the old layout with the move to redo, or the target layout with
+ * old shards to drop.
+ */
+int RocksDBStore::online_reshard_finish(online_reshard_t& r)
+{
+  {
+    // from now on neither reads nor writes use the old layout
+    std::unique_lock l{reshard_lock};
+    r.done = true;
+    reshard_epoch++;
+  }
+  reshard_active = false;
+  int ret = write_sharding_column(r.column_def);
+  if (ret < 0) {
+    return ret;
+  }
+  for (auto cf : r.dropped) {
+    // verify that column is empty
+    std::unique_ptr<rocksdb::Iterator> it{
+      db->NewIterator(rocksdb::ReadOptions(), cf)};
+    ceph_assert(it);
+    it->SeekToFirst();
+    ceph_assert(!it->Valid());
+    dout(5) << __func__ << " dropping column " << cf->GetName() << dendl;
+    if (rocksdb::Status status = db->DropColumnFamily(cf); !status.ok()) {
+      derr << __func__ << " Failed to drop column: " << cf->GetName() << dendl;
+      return -EIO;
+    }
+  }
+  db->GetEnv()->DeleteFile(sharding_online_reshard);
+  return 0;
+}
+
+void RocksDBStore::dump_online_reshard(Formatter *f)
+{
+  std::lock_guard l{online_reshard_thread_lock};
+  f->open_array_section("online_reshard");
+  for (auto& r : online_reshards) {
+    f->open_object_section("column");
+    f->dump_string("column", r->column_def);
+    bool running = r->finished.is_zero();
+    f->dump_string("state",
+		   running ? "running" :
+		   r->result < 0 ? "failed" :
+		   "done");
+    if (r->result < 0) {
+      f->dump_int("result", r->result);
+    }
+    f->dump_stream("started") << r->started;
+    if (!running) {
+      f->dump_stream("finished") << r->finished;
+    }
+    f->dump_unsigned("keys_scanned", r->keys_scanned);
+    f->dump_unsigned("keys_moved", r->keys_moved);
+    f->dump_unsigned("bytes_moved", r->bytes_moved);
+    f->close_section();
+  }
+  f->close_section();
+}
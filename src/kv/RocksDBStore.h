@@ -6,6 +6,7 @@
 #include "include/types.h"
 #include "include/buffer_fwd.h"
 #include "KeyValueDB.h"
+#include <atomic>
 #include <set>
 #include <map>
 #include <string>
@@ -32,6 +33,8 @@
 enum {
   l_rocksdb_first = 34300,
   l_rocksdb_get_latency,
+  l_rocksdb_multiget_latency,
+  l_rocksdb_multiget_keys,
   l_rocksdb_submit_latency,
   l_rocksdb_submit_sync_latency,
   l_rocksdb_compact,
@@ -44,6 +47,10 @@ enum {
   l_rocksdb_write_memtable_time,
   l_rocksdb_write_delay_time,
   l_rocksdb_write_pre_and_post_process_time,
+  l_rocksdb_reshard_keys_scanned,
+  l_rocksdb_reshard_keys_moved,
+  l_rocksdb_reshard_bytes_moved,
+  l_rocksdb_reshard_running,
   l_rocksdb_last,
 };
 
@@ -92,6 +99,7 @@ class RocksDBStore : public KeyValueDB {
 
   uint64_t cache_size = 0;
   bool set_cache_flag = false;
+  bool multiget_async_io = false;
   friend class ShardMergeIteratorImpl;
   friend class CFIteratorImpl;
   friend class WholeMergeIteratorImpl;
@@ -117,11 +125,41 @@ private:
   bool must_close_default_cf = false;
   rocksdb::ColumnFamilyHandle *default_cf = nullptr;
 
+  struct online_reshard_t;
   /// column families in use, name->handles
   struct prefix_shards {
     uint32_t hash_l;  //< first character to take for hash calc.
     uint32_t hash_h;  //< last character to take for hash calc.
     std::vector<rocksdb::ColumnFamilyHandle *> handles;
+    /// set once the column is being resharded online, never cleared until close
+    std::atomic<online_reshard_t*> reshard = nullptr;
+  };
+  /**
+   * Online reshard of a single column.
+   *
+   * While it runs every key lives in exactly one column family: writes go to
+   * the key's shard in the target layout and delete it from its old shard,
+   * and the mover thread relocates the remaining keys in atomic batches.
+   * Once done, the old layout is no longer consulted.
+   */
+  struct online_reshard_t {
+    std::string prefix;
+    std::string column_def;  ///< target definition as requested
+    prefix_shards target;    ///< layout keys are written to
+    /// every column family that may hold keys of this column until done
+    std::vector<rocksdb::ColumnFamilyHandle *> both;
+    /// target shards created online or opened with the store, destroyed
+    /// at close
+    std::vector<rocksdb::ColumnFamilyHandle *> created;
+    /// old shards that are not part of target, dropped once done
+    std::vector<rocksdb::ColumnFamilyHandle *> dropped;
+    std::atomic<bool> done = false;
+    std::atomic<uint64_t> keys_scanned = 0;
+    std::atomic<uint64_t> keys_moved = 0;
+    std::atomic<uint64_t> bytes_moved = 0;
+    utime_t started;
+    utime_t finished;
+    int result = 0;
   };
   std::unordered_map<std::string, prefix_shards> cf_handles;
   typedef decltype(cf_handles)::iterator cf_handles_iterator;
@@ -134,10 +172,19 @@ private:
   std::string_view get_key_hash_view(const prefix_shards& shards, const char* key, const size_t keylen);
   rocksdb::ColumnFamilyHandle *get_key_cf(const prefix_shards& shards, const char* key, const size_t keylen);
   rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix, const std::string& key);
-  rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix, const char* key, size_t keylen);
-  rocksdb::ColumnFamilyHandle *check_cf_handle_bounds(const cf_handles_iterator& it, const IteratorBounds& bounds);
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix, const char* key, size_t keylen,
+					     rocksdb::ColumnFamilyHandle **stale = nullptr);
+  rocksdb::ColumnFamilyHandle *get_shard_cf(const prefix_shards& shards, const char* key, size_t keylen,
+					    rocksdb::ColumnFamilyHandle **stale = nullptr);
+  const std::vector<rocksdb::ColumnFamilyHandle *>& get_shard_handles(const prefix_shards& shards) const;
+  static online_reshard_t* get_running_reshard(const prefix_shards& shards);
+  rocksdb::ColumnFamilyHandle *check_cf_handle_bounds(const prefix_shards& shards, const IteratorBounds& bounds);
 
   int submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t);
+  rocksdb::Status get_from_shard(rocksdb::ColumnFamilyHandle *cf,
+				 rocksdb::ColumnFamilyHandle *stale,
+				 const rocksdb::Slice& key,
+				 rocksdb::PinnableSlice *value);
   int install_cf_mergeop(const std::string &cf_name, rocksdb::ColumnFamilyOptions *cf_opt);
   int create_db_dir();
   int do_open(std::ostream &out, bool create_if_missing, bool open_readonly,
@@ -163,7 +210,9 @@ private:
 		      std::vector<rocksdb::ColumnFamilyDescriptor>& existing_cfs,
 		      std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& existing_cfs_shard,
 		      std::vector<rocksdb::ColumnFamilyDescriptor>& missing_cfs,
-		      std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard);
+		      std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& missing_cfs_shard,
+		      const std::string& pending_column,
+		      std::vector<rocksdb::ColumnFamilyDescriptor>& pending_cfs);
   std::shared_ptr<rocksdb::Cache> create_block_cache(const std::string& cache_type, size_t cache_size, double cache_prio_high = 0.0);
   int split_column_family_options(const std::string& opts_str,
 				  std::unordered_map<std::string, std::string>* column_opts_map,
@@ -193,6 +242,52 @@ private:
 
   void compact_thread_entry();
 
+  // online resharding
+  /// taken shared by submits while a reshard is moving keys or by stale
+  /// batches, exclusive by layout changes and by the mover's writes
+  ceph::shared_mutex reshard_lock =
+    ceph::make_shared_mutex("RocksDBStore::reshard_lock");
+  /// bumped on every layout change, transactions built earlier are re-routed
+  std::atomic<uint64_t> reshard_epoch = 0;
+  /// an online reshard is moving keys, submits take reshard_lock
+  std::atomic<bool> reshard_active = false;
+  /// submits in flight without reshard_lock
+  std::atomic<uint64_t> unlocked_submits = 0;
+  std::vector<std::unique_ptr<online_reshard_t>> online_reshards;
+  ceph::mutex online_reshard_thread_lock =
+    ceph::make_mutex("RocksDBStore::online_reshard_thread_lock");
+  ceph::condition_variable online_reshard_cond;
+  bool online_reshard_stop = false;
+  bool online_reshard_running = false;
+  class OnlineReshardThread : public Thread {
+    RocksDBStore *db;
+  public:
+    explicit OnlineReshardThread(RocksDBStore *d) : db(d) {}
+    void *entry() override {
+      db->online_reshard_thread_entry();
+      return NULL;
+    }
+  } online_reshard_thread;
+  class SocketHook;
+  SocketHook* asok_hook = nullptr;
+  struct RocksWBRerouter;
+
+  void online_reshard_thread_entry();
+  int prepare_online_reshard(prefix_shards& shards,
+			     const ColumnFamily& column,
+			     const std::string& column_def,
+			     const std::vector<rocksdb::ColumnFamilyHandle *>& opened,
+			     bool create,
+			     std::unique_ptr<online_reshard_t>* out);
+  void run_online_reshard(std::unique_ptr<online_reshard_t> reshard, bool move);
+  int resume_online_reshard(const std::string& column_def,
+			    std::vector<rocksdb::ColumnFamilyHandle *>& opened,
+			    bool open_readonly);
+  int online_reshard_move(online_reshard_t& r);
+  int online_reshard_finish(online_reshard_t& r);
+  void stop_online_reshard();
+  int write_sharding_column(const std::string& column_def);
+
   void compact_range(const std::string& start, const std::string& end);
   void compact_range_async(const std::string& start, const std::string& end);
   int tryInterpret(const std::string& key, const std::string& val,
@@ -249,6 +344,7 @@ public:
     dbstats(NULL),
     compact_queue_stop(false),
     compact_thread(this),
+    online_reshard_thread(this),
     compact_on_mount(false),
     disableWAL(false)
   {}
@@ -290,9 +386,16 @@ public:
   public:
     rocksdb::WriteBatch bat;
     RocksDBStore *db;
+    uint64_t reshard_epoch;  ///< layout the batch was routed with
 
     explicit RocksDBTransactionImpl(RocksDBStore *_db);
   private:
+    void note_layout();
+    void rm_range_resharding(
+      const std::string &prefix,
+      const online_reshard_t& r,
+      const std::string &start,
+      const std::string &end);
     void put_bat(
       rocksdb::WriteBatch& bat,
       rocksdb::ColumnFamilyHandle *cf,
@@ -358,6 +461,11 @@ public:
     const char *key,
     size_t keylen,
     ceph::bufferlist *out) override;
+  void multi_get(
+    const std::string &prefix,
+    const std::vector<std::string> &keys,
+    std::vector<ceph::bufferlist> *values,
+    std::vector<int> *rs) override;
 
 
   class RocksDBWholeSpaceIteratorImpl :
@@ -558,6 +666,20 @@ public:
   int reshard(const std::string& new_sharding, const resharding_ctrl* ctrl = nullptr);
   bool get_sharding(std::string& sharding);
 
+  /**
+   * Reshard a single existing column while the store stays open.
+   *
+   * column_def is one column of a sharding definition, e.g. "O(6,0-8)".
+   * Keys are moved in the background, throttled by
+   * rocksdb_online_reshard_bytes_per_sec; the store stays fully usable
+   * meanwhile. Moving a column in or out of the default column family,
+   * changing column options or resharding a column with a merge operator
+   * still requires the offline reshard(). A reshard interrupted by close
+   * or a crash is resumed when the store is opened again.
+   */
+  int start_online_reshard(const std::string& column_def, std::ostream& ss);
+  void dump_online_reshard(ceph::Formatter *f);
+
 };
 
 #endif
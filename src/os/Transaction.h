@@ -3,7 +3,11 @@
 
 #pragma once
 
+#include <algorithm>
 #include <map>
+#include <numeric>
+
+#include <boost/container/small_vector.hpp>
 
 #include "include/Context.h"
 #include "include/int_types.h"
@@ -232,11 +236,15 @@ public:
 private:
   TransactionData data;
 
-  std::map<coll_t, uint32_t> coll_index;
-  std::map<ghobject_t, uint32_t> object_index;
-
-  uint32_t coll_id = 0;
-  uint32_t object_id = 0;
+  /// the collections and objects the ops refer to, at the position of
+  /// their id; the usual one or two of each are stored inline so building
+  /// a small transaction does not allocate for them
+  boost::container::small_vector<coll_t, 2> coll_index;
+  boost::container::small_vector<ghobject_t, 2> object_index;
+  /// id lookup for transactions that outgrow a linear scan of the above
+  std::map<coll_t, uint32_t> coll_lookup;
+  std::map<ghobject_t, uint32_t> object_lookup;
+  static constexpr size_t INDEX_SCAN_MAX = 16;
 
   ceph::buffer::list data_bl;
   ceph::buffer::list op_bl;
@@ -261,30 +269,32 @@ public:
     data(std::move(other.data)),
     coll_index(std::move(other.coll_index)),
     object_index(std::move(other.object_index)),
-    coll_id(other.coll_id),
-    object_id(other.object_id),
+    coll_lookup(std::move(other.coll_lookup)),
+    object_lookup(std::move(other.object_lookup)),
     data_bl(std::move(other.data_bl)),
     op_bl(std::move(other.op_bl)),
     on_applied(std::move(other.on_applied)),
     on_commit(std::move(other.on_commit)),
     on_applied_sync(std::move(other.on_applied_sync)) {
-    other.coll_id = 0;
-    other.object_id = 0;
+    // moving out of small_vector's inline storage leaves moved-from
+    // elements behind
+    other.coll_index.clear();
+    other.object_index.clear();
   }
 
   Transaction& operator=(Transaction&& other) noexcept {
     data = std::move(other.data);
     coll_index = std::move(other.coll_index);
     object_index = std::move(other.object_index);
-    coll_id = other.coll_id;
-    object_id = other.object_id;
+    coll_lookup = std::move(other.coll_lookup);
+    object_lookup = std::move(other.object_lookup);
     data_bl = std::move(other.data_bl);
     op_bl = std::move(other.op_bl);
     on_applied = std::move(other.on_applied);
     on_commit = std::move(other.on_commit);
     on_applied_sync = std::move(other.on_applied_sync);
-    other.coll_id = 0;
-    other.object_id = 0;
+    other.coll_index.clear();
+    other.object_index.clear();
     return *this;
   }
 
@@ -297,10 +307,6 @@ public:
     return ret;
   }
 
-  // expose object_index for FileStore::Op's benefit
-  const std::map<ghobject_t, uint32_t>& get_object_index() const {
-    return object_index;
-  }
 
   /* Operations on callback contexts */
   void register_on_applied(Context *c) {
@@ -394,10 +400,10 @@ public:
     std::swap(on_commit, other.on_commit);
     std::swap(on_applied_sync, other.on_applied_sync);
 
-    std::swap(coll_index, other.coll_index);
-    std::swap(object_index, other.object_index);
-    std::swap(coll_id, other.coll_id);
-    std::swap(object_id, other.object_id);
+    coll_index.swap(other.coll_index);
+    object_index.swap(other.object_index);
+    coll_lookup.swap(other.coll_lookup);
+    object_lookup.swap(other.object_lookup);
     op_bl.swap(other.op_bl);
     data_bl.swap(other.data_bl);
   }
@@ -532,19 +538,13 @@ public:
 
     //append coll_index & object_index
     std::vector<uint32_t> cm(other.coll_index.size());
-    std::map<coll_t, uint32_t>::iterator coll_index_p;
-    for (coll_index_p = other.coll_index.begin();
-         coll_index_p != other.coll_index.end();
-         ++coll_index_p) {
-      cm[coll_index_p->second] = _get_coll_id(coll_index_p->first);
+    for (uint32_t i = 0; i < other.coll_index.size(); ++i) {
+      cm[i] = _get_coll_id(other.coll_index[i]);
     }
 
     std::vector<uint32_t> om(other.object_index.size());
-    std::map<ghobject_t, uint32_t>::iterator object_index_p;
-    for (object_index_p = other.object_index.begin();
-         object_index_p != other.object_index.end();
-         ++object_index_p) {
-      om[object_index_p->second] = _get_object_id(object_index_p->first);
+    for (uint32_t i = 0; i < other.object_index.size(); ++i) {
+      om[i] = _get_object_id(other.object_index[i]);
     }
 
     //the other.op_bl SHOULD NOT be changes during append operation,
@@ -582,13 +582,13 @@ public:
     final_size += (coll_index.size() + object_index.size()) * sizeof(__u32);
 
     // coll_index first
-    for (auto p = coll_index.begin(); p != coll_index.end(); ++p) {
-	final_size += p->first.encoded_size();
+    for (auto& c : coll_index) {
+	final_size += c.encoded_size();
     }
 
     // object_index first
-    for (auto p = object_index.begin(); p != object_index.end(); ++p) {
-	final_size += p->first.encoded_size();
+    for (auto& o : object_index) {
+	final_size += o.encoded_size();
     }
 
     return data_bl.length() +
@@ -601,8 +601,8 @@ public:
     using ceph::encode;
     //layout: data_bl + op_bl + coll_index + object_index + data
     ceph::buffer::list bl;
-    encode(coll_index, bl);
-    encode(object_index, bl);
+    _encode_index(coll_index, bl);
+    _encode_index(object_index, bl);
 
     return data_bl.length() +
 	op_bl.length() +
@@ -668,25 +668,11 @@ public:
     explicit iterator(Transaction *t)
       : t(t),
 	  data_bl_p(t->data_bl.cbegin()),
-        colls(t->coll_index.size()),
-        objects(t->object_index.size()) {
+        colls(t->coll_index.begin(), t->coll_index.end()),
+        objects(t->object_index.begin(), t->object_index.end()) {
 
       ops = t->data.ops;
       op_buffer_p = t->op_bl.c_str();
-
-      std::map<coll_t, uint32_t>::iterator coll_index_p;
-      for (coll_index_p = t->coll_index.begin();
-           coll_index_p != t->coll_index.end();
-           ++coll_index_p) {
-        colls[coll_index_p->second] = coll_index_p->first;
-      }
-
-      std::map<ghobject_t, uint32_t>::iterator object_index_p;
-      for (object_index_p = t->object_index.begin();
-           object_index_p != t->object_index.end();
-           ++object_index_p) {
-        objects[object_index_p->second] = object_index_p->first;
-      }
     }
 
     friend class Transaction;
@@ -776,23 +762,77 @@ private:
     memset(p, 0, sizeof(Op));
     return reinterpret_cast<Op*>(p);
   }
+  template <typename T, typename Index>
+  static uint32_t _get_id(const T& t, Index& index,
+			  std::map<T, uint32_t>& lookup) {
+    if (lookup.empty()) {
+      for (uint32_t i = 0; i < index.size(); ++i) {
+	if (index[i] == t)
+	  return i;
+      }
+      if (index.size() < INDEX_SCAN_MAX) {
+	index.push_back(t);
+	return index.size() - 1;
+      }
+      _build_lookup(index, lookup);
+    }
+    auto [p, inserted] = lookup.try_emplace(t, index.size());
+    if (inserted)
+      index.push_back(t);
+    return p->second;
+  }
+  template <typename T, typename Index>
+  static void _build_lookup(const Index& index,
+			    std::map<T, uint32_t>& lookup) {
+    lookup.clear();
+    if (index.size() < INDEX_SCAN_MAX)
+      return;
+    for (uint32_t i = 0; i < index.size(); ++i) {
+      lookup.emplace(index[i], i);
+    }
+  }
   uint32_t _get_coll_id(const coll_t& coll) {
-    std::map<coll_t, uint32_t>::iterator c = coll_index.find(coll);
-    if (c != coll_index.end())
-      return c->second;
-
-    uint32_t index_id = coll_id++;
-    coll_index[coll] = index_id;
-    return index_id;
+    return _get_id(coll, coll_index, coll_lookup);
   }
   uint32_t _get_object_id(const ghobject_t& oid) {
-    std::map<ghobject_t, uint32_t>::iterator o = object_index.find(oid);
-    if (o != object_index.end())
-      return o->second;
+    return _get_id(oid, object_index, object_lookup);
+  }
 
-    uint32_t index_id = object_id++;
-    object_index[oid] = index_id;
-    return index_id;
+  /// encode an id-ordered index exactly like the std::map<T, uint32_t>
+  /// it replaces, i.e. sorted by key
+  template <typename Index>
+  static void _encode_index(const Index& index, ceph::buffer::list& bl) {
+    using ceph::encode;
+    boost::container::small_vector<uint32_t, 8> order(index.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&index](uint32_t a, uint32_t b) {
+      return index[a] < index[b];
+    });
+    encode((__u32)index.size(), bl);
+    for (auto i : order) {
+      encode(index[i], bl);
+      encode(i, bl);
+    }
+  }
+  template <typename T, typename Index>
+  static void _decode_index(Index& index, std::map<T, uint32_t>& lookup,
+			    ceph::buffer::list::const_iterator& p) {
+    using ceph::decode;
+    __u32 n;
+    decode(n, p);
+    index.clear();
+    index.resize(n);
+    for (__u32 i = 0; i < n; ++i) {
+      T t;
+      uint32_t id;
+      decode(t, p);
+      decode(id, p);
+      if (id >= n) {
+	throw ceph::buffer::malformed_input("transaction index out of range");
+      }
+      index[id] = std::move(t);
+    }
+    _build_lookup(index, lookup);
   }
 
 public:
@@ -861,6 +901,31 @@ public:
     }
     data.ops = data.ops + 1;
   }
+  /// Write data to an offset within an object, taking over the buffers
+  /// of write_data instead of adding references to them
+  void write(const coll_t& cid, const ghobject_t& oid, uint64_t off, uint64_t len,
+	       ceph::buffer::list&& write_data, uint32_t flags = 0) {
+    using ceph::encode;
+    uint32_t orig_len = data_bl.length();
+    Op* _op = _get_next_op();
+    _op->op = OP_WRITE;
+    _op->cid = _get_coll_id(cid);
+    _op->oid = _get_object_id(oid);
+    _op->off = off;
+    _op->len = len;
+    ceph_assert(len == write_data.length());
+    // same encoding as encode(write_data, data_bl)
+    encode((__u32)len, data_bl);
+    data_bl.claim_append(write_data);
+
+    data.fadvise_flags = data.fadvise_flags | flags;
+    if (len > data.largest_data_len) {
+	data.largest_data_len = len;
+	data.largest_data_off = off;
+	data.largest_data_off_in_data_bl = orig_len + sizeof(__u32);
+    }
+    data.ops = data.ops + 1;
+  }
   /**
    * zero out the indicated byte range within an object. Some
    * ObjectStore instances may optimize this to release the
@@ -913,6 +978,18 @@ public:
     encode(val, data_bl);
     data.ops = data.ops + 1;
   }
+  /// Set an xattr of an object, taking over the buffers of val
+  void setattr(const coll_t& cid, const ghobject_t& oid, const std::string& s, ceph::buffer::list&& val) {
+    using ceph::encode;
+    Op* _op = _get_next_op();
+    _op->op = OP_SETATTR;
+    _op->cid = _get_coll_id(cid);
+    _op->oid = _get_object_id(oid);
+    encode(s, data_bl);
+    encode((__u32)val.length(), data_bl);
+    data_bl.claim_append(val);
+    data.ops = data.ops + 1;
+  }
   /// Set multiple xattrs of an object
   void setattrs(const coll_t& cid,
 		const ghobject_t& oid,
@@ -1271,8 +1348,8 @@ public:
     ENCODE_START(9, 9, bl);
     encode(data_bl, bl);
     encode(op_bl, bl);
-    encode(coll_index, bl);
-    encode(object_index, bl);
+    _encode_index(coll_index, bl);
+    _encode_index(object_index, bl);
     data.encode(bl);
     ENCODE_FINISH(bl);
   }
@@ -1283,11 +1360,9 @@ public:
 
     decode(data_bl, bl);
     decode(op_bl, bl);
-    decode(coll_index, bl);
-    decode(object_index, bl);
+    _decode_index(coll_index, coll_lookup, bl);
+    _decode_index(object_index, object_lookup, bl);
     data.decode(bl);
-    coll_id = coll_index.size();
-    object_id = object_index.size();
 
     DECODE_FINISH(bl);
   }
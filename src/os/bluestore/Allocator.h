@@ -13,7 +13,10 @@
 #define CEPH_OS_BLUESTORE_ALLOCATOR_H
 
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <thread>
 #include "include/ceph_assert.h"
 #include "bluestore_types.h"
 #include "common/ceph_mutex.h"
@@ -249,6 +252,155 @@ protected:
     }
   };
 
+  /*
+   * Per-thread extent cache to be placed in front of allocator's lock.
+   * Threads are mapped to a fixed set of shards by thread id, each shard
+   * keeps:
+   * - a contiguous chunk reserved from the allocator which small
+   *   allocations are carved from,
+   * - a batch of small released extents which are reused for allocations
+   *   of the same length or returned to the allocator all at once
+   *   when the batch is full.
+   * Shard is accessed with try_lock only, allocation/release requests
+   * hitting a shard busy with another thread are passed to the allocator.
+   */
+  class ThreadExtentCache {
+    enum {
+      RELEASE_BATCH = 32, // amount of released extents kept per shard
+    };
+    struct shard_t {
+      std::mutex lock;
+      uint64_t pos = 0;   // [pos, end) is unused part of the reserved chunk
+      uint64_t end = 0;
+      PExtentVector released;
+    };
+    const size_t shard_count;
+    const uint64_t chunk_size;
+    const uint64_t max_alloc; // max allocation length served from the cache
+    std::unique_ptr<shard_t[]> shards;
+    std::atomic<uint64_t> cached = 0; // bytes kept by all the shards
+    std::atomic<size_t> hits = 0;
+
+    shard_t& _get_shard() {
+      auto h = std::hash<std::thread::id>{}(std::this_thread::get_id());
+      return shards[h % shard_count];
+    }
+  public:
+    ThreadExtentCache(size_t _shard_count, uint64_t _chunk_size) :
+      shard_count(_shard_count),
+      chunk_size(_chunk_size),
+      max_alloc(std::min<uint64_t>(_chunk_size / 4, 64 * 1024)),
+      shards(new shard_t[_shard_count])
+    {
+      ceph_assert(shard_count);
+      for (size_t i = 0; i < shard_count; i++) {
+        shards[i].released.reserve(RELEASE_BATCH);
+      }
+    }
+    uint64_t get_chunk_size() const {
+      return chunk_size;
+    }
+    /*
+     * Tries to allocate 'want' bytes from calling thread's shard.
+     * When the reserved chunk is exhausted 'reserve' is called
+     * (with the shard locked) as reserve(unit, remainder_offs, remainder_len,
+     * &new_chunk_offs) to release the remainder and reserve chunk_size bytes
+     * anew. It returns false if no contiguous chunk could be provided.
+     */
+    template <typename Reserve>
+    bool try_get(uint64_t want, uint64_t unit, uint64_t* offset,
+                 Reserve&& reserve) {
+      if (want > max_alloc) {
+        return false;
+      }
+      auto& s = _get_shard();
+      std::unique_lock l(s.lock, std::try_to_lock);
+      if (!l.owns_lock()) {
+        return false;
+      }
+      for (auto it = s.released.rbegin(); it != s.released.rend(); ++it) {
+        if (it->length == want && p2aligned(it->offset, unit)) {
+          *offset = it->offset;
+          *it = s.released.back();
+          s.released.pop_back();
+          cached -= want;
+          ++hits;
+          return true;
+        }
+      }
+      if (s.end - s.pos < want || !p2aligned(s.pos, unit)) {
+        uint64_t new_chunk = 0;
+        uint64_t pos = s.pos;
+        uint64_t len = s.end - s.pos;
+        s.pos = s.end = 0;
+        cached -= len;
+        if (!reserve(unit, pos, len, &new_chunk)) {
+          return false;
+        }
+        s.pos = new_chunk;
+        s.end = new_chunk + chunk_size;
+        cached += chunk_size;
+      }
+      *offset = s.pos;
+      s.pos += want;
+      cached -= want;
+      ++hits;
+      return true;
+    }
+    /*
+     * Queues small extents from 'release_set' at calling thread's shard.
+     * Extents to be returned to the allocator right away are appended to
+     * 'to_release': large ones, the ones shard couldn't take and
+     * the queued ones when the batch gets full.
+     */
+    void put(const release_set_t& release_set, PExtentVector* to_release) {
+      auto& s = _get_shard();
+      std::unique_lock l(s.lock, std::try_to_lock);
+      for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+        if (!l.owns_lock() || p.get_len() > max_alloc) {
+          to_release->emplace_back(p.get_start(), p.get_len());
+          continue;
+        }
+        s.released.emplace_back(p.get_start(), p.get_len());
+        cached += p.get_len();
+        if (s.released.size() >= RELEASE_BATCH) {
+          for (auto& e : s.released) {
+            cached -= e.length;
+            to_release->emplace_back(e);
+          }
+          s.released.clear();
+        }
+      }
+    }
+    /*
+     * Detaches everything cached, caller to return 'to_release' content
+     * to the allocator. Shards are locked one by one, hence new entries
+     * might appear in the cache while the call is in progress.
+     */
+    void drain(PExtentVector* to_release) {
+      for (size_t i = 0; i < shard_count; i++) {
+        auto& s = shards[i];
+        std::lock_guard l(s.lock);
+        if (s.end > s.pos) {
+          to_release->emplace_back(s.pos, s.end - s.pos);
+          cached -= s.end - s.pos;
+        }
+        s.pos = s.end = 0;
+        for (auto& e : s.released) {
+          cached -= e.length;
+          to_release->emplace_back(e);
+        }
+        s.released.clear();
+      }
+    }
+    uint64_t get_cached() const {
+      return cached.load();
+    }
+    size_t get_hit_count() const {
+      return hits.load();
+    }
+  };
+
 public:
   Allocator(std::string_view name,
 	    int64_t _capacity,
@@ -9,6 +9,7 @@
 #include "common/debug.h"
 #include "common/errno.h"
 #include "common/perf_counters.h"
+#include "common/Thread.h"
 #include "Allocator.h"
 #include "include/ceph_assert.h"
 #include "common/admin_socket.h"
@@ -463,6 +464,38 @@ void BlueFS::_init_logger()
              "Max allocation latency for primary/shared device",
              "asxt",
              PerfCountersBuilder::PRIO_INTERESTING);
+  b.add_time(l_bluefs_mount_lat, "mount_lat",
+             "Time spent in the last mount");
+  b.add_time(l_bluefs_mount_super_lat, "mount_super_lat",
+             "Time spent reading the superblock in the last mount");
+  b.add_time(l_bluefs_mount_replay_lat, "mount_replay_lat",
+             "Time spent replaying the log in the last mount");
+  b.add_time(l_bluefs_mount_freelist_lat, "mount_freelist_lat",
+             "Time spent initializing the freelist in the last mount");
+  b.add_time(l_bluefs_replay_wait_lat, "replay_wait_lat",
+             "Time log replay spent waiting for records to be read");
+  b.add_u64_counter(l_bluefs_replay_records, "replay_records",
+                    "Log records replayed at mount");
+  b.add_u64_counter(l_bluefs_replay_bytes, "replay_bytes",
+                    "Bytes of log replayed at mount",
+                    NULL, PerfCountersBuilder::PRIO_DEBUGONLY,
+                    unit_t(UNIT_BYTES));
+  b.add_u64(l_bluefs_wal_ring_avail_bytes, "wal_ring_avail_bytes",
+	    "Zeroed space ready to be handed out to WAL files",
+	    NULL, PerfCountersBuilder::PRIO_DEBUGONLY, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluefs_wal_ring_zeroed_bytes, "wal_ring_zeroed_bytes",
+		    "Bytes zeroed to prepare WAL ring space",
+		    NULL, PerfCountersBuilder::PRIO_DEBUGONLY,
+		    unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluefs_wal_ring_files, "wal_ring_files",
+		    "WAL files written into WAL ring space");
+  b.add_u64_counter(l_bluefs_wal_ring_misses, "wal_ring_misses",
+		    "WAL files that outgrew the WAL ring and fell back to "
+		    "logging their size");
+  b.add_u64_counter(l_bluefs_wal_ring_fsyncs, "wal_ring_fsyncs",
+		    "fsyncs of WAL ring files that did not touch the log");
+  b.add_u64_counter(l_bluefs_bdev_flush_merged, "bdev_flush_merged",
+		    "Device flushes saved by waiting for a concurrent one");
 
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
@@ -1036,12 +1069,16 @@ int BlueFS::mount()
 {
   dout(1) << __func__ << dendl;
 
+  auto t0 = mono_clock::now();
+  auto t1 = t0;
   _init_logger();
   int r = _open_super();
   if (r < 0) {
     derr << __func__ << " failed to open super: " << cpp_strerror(r) << dendl;
     goto out;
   }
+  t1 = mono_clock::now();
+  logger->tset(l_bluefs_mount_super_lat, utime_t(t1 - t0));
 
   // set volume selector if not provided before/outside
   if (vselector == nullptr) {
@@ -1055,14 +1092,17 @@ int BlueFS::mount()
   _init_alloc();
 
   dout(5) << __func__ << " super: " << super << dendl;
+  t1 = mono_clock::now();
   r = _replay(false, false);
   if (r < 0) {
     derr << __func__ << " failed to replay log: " << cpp_strerror(r) << dendl;
     _stop_alloc();
     goto out;
   }
+  logger->tset(l_bluefs_mount_replay_lat, utime_t(mono_clock::now() - t1));
 
   // init freelist
+  t1 = mono_clock::now();
   for (auto& p : nodes.file_map) {
     dout(30) << __func__ << " noting alloc for " << p.second->fnode << dendl;
     for (auto& q : p.second->fnode.extents) {
@@ -1084,6 +1124,7 @@ int BlueFS::mount()
     dout(1) << __func__ << " shared bdev not used"
             << dendl;
   }
+  logger->tset(l_bluefs_mount_freelist_lat, utime_t(mono_clock::now() - t1));
 
   // set up the log for future writes
   log.writer = _create_writer(_get_file(1));
@@ -1095,6 +1136,12 @@ int BlueFS::mount()
            << dendl;
   // update log size
   logger->set(l_bluefs_log_bytes, log.writer->file->fnode.size);
+  _wal_ring_start();
+  {
+    auto lat = mono_clock::now() - t0;
+    logger->tset(l_bluefs_mount_lat, utime_t(lat));
+    dout(1) << __func__ << " done in " << lat << dendl;
+  }
   return 0;
 
  out:
@@ -1123,6 +1170,7 @@ void BlueFS::umount(bool avoid_compact)
 {
   dout(1) << __func__ << dendl;
 
+  _wal_ring_stop();
   sync_metadata(avoid_compact);
   if (cct->_conf->bluefs_check_volume_selector_on_umount) {
     _check_vselector_LNF();
@@ -1245,6 +1293,12 @@ int BlueFS::_open_super()
   }
   dout(10) << __func__ << " superblock " << super.version << dendl;
   dout(10) << __func__ << " log_fnode " << super.log_fnode << dendl;
+  if (super.incompat & ~(uint64_t)bluefs_super_t::INCOMPAT_ALL) {
+    derr << __func__ << " unsupported incompat features 0x" << std::hex
+	 << (super.incompat & ~(uint64_t)bluefs_super_t::INCOMPAT_ALL)
+	 << std::dec << dendl;
+    return -EOPNOTSUPP;
+  }
   return 0;
 }
 
@@ -1303,6 +1357,215 @@ int BlueFS::_verify_alloc_granularity(
   return 0;
 }
 
+void BlueFS::_replay_read_record(FileReader *reader, uint64_t pos,
+				 replay_record_t *rec, uint64_t expect_seq)
+{
+  rec->pos = pos;
+  uint64_t read_pos = pos;
+  rec->r = _read(reader, read_pos, super.block_size, &rec->bl, NULL);
+  if (rec->r != (int)super.block_size && cct->_conf->bluefs_replay_recovery) {
+    rec->r += _do_replay_recovery_read(reader, pos, read_pos + rec->r,
+				       super.block_size - rec->r, &rec->bl);
+  }
+  if (rec->r != (int)super.block_size) {
+    return;
+  }
+  read_pos += rec->r;
+  {
+    auto p = rec->bl.cbegin();
+    __u8 a, b;
+    uint32_t len;
+    decode(a, p);
+    decode(b, p);
+    decode(len, p);
+    decode(rec->uuid, p);
+    decode(rec->seq, p);
+    if (len + 6 > rec->bl.length()) {
+      rec->more = round_up_to(len + 6 - rec->bl.length(), super.block_size);
+    }
+  }
+  if (rec->uuid != super.uuid ||
+      (expect_seq && rec->seq != expect_seq)) {
+    return;
+  }
+  if (rec->more) {
+    bufferlist t;
+    rec->more_r = _read(reader, read_pos, rec->more, &t, NULL);
+    if (rec->more_r < (int)rec->more && cct->_conf->bluefs_replay_recovery) {
+      //try to search for more data
+      rec->more_r += _do_replay_recovery_read(
+	reader, pos, read_pos + rec->more_r, rec->more - rec->more_r, &t);
+    }
+    if (rec->more_r < (int)rec->more) {
+      return;
+    }
+    rec->bl.claim_append(t);
+  }
+  try {
+    auto p = rec->bl.cbegin();
+    decode(rec->t, p);
+    rec->decoded = true;
+  } catch (ceph::buffer::error& e) {
+    rec->decode_error = e.what();
+  }
+}
+
+// true if b maps every log offset a maps, to the same place
+static bool log_extents_extend(const bluefs_fnode_t& a,
+			       const bluefs_fnode_t& b)
+{
+  if (b.extents.size() < a.extents.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.extents.size(); ++i) {
+    const auto& x = a.extents[i];
+    const auto& y = b.extents[i];
+    if (x.bdev != y.bdev || x.offset != y.offset ||
+	(i + 1 < a.extents.size() ? x.length != y.length
+	                          : x.length > y.length)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Reads and decodes log records ahead of _replay() on its own thread,
+ * so that device reads and crc/decoding overlap with applying the ops.
+ *
+ * The log can only be read as far as its fnode is known, and that grows
+ * as _replay() applies updates to ino 1.  The thread works off a private
+ * copy of the log fnode that _replay() republishes through get(); it is
+ * restarted whenever _replay() moves somewhere else (op_jump), the log
+ * extents change other than by being extended, or it stopped short of
+ * what has since become readable.
+ */
+class BlueFS::LogReplayPrefetch {
+  BlueFS *fs;
+  const uint64_t max_bytes;   ///< bound on bytes of queued records
+
+  ceph::mutex lock = ceph::make_mutex("BlueFS::LogReplayPrefetch::lock");
+  ceph::condition_variable cond;
+  /// records read, with the fnode version they were read with
+  std::deque<std::pair<uint64_t, replay_record_t>> records;
+  uint64_t bytes = 0;
+  bool stopping = false;
+  bool done = false;          ///< thread has queued its last record
+  bluefs_fnode_t published;   ///< latest log fnode from _replay()
+  uint64_t published_ver = 0;
+
+  FileRef file;               ///< private copy of the log file
+  std::unique_ptr<FileReader> reader;
+  std::thread thread;
+
+  void run(uint64_t pos, uint64_t seq) {
+    uint64_t ver = 0;
+    while (true) {
+      {
+	std::unique_lock l(lock);
+	cond.wait(l, [&] { return stopping || bytes < max_bytes; });
+	if (stopping) {
+	  return;
+	}
+	if (ver != published_ver) {
+	  file->fnode = published;
+	  ver = published_ver;
+	}
+      }
+      replay_record_t rec;
+      // a seq gap means we ran into stale records, e.g. past an op_jump
+      fs->_replay_read_record(reader.get(), pos, &rec, seq);
+      bool last = rec.is_last();
+      uint64_t len = rec.bl.length();
+      {
+	std::lock_guard l(lock);
+	bytes += len;
+	records.emplace_back(ver, std::move(rec));
+	done = last;
+	cond.notify_all();
+      }
+      if (last) {
+	return;
+      }
+      pos += len;
+      ++seq;
+    }
+  }
+
+  void stop() {
+    if (thread.joinable()) {
+      {
+	std::lock_guard l(lock);
+	stopping = true;
+	cond.notify_all();
+      }
+      thread.join();
+    }
+    records.clear();
+    bytes = 0;
+    stopping = done = false;
+  }
+
+  void start(uint64_t pos, uint64_t seq) {
+    stop();
+    file = ceph::make_ref<File>();
+    file->fnode = published;
+    reader = std::make_unique<FileReader>(
+      file, std::max<uint64_t>(fs->cct->_conf->bluefs_max_prefetch,
+			       max_bytes / 4),
+      false,  // !random
+      true);  // ignore eof
+    thread = make_named_thread("bfs_replay", &LogReplayPrefetch::run, this,
+			       pos, seq);
+  }
+
+public:
+  LogReplayPrefetch(BlueFS *fs, uint64_t max_bytes)
+    : fs(fs), max_bytes(max_bytes) {}
+  ~LogReplayPrefetch() {
+    stop();
+  }
+
+  /// get the record at pos, expected to carry seq, given the log fnode
+  /// as replayed so far
+  void get(uint64_t pos, uint64_t seq, const bluefs_fnode_t& fnode,
+	   replay_record_t *rec) {
+    bool restart = !thread.joinable();
+    if (!restart && !log_extents_extend(fnode, published)) {
+      restart = !log_extents_extend(published, fnode);
+      std::lock_guard l(lock);
+      published = fnode;
+      ++published_ver;
+    }
+    if (restart) {
+      published = fnode;
+      start(pos, seq);
+    }
+    std::unique_lock l(lock);
+    while (true) {
+      if (!records.empty()) {
+	auto& [ver, front] = records.front();
+	if (front.pos == pos &&
+	    (!front.is_last() || ver == published_ver)) {
+	  break;
+	}
+      } else if (!done) {
+	cond.wait(l);
+	continue;
+      }
+      // we moved elsewhere, or the reader stopped at what it could not
+      // see back then; start over from here
+      l.unlock();
+      start(pos, seq);
+      l.lock();
+    }
+    *rec = std::move(records.front().second);
+    records.pop_front();
+    bytes -= rec->bl.length();
+    cond.notify_all();
+  }
+};
+
 int BlueFS::_replay(bool noop, bool to_stdout)
 {
   dout(10) << __func__ << (noop ? " NO-OP" : "") << dendl;
@@ -1350,36 +1613,33 @@ int BlueFS::_replay(bool noop, bool to_stdout)
     }
   }
   
+  std::unique_ptr<LogReplayPrefetch> prefetch;
+  uint64_t readahead =
+    cct->_conf.get_val<Option::size_t>("bluefs_log_replay_readahead");
+  if (readahead && !cct->_conf->bluefs_replay_recovery) {
+    prefetch = std::make_unique<LogReplayPrefetch>(this, readahead);
+  }
+  ceph::timespan read_wait = ceph::timespan::zero();
+  uint64_t next_pos = 0;
   while (true) {
-    ceph_assert((log_reader->buf.pos & ~super.block_mask()) == 0);
-    uint64_t pos = log_reader->buf.pos;
-    uint64_t read_pos = pos;
-    bufferlist bl;
+    ceph_assert((next_pos & ~super.block_mask()) == 0);
+    uint64_t pos = next_pos;
+    replay_record_t rec;
     {
-      int r = _read(log_reader, read_pos, super.block_size,
-		    &bl, NULL);
-      if (r != (int)super.block_size && cct->_conf->bluefs_replay_recovery) {
-	r += _do_replay_recovery_read(log_reader, pos, read_pos + r, super.block_size - r, &bl);
-      }
-      assert(r == (int)super.block_size);
-      read_pos += r;
-    }
-    uint64_t more = 0;
-    uint64_t seq;
-    uuid_d uuid;
-    {
-      auto p = bl.cbegin();
-      __u8 a, b;
-      uint32_t len;
-      decode(a, p);
-      decode(b, p);
-      decode(len, p);
-      decode(uuid, p);
-      decode(seq, p);
-      if (len + 6 > bl.length()) {
-	more = round_up_to(len + 6 - bl.length(), super.block_size);
+      auto t0 = mono_clock::now();
+      if (prefetch) {
+	prefetch->get(pos, log_seq + 1, log_file->fnode, &rec);
+      } else {
+	_replay_read_record(log_reader, pos, &rec);
       }
+      read_wait += mono_clock::now() - t0;
     }
+    assert(rec.r == (int)super.block_size);
+    uint64_t read_pos = pos + rec.r;
+    bufferlist& bl = rec.bl;
+    uint64_t more = rec.more;
+    uint64_t seq = rec.seq;
+    const uuid_d& uuid = rec.uuid;
     if (uuid != super.uuid) {
       if (seen_recs) {
 	dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
@@ -1411,47 +1671,36 @@ int BlueFS::_replay(bool noop, bool to_stdout)
     if (more) {
       dout(20) << __func__ << " need 0x" << std::hex << more << std::dec
                << " more bytes" << dendl;
-      bufferlist t;
-      int r = _read(log_reader, read_pos, more, &t, NULL);
-      if (r < (int)more) {
+      if (rec.more_r < (int)more) {
 	dout(10) << __func__ << " 0x" << std::hex << pos
-                 << ": stop: len is 0x" << bl.length() + more << std::dec
+                 << ": stop: len is 0x" << super.block_size + more << std::dec
                  << ", which is past eof" << dendl;
 	if (cct->_conf->bluefs_replay_recovery) {
-	  //try to search for more data
-	  r += _do_replay_recovery_read(log_reader, pos, read_pos + r, more - r, &t);
-	  if (r < (int)more) {
-	    //in normal mode we must read r==more, for recovery it is too strict
-	    break;
-	  }
+	  // recovery reads were tried already, still short
+	  break;
 	}
       }
-      ceph_assert(r == (int)more);
-      bl.claim_append(t);
-      read_pos += r;
-    }
-    bluefs_transaction_t t;
-    try {
-      auto p = bl.cbegin();
-      decode(t, p);
-      seen_recs = true;
+      ceph_assert(rec.more_r == (int)more);
+      read_pos += more;
     }
-    catch (ceph::buffer::error& e) {
+    if (!rec.decoded) {
       // Multi-block transactions might be incomplete due to unexpected
       // power off. Hence let's treat that as a regular stop condition.
       if (seen_recs && more) {
         dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
-                 << ": stop: failed to decode: " << e.what()
+                 << ": stop: failed to decode: " << rec.decode_error
                  << dendl;
       } else {
         derr << __func__ << " 0x" << std::hex << pos << std::dec
-             << ": stop: failed to decode: " << e.what()
+             << ": stop: failed to decode: " << rec.decode_error
              << dendl;
         delete log_reader;
         return -EIO;
       }
       break;
     }
+    seen_recs = true;
+    bluefs_transaction_t& t = rec.t;
     ceph_assert(seq == t.seq);
     dout(10) << __func__ << " 0x" << std::hex << pos << std::dec
              << ": " << t << dendl;
@@ -1497,18 +1746,13 @@ int BlueFS::_replay(bool noop, bool to_stdout)
 
 	  ceph_assert(next_seq > log_seq);
 	  log_seq = next_seq - 1; // we will increment it below
-	  uint64_t skip = offset - read_pos;
-	  if (skip) {
-	    bufferlist junk;
-	    int r = _read(log_reader, read_pos, skip, &junk,
-			  NULL);
-	    if (r != (int)skip) {
-	      dout(10) << __func__ << " 0x" << std::hex << read_pos
-		       << ": stop: failed to skip to " << offset
-		       << std::dec << dendl;
-	      ceph_abort_msg("problem with op_jump");
-	    }
+	  if (offset < read_pos) {
+	    dout(10) << __func__ << " 0x" << std::hex << read_pos
+		     << ": stop: failed to skip to " << offset
+		     << std::dec << dendl;
+	    ceph_abort_msg("problem with op_jump");
 	  }
+	  read_pos = offset;
 	}
 	break;
 
@@ -1796,8 +2040,13 @@ int BlueFS::_replay(bool noop, bool to_stdout)
 
     // we successfully replayed the transaction; bump the seq and log size
     ++log_seq;
-    log_file->fnode.size = log_reader->buf.pos;
+    log_file->fnode.size = read_pos;
+    next_pos = read_pos;
+    logger->inc(l_bluefs_replay_records);
+    logger->inc(l_bluefs_replay_bytes, read_pos - pos0);
   }
+  prefetch.reset();
+  logger->tset(l_bluefs_replay_wait_lat, utime_t(read_wait));
   if (!noop) {
     vselector->add_usage(log_file->vselector_hint, log_file->fnode);
     log.seq_live = log_seq + 1;
@@ -1824,6 +2073,18 @@ int BlueFS::_replay(bool noop, bool to_stdout)
 	     << dendl;
 	return -EIO;
       }
+      // a WAL ring file was not closed; what it wrote is somewhere in its
+      // zeroed space, let rocksdb find the end of its records
+      auto& fnode = p.second->fnode;
+      if ((fnode.flags & bluefs_fnode_t::FLAG_WAL_RING) &&
+	  fnode.size < fnode.get_allocated()) {
+	dout(10) << __func__ << " wal ring file " << fnode << " size 0x"
+		 << std::hex << fnode.size << " -> 0x" << fnode.get_allocated()
+		 << std::dec << dendl;
+	vselector->sub_usage(p.second->vselector_hint, fnode);
+	fnode.size = fnode.get_allocated();
+	vselector->add_usage(p.second->vselector_hint, fnode);
+      }
     }
   }
   // reflect file count in logger
@@ -3187,6 +3448,13 @@ void BlueFS::_consume_dirty(uint64_t seq)
       // the only path that adds to dirty.files goes from _fsync()
       // _fsync() is executed under writer lock,
       // and does not exit until syncing log is done
+      if (f.wal_ring_dropped) {
+	// flags are not part of the delta
+	dout(20) << __func__ << "   op_file_update " << f.fnode << dendl;
+	log.t.op_file_update(f.fnode);
+	f.wal_ring_dropped = false;
+	continue;
+      }
       dout(20) << __func__ << "   op_file_update_inc " << f.fnode << dendl;
       log.t.op_file_update_inc(f.fnode);
     }
@@ -3523,6 +3791,25 @@ int BlueFS::_flush_range_F(FileWriter *h, uint64_t offset, uint64_t length)
   uint64_t allocated = h->file->fnode.get_allocated();
   // do not bother to dirty the file if we are overwriting
   // previously allocated extents.
+  if (allocated < offset + length &&
+      (h->file->fnode.flags & bluefs_fnode_t::FLAG_WAL_RING)) {
+    while (h->file->fnode.get_allocated() < offset + length &&
+	   _wal_ring_take(h->file)) {
+    }
+    if (allocated != h->file->fnode.get_allocated()) {
+      allocated = h->file->fnode.get_allocated();
+      h->file->is_dirty = true;
+    }
+    if (allocated < offset + length) {
+      // space past this point is not zeroed; from now on the size
+      // has to be logged like for any other file
+      dout(10) << __func__ << " wal ring is empty, dropping "
+	       << h->file->fnode << " out of it" << dendl;
+      h->file->fnode.flags &= ~bluefs_fnode_t::FLAG_WAL_RING;
+      h->file->wal_ring_dropped = true;
+      logger->inc(l_bluefs_wal_ring_misses);
+    }
+  }
   if (allocated < offset + length) {
     // we should never run out of log space here; see the min runway check
     // in _flush_and_sync_log.
@@ -3545,7 +3832,10 @@ int BlueFS::_flush_range_F(FileWriter *h, uint64_t offset, uint64_t length)
   if (h->file->fnode.size < offset + length) {
     vselector->add_usage(h->file->vselector_hint, offset + length - h->file->fnode.size);
     h->file->fnode.size = offset + length;
-    h->file->is_dirty = true;
+    // a wal ring file gets its size back at replay
+    if (!(h->file->fnode.flags & bluefs_fnode_t::FLAG_WAL_RING)) {
+      h->file->is_dirty = true;
+    }
   }
   dout(20) << __func__ << " file now, unflushed " << h->file->fnode << dendl;
   int res = _flush_data(h, offset, length, buffered);
@@ -3833,7 +4123,11 @@ int BlueFS::truncate(FileWriter *h, uint64_t offset)/*_WF_L*/
         changed_extents = true;
       }
     }
-    if (changed_extents) {
+    // the final size of a wal ring file gets logged now, along with
+    // the flag going away
+    bool was_wal_ring = fnode.flags & bluefs_fnode_t::FLAG_WAL_RING;
+    fnode.flags &= ~bluefs_fnode_t::FLAG_WAL_RING;
+    if (changed_extents || was_wal_ring) {
       fnode.size = offset;
       fnode.reset_delta();
       fnode.recalc_allocated();
@@ -3879,6 +4173,8 @@ int BlueFS::fsync(FileWriter *h)/*_WF_WD_WLD_WLNF_WNF*/
   }
   if (old_dirty_seq) {
     _flush_and_sync_log_LD(old_dirty_seq);
+  } else if (h->file->fnode.flags & bluefs_fnode_t::FLAG_WAL_RING) {
+    logger->inc(l_bluefs_wal_ring_fsyncs);
   }
   _maybe_compact_log_LNF_NF_LD_D();
   logger->tinc(l_bluefs_fsync_lat, mono_clock::now() - t0);
@@ -3914,7 +4210,36 @@ void BlueFS::_flush_bdev(std::array<bool, MAX_BDEV>& dirty_bdevs)
   dout(20) << __func__ << dendl;
   for (unsigned i = 0; i < MAX_BDEV; i++) {
     if (dirty_bdevs[i])
-      bdev[i]->flush();
+      _flush_bdev_merged(i);
+  }
+}
+
+// Our writes have completed by now, so any flush that starts from here
+// on covers them; one already running might not.  Whoever finds no flush
+// running issues the next one for everybody waiting.
+void BlueFS::_flush_bdev_merged(unsigned id)
+{
+  auto& bf = bdev_flush[id];
+  std::unique_lock l(bf.lock);
+  uint64_t want = bf.started + 1;
+  bool issued = false;
+  while (bf.completed < want) {
+    if (bf.running) {
+      bf.cond.wait(l);
+      continue;
+    }
+    bf.running = true;
+    uint64_t seq = ++bf.started;
+    l.unlock();
+    bdev[id]->flush();
+    l.lock();
+    bf.completed = seq;
+    bf.running = false;
+    bf.cond.notify_all();
+    issued = true;
+  }
+  if (!issued) {
+    logger->inc(l_bluefs_bdev_flush_merged);
   }
 }
 
@@ -4098,6 +4423,125 @@ int BlueFS::_allocate(uint8_t id, uint64_t len,
   return 0;
 }
 
+void BlueFS::_wal_ring_start()
+{
+  if (!cct->_conf.get_val<Option::size_t>("bluefs_wal_ring_size")) {
+    return;
+  }
+  if (!(super.incompat & bluefs_super_t::INCOMPAT_WAL_RING)) {
+    // Ring files log a stale size that only this replay knows to extend,
+    // so make sure BlueFS that does not won't mount once they exist.
+    // This is never cleared again: the log may still hold such fnodes.
+    dout(1) << __func__ << " marking superblock incompat wal_ring" << dendl;
+    super.incompat |= bluefs_super_t::INCOMPAT_WAL_RING;
+    _write_super(BDEV_DB);
+    _flush_bdev();
+  }
+  std::lock_guard l(wal_ring.lock);
+  wal_ring.bdev = bdev[BDEV_WAL] ? BDEV_WAL : BDEV_DB;
+  wal_ring.stop = false;
+  dout(10) << __func__ << " on bdev " << wal_ring.bdev << dendl;
+  wal_ring.thread = make_named_thread("bfs_wal_ring",
+				      &BlueFS::_wal_ring_fill, this);
+}
+
+void BlueFS::_wal_ring_stop()
+{
+  if (!wal_ring.thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard l(wal_ring.lock);
+    wal_ring.stop = true;
+    wal_ring.cond.notify_all();
+  }
+  wal_ring.thread.join();
+
+  // nothing was logged for what is left, just hand it back
+  vector<interval_set<uint64_t>> to_release(MAX_BDEV);
+  for (auto& chunk : wal_ring.chunks) {
+    for (auto& e : chunk) {
+      to_release[e.bdev].insert(e.offset, e.length);
+    }
+  }
+  dout(10) << __func__ << " releasing 0x" << std::hex << wal_ring.avail
+	   << std::dec << " unused" << dendl;
+  wal_ring.chunks.clear();
+  wal_ring.avail = 0;
+  wal_ring.bdev = -1;
+  logger->set(l_bluefs_wal_ring_avail_bytes, 0);
+  _release_pending_allocations(to_release);
+}
+
+void BlueFS::_wal_ring_fill()
+{
+  bufferptr zeros = buffer::create_page_aligned(
+    std::max<uint64_t>(alloc_size[wal_ring.bdev], 1ull << 20));
+  zeros.zero();
+  std::unique_lock l(wal_ring.lock);
+  while (!wal_ring.stop) {
+    if (wal_ring.avail >=
+	cct->_conf.get_val<Option::size_t>("bluefs_wal_ring_size")) {
+      wal_ring.cond.wait(l);
+      continue;
+    }
+    uint64_t want =
+      cct->_conf.get_val<Option::size_t>("bluefs_wal_ring_chunk_size");
+    l.unlock();
+    bluefs_fnode_t chunk;
+    int r = _allocate(wal_ring.bdev, want, 0, &chunk, nullptr, 0, false);
+    if (r == 0) {
+      for (auto& e : chunk.extents) {
+	for (uint64_t off = 0; off < e.length; off += zeros.length()) {
+	  bufferlist bl;
+	  bl.append(zeros, 0, std::min<uint64_t>(zeros.length(),
+						 e.length - off));
+	  bdev[e.bdev]->write(e.offset + off, bl, false);
+	}
+      }
+      // replay trusts these to read back as zeros
+      bdev[wal_ring.bdev]->flush();
+      logger->inc(l_bluefs_wal_ring_zeroed_bytes, chunk.get_allocated());
+    }
+    l.lock();
+    if (r < 0) {
+      dout(10) << __func__ << " no space for 0x" << std::hex << want
+	       << std::dec << ", retrying later" << dendl;
+      wal_ring.cond.wait_for(l, std::chrono::seconds(1));
+      continue;
+    }
+    wal_ring.avail += chunk.get_allocated();
+    wal_ring.chunks.emplace_back(std::move(chunk.extents));
+    logger->set(l_bluefs_wal_ring_avail_bytes, wal_ring.avail);
+  }
+}
+
+// Appends a chunk of the wal ring to f if it lives on the ring's device.
+bool BlueFS::_wal_ring_take(FileRef f)
+{
+  mempool::bluefs::vector<bluefs_extent_t> chunk;
+  {
+    std::lock_guard l(wal_ring.lock);
+    if (wal_ring.chunks.empty() ||
+	vselector->select_prefer_bdev(f->vselector_hint) != wal_ring.bdev) {
+      return false;
+    }
+    chunk.swap(wal_ring.chunks.front());
+    wal_ring.chunks.pop_front();
+    for (auto& e : chunk) {
+      wal_ring.avail -= e.length;
+    }
+    logger->set(l_bluefs_wal_ring_avail_bytes, wal_ring.avail);
+    wal_ring.cond.notify_all();
+  }
+  for (auto& e : chunk) {
+    f->fnode.append_extent(e);
+    vselector->add_usage(f->vselector_hint, e);
+  }
+  dout(20) << __func__ << " " << f->fnode << dendl;
+  return true;
+}
+
 int BlueFS::preallocate(FileRef f, uint64_t off, uint64_t len)/*_LF*/
 {
   std::lock_guard ll(log.lock);
@@ -4226,10 +4670,20 @@ int BlueFS::open_for_write(
       pending_release_extents.swap(file->fnode.extents);
 
       file->fnode.clear_extents();
+      file->fnode.flags &= ~bluefs_fnode_t::FLAG_WAL_RING;
     }
   }
   ceph_assert(file->fnode.ino > 1);
 
+  if (!overwrite && boost::algorithm::ends_with(filename, ".log") &&
+      _wal_ring_take(file)) {
+    // appends stay within zeroed space and do not log the size; the
+    // file itself still has to be logged on the first fsync
+    file->fnode.flags |= bluefs_fnode_t::FLAG_WAL_RING;
+    file->is_dirty = true;
+    logger->inc(l_bluefs_wal_ring_files);
+  }
+
   file->fnode.mtime = ceph_clock_now();
   dout(20) << __func__ << " mapping " << dirname << "/" << filename
 	   << " vsel_hint " << file->vselector_hint
@@ -6,6 +6,8 @@
 #include <atomic>
 #include <mutex>
 #include <limits>
+#include <deque>
+#include <thread>
 
 #include "bluefs_types.h"
 #include "blk/BlockDevice.h"
@@ -85,6 +87,19 @@ enum {
   l_bluefs_wal_alloc_max_lat,
   l_bluefs_db_alloc_max_lat,
   l_bluefs_slow_alloc_max_lat,
+  l_bluefs_mount_lat,
+  l_bluefs_mount_super_lat,
+  l_bluefs_mount_replay_lat,
+  l_bluefs_mount_freelist_lat,
+  l_bluefs_replay_wait_lat,
+  l_bluefs_replay_records,
+  l_bluefs_replay_bytes,
+  l_bluefs_wal_ring_avail_bytes,
+  l_bluefs_wal_ring_zeroed_bytes,
+  l_bluefs_wal_ring_files,
+  l_bluefs_wal_ring_misses,
+  l_bluefs_wal_ring_fsyncs,
+  l_bluefs_bdev_flush_merged,
   l_bluefs_last,
 };
 
@@ -242,6 +257,7 @@ public:
     bool locked;
     bool deleted;
     bool is_dirty;
+    bool wal_ring_dropped = false; ///< FLAG_WAL_RING cleared, not logged yet
     boost::intrusive::list_member_hook<> dirty_item;
 
     std::atomic_int num_readers, num_writers;
@@ -478,6 +494,28 @@ private:
     // 2) we usually not remove extents from files. And when we do, we force log-syncing.
   } dirty;
 
+  // zeroed space handed out to WAL files, so that their appends need
+  // neither allocations nor log updates; see bluefs_wal_ring_size
+  struct {
+    ceph::mutex lock = ceph::make_mutex("BlueFS::wal_ring.lock");
+    ceph::condition_variable cond;
+    std::deque<mempool::bluefs::vector<bluefs_extent_t>> chunks;
+    uint64_t avail = 0;      ///< bytes in chunks
+    int bdev = -1;
+    bool stop = false;
+    std::thread thread;
+  } wal_ring;
+
+  // concurrent flushes of a device are merged into one
+  struct bdev_flush_t {
+    ceph::mutex lock = ceph::make_mutex("BlueFS::bdev_flush_t::lock");
+    ceph::condition_variable cond;
+    uint64_t started = 0;    ///< flushes issued so far
+    uint64_t completed = 0;  ///< last flush that returned
+    bool running = false;
+  };
+  std::array<bdev_flush_t, MAX_BDEV> bdev_flush;
+
   ceph::condition_variable log_cond;                             ///< used for state control between log flush / log compaction
   std::atomic<bool> log_is_compacting{false};                    ///< signals that bluefs log is already ongoing compaction
   std::atomic<bool> log_forbidden_to_expand{false};              ///< used to signal that async compaction is in state
@@ -601,6 +639,12 @@ private:
   void _flush_bdev(FileWriter *h, bool check_mutex_locked = true);
   void _flush_bdev();  // this is safe to call without a lock
   void _flush_bdev(std::array<bool, MAX_BDEV>& dirty_bdevs);  // this is safe to call without a lock
+  void _flush_bdev_merged(unsigned id);
+
+  void _wal_ring_start();
+  void _wal_ring_stop();
+  void _wal_ring_fill();
+  bool _wal_ring_take(FileRef f);
 
   int64_t _read(
     FileReader *h,   ///< [in] read from here
@@ -626,6 +670,28 @@ private:
     const char *op);
   int _replay(bool noop, bool to_stdout = false); ///< replay journal
 
+  /// one log record as read (and decoded) for _replay()
+  struct replay_record_t {
+    uint64_t pos = 0;         ///< log offset of the record
+    int r = 0;                ///< bytes of the first block we got
+    uint64_t more = 0;        ///< bytes needed past the first block
+    int more_r = 0;           ///< bytes of those we got
+    uuid_d uuid;
+    uint64_t seq = 0;
+    ceph::buffer::list bl;    ///< the whole record
+    bool decoded = false;
+    std::string decode_error;
+    bluefs_transaction_t t;
+
+    /// the reader cannot tell whether anything follows this record
+    bool is_last() const {
+      return !decoded;
+    }
+  };
+  class LogReplayPrefetch;
+  void _replay_read_record(FileReader *reader, uint64_t pos,
+			   replay_record_t *rec, uint64_t expect_seq = 0);
+
   FileWriter *_create_writer(FileRef f);
   void _drain_writer(FileWriter *h);
   void _close_writer(FileWriter *h);
@@ -132,6 +132,7 @@ const string PREFIX_DEFERRED = "L";    // id -> deferred_transaction_t
 const string PREFIX_ALLOC = "B";       // u64 offset -> u64 length (freelist)
 const string PREFIX_ALLOC_BITMAP = "b";// (see BitmapFreelistManager)
 const string PREFIX_SHARED_BLOB = "X"; // u64 SB id -> shared_blob_t
+const string PREFIX_ALLOC_DELTA = "a"; // u64 seq -> allocated + released (NCB)
 
 const string BLUESTORE_GLOBAL_STATFS_KEY = "bluestore_statfs";
 
@@ -554,6 +555,11 @@ static void get_deferred_key(uint64_t seq, string *out)
   _key_encode_u64(seq, out);
 }
 
+static void get_alloc_delta_key(uint64_t seq, string *out)
+{
+  _key_encode_u64(seq, out);
+}
+
 static void get_pool_stat_key(int64_t pool_id, string *key)
 {
   key->clear();
@@ -1121,6 +1127,15 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
       ocs->lock.lock();
     }
     if (o->is_cached() && o->pin_nref == 1) {
+      if (o->exists && o->extent_map.may_pack_shards()) {
+	// lookups pin onodes under the shared side of onode_space.lock,
+	// so while we hold it exclusively nobody else can get at the
+	// extent map
+	std::unique_lock l(o->c->onode_space.lock);
+	if (o->pin_nref == 1) {
+	  o->extent_map.pack_clean_shards();
+	}
+      }
       if(!o->lru_item.is_linked()) {
         if (o->exists) {
 	  lru.push_front(*o);
@@ -1129,13 +1144,20 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
 	  dout(20) << __func__ << " " << this << " " << o->oid << " unpinned"
                    << dendl;
         } else {
-	  ceph_assert(num);
-	  --num;
-	  o->clear_cached();
-	  dout(20) << __func__ << " " << this << " " << o->oid << " removed"
-                   << dendl;
-          // remove will also decrement nref
-          o->c->onode_space._remove(o->oid);
+	  std::unique_lock l(o->c->onode_space.lock);
+	  if (o->pin_nref > 1) {
+	    // raced with a lookup, the last unpin will get us here again
+	    dout(20) << __func__ << " " << this << " " << o->oid
+		     << " repinned" << dendl;
+	  } else {
+	    ceph_assert(num);
+	    --num;
+	    o->clear_cached();
+	    dout(20) << __func__ << " " << this << " " << o->oid << " removed"
+		     << dendl;
+	    // remove will also decrement nref
+	    o->c->onode_space._remove(o->oid);
+	  }
         }
       } else if (o->exists) {
         // move onode within LRU
@@ -1170,6 +1192,9 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
                << o->nref << " " << o->cached << dendl;
 
       *(o->cache_age_bin) -= 1;
+      // lookups don't take our lock, recheck pinning under the
+      // exclusive onode_space lock which they do take
+      std::unique_lock l(o->c->onode_space.lock);
       if (o->pin_nref > 1) {
         dout(20) << __func__ << " " << this << " " << " " << " " << o->oid << dendl;
       } else {
@@ -2049,13 +2074,16 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::add_onode(const ghobject_t& oid,
   OnodeRef& o)
 {
   std::lock_guard l(cache->lock);
-  // add entry or return existing one
-  auto p = onode_map.emplace(oid, o);
-  if (!p.second) {
-    ldout(cache->cct, 30) << __func__ << " " << oid << " " << o
-			  << " raced, returning existing " << p.first->second
-			  << dendl;
-    return p.first->second;
+  {
+    std::unique_lock ml(lock);
+    // add entry or return existing one
+    auto p = onode_map.emplace(oid, o);
+    if (!p.second) {
+      ldout(cache->cct, 30) << __func__ << " " << oid << " " << o
+			    << " raced, returning existing " << p.first->second
+			    << dendl;
+      return p.first->second;
+    }
   }
   ldout(cache->cct, 20) << __func__ << " " << oid << " " << o << dendl;
   cache->_add(o.get(), 1);
@@ -2075,7 +2103,10 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
   OnodeRef o;
 
   {
-    std::lock_guard l(cache->lock);
+    // Hits don't touch the cache shard: pinning the onode defers the LRU
+    // update to unpin time, and evictions recheck the pin under the
+    // exclusive side of this lock.
+    std::shared_lock l(lock);
     ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
     if (p == onode_map.end()) {
       ldout(cache->cct, 30) << __func__ << " " << oid << " miss" << dendl;
@@ -2096,9 +2127,16 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
   return o;
 }
 
+bool BlueStore::OnodeSpace::contains(const ghobject_t& oid)
+{
+  std::shared_lock l(lock);
+  return onode_map.count(oid);
+}
+
 void BlueStore::OnodeSpace::clear()
 {
   std::lock_guard l(cache->lock);
+  std::unique_lock ml(lock);
   ldout(cache->cct, 10) << __func__ << " " << onode_map.size()<< dendl;
   for (auto &p : onode_map) {
     cache->_rm(p.second.get());
@@ -2108,7 +2146,7 @@ void BlueStore::OnodeSpace::clear()
 
 bool BlueStore::OnodeSpace::empty()
 {
-  std::lock_guard l(cache->lock);
+  std::shared_lock l(lock);
   return onode_map.empty();
 }
 
@@ -2119,6 +2157,7 @@ void BlueStore::OnodeSpace::rename(
   const mempool::bluestore_cache_meta::string& new_okey)
 {
   std::lock_guard l(cache->lock);
+  std::unique_lock ml(lock);
   ldout(cache->cct, 30) << __func__ << " " << old_oid << " -> " << new_oid
 			<< dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator po, pn;
@@ -2146,12 +2185,14 @@ void BlueStore::OnodeSpace::rename(
 
   o->oid = new_oid;
   o->key = new_okey;
+  // trimming takes the onode_space lock of the victims
+  ml.unlock();
   cache->_trim();
 }
 
 bool BlueStore::OnodeSpace::map_any(std::function<bool(Onode*)> f)
 {
-  std::lock_guard l(cache->lock);
+  std::shared_lock l(lock);
   ldout(cache->cct, 20) << __func__ << dendl;
   for (auto& i : onode_map) {
     if (f(i.second.get())) {
@@ -2172,6 +2213,111 @@ void BlueStore::OnodeSpace::dump(CephContext *cct)
   }
 }
 
+// DecompressedCache
+
+bool BlueStore::DecompressedCache::lookup(
+  const bluestore_blob_t& blob,
+  bufferlist* out)
+{
+  if (!enabled() || blob.get_extents().empty()) {
+    return false;
+  }
+  uint64_t offset = blob.get_extents().front().offset;
+  auto& sh = _get_shard(offset);
+  std::lock_guard l(sh.lock);
+  auto p = sh.entries.find(offset);
+  if (p == sh.entries.end() ||
+      p->second.ondisk_length != blob.get_ondisk_length() ||
+      p->second.data.length() != blob.get_logical_length()) {
+    return false;
+  }
+  sh.lru.splice(sh.lru.begin(), sh.lru, p->second.lru_it);
+  *out = p->second.data;
+  return true;
+}
+
+void BlueStore::DecompressedCache::insert(
+  const bluestore_blob_t& blob,
+  const bufferlist& data)
+{
+  uint64_t shard_max = max_bytes / num_shards;
+  if (blob.get_extents().empty() || data.length() > shard_max) {
+    return;
+  }
+  uint64_t offset = blob.get_extents().front().offset;
+  auto& sh = _get_shard(offset);
+  std::lock_guard l(sh.lock);
+  auto p = sh.entries.find(offset);
+  if (p != sh.entries.end()) {
+    _erase(sh, p);
+  }
+  sh.lru.push_front(offset);
+  auto& e = sh.entries[offset];
+  e.ondisk_length = blob.get_ondisk_length();
+  e.data = data;
+  e.lru_it = sh.lru.begin();
+  sh.bytes += data.length();
+  bytes += data.length();
+  ++num;
+  _trim(sh, shard_max);
+}
+
+void BlueStore::DecompressedCache::invalidate(
+  const interval_set<uint64_t>& released)
+{
+  if (num == 0) {
+    return;
+  }
+  for (auto& sh : shards) {
+    std::lock_guard l(sh.lock);
+    if (sh.entries.empty()) {
+      continue;
+    }
+    for (auto r = released.begin(); r != released.end(); ++r) {
+      auto p = sh.entries.lower_bound(r.get_start());
+      while (p != sh.entries.end() && p->first < r.get_end()) {
+	_erase(sh, p++);
+      }
+    }
+  }
+}
+
+void BlueStore::DecompressedCache::set_max(uint64_t max)
+{
+  max_bytes = max;
+  for (auto& sh : shards) {
+    std::lock_guard l(sh.lock);
+    _trim(sh, max / num_shards);
+  }
+}
+
+void BlueStore::DecompressedCache::flush()
+{
+  for (auto& sh : shards) {
+    std::lock_guard l(sh.lock);
+    _trim(sh, 0);
+  }
+}
+
+void BlueStore::DecompressedCache::_erase(
+  shard_t& sh,
+  std::map<uint64_t, entry_t>::iterator p)
+{
+  sh.bytes -= p->second.data.length();
+  bytes -= p->second.data.length();
+  --num;
+  sh.lru.erase(p->second.lru_it);
+  sh.entries.erase(p);
+}
+
+void BlueStore::DecompressedCache::_trim(shard_t& sh, uint64_t shard_max)
+{
+  while (sh.bytes > shard_max) {
+    ceph_assert(!sh.lru.empty());
+    _erase(sh, sh.entries.find(sh.lru.back()));
+  }
+}
+
 // SharedBlob
 
 #undef dout_prefix
@@ -3532,6 +3678,11 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
 	       << it.shard->shard_info->offset << std::dec << dendl;
       it.shard->dirty = false;
       it.shard->shard_info->bytes = it.bl.length();
+      if (onode->c->store->onode_pack_shards) {
+	it.shard->packed = it.bl;
+	it.shard->packed.reassign_to_mempool(
+	  mempool::mempool_bluestore_cache_meta);
+      }
       generate_extent_shard_key_and_apply(
 	onode->key,
 	it.shard->shard_info->offset,
@@ -4196,7 +4347,16 @@ void BlueStore::ExtentMap::fault_range(
   while (start <= last) {
     ceph_assert((size_t)start < shards.size());
     auto p = &shards[start];
-    if (!p->loaded) {
+    if (!p->loaded && p->packed.length()) {
+      ceph_assert(p->packed.length() == p->shard_info->bytes);
+      p->extents = decode_some(p->packed);
+      p->loaded = true;
+      dout(20) << __func__ << " unpacked shard 0x" << std::hex
+	       << p->shard_info->offset
+	       << " for range 0x" << offset << "~" << length << std::dec
+	       << " (" << p->packed.length() << " bytes)" << dendl;
+      onode->c->store->logger->inc(l_bluestore_onode_shard_unpacks);
+    } else if (!p->loaded) {
       dout(30) << __func__ << " opening shard 0x" << std::hex
 	       << p->shard_info->offset << std::dec << dendl;
       bufferlist v;
@@ -4220,6 +4380,10 @@ void BlueStore::ExtentMap::fault_range(
 	       << " (" << v.length() << " bytes)" << dendl;
       ceph_assert(p->dirty == false);
       ceph_assert(v.length() == p->shard_info->bytes);
+      if (onode->c->store->onode_pack_shards) {
+	p->packed = std::move(v);
+	p->packed.reassign_to_mempool(mempool::mempool_bluestore_cache_meta);
+      }
       onode->c->store->logger->inc(l_bluestore_onode_shard_misses);
     } else {
       onode->c->store->logger->inc(l_bluestore_onode_shard_hits);
@@ -4261,11 +4425,49 @@ void BlueStore::ExtentMap::dirty_range(
       dout(20) << __func__ << " mark shard 0x" << std::hex
 	       << p->shard_info->offset << std::dec << " dirty" << dendl;
       p->dirty = true;
+      p->packed.clear();
     }
     ++start;
   }
 }
 
+bool BlueStore::ExtentMap::may_pack_shards() const
+{
+  return onode->c->store->onode_pack_shards && !shards.empty();
+}
+
+void BlueStore::ExtentMap::pack_clean_shards()
+{
+  if (!may_pack_shards() || needs_reshard()) {
+    return;
+  }
+  auto cct = onode->c->store->cct; // used by dout
+  unsigned packed = 0;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    auto& sh = shards[i];
+    if (!sh.loaded || sh.dirty || sh.packed.length() == 0) {
+      continue;
+    }
+    uint32_t start = sh.shard_info->offset;
+    uint32_t end = i + 1 < shards.size() ?
+      shards[i + 1].shard_info->offset : OBJECT_MAX_SIZE;
+    // extents never cross shard boundaries, spanning blobs stay
+    // referenced from spanning_blob_map
+    auto p = seek_lextent(start);
+    while (p != extent_map.end() && p->logical_offset < end) {
+      rm(p++);
+    }
+    sh.extents = 0;
+    sh.loaded = false;
+    ++packed;
+  }
+  if (packed) {
+    dout(20) << __func__ << " " << onode->oid << " packed " << packed
+	     << " shards" << dendl;
+    onode->c->store->logger->inc(l_bluestore_onode_shard_packs, packed);
+  }
+}
+
 BlueStore::extent_map_t::iterator BlueStore::ExtentMap::find(
   uint64_t offset)
 {
@@ -5170,6 +5372,48 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
   return onode_space.add_onode(oid, o);
 }
 
+void BlueStore::Collection::get_onodes(
+  const vector<ghobject_t>& oids,
+  vector<OnodeRef> *onodes)
+{
+  // objects not found are cached as non-existent, as get_onode(create) does
+  ceph_assert(ceph_mutex_is_wlocked(lock));
+  ceph_assert(onodes->size() == oids.size());
+
+  spg_t pgid;
+  bool is_pg = cid.is_pg(&pgid);
+  vector<size_t> missing;
+  for (size_t i = 0; i < oids.size(); ++i) {
+    if ((*onodes)[i] ||
+	(is_pg && !oids[i].match(cnode.bits, pgid.ps())) ||
+	onode_space.contains(oids[i])) {
+      continue;
+    }
+    missing.push_back(i);
+  }
+  if (missing.size() < 2) {
+    // nothing to batch, leave it to get_onode()
+    return;
+  }
+
+  vector<string> keys(missing.size());
+  for (size_t j = 0; j < missing.size(); ++j) {
+    get_object_key(store->cct, oids[missing[j]], &keys[j]);
+  }
+  vector<bufferlist> vals;
+  vector<int> rs;
+  store->db->multi_get(PREFIX_OBJ, keys, &vals, &rs);
+  get_onode_cache()->logger->inc(l_bluestore_onode_misses, missing.size());
+  for (size_t j = 0; j < missing.size(); ++j) {
+    const ghobject_t& oid = oids[missing[j]];
+    ldout(store->cct, 20) << __func__ << " oid " << oid << " key "
+			  << pretty_binary_string(keys[j]) << " r " << rs[j]
+			  << " v.len " << vals[j].length() << dendl;
+    OnodeRef o(Onode::create_decode(this, oid, keys[j], vals[j], true));
+    (*onodes)[missing[j]] = onode_space.add_onode(oid, o);
+  }
+}
+
 void BlueStore::Collection::split_cache(
   Collection *dest)
 {
@@ -5184,6 +5428,10 @@ void BlueStore::Collection::split_cache(
   std::lock_guard l2(ocache_dest->lock, std::adopt_lock);
   std::lock_guard l3(cache->lock, std::adopt_lock);
   std::lock_guard l4(dest->cache->lock, std::adopt_lock);
+  // and both onode maps, to keep lookups out
+  std::lock(onode_space.lock, dest->onode_space.lock);
+  std::unique_lock l5(onode_space.lock, std::adopt_lock);
+  std::unique_lock l6(dest->onode_space.lock, std::adopt_lock);
 
   int destbits = dest->cnode.bits;
   spg_t destpg;
@@ -5308,6 +5556,9 @@ void *BlueStore::MempoolThread::entry()
     pcm->insert("kv", binned_kv_cache, true);
     pcm->insert("meta", meta_cache, true);
     pcm->insert("data", data_cache, true);
+    if (store->cache_decompressed_ratio > 0) {
+      pcm->insert("decompressed", decompressed_cache, true);
+    }
     if (binned_kv_onode_cache != nullptr) {
       pcm->insert("kv_onode", binned_kv_onode_cache, true);
     }
@@ -5317,6 +5568,7 @@ void *BlueStore::MempoolThread::entry()
   utime_t next_resize = ceph_clock_now();
   utime_t next_bin_rotation = ceph_clock_now();
   utime_t next_deferred_force_submit = ceph_clock_now();
+  utime_t next_deferred_tune = ceph_clock_now();
   utime_t alloc_stats_dump_clock = ceph_clock_now();
 
   bool interval_stats_trim = false;
@@ -5369,6 +5621,7 @@ void *BlueStore::MempoolThread::entry()
       }
       meta_cache->set_cache_ratio(store->cache_meta_ratio);
       data_cache->set_cache_ratio(store->cache_data_ratio);
+      decompressed_cache->set_cache_ratio(store->cache_decompressed_ratio);
 
       // Log events at 5 instead of 20 when balance happens.
       interval_stats_trim = true;
@@ -5398,6 +5651,15 @@ void *BlueStore::MempoolThread::entry()
       next_deferred_force_submit = ceph_clock_now();
       next_deferred_force_submit += max_defer_interval/3;
     }
+    // adaptive deferred write threshold
+    double deferred_tune_interval =
+      store->cct->_conf.get_val<double>(
+	"bluestore_prefer_deferred_size_adaptive_interval");
+    if (deferred_tune_interval > 0 && next_deferred_tune < ceph_clock_now()) {
+      store->tune_prefer_deferred_size();
+      next_deferred_tune = ceph_clock_now();
+      next_deferred_tune += deferred_tune_interval;
+    }
 
     // Now Resize the shards 
     _resize_shards(interval_stats_trim);
@@ -5433,12 +5695,17 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
      static_cast<int64_t>(store->cache_meta_ratio * cache_size);
   int64_t data_alloc =
      static_cast<int64_t>(store->cache_data_ratio * cache_size);
+  int64_t decompressed_alloc =
+     static_cast<int64_t>(store->cache_decompressed_ratio * cache_size);
 
   if (pcm != nullptr && binned_kv_cache != nullptr) {
     cache_size = pcm->get_tuned_mem();
     kv_alloc = binned_kv_cache->get_committed_size();
     meta_alloc = meta_cache->get_committed_size();
     data_alloc = data_cache->get_committed_size();
+    if (store->cache_decompressed_ratio > 0) {
+      decompressed_alloc = decompressed_cache->get_committed_size();
+    }
     if (binned_kv_onode_cache != nullptr) {
       kv_onode_alloc = binned_kv_onode_cache->get_committed_size();
     }
@@ -5479,6 +5746,7 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
   for (auto i : store->buffer_cache_shards) {
     i->set_max(max_shard_buffer);
   }
+  store->decompressed_cache.set_max(decompressed_alloc);
 }
 
 void BlueStore::MempoolThread::_update_cache_settings()
@@ -5715,6 +5983,8 @@ BlueStore::BlueStore(CephContext *cct,
     finisher(cct, "commit_finisher", "cfin"),
     kv_sync_thread(this),
     kv_finalize_thread(this),
+    defrag_thread(this),
+    alloc_ckpt_thread(this),
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(std::countr_zero(_min_alloc_size)),
     mempool_thread(this)
@@ -5723,6 +5993,7 @@ BlueStore::BlueStore(CephContext *cct,
   cct->_conf.add_observer(this);
   set_cache_shards(1);
   bluestore_bdev_label_require_all = cct->_conf.get_val<bool>("bluestore_bdev_label_require_all");
+  onode_pack_shards = cct->_conf.get_val<bool>("bluestore_onode_pack_shards");
 }
 
 BlueStore::~BlueStore()
@@ -5788,6 +6059,9 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_warn_on_no_per_pool_omap",
     "bluestore_warn_on_no_per_pg_omap",
     "bluestore_max_defer_interval",
+    "bluestore_onode_pack_shards",
+    "bluestore_defrag",
+    "bluestore_allocation_checkpoint_interval",
     NULL
   };
   return KEYS;
@@ -5807,6 +6081,9 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
   if (changed.count("bluestore_csum_type")) {
     _set_csum();
   }
+  if (changed.count("bluestore_onode_pack_shards")) {
+    onode_pack_shards = conf.get_val<bool>("bluestore_onode_pack_shards");
+  }
   if (changed.count("bluestore_compression_mode") ||
       changed.count("bluestore_compression_algorithm") ||
       changed.count("bluestore_compression_min_blob_size") ||
@@ -5852,6 +6129,14 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
       _set_max_defer_interval();
     }
   }
+  if (changed.count("bluestore_defrag")) {
+    std::lock_guard l{defrag_lock};
+    defrag_cond.notify_all();
+  }
+  if (changed.count("bluestore_allocation_checkpoint_interval")) {
+    std::lock_guard l{alloc_ckpt_lock};
+    alloc_ckpt_cond.notify_all();
+  }
   if (changed.count("osd_memory_target") ||
       changed.count("osd_memory_base") ||
       changed.count("osd_memory_cache_min") ||
@@ -6039,11 +6324,24 @@ int BlueStore::_set_cache_sizes()
     return -EINVAL;
   }
 
-  if (cache_meta_ratio + cache_kv_ratio + cache_kv_onode_ratio > 1.0) {
+  cache_decompressed_ratio =
+    cct->_conf.get_val<double>("bluestore_cache_decompressed_ratio");
+  if (cache_decompressed_ratio < 0 || cache_decompressed_ratio > 1.0) {
+    derr << __func__ << " bluestore_cache_decompressed_ratio ("
+         << cache_decompressed_ratio
+         << ") must be in range [0,1.0]" << dendl;
+    return -EINVAL;
+  }
+
+  if (cache_meta_ratio + cache_kv_ratio + cache_kv_onode_ratio +
+      cache_decompressed_ratio > 1.0) {
     derr << __func__ << " bluestore_cache_meta_ratio (" << cache_meta_ratio
          << ") + bluestore_cache_kv_ratio (" << cache_kv_ratio
          << ") + bluestore_cache_kv_onode_ratio (" << cache_kv_onode_ratio
-         << ") = " << cache_meta_ratio + cache_kv_ratio + cache_kv_onode_ratio << "; must be <= 1.0"
+         << ") + bluestore_cache_decompressed_ratio ("
+         << cache_decompressed_ratio
+         << ") = " << cache_meta_ratio + cache_kv_ratio + cache_kv_onode_ratio +
+                      cache_decompressed_ratio << "; must be <= 1.0"
          << dendl;
     return -EINVAL;
   }
@@ -6051,7 +6349,8 @@ int BlueStore::_set_cache_sizes()
   cache_data_ratio = (double)1.0 - 
                      (double)cache_meta_ratio - 
                      (double)cache_kv_ratio - 
-                     (double)cache_kv_onode_ratio;
+                     (double)cache_kv_onode_ratio -
+                     (double)cache_decompressed_ratio;
   if (cache_data_ratio < 0) {
     // deal with floating point imprecision
     cache_data_ratio = 0;
@@ -6062,6 +6361,7 @@ int BlueStore::_set_cache_sizes()
 	  << " kv " << cache_kv_ratio
 	  << " kv_onode " << cache_kv_onode_ratio
 	  << " data " << cache_data_ratio
+	  << " decompressed " << cache_decompressed_ratio
 	  << dendl;
   return 0;
 }
@@ -6179,6 +6479,11 @@ void BlueStore::_init_logger()
             "How fragmented bluestore free space is (free extents / max possible number of free extents) * 1000",
 	    "fbss",
 	    PerfCountersBuilder::PRIO_USEFUL);
+  b.add_u64(l_bluestore_fragmentation_score, "fragmentation_score",
+	    "Allocator fragmentation score * 1000, refreshed by each "
+	    "defragmentation pass",
+	    NULL,
+	    PerfCountersBuilder::PRIO_USEFUL);
   b.add_u64(l_bluestore_alloc_unit, "alloc_unit",
 	    "allocation unit size in bytes",
 	    "au_b",
@@ -6253,6 +6558,8 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_reads_with_retries, "reads_with_retries",
                     "Read operations that required at least one retry due to failed checksum validation",
 		    "rd_r", PerfCountersBuilder::PRIO_USEFUL);
+  b.add_u64_counter(l_bluestore_read_merged, "read_merged",
+                    "Blob reads merged into a physically adjacent device read");
   b.add_time_avg(l_bluestore_read_lat, "read_lat",
 		 "Average read latency",
 		 "r_l", PerfCountersBuilder::PRIO_CRITICAL);
@@ -6335,6 +6642,11 @@ void BlueStore::_init_logger()
 		    NULL,
 		    PerfCountersBuilder::PRIO_DEBUGONLY,
 		    unit_t(UNIT_BYTES));
+  b.add_u64(l_bluestore_deferred_size_shift,
+	    "deferred_size_shift",
+	    "Adaptive right shift applied to prefer_deferred_size",
+	    NULL,
+	    PerfCountersBuilder::PRIO_DEBUGONLY);
 
   b.add_u64_counter(l_bluestore_write_big_skipped_blobs,
       "write_big_skipped_blobs",
@@ -6390,6 +6702,12 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_onode_shard_misses,
 		    "onode_shard_misses",
 		    "Count of onode shard cache lookups misses");
+  b.add_u64_counter(l_bluestore_onode_shard_packs,
+		    "onode_shard_packs",
+		    "Count of clean onode shards reduced to encoded form");
+  b.add_u64_counter(l_bluestore_onode_shard_unpacks,
+		    "onode_shard_unpacks",
+		    "Count of onode shards decoded from their in-memory encoded form");
   b.add_u64(l_bluestore_extents, "onode_extents",
 	    "Number of extents in cache");
   b.add_u64(l_bluestore_blobs, "onode_blobs",
@@ -6415,6 +6733,18 @@ void BlueStore::_init_logger()
 	    NULL,
 	    PerfCountersBuilder::PRIO_DEBUGONLY,
 	    unit_t(UNIT_BYTES));
+  b.add_u64(l_bluestore_decompressed_blobs, "decompressed_blobs",
+	    "Number of decompressed blobs in cache");
+  b.add_u64(l_bluestore_decompressed_bytes, "decompressed_bytes",
+	    "Number of decompressed blob bytes in cache",
+	     NULL,
+	     PerfCountersBuilder::PRIO_DEBUGONLY,
+	     unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_decompressed_hit_bytes, "decompressed_hit_bytes",
+	    "Sum for bytes of read served from the decompressed blob cache",
+	    NULL,
+	    PerfCountersBuilder::PRIO_DEBUGONLY,
+	    unit_t(UNIT_BYTES));
   //****************************************
 
   // internal stats
@@ -6429,6 +6759,29 @@ void BlueStore::_init_logger()
 		    "Sum for extents that have been merged due to garbage "
 		    "collection");
   //****************************************
+  // online defragmentation stats
+  //****************************************
+  b.add_u64_counter(l_bluestore_defrag_scanned, "defrag_scanned",
+		    "Objects examined by the background defragmentation");
+  b.add_u64_counter(l_bluestore_defrag_fragmented, "defrag_fragmented",
+		    "Objects found to be fragmented");
+  b.add_u64_counter(l_bluestore_defrag_rewritten, "defrag_rewritten",
+		    "Objects rewritten into contiguous allocations");
+  b.add_u64_counter(l_bluestore_defrag_rewritten_bytes,
+		    "defrag_rewritten_bytes",
+		    "Bytes rewritten by the background defragmentation",
+		    NULL,
+		    PerfCountersBuilder::PRIO_DEBUGONLY,
+		    unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_defrag_extents_before,
+		    "defrag_extents_before",
+		    "Physical extents of rewritten objects before the rewrite");
+  b.add_u64_counter(l_bluestore_defrag_extents_after,
+		    "defrag_extents_after",
+		    "Physical extents of rewritten objects after the rewrite");
+  b.add_time_avg(l_bluestore_defrag_lat, "defrag_lat",
+		 "Average latency of rewriting a fragmented object");
+  //****************************************
   // misc
   //****************************************
   b.add_u64_counter(l_bluestore_omap_iterator_count, "omap_iterator_count",
@@ -6529,6 +6882,8 @@ void BlueStore::_init_logger()
     "Average bluestore allocator latency",
     "bsal",
     PerfCountersBuilder::PRIO_USEFUL);
+  b.add_time_avg(l_bluestore_alloc_checkpoint_lat, "alloc_checkpoint_lat",
+    "Average time to write an allocation checkpoint");
 
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
@@ -7270,13 +7625,20 @@ int BlueStore::_init_alloc()
       dout(5) << __func__ << "::NCB::restore_allocator() completed successfully alloc=" << alloc << dendl;
     } else {
       // This must mean that we had an unplanned shutdown and didn't manage to destage the allocator
-      dout(0) << __func__ << "::NCB::restore_allocator() failed! Run Full Recovery from ONodes (might take a while) ..." << dendl;
-      // if failed must recover from on-disk ONode internal state
-      if (read_allocation_from_drive_on_startup() != 0) {
-	derr << __func__ << "::NCB::Failed Recovery" << dendl;
-	derr << __func__ << "::NCB::Ceph-OSD won't start, make sure your drives are connected and readable" << dendl;
-	derr << __func__ << "::NCB::If no HW fault is found, please report failure and consider redeploying OSD" << dendl;
-	return -ENOTRECOVERABLE;
+      dout(0) << __func__ << "::NCB::restore_allocator() failed!" << dendl;
+      // the latest allocation checkpoint plus the deltas logged since then
+      // are the next best thing
+      if (restore_allocator_from_checkpoint(alloc, &num, &bytes) == 0) {
+	dout(1) << __func__ << "::NCB::restored from allocation checkpoint" << dendl;
+      } else {
+	dout(0) << __func__ << "::NCB::Run Full Recovery from ONodes (might take a while) ..." << dendl;
+	// if failed must recover from on-disk ONode internal state
+	if (read_allocation_from_drive_on_startup() != 0) {
+	  derr << __func__ << "::NCB::Failed Recovery" << dendl;
+	  derr << __func__ << "::NCB::Ceph-OSD won't start, make sure your drives are connected and readable" << dendl;
+	  derr << __func__ << "::NCB::If no HW fault is found, please report failure and consider redeploying OSD" << dendl;
+	  return -ENOTRECOVERABLE;
+	}
       }
     }
   }
@@ -7798,6 +8160,20 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
     dout(10) << __func__ << "::NCB::need_to_destage_allocation_file was set" << dendl;
   }
 
+  // the allocator is loaded by now, whatever has been checkpointed before
+  // is of no use anymore and might get stale with the coming changes
+  if (fm->is_null_manager() && !read_only && !to_repair) {
+    r = _alloc_delta_reset();
+    if (r < 0) {
+      goto out_alloc;
+    }
+    alloc_ckpt_enabled =
+      cct->_conf.get_val<double>("bluestore_allocation_checkpoint_interval") > 0;
+  } else {
+    alloc_ckpt_enabled = false;
+  }
+  alloc_delta_logging = alloc_ckpt_enabled;
+
   return 0;
 
 out_alloc:
@@ -9320,6 +9696,12 @@ int BlueStore::_mount()
     }
   }
 
+  if (!db_was_opened_read_only) {
+    _defrag_start();
+  }
+  if (alloc_ckpt_enabled) {
+    _alloc_ckpt_start();
+  }
   mounted = true;
   return 0;
 }
@@ -9328,6 +9710,12 @@ int BlueStore::umount()
 {
   dout(5) << __func__ << dendl;
   ceph_assert(_kv_only || mounted);
+  if (defrag_thread.is_started()) {
+    _defrag_stop();
+  }
+  if (alloc_ckpt_thread.is_started()) {
+    _alloc_ckpt_stop();
+  }
   _osr_drain_all();
 
   mounted = false;
@@ -9400,11 +9788,28 @@ int _fsck_sum_extents(
   return 0;
 }
 
+static bool fsck_test_and_set(BlueStore::mempool_dynamic_bitset& bs,
+			      uint64_t pos)
+{
+  if (bs.test(pos)) {
+    return true;
+  }
+  bs.set(pos);
+  return false;
+}
+
+static bool fsck_test_and_set(BlueStore::fsck_shared_bitset_t& bs,
+			      uint64_t pos)
+{
+  return bs.test_and_set(pos);
+}
+
+template <typename Bitset>
 int BlueStore::_fsck_check_extents(
   std::string_view ctx_descr,
   const PExtentVector& extents,
   bool compressed,
-  mempool_dynamic_bitset &used_blocks,
+  Bitset &used_blocks,
   uint64_t granularity,
   BlueStoreRepairer* repairer,
   store_statfs_t& expected_statfs,
@@ -9425,8 +9830,8 @@ int BlueStore::_fsck_check_extents(
       bool already = false;
       apply_for_bitset_range(
         e.offset, e.length, granularity, used_blocks,
-        [&](uint64_t pos, mempool_dynamic_bitset &bs) {
-	  if (bs.test(pos)) {
+        [&](uint64_t pos, Bitset &bs) {
+	  if (fsck_test_and_set(bs, pos)) {
 	    if (repairer) {
 	      repairer->note_misreference(
 	        pos * min_alloc_size, min_alloc_size, !already);
@@ -9438,8 +9843,6 @@ int BlueStore::_fsck_check_extents(
 	      already = true;
 	    }
 	  }
-	  else
-	    bs.set(pos);
         });
 
       if (e.end() > bdev->get_size()) {
@@ -9889,6 +10292,17 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
       if (sb_info_lock) {
         sb_info_lock->unlock();
       }
+    } else if (depth != FSCK_SHALLOW && ctx.shared_used_blocks) {
+      string ctx_descr = " oid " + stringify(oid);
+      errors += _fsck_check_extents(ctx_descr,
+	blob.get_extents(),
+        blob.is_compressed(),
+        *ctx.shared_used_blocks,
+        fm->get_alloc_size(),
+        repairer,
+        *res_statfs,
+        *pool_fsck_stat,
+        depth);
     } else if (depth != FSCK_SHALLOW) {
       ceph_assert(used_blocks);
       string ctx_descr = " oid " + stringify(oid);
@@ -10354,18 +10768,23 @@ void BlueStore::_fsck_check_objects(
   FSCKDepth depth,
   BlueStore::FSCK_ObjectCtx& ctx)
 {
-  auto& errors = ctx.errors;
   auto sb_info_lock = ctx.sb_info_lock;
   auto& sb_info = ctx.sb_info;
   auto& sb_ref_counts = ctx.sb_ref_counts;
   auto repairer = ctx.repairer;
 
+  const size_t fsck_threads = cct->_conf->bluestore_fsck_threads;
+  if (depth != FSCK_SHALLOW && !repairer && fsck_threads > 1 &&
+      coll_map.size() > 1) {
+    _fsck_check_objects_parallel(depth, ctx, fsck_threads);
+    return;
+  }
+
   uint64_t_btree_t used_nids;
 
   size_t processed_myself = 0;
 
   auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
-  mempool::bluestore_fsck::list<string> expecting_shards;
   if (it) {
     const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
     typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
@@ -10388,224 +10807,414 @@ void BlueStore::_fsck_check_objects(
       thread_pool.start();
     }
 
-    // fill global if not overriden below
-    CollectionRef c;
-    int64_t pool_id = -1;
-    spg_t pgid;
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      dout(30) << __func__ << " key "
-        << pretty_binary_string(it->key()) << dendl;
-      if (is_extent_shard_key(it->key())) {
-        if (depth == FSCK_SHALLOW) {
-          continue;
-        }
-        while (!expecting_shards.empty() &&
-          expecting_shards.front() < it->key()) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(expecting_shards.front())
-            << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-        }
-        if (!expecting_shards.empty() &&
-          expecting_shards.front() == it->key()) {
-          // all good
-          expecting_shards.pop_front();
-          continue;
-        }
+    it->lower_bound(string());
+    if (depth == FSCK_SHALLOW && thread_count > 0) {
+      processed_myself = _fsck_walk_objects(depth, ctx, it, string(),
+        used_nids,
+        [&](int64_t pool_id, CollectionRef c, const ghobject_t& oid,
+            const string& key, const bufferlist& value) {
+          return wq->queue(pool_id, c, oid, key, value);
+        },
+        nullptr);
+      wq->finalize(thread_pool, ctx);
+      if (processed_myself) {
+        // may be needs more threads?
+        dout(0) << __func__ << " partial offload"
+                << ", done myself " << processed_myself
+                << " of " << ctx.num_objects
+                << "objects, threads " << thread_count
+                << dendl;
+      }
+    } else {
+      _fsck_walk_objects(depth, ctx, it, string(), used_nids, nullptr,
+                         nullptr);
+    }
+  } // if (it)
+}
 
-        uint32_t offset;
-        string okey;
-        get_key_extent_shard(it->key(), &okey, &offset);
-        derr << "fsck error: stray shard 0x" << std::hex << offset
-          << std::dec << dendl;
-        if (expecting_shards.empty()) {
-          derr << "fsck error: " << pretty_binary_string(it->key())
-            << " is unexpected" << dendl;
-          ++errors;
-          continue;
-        }
-        while (expecting_shards.front() > it->key()) {
-          derr << "fsck error:   saw " << pretty_binary_string(it->key())
-            << dendl;
-          derr << "fsck error:   exp "
-            << pretty_binary_string(expecting_shards.front()) << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-          if (expecting_shards.empty()) {
-            break;
-          }
-        }
+/*
+ * Check objects within [it, end) of the PREFIX_OBJ keyspace.  Objects
+ * may be handed over to @offload (shallow mode only), the rest are
+ * checked in the calling thread.  Returns the number of the latter.
+ */
+size_t BlueStore::_fsck_walk_objects(
+  FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx,
+  KeyValueDB::Iterator& it,
+  const string& end,
+  uint64_t_btree_t& used_nids,
+  std::function<bool(int64_t, CollectionRef, const ghobject_t&,
+                     const string&, const bufferlist&)> offload,
+  std::atomic<uint64_t>* progress)
+{
+  auto& errors = ctx.errors;
+  size_t processed_myself = 0;
+  mempool::bluestore_fsck::list<string> expecting_shards;
+
+  // fill global if not overriden below
+  CollectionRef c;
+  int64_t pool_id = -1;
+  spg_t pgid;
+  for (; it->valid() && (end.empty() || it->key() < end); it->next()) {
+    dout(30) << __func__ << " key "
+      << pretty_binary_string(it->key()) << dendl;
+    if (is_extent_shard_key(it->key())) {
+      if (depth == FSCK_SHALLOW) {
+        continue;
+      }
+      while (!expecting_shards.empty() &&
+        expecting_shards.front() < it->key()) {
+        derr << "fsck error: missing shard key "
+          << pretty_binary_string(expecting_shards.front())
+          << dendl;
+        ++errors;
+        expecting_shards.pop_front();
+      }
+      if (!expecting_shards.empty() &&
+        expecting_shards.front() == it->key()) {
+        // all good
+        expecting_shards.pop_front();
         continue;
       }
 
-      ghobject_t oid;
-      int r = get_key_object(it->key(), &oid);
-      if (r < 0) {
-        derr << "fsck error: bad object key "
-          << pretty_binary_string(it->key()) << dendl;
+      uint32_t offset;
+      string okey;
+      get_key_extent_shard(it->key(), &okey, &offset);
+      derr << "fsck error: stray shard 0x" << std::hex << offset
+        << std::dec << dendl;
+      if (expecting_shards.empty()) {
+        derr << "fsck error: " << pretty_binary_string(it->key())
+          << " is unexpected" << dendl;
         ++errors;
         continue;
       }
-      if (!c ||
-        oid.shard_id != pgid.shard ||
-        oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
-        !c->contains(oid)) {
-        c = nullptr;
-        for (auto& p : coll_map) {
-          if (p.second->contains(oid)) {
-            c = p.second;
-            break;
-          }
-        }
-        if (!c) {
-          derr << "fsck error: stray object " << oid
-            << " not owned by any collection" << dendl;
-          ++errors;
-          continue;
-        }
-        pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
-        dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
+      while (expecting_shards.front() > it->key()) {
+        derr << "fsck error:   saw " << pretty_binary_string(it->key())
           << dendl;
+        derr << "fsck error:   exp "
+          << pretty_binary_string(expecting_shards.front()) << dendl;
+        ++errors;
+        expecting_shards.pop_front();
+        if (expecting_shards.empty()) {
+          break;
+        }
       }
+      continue;
+    }
 
-      if (depth != FSCK_SHALLOW &&
-        !expecting_shards.empty()) {
-        for (auto& k : expecting_shards) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(k) << dendl;
+    ghobject_t oid;
+    int r = get_key_object(it->key(), &oid);
+    if (r < 0) {
+      derr << "fsck error: bad object key "
+        << pretty_binary_string(it->key()) << dendl;
+      ++errors;
+      continue;
+    }
+    if (!c ||
+      oid.shard_id != pgid.shard ||
+      oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
+      !c->contains(oid)) {
+      c = nullptr;
+      for (auto& p : coll_map) {
+        if (p.second->contains(oid)) {
+          c = p.second;
+          break;
         }
+      }
+      if (!c) {
+        derr << "fsck error: stray object " << oid
+          << " not owned by any collection" << dendl;
         ++errors;
-        expecting_shards.clear();
+        continue;
       }
+      pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
+      dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
+        << dendl;
+    }
 
-      bool queued = false;
-      if (depth == FSCK_SHALLOW && thread_count > 0) {
-        queued = wq->queue(
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value());
+    if (depth != FSCK_SHALLOW &&
+      !expecting_shards.empty()) {
+      for (auto& k : expecting_shards) {
+        derr << "fsck error: missing shard key "
+          << pretty_binary_string(k) << dendl;
       }
-      OnodeRef o;
-      map<BlobRef, bluestore_blob_t::unused_t> referenced;
-
-      if (!queued) {
-        ++processed_myself;
-         o = fsck_check_objects_shallow(
-          depth,
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value(),
-          &expecting_shards,
-          &referenced,
-          ctx);
+      ++errors;
+      expecting_shards.clear();
+    }
+
+    bool queued = false;
+    if (offload) {
+      queued = offload(
+        pool_id,
+        c,
+        oid,
+        it->key(),
+        it->value());
+    }
+    OnodeRef o;
+    map<BlobRef, bluestore_blob_t::unused_t> referenced;
+
+    if (!queued) {
+      ++processed_myself;
+       o = fsck_check_objects_shallow(
+        depth,
+        pool_id,
+        c,
+        oid,
+        it->key(),
+        it->value(),
+        &expecting_shards,
+        &referenced,
+        ctx);
+      if (progress) {
+        progress->fetch_add(1, std::memory_order_relaxed);
       }
+    }
 
-      if (depth != FSCK_SHALLOW) {
-        ceph_assert(o != nullptr);
-        if (o->onode.nid) {
-          if (o->onode.nid > nid_max) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " > nid_max " << nid_max << dendl;
-            ++errors;
-          }
-          if (used_nids.count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
-            continue; // go for next object
-          }
-          used_nids.insert(o->onode.nid);
+    if (depth != FSCK_SHALLOW) {
+      ceph_assert(o != nullptr);
+      if (o->onode.nid) {
+        if (o->onode.nid > nid_max) {
+          derr << "fsck error: " << oid << " nid " << o->onode.nid
+            << " > nid_max " << nid_max << dendl;
+          ++errors;
         }
-        for (auto& i : referenced) {
-          dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
-            << std::dec << " for " << *i.first << dendl;
-          const bluestore_blob_t& blob = i.first->get_blob();
-          if (i.second & blob.unused) {
-            derr << "fsck error: " << oid << " blob claims unused 0x"
-              << std::hex << blob.unused
-              << " but extents reference 0x" << i.second << std::dec
-              << " on blob " << *i.first << dendl;
-            ++errors;
-          }
-          if (blob.has_csum()) {
-            uint64_t blob_len = blob.get_logical_length();
-            uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
-            unsigned csum_count = blob.get_csum_count();
-            unsigned csum_chunk_size = blob.get_csum_chunk_size();
-            for (unsigned p = 0; p < csum_count; ++p) {
-              unsigned pos = p * csum_chunk_size;
-              unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
-              unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
-              unsigned mask = 1u << firstbit;
-              for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
-                mask |= 1u << b;
-              }
-              if ((blob.unused & mask) == mask) {
-                // this csum chunk region is marked unused
-                if (blob.get_csum_item(p) != 0) {
-                  derr << "fsck error: " << oid
-                    << " blob claims csum chunk 0x" << std::hex << pos
-                    << "~" << csum_chunk_size
-                    << " is unused (mask 0x" << mask << " of unused 0x"
-                    << blob.unused << ") but csum is non-zero 0x"
-                    << blob.get_csum_item(p) << std::dec << " on blob "
-                    << *i.first << dendl;
-                  ++errors;
-                }
+        if (used_nids.count(o->onode.nid)) {
+          derr << "fsck error: " << oid << " nid " << o->onode.nid
+            << " already in use" << dendl;
+          ++errors;
+          continue; // go for next object
+        }
+        used_nids.insert(o->onode.nid);
+      }
+      for (auto& i : referenced) {
+        dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
+          << std::dec << " for " << *i.first << dendl;
+        const bluestore_blob_t& blob = i.first->get_blob();
+        if (i.second & blob.unused) {
+          derr << "fsck error: " << oid << " blob claims unused 0x"
+            << std::hex << blob.unused
+            << " but extents reference 0x" << i.second << std::dec
+            << " on blob " << *i.first << dendl;
+          ++errors;
+        }
+        if (blob.has_csum()) {
+          uint64_t blob_len = blob.get_logical_length();
+          uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
+          unsigned csum_count = blob.get_csum_count();
+          unsigned csum_chunk_size = blob.get_csum_chunk_size();
+          for (unsigned p = 0; p < csum_count; ++p) {
+            unsigned pos = p * csum_chunk_size;
+            unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
+            unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
+            unsigned mask = 1u << firstbit;
+            for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
+              mask |= 1u << b;
+            }
+            if ((blob.unused & mask) == mask) {
+              // this csum chunk region is marked unused
+              if (blob.get_csum_item(p) != 0) {
+                derr << "fsck error: " << oid
+                  << " blob claims csum chunk 0x" << std::hex << pos
+                  << "~" << csum_chunk_size
+                  << " is unused (mask 0x" << mask << " of unused 0x"
+                  << blob.unused << ") but csum is non-zero 0x"
+                  << blob.get_csum_item(p) << std::dec << " on blob "
+                  << *i.first << dendl;
+                ++errors;
               }
             }
           }
         }
-        // omap
-        if (o->onode.has_omap()) {
-          ceph_assert(ctx.used_omap_head);
-          if (ctx.used_omap_head->count(o->onode.nid)) {
-            derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
-                 << " already in use" << dendl;
+      }
+      // omap
+      if (o->onode.has_omap()) {
+        ceph_assert(ctx.used_omap_head);
+        if (ctx.used_omap_head->count(o->onode.nid)) {
+          derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
+               << " already in use" << dendl;
+          ++errors;
+        } else {
+          ctx.used_omap_head->insert(o->onode.nid);
+        }
+      } // if (o->onode.has_omap())
+      if (depth == FSCK_DEEP) {
+        bufferlist bl;
+        uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
+        uint64_t offset = 0;
+        do {
+          uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
+          int r = _do_read(c.get(), o, offset, l, bl,
+            CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+          if (r < 0) {
             ++errors;
-          } else {
-            ctx.used_omap_head->insert(o->onode.nid);
+            derr << "fsck error: " << oid << std::hex
+              << " error during read: "
+              << " " << offset << "~" << l
+              << " " << cpp_strerror(r) << std::dec
+              << dendl;
+            break;
           }
-        } // if (o->onode.has_omap())
-        if (depth == FSCK_DEEP) {
-          bufferlist bl;
-          uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
-          uint64_t offset = 0;
-          do {
-            uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
-            int r = _do_read(c.get(), o, offset, l, bl,
-              CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
-            if (r < 0) {
-              ++errors;
-              derr << "fsck error: " << oid << std::hex
-                << " error during read: "
-                << " " << offset << "~" << l
-                << " " << cpp_strerror(r) << std::dec
-                << dendl;
-              break;
-            }
-            offset += l;
-          } while (offset < o->onode.size);
-        } // deep
-      } //if (depth != FSCK_SHALLOW)
-    } // for (it->lower_bound(string()); it->valid(); it->next())
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
-      wq->finalize(thread_pool, ctx);
-      if (processed_myself) {
-        // may be needs more threads?
-        dout(0) << __func__ << " partial offload"
-                << ", done myself " << processed_myself
-                << " of " << ctx.num_objects
-                << "objects, threads " << thread_count
-                << dendl;
+          offset += l;
+        } while (offset < o->onode.size);
+      } // deep
+    } //if (depth != FSCK_SHALLOW)
+  } // for (; it->valid() && it->key() < end; it->next())
+  return processed_myself;
+}
+
+/*
+ * Regular and deep fsck of the object keyspace on multiple threads.
+ * The keyspace is split at collection boundaries, so an onode and its
+ * extent shards never end up in different partitions.  Every partition
+ * keeps its own counters, statfs and nid sets which are merged once all
+ * workers are done; used blocks go into a shared bitmap updated with
+ * atomic test-and-set so misreferences across partitions are caught.
+ */
+void BlueStore::_fsck_check_objects_parallel(
+  FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx,
+  size_t num_threads)
+{
+  ceph_assert(depth != FSCK_SHALLOW);
+  ceph_assert(ctx.used_blocks);
+  ceph_assert(ctx.used_omap_head);
+
+  struct partition_t {
+    string start, end;
+    int64_t errors = 0;
+    int64_t warnings = 0;
+    uint64_t num_objects = 0;
+    uint64_t num_extents = 0;
+    uint64_t num_blobs = 0;
+    uint64_t num_sharded_objects = 0;
+    uint64_t num_spanning_blobs = 0;
+    store_statfs_t expected_store_statfs;
+    per_pool_statfs expected_pool_statfs;
+    per_pool_fsck_stats_t per_pool_fsck_stats;
+    uint64_t_btree_t used_nids;
+    uint64_t_btree_t used_omap_head;
+  };
+
+  // split points are collection start keys
+  vector<string> bounds;
+  for (auto& [cid, c] : coll_map) {
+    ghobject_t temp_start, temp_end, start, end;
+    get_coll_range(cid, c->cnode.bits, &temp_start, &temp_end,
+                   &start, &end, false);
+    bounds.emplace_back();
+    get_object_key(cct, start, &bounds.back());
+  }
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+  size_t num_parts = std::min(num_threads, bounds.size());
+  std::vector<partition_t> parts(num_parts);
+  for (size_t i = 1; i < num_parts; ++i) {
+    parts[i - 1].end = parts[i].start = bounds[i * bounds.size() / num_parts];
+  }
+
+  // move used blocks into the lock-free bitmap for the duration of the walk
+  fsck_shared_bitset_t shared_used_blocks;
+  shared_used_blocks.num_bits = ctx.used_blocks->size();
+  shared_used_blocks.blocks.reserve(ctx.used_blocks->num_blocks());
+  boost::to_block_range(*ctx.used_blocks,
+                        std::back_inserter(shared_used_blocks.blocks));
+  ctx.used_blocks->clear();
+
+  ceph::mutex sb_info_lock =
+    ceph::make_mutex("BlueStore::fsck::parallel_sbinfo_lock");
+  ceph::mutex done_lock = ceph::make_mutex("BlueStore::fsck::parallel_done");
+  ceph::condition_variable done_cond;
+  size_t num_done = 0;
+  std::atomic<uint64_t> progress = {0};
+
+  dout(1) << __func__ << " checking objects in " << num_parts
+          << " partitions" << dendl;
+  vector<std::thread> workers;
+  for (auto& part : parts) {
+    workers.emplace_back(make_named_thread("bstore_fsck", [&, this] {
+      BlueStore::FSCK_ObjectCtx pctx(
+        part.errors,
+        part.warnings,
+        part.num_objects,
+        part.num_extents,
+        part.num_blobs,
+        part.num_sharded_objects,
+        part.num_spanning_blobs,
+        nullptr,
+        &part.used_omap_head,
+        ctx.zone_refs,
+        &sb_info_lock,
+        ctx.sb_info,
+        ctx.sb_ref_counts,
+        part.expected_store_statfs,
+        part.expected_pool_statfs,
+        part.per_pool_fsck_stats,
+        nullptr);
+      pctx.shared_used_blocks = &shared_used_blocks;
+      auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
+      if (it) {
+        it->lower_bound(part.start);
+        _fsck_walk_objects(depth, pctx, it, part.end, part.used_nids,
+                           nullptr, &progress);
+      }
+      std::lock_guard l(done_lock);
+      ++num_done;
+      done_cond.notify_all();
+    }));
+  }
+  {
+    std::unique_lock l(done_lock);
+    while (num_done < num_parts) {
+      if (done_cond.wait_for(l, std::chrono::seconds(5)) ==
+          std::cv_status::timeout) {
+        dout(1) << __func__ << " checked " << progress.load()
+                << " objects, " << num_done << "/" << num_parts
+                << " partitions done" << dendl;
       }
     }
-  } // if (it)
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+
+  ctx.used_blocks->resize(shared_used_blocks.num_bits);
+  boost::from_block_range(shared_used_blocks.blocks.begin(),
+                          shared_used_blocks.blocks.end(),
+                          *ctx.used_blocks);
+
+  uint64_t_btree_t used_nids;
+  for (auto& part : parts) {
+    ctx.errors += part.errors;
+    ctx.warnings += part.warnings;
+    ctx.num_objects += part.num_objects;
+    ctx.num_extents += part.num_extents;
+    ctx.num_blobs += part.num_blobs;
+    ctx.num_sharded_objects += part.num_sharded_objects;
+    ctx.num_spanning_blobs += part.num_spanning_blobs;
+    ctx.expected_store_statfs.add(part.expected_store_statfs);
+    for (auto& [pool, statfs] : part.expected_pool_statfs) {
+      ctx.expected_pool_statfs[pool].add(statfs);
+    }
+    for (auto& [pool, stats] : part.per_pool_fsck_stats) {
+      ctx.per_pool_fsck_stats[pool].add(stats);
+    }
+    // nids and omap heads are only unique within a partition so far
+    for (auto nid : part.used_nids) {
+      if (!used_nids.insert(nid).second) {
+        derr << "fsck error: nid " << nid << " already in use" << dendl;
+        ++ctx.errors;
+      }
+    }
+    for (auto nid : part.used_omap_head) {
+      if (!ctx.used_omap_head->insert(nid).second) {
+        derr << "fsck error: omap_head " << nid << " already in use"
+             << dendl;
+        ++ctx.errors;
+      }
+    }
+  }
 }
 /**
 An overview for currently implemented repair logics 
@@ -12220,6 +12829,8 @@ void BlueStore::refresh_perf_counters()
   logger->set(l_bluestore_blobs, num_blobs);
   logger->set(l_bluestore_buffers, num_buffers);
   logger->set(l_bluestore_buffer_bytes, num_buffer_bytes);
+  logger->set(l_bluestore_decompressed_blobs, decompressed_cache.num);
+  logger->set(l_bluestore_decompressed_bytes, decompressed_cache.bytes);
 }
 
 // ---------------
@@ -12423,6 +13034,14 @@ void BlueStore::_read_cache(
 
     auto pc = cache_res.begin();
     uint64_t chunk_size = bptr->get_blob().get_chunk_size(block_size);
+    // a decompressed copy of the blob spares both the read and the
+    // decompression of the whole blob
+    bufferlist decompressed;
+    bool have_decompressed =
+      b_len > cache_interval.size() &&
+      bptr->get_blob().is_compressed() &&
+      !(read_cache_policy & BufferSpace::BYPASS_CLEAN_CACHE) &&
+      decompressed_cache.lookup(bptr->get_blob(), &decompressed);
     while (b_len > 0) {
       unsigned l;
       if (pc != cache_res.end() &&
@@ -12438,10 +13057,15 @@ void BlueStore::_read_cache(
           ceph_assert(pc->first > pos);
           l = pc->first - pos;
         }
-        dout(30) << __func__ << "    will read 0x" << std::hex << pos << ": 0x"
-                 << b_off << "~" << l << std::dec << dendl;
-        // merge regions
-        {
+        if (have_decompressed) {
+          dout(30) << __func__ << "    use decompressed 0x" << std::hex
+                   << pos << ": 0x" << b_off << "~" << l << std::dec << dendl;
+          ready_regions[pos].substr_of(decompressed, b_off, l);
+          logger->inc(l_bluestore_decompressed_hit_bytes, l);
+        } else {
+          dout(30) << __func__ << "    will read 0x" << std::hex << pos
+                   << ": 0x" << b_off << "~" << l << std::dec << dendl;
+          // merge regions
           uint64_t r_off = b_off;
           uint64_t r_len = l;
           uint64_t front = r_off % chunk_size;
@@ -12485,6 +13109,9 @@ int BlueStore::_prepare_read_ioc(
   vector<bufferlist>* compressed_blob_bls,
   IOContext* ioc)
 {
+  const uint64_t merge_max = cct->_conf->bluestore_read_merge_max_bytes;
+  // (disk offset, request) of uncompressed reads to be merged
+  std::vector<std::pair<uint64_t, read_req_t*>> to_merge;
   for (auto& p : blobs2read) {
     const BlobRef& bptr = p.first;
     regions2read_t& r2r = p.second;
@@ -12524,6 +13151,23 @@ int BlueStore::_prepare_read_ioc(
                  << "~" << req.r_len << std::dec
                  << dendl;
 
+        if (merge_max && req.r_len < merge_max) {
+          // single extent requests are candidates for merging below
+          uint64_t disk_off = 0;
+          unsigned num_extents = 0;
+          bptr->get_blob().map(
+            req.r_off, req.r_len,
+            [&](uint64_t offset, uint64_t length) {
+              disk_off = offset;
+              ++num_extents;
+              return 0;
+            });
+          if (num_extents == 1) {
+            to_merge.emplace_back(disk_off, &req);
+            continue;
+          }
+        }
+
         // read it
         auto r = bptr->get_blob().map(
           req.r_off, req.r_len,
@@ -12546,6 +13190,45 @@ int BlueStore::_prepare_read_ioc(
       }
     }
   }
+
+  // Issue one device read per run of physically adjacent requests; each
+  // request gets a slice of the shared buffer, so no data is copied and
+  // the assembled result keeps contiguous runs in a single buffer.
+  std::sort(to_merge.begin(), to_merge.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (size_t i = 0; i < to_merge.size();) {
+    uint64_t run_off = to_merge[i].first;
+    uint64_t run_len = to_merge[i].second->r_len;
+    size_t j = i + 1;
+    while (j < to_merge.size() &&
+           to_merge[j].first == run_off + run_len &&
+           run_len + to_merge[j].second->r_len <= merge_max) {
+      run_len += to_merge[j].second->r_len;
+      ++j;
+    }
+    dout(20) << __func__ << "    merged " << (j - i) << " reads 0x"
+             << std::hex << run_off << "~" << run_len << std::dec << dendl;
+    bufferlist run_bl;
+    int r = bdev->aio_read(run_off, run_len, &run_bl, ioc);
+    if (r < 0) {
+      derr << __func__ << " bdev-read failed: " << cpp_strerror(r) << dendl;
+      if (r == -EIO) {
+        // propagate EIO to caller
+        return r;
+      }
+      ceph_assert(r == 0);
+    }
+    uint64_t pos = 0;
+    for (size_t k = i; k < j; ++k) {
+      read_req_t* req = to_merge[k].second;
+      req->bl.substr_of(run_bl, pos, req->r_len);
+      pos += req->r_len;
+    }
+    if (j - i > 1) {
+      logger->inc(l_bluestore_read_merged, j - i - 1);
+    }
+    i = j;
+  }
   return 0;
 }
 
@@ -12582,6 +13265,9 @@ int BlueStore::_generate_read_result_bl(
       auto r = _decompress(compressed_bl, &raw_bl);
       if (r < 0)
         return r;
+      if (decompressed_cache.enabled()) {
+        decompressed_cache.insert(bptr->get_blob(), raw_bl);
+      }
       if (buffered) {
         bufferlist region_buffer;
         region_buffer.substr_of(raw_bl, blob_offset, length);
@@ -12626,7 +13312,10 @@ int BlueStore::_generate_read_result_bl(
                << ": data from 0x" << pr->first << "~" << pr->second.length()
                << std::dec << dendl;
       pos += pr->second.length();
-      bl.claim_append(pr->second);
+      // appending ptr by ptr merges slices which are contiguous in memory
+      for (const auto& p : pr->second.buffers()) {
+        bl.append(p, 0, p.length());
+      }
       ++pr;
     } else {
       uint64_t l = length - pos;
@@ -13620,15 +14309,20 @@ int BlueStore::omap_get_values(
   {
     const string& prefix = o->get_omap_prefix();
     o->get_omap_key(string(), &final_key);
-    size_t base_key_len = final_key.size();
-    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-      final_key.resize(base_key_len); // keep prefix
-      final_key += *p;
-      bufferlist val;
-      if (db->get(prefix, final_key, &val) >= 0) {
-	dout(30) << __func__ << "  got " << pretty_binary_string(final_key)
+    vector<string> db_keys;
+    db_keys.reserve(keys.size());
+    for (auto& k : keys) {
+      db_keys.emplace_back(final_key).append(k);
+    }
+    vector<bufferlist> vals;
+    vector<int> rs;
+    db->multi_get(prefix, db_keys, &vals, &rs);
+    auto p = keys.begin();
+    for (size_t i = 0; i < db_keys.size(); ++i, ++p) {
+      if (rs[i] >= 0) {
+	dout(30) << __func__ << "  got " << pretty_binary_string(db_keys[i])
 		 << " -> " << *p << dendl;
-	out->insert(make_pair(*p, val));
+	out->emplace_hint(out->end(), *p, std::move(vals[i]));
       }
     }
   }
@@ -13670,17 +14364,22 @@ int BlueStore::omap_check_keys(
   {
     const string& prefix = o->get_omap_prefix();
     o->get_omap_key(string(), &final_key);
-    size_t base_key_len = final_key.size();
-    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-      final_key.resize(base_key_len); // keep prefix
-      final_key += *p;
-      bufferlist val;
-      if (db->get(prefix, final_key, &val) >= 0) {
-	dout(30) << __func__ << "  have " << pretty_binary_string(final_key)
+    vector<string> db_keys;
+    db_keys.reserve(keys.size());
+    for (auto& k : keys) {
+      db_keys.emplace_back(final_key).append(k);
+    }
+    vector<bufferlist> vals;
+    vector<int> rs;
+    db->multi_get(prefix, db_keys, &vals, &rs);
+    auto p = keys.begin();
+    for (size_t i = 0; i < db_keys.size(); ++i, ++p) {
+      if (rs[i] >= 0) {
+	dout(30) << __func__ << "  have " << pretty_binary_string(db_keys[i])
 		 << " -> " << *p << dendl;
 	out->insert(*p);
       } else {
-	dout(30) << __func__ << "  miss " << pretty_binary_string(final_key)
+	dout(30) << __func__ << "  miss " << pretty_binary_string(db_keys[i])
 		 << " -> " << *p << dendl;
       }
     }
@@ -14200,6 +14899,13 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 	  _txc_apply_kv(txc, true);
 	}
       }
+      if (!kv_sync_lanes.empty()) {
+	unsigned lane = txc->osr->get_sequencer_id() % (kv_sync_lanes.size() + 1);
+	if (lane > 0) {
+	  _kv_queue_lane(txc, kv_sync_lanes[lane - 1].get());
+	  return;
+	}
+      }
       {
 	std::lock_guard l(kv_lock);
 	kv_queue.push_back(txc);
@@ -14389,11 +15095,34 @@ void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
 	       << "~" << p.get_len() << std::dec << dendl;
       fm->release(p.get_start(), p.get_len(), t);
     }
+  } else if (alloc_ckpt_enabled &&
+	     (!txc->allocated.empty() || !txc->released.empty())) {
+    _txc_log_alloc_delta(txc, t);
   }
 
   _txc_update_store_statfs(txc);
 }
 
+void BlueStore::_txc_log_alloc_delta(TransContext *txc, KeyValueDB::Transaction t)
+{
+  // the epoch must be taken before the seq, see _alloc_checkpoint(), and
+  // before checking whether we log at all, see _alloc_ckpt_thread()
+  unsigned e = alloc_delta_epoch.load() & 1;
+  ++alloc_delta_inflight[e];
+  txc->alloc_delta_epoch = e;
+  if (!alloc_delta_logging) {
+    return;
+  }
+  uint64_t seq = ++alloc_delta_seq;
+  bufferlist bl;
+  encode(txc->allocated, bl);
+  encode(txc->released, bl);
+  string key;
+  get_alloc_delta_key(seq, &key);
+  t->set(PREFIX_ALLOC_DELTA, key, bl);
+  dout(20) << __func__ << " txc " << txc << " seq " << seq << dendl;
+}
+
 void BlueStore::_txc_apply_kv(TransContext *txc, bool sync_submit_transaction)
 {
   ceph_assert(txc->get_state() == TransContext::STATE_KV_QUEUED);
@@ -14569,6 +15298,8 @@ void BlueStore::_txc_release_alloc(TransContext *txc)
                !alloc)) {
       goto out;
   }
+  // the space may be reused from now on, drop what we cached from it
+  decompressed_cache.invalidate(txc->released);
   discard_queued = bdev->try_discard(txc->released);
   // if async discard succeeded, will do alloc->release when discard callback
   // else we should release here
@@ -14579,6 +15310,10 @@ void BlueStore::_txc_release_alloc(TransContext *txc)
   }
 
 out:
+  if (txc->alloc_delta_epoch >= 0) {
+    --alloc_delta_inflight[txc->alloc_delta_epoch];
+    txc->alloc_delta_epoch = -1;
+  }
   txc->allocated.clear();
   txc->released.clear();
 }
@@ -14741,11 +15476,51 @@ void BlueStore::_kv_start()
   finisher.start();
   kv_sync_thread.create("bstore_kv_sync");
   kv_finalize_thread.create("bstore_kv_final");
+
+  auto lanes = cct->_conf.get_val<uint64_t>("bluestore_kv_sync_lanes");
+  ceph_assert(kv_sync_lanes.empty());
+  for (unsigned i = 1; i < lanes; ++i) {
+    auto lane = std::make_unique<KVSyncLane>(this, i);
+    string name = "bluestore-kv-lane-" + stringify(i);
+    PerfCountersBuilder b(cct, name,
+			  l_bluestore_kv_lane_first, l_bluestore_kv_lane_last);
+    b.add_u64_avg(l_bluestore_kv_lane_batch_txc, "batch_txc",
+		  "Transactions committed per lane commit cycle",
+		  "btxc", PerfCountersBuilder::PRIO_USEFUL);
+    b.add_time_avg(l_bluestore_kv_lane_flush_lat, "kv_flush_lat",
+		   "Average lane kv_sync flush latency",
+		   "flat", PerfCountersBuilder::PRIO_INTERESTING);
+    b.add_time_avg(l_bluestore_kv_lane_commit_lat, "kv_commit_lat",
+		   "Average lane kv_sync commit latency",
+		   "clat", PerfCountersBuilder::PRIO_INTERESTING);
+    b.add_time_avg(l_bluestore_kv_lane_sync_lat, "kv_sync_lat",
+		   "Average lane kv_sync total latency",
+		   "slat", PerfCountersBuilder::PRIO_INTERESTING);
+    lane->logger = b.create_perf_counters();
+    cct->get_perfcounters_collection()->add(lane->logger);
+    lane->create(("bstore_kv_ln" + stringify(i)).c_str());
+    kv_sync_lanes.push_back(std::move(lane));
+  }
+  dout(10) << __func__ << " " << lanes << " kv sync lane(s)" << dendl;
 }
 
 void BlueStore::_kv_stop()
 {
   dout(10) << __func__ << dendl;
+  for (auto& lane : kv_sync_lanes) {
+    {
+      std::unique_lock l{lane->lock};
+      while (!lane->started) {
+	lane->cond.wait(l);
+      }
+      lane->stop = true;
+      lane->cond.notify_all();
+    }
+    lane->join();
+    cct->get_perfcounters_collection()->remove(lane->logger);
+    delete lane->logger;
+  }
+  kv_sync_lanes.clear();
   {
     std::unique_lock l{kv_lock};
     while (!kv_sync_started) {
@@ -14890,29 +15665,10 @@ void BlueStore::_kv_sync_thread()
       // we will use one final transaction to force a sync
       KeyValueDB::Transaction synct = db->get_transaction();
 
-      // increase {nid,blobid}_max?  note that this covers both the
-      // case where we are approaching the max and the case we passed
-      // it.  in either case, we increase the max in the earlier txn
-      // we submit.
       uint64_t new_nid_max = 0, new_blobid_max = 0;
-      if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
-	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
-	bufferlist bl;
-	encode(new_nid_max, bl);
-	t->set(PREFIX_SUPER, "nid_max", bl);
-	dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
-      }
-      if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
-	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
-	bufferlist bl;
-	encode(new_blobid_max, bl);
-	t->set(PREFIX_SUPER, "blobid_max", bl);
-	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
-      }
+      std::unique_lock max_lock{kv_max_lock, std::defer_lock};
+      _kv_prepare_max(kv_submitting.empty() ? synct : kv_submitting.front()->t,
+		      max_lock, &new_nid_max, &new_blobid_max);
 
       for (auto txc : kv_committing) {
 	throttle.log_state_latency(*txc, logger, l_bluestore_state_kv_queued_lat);
@@ -14984,39 +15740,10 @@ void BlueStore::_kv_sync_thread()
       }
 #endif
 
-      {
-	std::unique_lock m{kv_finalize_lock};
-	if (kv_committing_to_finalize.empty()) {
-	  kv_committing_to_finalize.swap(kv_committing);
-	} else {
-	  kv_committing_to_finalize.insert(
-	      kv_committing_to_finalize.end(),
-	      kv_committing.begin(),
-	      kv_committing.end());
-	  kv_committing.clear();
-	}
-	if (deferred_stable_to_finalize.empty()) {
-	  deferred_stable_to_finalize.swap(deferred_stable);
-	} else {
-	  deferred_stable_to_finalize.insert(
-	      deferred_stable_to_finalize.end(),
-	      deferred_stable.begin(),
-	      deferred_stable.end());
-	  deferred_stable.clear();
-	}
-	if (!kv_finalize_in_progress) {
-	  kv_finalize_in_progress = true;
-	  kv_finalize_cond.notify_one();
-	}
-      }
-
-      if (new_nid_max) {
-	nid_max = new_nid_max;
-	dout(10) << __func__ << " nid_max now " << nid_max << dendl;
-      }
-      if (new_blobid_max) {
-	blobid_max = new_blobid_max;
-	dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+      _kv_queue_finalize(kv_committing, deferred_stable);
+      _kv_commit_max(new_nid_max, new_blobid_max);
+      if (max_lock.owns_lock()) {
+	max_lock.unlock();
       }
 
       {
@@ -15053,6 +15780,198 @@ void BlueStore::_kv_sync_thread()
   kv_sync_started = false;
 }
 
+void BlueStore::_kv_prepare_max(KeyValueDB::Transaction t,
+				std::unique_lock<ceph::mutex>& max_lock,
+				uint64_t *new_nid_max,
+				uint64_t *new_blobid_max)
+{
+  auto need_nid = [&] {
+    return nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max;
+  };
+  auto need_blobid = [&] {
+    return blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max;
+  };
+  if (!need_nid() && !need_blobid()) {
+    return;
+  }
+  if (!kv_sync_lanes.empty()) {
+    // with several lanes committing in parallel the new max values
+    // must hit the db in increasing order; hold the lock until the
+    // commit carrying them is stable and _kv_commit_max() is done.
+    max_lock.lock();
+  }
+
+  // increase {nid,blobid}_max?  note that this covers both the
+  // case where we are approaching the max and the case we passed
+  // it.  in either case, we increase the max in the earlier txn
+  // we submit.
+  if (need_nid()) {
+    *new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
+    bufferlist bl;
+    encode(*new_nid_max, bl);
+    t->set(PREFIX_SUPER, "nid_max", bl);
+    dout(10) << __func__ << " new_nid_max " << *new_nid_max << dendl;
+  }
+  if (need_blobid()) {
+    *new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
+    bufferlist bl;
+    encode(*new_blobid_max, bl);
+    t->set(PREFIX_SUPER, "blobid_max", bl);
+    dout(10) << __func__ << " new_blobid_max " << *new_blobid_max << dendl;
+  }
+}
+
+void BlueStore::_kv_commit_max(uint64_t new_nid_max, uint64_t new_blobid_max)
+{
+  if (new_nid_max) {
+    nid_max = new_nid_max;
+    dout(10) << __func__ << " nid_max now " << nid_max << dendl;
+  }
+  if (new_blobid_max) {
+    blobid_max = new_blobid_max;
+    dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+  }
+}
+
+void BlueStore::_kv_queue_finalize(deque<TransContext*>& committed,
+				   deque<DeferredBatch*>& deferred_stable)
+{
+  std::unique_lock m{kv_finalize_lock};
+  if (kv_committing_to_finalize.empty()) {
+    kv_committing_to_finalize.swap(committed);
+  } else {
+    kv_committing_to_finalize.insert(
+      kv_committing_to_finalize.end(),
+      committed.begin(),
+      committed.end());
+    committed.clear();
+  }
+  if (deferred_stable_to_finalize.empty()) {
+    deferred_stable_to_finalize.swap(deferred_stable);
+  } else {
+    deferred_stable_to_finalize.insert(
+      deferred_stable_to_finalize.end(),
+      deferred_stable.begin(),
+      deferred_stable.end());
+    deferred_stable.clear();
+  }
+  if (!kv_finalize_in_progress) {
+    kv_finalize_in_progress = true;
+    kv_finalize_cond.notify_one();
+  }
+}
+
+void BlueStore::_kv_queue_lane(TransContext *txc, KVSyncLane *lane)
+{
+  std::lock_guard l(lane->lock);
+  lane->queue.push_back(txc);
+  if (!lane->in_progress) {
+    lane->in_progress = true;
+    lane->cond.notify_one();
+  }
+  if (txc->get_state() != TransContext::STATE_KV_SUBMITTED) {
+    lane->queue_unsubmitted.push_back(txc);
+    ++txc->osr->kv_committing_serially;
+  }
+  if (txc->had_ios)
+    lane->ios++;
+  lane->throttle_costs += txc->cost;
+  ++lane->throttle_txcs;
+}
+
+/*
+ * A stripped down _kv_sync_thread() for the extra commit lanes: no
+ * deferred write handling, just flush, apply, sync and hand the
+ * committed txcs over to the (shared) finalize thread.  Concurrent
+ * lanes' sync commits are group committed by the kv store itself.
+ */
+void BlueStore::_kv_sync_lane_thread(KVSyncLane *lane)
+{
+  dout(10) << __func__ << " lane " << lane->id << " start" << dendl;
+  std::unique_lock l{lane->lock};
+  ceph_assert(!lane->started);
+  lane->started = true;
+  lane->cond.notify_all();
+
+  while (true) {
+    if (lane->queue.empty()) {
+      if (lane->stop)
+	break;
+      dout(20) << __func__ << " lane " << lane->id << " sleep" << dendl;
+      lane->in_progress = false;
+      lane->cond.wait(l);
+      dout(20) << __func__ << " lane " << lane->id << " wake" << dendl;
+      continue;
+    }
+
+    deque<TransContext*> committing, submitting;
+    deque<DeferredBatch*> no_deferred;
+    committing.swap(lane->queue);
+    submitting.swap(lane->queue_unsubmitted);
+    uint64_t aios = lane->ios;
+    uint64_t costs = lane->throttle_costs;
+    uint64_t txcs = lane->throttle_txcs;
+    lane->ios = 0;
+    lane->throttle_costs = 0;
+    lane->throttle_txcs = 0;
+    l.unlock();
+
+    dout(20) << __func__ << " lane " << lane->id
+	     << " committing " << committing.size()
+	     << " submitting " << submitting.size() << dendl;
+
+    auto start = mono_clock::now();
+    if (aios) {
+      bdev->flush();
+    }
+    auto after_flush = mono_clock::now();
+
+    KeyValueDB::Transaction synct = db->get_transaction();
+    uint64_t new_nid_max = 0, new_blobid_max = 0;
+    std::unique_lock max_lock{kv_max_lock, std::defer_lock};
+    _kv_prepare_max(submitting.empty() ? synct : submitting.front()->t,
+		    max_lock, &new_nid_max, &new_blobid_max);
+
+    for (auto txc : committing) {
+      throttle.log_state_latency(*txc, logger, l_bluestore_state_kv_queued_lat);
+      if (txc->get_state() == TransContext::STATE_KV_QUEUED) {
+	_txc_apply_kv(txc, false);
+	--txc->osr->kv_committing_serially;
+      } else {
+	ceph_assert(txc->get_state() == TransContext::STATE_KV_SUBMITTED);
+      }
+      if (txc->had_ios) {
+	--txc->osr->txc_with_unstable_io;
+      }
+    }
+    throttle.release_kv_throttle(costs, txcs);
+
+    int r = db_was_opened_read_only || cct->_conf->bluestore_debug_omit_kv_commit ?
+      0 : db->submit_transaction_sync(synct);
+    ceph_assert(r == 0);
+
+    size_t committing_size = committing.size();
+    _kv_queue_finalize(committing, no_deferred);
+    _kv_commit_max(new_nid_max, new_blobid_max);
+    if (max_lock.owns_lock()) {
+      max_lock.unlock();
+    }
+
+    auto finish = mono_clock::now();
+    lane->logger->inc(l_bluestore_kv_lane_batch_txc, committing_size);
+    lane->logger->tinc(l_bluestore_kv_lane_flush_lat, after_flush - start);
+    lane->logger->tinc(l_bluestore_kv_lane_commit_lat, finish - after_flush);
+    lane->logger->tinc(l_bluestore_kv_lane_sync_lat, finish - start);
+    dout(20) << __func__ << " lane " << lane->id
+	     << " committed " << committing_size
+	     << " in " << (finish - start) << dendl;
+
+    l.lock();
+  }
+  dout(10) << __func__ << " lane " << lane->id << " finish" << dendl;
+  lane->started = false;
+}
+
 void BlueStore::_kv_finalize_thread()
 {
   deque<TransContext*> kv_committed;
@@ -15124,6 +16043,281 @@ void BlueStore::_kv_finalize_thread()
   kv_finalize_started = false;
 }
 
+void BlueStore::_defrag_start()
+{
+  dout(10) << __func__ << dendl;
+  defrag_stop = false;
+  defrag_thread.create("bstore_defrag");
+}
+
+void BlueStore::_defrag_stop()
+{
+  dout(10) << __func__ << dendl;
+  {
+    std::lock_guard l{defrag_lock};
+    defrag_stop = true;
+    defrag_cond.notify_all();
+  }
+  defrag_thread.join();
+}
+
+void BlueStore::_defrag_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l{defrag_lock};
+  // sleep for secs (or until stopped/disabled), true if we should go on
+  auto pause = [&](double secs) {
+    if (secs > 0) {
+      defrag_cond.wait_for(l, make_timespan(secs));
+    }
+    return !defrag_stop && cct->_conf.get_val<bool>("bluestore_defrag");
+  };
+  while (!defrag_stop) {
+    if (!cct->_conf.get_val<bool>("bluestore_defrag")) {
+      defrag_cond.wait(l);
+      continue;
+    }
+    l.unlock();
+    auto start = mono_clock::now();
+    logger->set(l_bluestore_fragmentation_score,
+      (uint64_t)(alloc->get_fragmentation_score() * 1000));
+
+    vector<CollectionRef> colls;
+    {
+      std::shared_lock cl{coll_lock};
+      for (auto& [cid, c] : coll_map) {
+	colls.push_back(c);
+      }
+    }
+    uint64_t scanned = 0, objects = 0, bytes = 0;
+    bool go_on = true;
+    for (auto& c : colls) {
+      CollectionHandle ch = c;
+      ghobject_t pos;
+      while (go_on && !pos.is_max()) {
+	vector<ghobject_t> ls;
+	int r;
+	{
+	  std::shared_lock cl{c->lock};
+	  if (!c->exists) {
+	    break;
+	  }
+	  r = _collection_list(c.get(), pos, ghobject_t::get_max(), 64, false,
+			       &ls, &pos);
+	}
+	if (r < 0) {
+	  break;
+	}
+	for (auto& oid : ls) {
+	  uint64_t rewritten = 0;
+	  ++scanned;
+	  r = defrag_object(ch, oid, &rewritten);
+	  if (r < 0 || !rewritten) {
+	    continue;
+	  }
+	  ++objects;
+	  bytes += rewritten;
+	  // rate limit against the data we have rewritten
+	  auto rate = cct->_conf.get_val<Option::size_t>(
+	    "bluestore_defrag_max_bytes_per_sec");
+	  l.lock();
+	  go_on = pause(rate ? (double)rewritten / rate : 0);
+	  l.unlock();
+	  if (!go_on) {
+	    break;
+	  }
+	}
+	if (go_on) {
+	  l.lock();
+	  go_on = pause(0);
+	  l.unlock();
+	}
+      }
+      if (!go_on) {
+	break;
+      }
+    }
+    dout(5) << __func__ << " pass scanned " << scanned << " objects, rewrote "
+	    << objects << " objects (" << byte_u_t(bytes) << ") in "
+	    << ceph::to_seconds<double>(mono_clock::now() - start) << "s"
+	    << (go_on ? "" : ", interrupted") << dendl;
+    l.lock();
+    if (go_on) {
+      pause(cct->_conf.get_val<double>("bluestore_defrag_interval"));
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+/**
+ * Count the physically contiguous runs the object's data is spread
+ * over (pextents adjacent on disk are merged, across blobs too), the
+ * bytes allocated to it and the logical ranges that hold data.
+ * Returns false if the object must not be rewritten: shared blobs would
+ * be unshared (doubling space used by clones) and compressed blobs are
+ * not worth the recompression.
+ */
+bool BlueStore::_defrag_measure(OnodeRef& o,
+				uint64_t *runs, uint64_t *bytes,
+				interval_set<uint64_t> *data)
+{
+  uint64_t last_end = 0;
+  *runs = *bytes = 0;
+  for (auto& e : o->extent_map.extent_map) {
+    const bluestore_blob_t& b = e.blob->get_blob();
+    if (b.is_shared() || b.is_compressed()) {
+      return false;
+    }
+    if (data) {
+      data->union_insert(e.logical_offset, e.length);
+    }
+    b.map(e.blob_offset, e.length, [&](uint64_t poff, uint64_t plen) {
+      if (!*runs || poff != last_end) {
+	++*runs;
+      }
+      last_end = poff + plen;
+      *bytes += plen;
+      return 0;
+    });
+  }
+  return true;
+}
+
+int BlueStore::defrag_object(CollectionHandle& ch, const ghobject_t& oid,
+			     uint64_t *rewritten)
+{
+  CollectionRef c(static_cast<Collection*>(ch.get()));
+  auto start = mono_clock::now();
+  if (rewritten) {
+    *rewritten = 0;
+  }
+
+  // Measure and read under the shared lock so that client I/O to the
+  // collection goes on meanwhile.  submit_seq tells us whether any txc
+  // touching the collection came along before we get to rewrite the
+  // object.
+  std::shared_lock rl(c->lock);
+  if (!c->exists) {
+    return -ENOENT;
+  }
+  spg_t pgid;
+  if (c->cid.is_pg(&pgid) && !oid.match(c->cnode.bits, pgid.ps())) {
+    // split away since it was listed
+    return -ENOENT;
+  }
+  uint64_t seq = c->submit_seq;
+  OnodeRef o = c->get_onode(oid, false);
+  if (!o || !o->exists) {
+    return -ENOENT;
+  }
+  o->extent_map.fault_range(db, 0, o->onode.size);
+  logger->inc(l_bluestore_defrag_scanned);
+
+  uint64_t runs, bytes;
+  interval_set<uint64_t> data;
+  if (!_defrag_measure(o, &runs, &bytes, &data)) {
+    return 0;
+  }
+  uint64_t min_extents =
+    cct->_conf.get_val<uint64_t>("bluestore_defrag_min_extents");
+  uint64_t min_extent_size =
+    cct->_conf.get_val<Option::size_t>("bluestore_defrag_min_extent_size");
+  if (runs < std::max<uint64_t>(min_extents, 2) ||
+      bytes / runs >= min_extent_size) {
+    return 0;
+  }
+  logger->inc(l_bluestore_defrag_fragmented);
+  // old extents are only released once the txc commits
+  if (alloc->get_free() < bytes * 2) {
+    dout(10) << __func__ << " " << oid << " not enough free space" << dendl;
+    return 0;
+  }
+  dout(10) << __func__ << " " << c->cid << " " << oid << " " << runs
+	   << " extents, 0x" << std::hex << bytes << " bytes, data " << data
+	   << std::dec << dendl;
+
+  // read everything before the rewrite punches the old extents out
+  vector<bufferlist> bls(data.num_intervals());
+  auto bp = bls.begin();
+  for (auto p = data.begin(); p != data.end(); ++p, ++bp) {
+    int r = _do_read(c.get(), o, p.get_start(), p.get_len(), *bp,
+		     CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    if (r < 0) {
+      derr << __func__ << " " << oid << " read 0x" << std::hex
+	   << p.get_start() << "~" << p.get_len() << std::dec
+	   << " failed: " << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+  rl.unlock();
+
+  std::unique_lock l(c->lock);
+  if (!c->exists || c->submit_seq != seq) {
+    // written to (or removed) while we were reading; what we read may be
+    // stale, leave the object to a later pass
+    dout(10) << __func__ << " " << c->cid << " " << oid
+	     << " changed while reading, skipping" << dendl;
+    return 0;
+  }
+
+  // We are not running under the caller's (PG) lock.  A client txc
+  // queued on the sequencer ahead of ours commits first, so it must not
+  // touch the object after we rewrite it: such a txc bumps submit_seq
+  // before it is queued, so check again once ours is.  A txc queued
+  // after ours waits for c->lock, so the onode is encoded before we
+  // drop it and the client sees the rewritten extents.
+  TransContext *txc = _txc_create(c.get(), c->osr.get(), nullptr);
+  bool raced = c->submit_seq != seq;
+  uint64_t runs_after = 0, bytes_after;
+  if (raced) {
+    // ours goes through empty
+    dout(10) << __func__ << " " << c->cid << " " << oid
+	     << " raced with a client txc, skipping" << dendl;
+  } else {
+    bp = bls.begin();
+    for (auto p = data.begin(); p != data.end(); ++p, ++bp) {
+      // zero first so that even small ranges get a fresh allocation
+      // instead of being overwritten in place
+      int r = _zero(txc, c, o, p.get_start(), p.get_len());
+      if (r == 0) {
+	r = _write(txc, c, o, p.get_start(), p.get_len(), *bp,
+		   CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+      }
+      if (r < 0) {
+	// the txc cannot be unwound at this point, as in _txc_add_transaction
+	derr << __func__ << " " << oid << " rewrite 0x" << std::hex
+	     << p.get_start() << "~" << p.get_len() << std::dec
+	     << " failed: " << cpp_strerror(r) << dendl;
+	ceph_abort_msg("unexpected error");
+      }
+      txc->bytes += p.get_len();
+    }
+    _defrag_measure(o, &runs_after, &bytes_after, nullptr);
+  }
+  _txc_calc_cost(txc);
+  _txc_prepare_kv(txc);
+  l.unlock();
+
+  _txc_throttle(txc, mono_clock::now());
+  logger->inc(l_bluestore_txc);
+  _txc_state_proc(txc);
+  if (raced) {
+    return 0;
+  }
+
+  dout(10) << __func__ << " " << c->cid << " " << oid << " extents " << runs
+	   << " -> " << runs_after << dendl;
+  logger->inc(l_bluestore_defrag_rewritten);
+  logger->inc(l_bluestore_defrag_rewritten_bytes, data.size());
+  logger->inc(l_bluestore_defrag_extents_before, runs);
+  logger->inc(l_bluestore_defrag_extents_after, runs_after);
+  logger->tinc(l_bluestore_defrag_lat, mono_clock::now() - start);
+  if (rewritten) {
+    *rewritten = data.size();
+  }
+  return 0;
+}
+
 
 bluestore_deferred_op_t *BlueStore::_get_deferred_op(
   TransContext *txc, uint64_t len)
@@ -15218,6 +16412,77 @@ void BlueStore::deferred_try_submit()
   }
 }
 
+/*
+ * Adjust prefer_deferred_shift from what deferred writes cost us over the
+ * last interval.  A deferred write is committed twice (to the kv WAL and
+ * later to its final location), so once its device writes are slower than
+ * those of the direct path, or the backlog outgrows what a single batch
+ * submit can drain, we halve the effective threshold.  It is doubled back as soon as
+ * the deferred path keeps up again.
+ */
+uint8_t BlueStore::next_prefer_deferred_shift(
+  uint8_t shift,
+  uint64_t deferred_cnt,
+  uint64_t deferred_avg,
+  uint64_t direct_avg,
+  int backlog,
+  int batch)
+{
+  constexpr uint8_t max_shift = 16;
+  if (deferred_cnt == 0) {
+    // nothing went deferred; allow the threshold to grow back
+    return shift ? shift - 1 : 0;
+  }
+  batch = std::max(batch, 1);
+  if ((direct_avg && deferred_avg > direct_avg * 4) ||
+      backlog >= batch * 2) {
+    return shift < max_shift ? shift + 1 : shift;
+  }
+  if (shift &&
+      (!direct_avg || deferred_avg < direct_avg * 2) &&
+      backlog < batch) {
+    return shift - 1;
+  }
+  return shift;
+}
+
+void BlueStore::tune_prefer_deferred_size()
+{
+  // the time spent in the deferred queue is batching we asked for (and
+  // grows as writes get sparser), only the device writes are comparable
+  // with the direct path
+  auto deferred_lat =
+    logger->get_tavg_ns(l_bluestore_state_deferred_aio_wait_lat);
+  auto direct_lat = logger->get_tavg_ns(l_bluestore_state_aio_wait_lat);
+
+  uint64_t deferred_cnt = deferred_lat.first - deferred_tune_lat.first;
+  uint64_t deferred_ns = deferred_lat.second - deferred_tune_lat.second;
+  uint64_t direct_cnt = direct_lat.first - direct_tune_lat.first;
+  uint64_t direct_ns = direct_lat.second - direct_tune_lat.second;
+  deferred_tune_lat = deferred_lat;
+  direct_tune_lat = direct_lat;
+
+  uint8_t shift = prefer_deferred_shift.load();
+  uint8_t new_shift = 0;
+  if (cct->_conf.get_val<bool>("bluestore_prefer_deferred_size_adaptive")) {
+    uint64_t deferred_avg = deferred_cnt ? deferred_ns / deferred_cnt : 0;
+    uint64_t direct_avg = direct_cnt ? direct_ns / direct_cnt : 0;
+    int backlog = deferred_queue_size.load();
+    new_shift = next_prefer_deferred_shift(
+      shift, deferred_cnt, deferred_avg, direct_avg,
+      backlog, deferred_batch_ops.load());
+    dout(20) << __func__ << " deferred " << deferred_cnt << " ops avg "
+	     << deferred_avg << "ns, direct " << direct_cnt << " ops avg "
+	     << direct_avg << "ns, backlog " << backlog << dendl;
+  }
+  if (new_shift != shift) {
+    dout(5) << __func__ << " prefer_deferred_size shift " << (int)shift
+	    << " -> " << (int)new_shift << dendl;
+    prefer_deferred_shift = new_shift;
+    logger->set(l_bluestore_deferred_size_shift, new_shift);
+  }
+}
+
 void BlueStore::_deferred_submit_unlock(OpSequencer *osr)
 {
   dout(10) << __func__ << " osr " << osr
@@ -15490,28 +16755,16 @@ int BlueStore::queue_transactions(
   dout(10) << __func__ << " ch " << c << " " << c->cid << dendl;
 
   // prepare
-  TransContext *txc = _txc_create(static_cast<Collection*>(ch.get()), osr,
-				  &on_commit, op);
+  // before the txc is queued, see defrag_object()
+  ++c->submit_seq;
+  TransContext *txc = _txc_create(c, osr, &on_commit, op);
 
   for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
     txc->bytes += (*p).get_num_bytes();
     _txc_add_transaction(txc, &(*p));
   }
   _txc_calc_cost(txc);
-
-  _txc_write_nodes(txc, txc->t);
-
-  // journal deferred items
-  if (txc->deferred_txn) {
-    txc->deferred_txn->seq = ++deferred_seq;
-    bufferlist bl;
-    encode(*txc->deferred_txn, bl);
-    string key;
-    get_deferred_key(txc->deferred_txn->seq, &key);
-    txc->t->set(PREFIX_DEFERRED, key, bl);
-  }
-
-  _txc_finalize_kv(txc, txc->t);
+  _txc_prepare_kv(txc);
 
 #ifdef WITH_BLKIN
   if (txc->trace) {
@@ -15523,27 +16776,7 @@ int BlueStore::queue_transactions(
     handle->suspend_tp_timeout();
 
   auto tstart = mono_clock::now();
-
-  if (!throttle.try_start_transaction(
-	*db,
-	*txc,
-	tstart)) {
-    // ensure we do not block here because of deferred writes
-    dout(10) << __func__ << " failed get throttle_deferred_bytes, aggressive"
-	     << dendl;
-    ++deferred_aggressive;
-    deferred_try_submit();
-    {
-      // wake up any previously finished deferred events
-      std::lock_guard l(kv_lock);
-      if (!kv_sync_in_progress) {
-	kv_sync_in_progress = true;
-	kv_cond.notify_one();
-      }
-    }
-    throttle.finish_start_transaction(*db, *txc, tstart);
-    --deferred_aggressive;
-  }
+  _txc_throttle(txc, tstart);
   auto tend = mono_clock::now();
 
   if (handle)
@@ -15570,17 +16803,58 @@ int BlueStore::queue_transactions(
   if (txc->trace) {
     txc->trace.event("txc applied");
   }
-#endif
-
-  log_latency("submit_transact",
-    l_bluestore_submit_lat,
-    mono_clock::now() - start,
-    cct->_conf->bluestore_log_op_age);
-  log_latency("throttle_transact",
-    l_bluestore_throttle_lat,
-    tend - tstart,
-    cct->_conf->bluestore_log_op_age);
-  return 0;
+#endif
+
+  log_latency("submit_transact",
+    l_bluestore_submit_lat,
+    mono_clock::now() - start,
+    cct->_conf->bluestore_log_op_age);
+  log_latency("throttle_transact",
+    l_bluestore_throttle_lat,
+    tend - tstart,
+    cct->_conf->bluestore_log_op_age);
+  return 0;
+}
+
+void BlueStore::_txc_prepare_kv(TransContext *txc)
+{
+  _txc_write_nodes(txc, txc->t);
+
+  // journal deferred items
+  if (txc->deferred_txn) {
+    txc->deferred_txn->seq = ++deferred_seq;
+    bufferlist bl;
+    encode(*txc->deferred_txn, bl);
+    string key;
+    get_deferred_key(txc->deferred_txn->seq, &key);
+    txc->t->set(PREFIX_DEFERRED, key, bl);
+  }
+
+  _txc_finalize_kv(txc, txc->t);
+}
+
+void BlueStore::_txc_throttle(TransContext *txc, mono_clock::time_point tstart)
+{
+  if (!throttle.try_start_transaction(
+	*db,
+	*txc,
+	tstart)) {
+    // ensure we do not block here because of deferred writes
+    dout(10) << __func__ << " failed get throttle_deferred_bytes, aggressive"
+	     << dendl;
+    ++deferred_aggressive;
+    deferred_try_submit();
+    {
+      // wake up any previously finished deferred events
+      std::lock_guard l(kv_lock);
+      if (!kv_sync_in_progress) {
+	kv_sync_in_progress = true;
+	kv_cond.notify_one();
+      }
+    }
+    throttle.finish_start_transaction(*db, *txc, tstart);
+    --deferred_aggressive;
+  }
 }
 
 void BlueStore::_txc_aio_submit(TransContext *txc)
@@ -15600,9 +16874,21 @@ void BlueStore::_txc_add_transaction(TransContext *txc, Transaction *t)
   for (vector<coll_t>::iterator p = i.colls.begin(); p != i.colls.end();
        ++p, ++j) {
     cvec[j] = _get_collection(*p);
+    if (cvec[j] && cvec[j] != txc->ch) {
+      // let defrag_object() see writes through other collection handles
+      ++cvec[j]->submit_seq;
+    }
   }
   
   vector<OnodeRef> ovec(i.objects.size());
+  if (cvec.size() == 1 && cvec[0] && ovec.size() > 1) {
+    // multi-object transaction on a single collection: fetch the onodes
+    // we do not have cached in one go rather than one by one below
+    std::unique_lock l(cvec[0]->lock);
+    if (cvec[0]->exists) {
+      cvec[0]->get_onodes(i.objects, &ovec);
+    }
+  }
 
   for (int pos = 0; i.have_op(); ++pos) {
     Transaction::Op *op = i.decode_op();
@@ -16167,7 +17453,7 @@ void BlueStore::_do_write_small(
                    << tail_pad << std::dec << " of mutable " << *b << dendl;
 
           if (!g_conf()->bluestore_debug_omit_block_device_write) {
-          if (b_len < prefer_deferred_size) {
+          if (b_len < wctx->prefer_deferred_size) {
               dout(20) << __func__ << " deferring small 0x" << std::hex
 		       << b_len << std::dec << " unused write via deferred" << dendl;
               bluestore_deferred_op_t *op = _get_deferred_op(txc, bl.length());
@@ -16576,7 +17862,7 @@ void BlueStore::_do_write_big(
   logger->inc(l_bluestore_write_big);
   logger->inc(l_bluestore_write_big_bytes, length);
   auto max_bsize = std::max(wctx->target_blob_size, min_alloc_size);
-  uint64_t prefer_deferred_size_snapshot = prefer_deferred_size.load();
+  uint64_t prefer_deferred_size_snapshot = wctx->prefer_deferred_size;
   while (length > 0) {
     bool new_blob = false;
     BlobRef b;
@@ -17017,7 +18303,7 @@ int BlueStore::_do_alloc_write(
 
     PExtentVector extents;
     int64_t left = final_length;
-    auto prefer_deferred_size_snapshot = prefer_deferred_size.load();
+    auto prefer_deferred_size_snapshot = wctx->prefer_deferred_size;
     while (left > 0) {
       ceph_assert(prealloc_left > 0);
       if (prealloc_pos->length <= left) {
@@ -17324,8 +18610,24 @@ void BlueStore::_choose_write_options(
     wctx->target_blob_size = min_alloc_size * 2;
   }
 
+  // deferred write threshold, possibly shrunk by the adaptive tuner
+  uint64_t pds = select_option(
+    "prefer_deferred_size",
+    prefer_deferred_size.load(),
+    [&]() {
+      int64_t val;
+      if (c->pool_opts.get(pool_opts_t::PREFER_DEFERRED_SIZE, &val)) {
+	return std::optional<uint64_t>((uint64_t)val);
+      }
+      return std::optional<uint64_t>();
+    }
+  );
+  pds >>= prefer_deferred_shift.load();
+  wctx->prefer_deferred_size = pds < block_size ? 0 : pds;
+
   dout(20) << __func__ << " prefer csum_order " << wctx->csum_order
            << " target_blob_size 0x" << std::hex << wctx->target_blob_size
+           << " prefer_deferred_size 0x" << wctx->prefer_deferred_size
 	   << " compress=" << (int)wctx->compress
 	   << " buffered=" << (int)wctx->buffered
            << std::dec << dendl;
@@ -18880,7 +20182,8 @@ void BlueStore::generate_db_histogram(Formatter *f)
     } else if (key.first == PREFIX_DEFERRED) {
 	hist.update_hist_entry(hist.key_hist, PREFIX_DEFERRED, key_size, value_size);
 	num_deferred++;
-    } else if (key.first == PREFIX_ALLOC || key.first == PREFIX_ALLOC_BITMAP) {
+    } else if (key.first == PREFIX_ALLOC || key.first == PREFIX_ALLOC_BITMAP ||
+	       key.first == PREFIX_ALLOC_DELTA) {
 	hist.update_hist_entry(hist.key_hist, PREFIX_ALLOC, key_size, value_size);
 	num_alloc++;
     } else if (key.first == PREFIX_SHARED_BLOB) {
@@ -18943,6 +20246,7 @@ void BlueStore::_shutdown_cache()
     ceph_assert(i->empty());
   }
   ceph_assert(Buffer::total == 0);
+  decompressed_cache.set_max(0);
 }
 
 // For external caller.
@@ -18958,6 +20262,7 @@ int BlueStore::flush_cache(ostream *os)
   for (auto i : buffer_cache_shards) {
     i->flush();
   }
+  decompressed_cache.flush();
 
   return 0;
 }
@@ -19584,6 +20889,10 @@ bool RocksDBBlueFSVolumeSelector::compare(BlueFSVolumeSelector* other) {
 
 static const std::string allocator_dir    = "ALLOCATOR_NCB_DIR";
 static const std::string allocator_file   = "ALLOCATOR_NCB_FILE";
+static const std::string allocator_ckpt_file     = "ALLOCATOR_NCB_CKPT";
+static const std::string allocator_ckpt_tmp_file = "ALLOCATOR_NCB_CKPT.tmp";
+// PREFIX_SUPER key holding the first delta seq the checkpoint doesn't cover
+static const std::string alloc_ckpt_replay_key   = "alloc_ckpt_replay_seq";
 static uint32_t    s_format_version = 0x01; // support future changes to allocator-map file
 static uint32_t    s_serial         = 0x01;
 
@@ -19890,51 +21199,13 @@ static uint32_t flush_extent_buffer_with_crc(BlueFS::FileWriter *p_handle, const
 }
 
 const unsigned MAX_EXTENTS_IN_BUFFER = 4 * 1024; // 4K extents = 64KB of data
-// write the allocator to a flat bluefs file - 4K extents at a time
 //-----------------------------------------------------------------------------------
-int BlueStore::store_allocator(Allocator* src_allocator)
+// write the extents reported by foreach_extent as an allocator image to an open bluefs file
+int BlueStore::__store_allocator_image(BlueFS::FileWriter *p_handle,
+				       std::function<void(std::function<void(uint64_t, uint64_t)>)> foreach_extent,
+				       uint64_t *p_extent_count, uint64_t *p_allocation_size)
 {
-  // when storing allocations to file we must be sure there is no background compactions
-  // the easiest way to achieve it is to make sure db is closed
-  ceph_assert(db == nullptr);
-  utime_t  start_time = ceph_clock_now();
-  int ret = 0;
-
-  // create dir if doesn't exist already
-  if (!bluefs->dir_exists(allocator_dir) ) {
-    ret = bluefs->mkdir(allocator_dir);
-    if (ret != 0) {
-      derr << "Failed mkdir with error-code " << ret << dendl;
-      return -1;
-    }
-  }
-  bluefs->compact_log();
-  // reuse previous file-allocation if exists
-  ret = bluefs->stat(allocator_dir, allocator_file, nullptr, nullptr);
-  bool overwrite_file = (ret == 0);
-  BlueFS::FileWriter *p_handle = nullptr;
-  ret = bluefs->open_for_write(allocator_dir, allocator_file, &p_handle, overwrite_file);
-  if (ret != 0) {
-    derr <<  __func__ << "Failed open_for_write with error-code " << ret << dendl;
-    return -1;
-  }
-
-  uint64_t file_size = p_handle->file->fnode.size;
-  uint64_t allocated = p_handle->file->fnode.get_allocated();
-  dout(10) << "file_size=" << file_size << ", allocated=" << allocated << dendl;
-
-  bluefs->sync_metadata(false);
-  unique_ptr<Allocator> allocator(clone_allocator_without_bluefs(src_allocator));
-  if (!allocator) {
-    bluefs->close_writer(p_handle);
-    return -1;
-  }
-  // remove allocations that are used by bdev label copies
-  if (bdev_label_multi == true) {
-    _main_bdev_label_remove(allocator.get());
-  }
-
-  // store all extents (except for the bluefs extents we removed) in a single flat file
+  int                     ret       = 0;
   utime_t                 timestamp = ceph_clock_now();
   uint32_t                crc       = -1;
   {
@@ -19969,13 +21240,12 @@ int BlueStore::store_allocator(Allocator* src_allocator)
       p_curr = buffer; // recycle the buffer
     }
   };
-  allocator->foreach(iterated_allocation);
+  foreach_extent(iterated_allocation);
   // if got null extent -> fail the operation
   if (ret != 0) {
     derr << "Illegal extent, fail store operation" << dendl;
     derr << "invalidate using bluefs->truncate(p_handle, 0)" << dendl;
     bluefs->truncate(p_handle, 0);
-    bluefs->close_writer(p_handle);
     return -1;
   }
 
@@ -19998,6 +21268,68 @@ int BlueStore::store_allocator(Allocator* src_allocator)
   bluefs->truncate(p_handle, p_handle->pos);
   bluefs->fsync(p_handle);
 
+  *p_extent_count    = extent_count;
+  *p_allocation_size = allocation_size;
+  return 0;
+}
+
+// write the allocator to a flat bluefs file - 4K extents at a time
+//-----------------------------------------------------------------------------------
+int BlueStore::store_allocator(Allocator* src_allocator)
+{
+  // when storing allocations to file we must be sure there is no background compactions
+  // the easiest way to achieve it is to make sure db is closed
+  ceph_assert(db == nullptr);
+  utime_t  start_time = ceph_clock_now();
+  int ret = 0;
+
+  // create dir if doesn't exist already
+  if (!bluefs->dir_exists(allocator_dir) ) {
+    ret = bluefs->mkdir(allocator_dir);
+    if (ret != 0) {
+      derr << "Failed mkdir with error-code " << ret << dendl;
+      return -1;
+    }
+  }
+  bluefs->compact_log();
+  // reuse previous file-allocation if exists
+  ret = bluefs->stat(allocator_dir, allocator_file, nullptr, nullptr);
+  bool overwrite_file = (ret == 0);
+  BlueFS::FileWriter *p_handle = nullptr;
+  ret = bluefs->open_for_write(allocator_dir, allocator_file, &p_handle, overwrite_file);
+  if (ret != 0) {
+    derr <<  __func__ << "Failed open_for_write with error-code " << ret << dendl;
+    return -1;
+  }
+
+  uint64_t file_size = p_handle->file->fnode.size;
+  uint64_t allocated = p_handle->file->fnode.get_allocated();
+  dout(10) << "file_size=" << file_size << ", allocated=" << allocated << dendl;
+
+  bluefs->sync_metadata(false);
+  unique_ptr<Allocator> allocator(clone_allocator_without_bluefs(src_allocator));
+  if (!allocator) {
+    bluefs->close_writer(p_handle);
+    return -1;
+  }
+  // remove allocations that are used by bdev label copies
+  if (bdev_label_multi == true) {
+    _main_bdev_label_remove(allocator.get());
+  }
+
+  // store all extents (except for the bluefs extents we removed) in a single flat file
+  uint64_t extent_count    = 0;
+  uint64_t allocation_size = 0;
+  ret = __store_allocator_image(p_handle,
+    [&](std::function<void(uint64_t, uint64_t)> notify) {
+      allocator->foreach(notify);
+    },
+    &extent_count, &allocation_size);
+  if (ret != 0) {
+    bluefs->close_writer(p_handle);
+    return -1;
+  }
+
   utime_t duration = ceph_clock_now() - start_time;
   dout(5) <<"WRITE-extent_count=" << extent_count << ", allocation_size=" << allocation_size << ", serial=" << s_serial << dendl;
   dout(5) <<"p_handle->pos=" << p_handle->pos << " WRITE-duration=" << duration << " seconds" << dendl;
@@ -20052,19 +21384,12 @@ int calc_allocator_image_trailer_size()
 }
 
 //-----------------------------------------------------------------------------------
-int BlueStore::__restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes)
+int BlueStore::__restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes,
+				   const std::string& file_name)
 {
-  if (cct->_conf->bluestore_debug_inject_allocation_from_file_failure > 0) {
-     boost::mt11213b rng(time(NULL));
-    boost::uniform_real<> ur(0, 1);
-    if (ur(rng) < cct->_conf->bluestore_debug_inject_allocation_from_file_failure) {
-      derr << __func__ << " failure injected." << dendl;
-      return -1;
-    }
-  }
   utime_t start_time = ceph_clock_now();
   BlueFS::FileReader *p_temp_handle = nullptr;
-  int ret = bluefs->open_for_read(allocator_dir, allocator_file, &p_temp_handle, false);
+  int ret = bluefs->open_for_read(allocator_dir, file_name, &p_temp_handle, false);
   if (ret != 0) {
     dout(1) << "Failed open_for_read with error-code " << ret << dendl;
     return -1;
@@ -20211,9 +21536,17 @@ int BlueStore::__restore_allocator(Allocator* allocator, uint64_t *num, uint64_t
 //-----------------------------------------------------------------------------------
 int BlueStore::restore_allocator(Allocator* dest_allocator, uint64_t *num, uint64_t *bytes)
 {
+  if (cct->_conf->bluestore_debug_inject_allocation_from_file_failure > 0) {
+     boost::mt11213b rng(time(NULL));
+    boost::uniform_real<> ur(0, 1);
+    if (ur(rng) < cct->_conf->bluestore_debug_inject_allocation_from_file_failure) {
+      derr << __func__ << " failure injected." << dendl;
+      return -1;
+    }
+  }
   utime_t    start = ceph_clock_now();
   auto temp_allocator = unique_ptr<Allocator>(create_bitmap_allocator(bdev->get_size()));
-  int ret = __restore_allocator(temp_allocator.get(), num, bytes);
+  int ret = __restore_allocator(temp_allocator.get(), num, bytes, allocator_file);
   if (ret != 0) {
     return ret;
   }
@@ -20226,6 +21559,308 @@ int BlueStore::restore_allocator(Allocator* dest_allocator, uint64_t *num, uint6
   return ret;
 }
 
+//-----------------------------------------------------------------------------------
+// Allocation checkpoints.
+// With NCB the allocation map is only stored on umount, so a crash means
+// rebuilding it from all the onodes. When enabled, every txc logs the extents
+// it allocated/released under PREFIX_ALLOC_DELTA (in the same kv transaction
+// as its onodes) and a background thread periodically stores the allocator
+// image into allocator_ckpt_file and drops the deltas it covers.
+// After a crash the image is loaded and the remaining deltas are replayed
+// in their seq order.
+// Anything the checkpoint covers is dropped on every mount (the allocator is
+// already loaded then), so an image never gets combined with changes made
+// outside of txcs (fsck repair, expansion, etc). It is dropped as well, and
+// no deltas are logged, while checkpoints are paused at runtime.
+int BlueStore::restore_allocator_from_checkpoint(Allocator* dest_allocator, uint64_t *num, uint64_t *bytes)
+{
+  utime_t start = ceph_clock_now();
+  uint64_t replay_seq = 0;
+  {
+    bufferlist bl;
+    if (db->get(PREFIX_SUPER, alloc_ckpt_replay_key, &bl) < 0 || !bl.length()) {
+      dout(1) << "no allocation checkpoint" << dendl;
+      return -1;
+    }
+    auto p = bl.cbegin();
+    decode(replay_seq, p);
+  }
+  interval_set<uint64_t> free_set;
+  {
+    uint64_t ckpt_num = 0, ckpt_bytes = 0;
+    auto temp_allocator = unique_ptr<Allocator>(create_bitmap_allocator(bdev->get_size()));
+    int ret = __restore_allocator(temp_allocator.get(), &ckpt_num, &ckpt_bytes,
+				  allocator_ckpt_file);
+    if (ret != 0) {
+      return ret;
+    }
+    temp_allocator->foreach([&](uint64_t offset, uint64_t length) {
+      free_set.insert(offset, length);
+    });
+  }
+
+  // the latest delta touching an extent wins; those preceding replay_seq
+  // are reflected in the image already
+  uint64_t deltas = 0;
+  string from;
+  get_alloc_delta_key(replay_seq, &from);
+  auto it = db->get_iterator(PREFIX_ALLOC_DELTA, KeyValueDB::ITERATOR_NOCACHE);
+  for (it->lower_bound(from); it->valid(); it->next()) {
+    interval_set<uint64_t> allocated, released;
+    try {
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(allocated, p);
+      decode(released, p);
+    } catch (ceph::buffer::error& e) {
+      derr << "failed to decode delta " << pretty_binary_string(it->key())
+	   << ": " << e.what() << dendl;
+      return -1;
+    }
+    interval_set<uint64_t> overlap;
+    overlap.intersection_of(allocated, free_set);
+    free_set.subtract(overlap);
+    free_set.union_of(released);
+    ++deltas;
+  }
+  // bluefs is about to claim its extents back, these must be free
+  // whatever the image says
+  bluefs->foreach_block_extents(
+    bluefs_layout.shared_bdev,
+    [&] (uint64_t start, uint32_t len) {
+      free_set.union_insert(start, len);
+    }
+  );
+
+  *num   = 0;
+  *bytes = 0;
+  for (auto p = free_set.begin(); p != free_set.end(); ++p) {
+    dest_allocator->init_add_free(p.get_start(), p.get_len());
+    ++(*num);
+    *bytes += p.get_len();
+  }
+  utime_t duration = ceph_clock_now() - start;
+  dout(5) << "restored in " << duration << " seconds, replayed " << deltas
+	  << " deltas from seq " << replay_seq << dendl;
+  return 0;
+}
+
+//-----------------------------------------------------------------------------------
+int BlueStore::_alloc_delta_reset()
+{
+  alloc_delta_seq = 0;
+  return _alloc_ckpt_drop();
+}
+
+int BlueStore::_alloc_ckpt_drop()
+{
+  bufferlist bl;
+  bool have_ckpt = db->get(PREFIX_SUPER, alloc_ckpt_replay_key, &bl) >= 0;
+  auto it = db->get_iterator(PREFIX_ALLOC_DELTA, KeyValueDB::ITERATOR_NOCACHE);
+  it->seek_to_first();
+  if (!have_ckpt && !it->valid()) {
+    return 0;
+  }
+  dout(5) << "dropping allocation checkpoint" << dendl;
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->rmkey(PREFIX_SUPER, alloc_ckpt_replay_key);
+  t->rmkeys_by_prefix(PREFIX_ALLOC_DELTA);
+  int r = db->submit_transaction_sync(t);
+  if (r < 0) {
+    derr << "failed to drop allocation checkpoint: " << cpp_strerror(r) << dendl;
+  }
+  return r;
+}
+
+//-----------------------------------------------------------------------------------
+int BlueStore::_alloc_checkpoint()
+{
+  auto start = mono_clock::now();
+  // Deltas preceding the replay seq are not replayed over the image, so
+  // whatever they changed must be in the allocator by the time it is copied:
+  // allocations are there before a delta gets its seq, releases once its txc
+  // is done. As a txc takes the epoch before the seq, all the ones with seq
+  // up to replay_seq - 1 are accounted in the epoch being closed here.
+  uint64_t replay_seq;
+  {
+    std::unique_lock l{alloc_ckpt_lock};
+    auto drain = [&](unsigned e) {
+      while (alloc_delta_inflight[e] > 0) {
+	if (alloc_ckpt_stop) {
+	  return false;
+	}
+	alloc_ckpt_cond.wait_for(l, make_timespan(0.001));
+      }
+      return true;
+    };
+    unsigned cur = alloc_delta_epoch.load() & 1;
+    // txcs left over by an interrupted checkpoint share the epoch we switch to
+    if (!drain(cur ^ 1)) {
+      return -ECANCELED;
+    }
+    replay_seq = alloc_delta_seq.load() + 1;
+    alloc_delta_epoch = cur ^ 1;
+    // don't let the epoch wait for deferred writes to be batched up
+    l.unlock();
+    deferred_try_submit();
+    l.lock();
+    if (!drain(cur)) {
+      return -ECANCELED;
+    }
+  }
+  // released extents might still wait for their discard
+  bdev->discard_drain();
+
+  interval_set<uint64_t> free_set;
+  alloc->foreach([&](uint64_t offset, uint64_t length) {
+    free_set.union_insert(offset, length);
+  });
+  // hide bluefs and bdev label copies the way store_allocator() does,
+  // these are reserved again on mount
+  bluefs->foreach_block_extents(
+    bluefs_layout.shared_bdev,
+    [&] (uint64_t start, uint32_t len) {
+      free_set.union_insert(start, len);
+    }
+  );
+  if (bdev_label_multi) {
+    uint64_t lsize = std::max(BDEV_LABEL_BLOCK_SIZE, min_alloc_size);
+    for (uint64_t location : bdev_label_valid_locations) {
+      if (location != BDEV_FIRST_LABEL_POSITION) {
+	free_set.union_insert(location, lsize);
+      }
+    }
+  }
+
+  // write the image aside and move it in place once complete
+  int ret = 0;
+  if (!bluefs->dir_exists(allocator_dir)) {
+    ret = bluefs->mkdir(allocator_dir);
+    if (ret != 0) {
+      derr << "Failed mkdir with error-code " << ret << dendl;
+      return ret;
+    }
+  }
+  if (bluefs->stat(allocator_dir, allocator_ckpt_tmp_file, nullptr, nullptr) == 0) {
+    bluefs->unlink(allocator_dir, allocator_ckpt_tmp_file);
+  }
+  BlueFS::FileWriter *p_handle = nullptr;
+  ret = bluefs->open_for_write(allocator_dir, allocator_ckpt_tmp_file, &p_handle, false);
+  if (ret != 0) {
+    derr << "Failed open_for_write with error-code " << ret << dendl;
+    return ret;
+  }
+  uint64_t extent_count    = 0;
+  uint64_t allocation_size = 0;
+  ret = __store_allocator_image(p_handle,
+    [&](std::function<void(uint64_t, uint64_t)> notify) {
+      for (auto p = free_set.begin(); p != free_set.end(); ++p) {
+	notify(p.get_start(), p.get_len());
+      }
+    },
+    &extent_count, &allocation_size);
+  bluefs->close_writer(p_handle);
+  if (ret != 0) {
+    return -EIO;
+  }
+  ret = bluefs->rename(allocator_dir, allocator_ckpt_tmp_file,
+		       allocator_dir, allocator_ckpt_file);
+  if (ret != 0) {
+    derr << "Failed rename with error-code " << ret << dendl;
+    return ret;
+  }
+  bluefs->sync_metadata(false);
+
+  // Publish the image and trim the deltas it covers. Should we crash before
+  // that, the previous replay seq is kept along with the newer image, which
+  // is fine as replaying deltas the image already reflects has no effect.
+  KeyValueDB::Transaction t = db->get_transaction();
+  bufferlist bl;
+  encode(replay_seq, bl);
+  t->set(PREFIX_SUPER, alloc_ckpt_replay_key, bl);
+  string end;
+  get_alloc_delta_key(replay_seq, &end);
+  t->rm_range_keys(PREFIX_ALLOC_DELTA, string(), end);
+  ret = db->submit_transaction_sync(t);
+  if (ret < 0) {
+    return ret;
+  }
+  auto duration = mono_clock::now() - start;
+  logger->tinc(l_bluestore_alloc_checkpoint_lat, duration);
+  dout(5) << "extent_count=" << extent_count
+	  << ", allocation_size=" << allocation_size
+	  << ", replay_seq=" << replay_seq
+	  << " in " << duration << dendl;
+  return 0;
+}
+
+void BlueStore::_alloc_ckpt_start()
+{
+  dout(10) << __func__ << dendl;
+  alloc_ckpt_stop = false;
+  alloc_ckpt_thread.create("bstore_alloc_ck");
+}
+
+void BlueStore::_alloc_ckpt_stop()
+{
+  dout(10) << __func__ << dendl;
+  {
+    std::lock_guard l{alloc_ckpt_lock};
+    alloc_ckpt_stop = true;
+    alloc_ckpt_cond.notify_all();
+  }
+  alloc_ckpt_thread.join();
+}
+
+void BlueStore::_alloc_ckpt_thread()
+{
+  dout(10) << "start" << dendl;
+  std::unique_lock l{alloc_ckpt_lock};
+  while (!alloc_ckpt_stop) {
+    auto interval =
+      cct->_conf.get_val<double>("bluestore_allocation_checkpoint_interval");
+    if (interval <= 0) {
+      if (alloc_delta_logging) {
+	// Paused at runtime. Nothing would trim the deltas meanwhile, so
+	// stop logging them and drop the checkpoint they extend: a crash
+	// restart rebuilds the allocator from the onodes instead. A txc
+	// may still add a delta after the drop, the next checkpoint (or
+	// mount) trims it.
+	dout(5) << "paused" << dendl;
+	alloc_delta_logging = false;
+	l.unlock();
+	_alloc_ckpt_drop();
+	l.lock();
+	continue;
+      }
+      alloc_ckpt_cond.wait(l);
+      continue;
+    }
+    if (!alloc_delta_logging) {
+      // Resumed. txcs that did not log a delta are still counted in
+      // their epoch, and took it before seeing this, so the next
+      // checkpoint waits for them.
+      dout(5) << "resumed" << dendl;
+      alloc_delta_logging = true;
+    }
+    alloc_ckpt_cond.wait_for(l, make_timespan(interval));
+    if (alloc_ckpt_stop) {
+      break;
+    }
+    if (cct->_conf.get_val<double>(
+	  "bluestore_allocation_checkpoint_interval") <= 0) {
+      continue;
+    }
+    l.unlock();
+    int r = _alloc_checkpoint();
+    if (r < 0 && r != -ECANCELED) {
+      derr << "failed to store allocation checkpoint: " << cpp_strerror(r) << dendl;
+    }
+    l.lock();
+  }
+  dout(10) << "finish" << dendl;
+}
+
 //-----------------------------------------------------------------------------------
 void BlueStore::set_allocation_in_simple_bmap(SimpleBitmap* sbmap, uint64_t offset, uint64_t length)
 {
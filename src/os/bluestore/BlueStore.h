@@ -20,6 +20,7 @@
 #include <tuple>
 #include <unistd.h>
 
+#include <array>
 #include <atomic>
 #include <bit>
 #include <chrono>
@@ -79,6 +80,7 @@ enum {
   l_bluestore_allocated,
   l_bluestore_stored,
   l_bluestore_fragmentation,
+  l_bluestore_fragmentation_score,
   l_bluestore_alloc_unit,
   //****************************************
 
@@ -114,6 +116,7 @@ enum {
   l_bluestore_csum_lat,
   l_bluestore_read_eio,
   l_bluestore_reads_with_retries,
+  l_bluestore_read_merged,
   l_bluestore_read_lat,
   //****************************************
 
@@ -146,6 +149,7 @@ enum {
   l_bluestore_issued_deferred_write_bytes,
   l_bluestore_submitted_deferred_writes,
   l_bluestore_submitted_deferred_write_bytes,
+  l_bluestore_deferred_size_shift,
 
   l_bluestore_write_big_skipped_blobs,
   l_bluestore_write_big_skipped_bytes,
@@ -172,6 +176,8 @@ enum {
   l_bluestore_onode_misses,
   l_bluestore_onode_shard_hits,
   l_bluestore_onode_shard_misses,
+  l_bluestore_onode_shard_packs,
+  l_bluestore_onode_shard_unpacks,
   l_bluestore_extents,
   l_bluestore_blobs,
   //****************************************
@@ -182,6 +188,9 @@ enum {
   l_bluestore_buffer_bytes,
   l_bluestore_buffer_hit_bytes,
   l_bluestore_buffer_miss_bytes,
+  l_bluestore_decompressed_blobs,
+  l_bluestore_decompressed_bytes,
+  l_bluestore_decompressed_hit_bytes,
   //****************************************
 
   // internal stats
@@ -192,6 +201,17 @@ enum {
   l_bluestore_gc_merged,
   //****************************************
 
+  // online defragmentation stats
+  //****************************************
+  l_bluestore_defrag_scanned,
+  l_bluestore_defrag_fragmented,
+  l_bluestore_defrag_rewritten,
+  l_bluestore_defrag_rewritten_bytes,
+  l_bluestore_defrag_extents_before,
+  l_bluestore_defrag_extents_after,
+  l_bluestore_defrag_lat,
+  //****************************************
+
   // misc
   //****************************************
   l_bluestore_omap_iterator_count,
@@ -222,6 +242,7 @@ enum {
   //****************************************
   l_bluestore_allocate_hist,
   l_bluestore_allocator_lat,
+  l_bluestore_alloc_checkpoint_lat,
   //****************************************
 
   // slow op counter
@@ -234,6 +255,16 @@ enum {
   l_bluestore_last
 };
 
+// per-lane counters for the extra kv commit lanes (bluestore_kv_sync_lanes)
+enum {
+  l_bluestore_kv_lane_first = 732800,
+  l_bluestore_kv_lane_batch_txc,
+  l_bluestore_kv_lane_flush_lat,
+  l_bluestore_kv_lane_commit_lat,
+  l_bluestore_kv_lane_sync_lat,
+  l_bluestore_kv_lane_last
+};
+
 #define META_POOL_ID ((uint64_t)-1ull)
 using bptr_c_it_t = buffer::ptr::const_iterator;
 
@@ -971,6 +1002,7 @@ public:
       unsigned extents = 0;  ///< count extents in this shard
       bool loaded = false;   ///< true if shard is loaded
       bool dirty = false;    ///< true if shard is dirty and needs reencoding
+      ceph::buffer::list packed; ///< encoded shard, if clean and kept packed
     };
 
     mempool::bluestore_cache_meta::vector<Shard> shards;    ///< shards
@@ -1146,6 +1178,11 @@ public:
     void fault_range(KeyValueDB *db,
 		     uint32_t offset, uint32_t length);
 
+    /// drop the decoded extents of clean shards, keeping only their
+    /// encoded form; fault_range() materializes them again on access
+    void pack_clean_shards();
+    bool may_pack_shards() const;
+
     /// ensure a range of the map is marked dirty
     void dirty_range(uint32_t offset, uint32_t length);
 
@@ -1629,9 +1666,55 @@ public:
     }
   };
 
+  /// Decompressed payloads of compressed blobs, so that partial reads of a
+  /// compressed blob do not decompress it over and over. Entries are keyed
+  /// by the disk offset of the blob's first extent; compressed blobs are
+  /// never overwritten in place, so an entry stays valid until that space
+  /// is released (see invalidate()).
+  struct DecompressedCache {
+    static constexpr size_t num_shards = 8;
+
+    struct entry_t {
+      uint32_t ondisk_length = 0;
+      ceph::buffer::list data;
+      std::list<uint64_t>::iterator lru_it;
+    };
+    struct shard_t {
+      ceph::mutex lock = ceph::make_mutex("BlueStore::DecompressedCache::lock");
+      std::map<uint64_t, entry_t> entries;
+      std::list<uint64_t> lru;   ///< front is most recently used
+      uint64_t bytes = 0;
+    };
+    std::array<shard_t, num_shards> shards;
+    std::atomic<uint64_t> max_bytes = {0};
+    std::atomic<uint64_t> bytes = {0};
+    std::atomic<uint64_t> num = {0};
+
+    bool enabled() const {
+      return max_bytes > 0;
+    }
+    bool lookup(const bluestore_blob_t& blob, ceph::buffer::list* out);
+    void insert(const bluestore_blob_t& blob, const ceph::buffer::list& data);
+    void invalidate(const interval_set<uint64_t>& released);
+    void set_max(uint64_t max);
+    void flush();
+
+  private:
+    shard_t& _get_shard(uint64_t offset) {
+      return shards[(offset >> 12) % num_shards];
+    }
+    void _erase(shard_t& sh, std::map<uint64_t, entry_t>::iterator p);
+    void _trim(shard_t& sh, uint64_t shard_max);
+  };
+
   struct OnodeSpace {
     OnodeCacheShard *cache;
 
+    /// protects onode_map; taken shared by lookups, so cache hits do not
+    /// contend on the cache shard lock. Writers hold cache->lock first.
+    ceph::shared_mutex lock =
+      ceph::make_shared_mutex("BlueStore::OnodeSpace::lock");
+
   private:
     /// forward lookups
     mempool::bluestore_cache_meta::unordered_map<ghobject_t,OnodeRef> onode_map;
@@ -1648,6 +1731,8 @@ public:
 
     OnodeRef add_onode(const ghobject_t& oid, OnodeRef& o);
     OnodeRef lookup(const ghobject_t& o);
+    /// like lookup() but neither pins nor accounts a hit/miss
+    bool contains(const ghobject_t& o);
     void rename(OnodeRef& o, const ghobject_t& old_oid,
 		const ghobject_t& new_oid,
 		const mempool::bluestore_cache_meta::string& new_okey);
@@ -1671,6 +1756,10 @@ public:
     bluestore_cnode_t cnode;
     ceph::shared_mutex lock =
       ceph::make_shared_mutex("BlueStore::Collection::lock", true, false);
+    /// bumped by every client txc touching this collection before it
+    /// changes anything (and before it is queued, if queued on our osr),
+    /// so internal writers (background defrag) can tell it changed
+    std::atomic<uint64_t> submit_seq = {0};
 
     bool exists;
 
@@ -1688,6 +1777,10 @@ public:
       return onode_space.cache;
     }
     OnodeRef get_onode(const ghobject_t& oid, bool create, bool is_createop=false);
+    /// load the onodes of oids missing from the cache with a single batched
+    /// kv lookup; (*onodes)[i] is set for each oid loaded this way
+    void get_onodes(const std::vector<ghobject_t>& oids,
+		    std::vector<OnodeRef> *onodes);
 
     // the terminology is confusing here, sorry!
     //
@@ -1953,6 +2046,7 @@ public:
     bluestore_deferred_transaction_t *deferred_txn = nullptr; ///< if any
 
     interval_set<uint64_t> allocated, released;
+    int alloc_delta_epoch = -1;  ///< checkpoint epoch of our alloc delta, if any
     volatile_statfs statfs_delta;	   ///< overall store statistics delta
     uint64_t osd_pool_id = META_POOL_ID;    ///< osd pool id we're operating on
 
@@ -2348,6 +2442,48 @@ public:
       return NULL;
     }
   };
+  struct DefragThread : public Thread {
+    BlueStore *store;
+    explicit DefragThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_defrag_thread();
+      return NULL;
+    }
+  };
+  struct AllocCheckpointThread : public Thread {
+    BlueStore *store;
+    explicit AllocCheckpointThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_alloc_ckpt_thread();
+      return NULL;
+    }
+  };
+
+  /// an additional, independent kv commit pipeline.  OpSequencers are
+  /// statically mapped to a lane so per-sequencer commit order is kept;
+  /// lane 0 is always the main kv_sync_thread, which also owns the
+  /// deferred write cleanup.
+  struct KVSyncLane : public Thread {
+    BlueStore *store;
+    const unsigned id;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::KVSyncLane::lock");
+    ceph::condition_variable cond;
+    bool started = false;
+    bool stop = false;
+    bool in_progress = false;
+    std::deque<TransContext*> queue;             ///< ready, already submitted
+    std::deque<TransContext*> queue_unsubmitted; ///< ready, need submit by lane
+    uint64_t ios = 0;
+    uint64_t throttle_costs = 0;
+    uint64_t throttle_txcs = 0;
+    PerfCounters *logger = nullptr;
+
+    KVSyncLane(BlueStore *s, unsigned id) : store(s), id(id) {}
+    void *entry() override {
+      store->_kv_sync_lane_thread(this);
+      return NULL;
+    }
+  };
 
   struct BigDeferredWriteContext {
     uint64_t off = 0;     // original logical offset
@@ -2406,6 +2542,7 @@ private:
 
   mempool::bluestore_cache_buffer::vector<BufferCacheShard*> buffer_cache_shards;
   mempool::bluestore_cache_onode::vector<OnodeCacheShard*> onode_cache_shards;
+  DecompressedCache decompressed_cache;
 
   /// protect zombie_osr_set
   ceph::mutex zombie_osr_lock = ceph::make_mutex("BlueStore::zombie_osr_lock");
@@ -2441,6 +2578,11 @@ private:
   std::deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
   bool kv_sync_in_progress = false;
 
+  /// lanes 1..N-1, empty unless bluestore_kv_sync_lanes > 1
+  std::vector<std::unique_ptr<KVSyncLane>> kv_sync_lanes;
+  /// serializes {nid,blobid}_max updates between lanes
+  ceph::mutex kv_max_lock = ceph::make_mutex("BlueStore::kv_max_lock");
+
   KVFinalizeThread kv_finalize_thread;
   ceph::mutex kv_finalize_lock = ceph::make_mutex("BlueStore::kv_finalize_lock");
   ceph::condition_variable kv_finalize_cond;
@@ -2448,6 +2590,25 @@ private:
   std::deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
   bool kv_finalize_in_progress = false;
 
+  DefragThread defrag_thread;
+  ceph::mutex defrag_lock = ceph::make_mutex("BlueStore::defrag_lock");
+  ceph::condition_variable defrag_cond;
+  bool defrag_stop = false;
+
+  /// allocation checkpoints (NCB only): txcs log their allocated/released
+  /// extents under PREFIX_ALLOC_DELTA and the allocator image is written
+  /// to bluefs periodically, so a crash restart only replays the log tail
+  bool alloc_ckpt_enabled = false;
+  /// cleared while checkpoints are paused at runtime
+  std::atomic<bool> alloc_delta_logging = {false};
+  std::atomic<uint64_t> alloc_delta_seq = {0};
+  std::atomic<unsigned> alloc_delta_epoch = {0};
+  std::atomic<uint64_t> alloc_delta_inflight[2] = {0, 0}; ///< per epoch
+  AllocCheckpointThread alloc_ckpt_thread;
+  ceph::mutex alloc_ckpt_lock = ceph::make_mutex("BlueStore::alloc_ckpt_lock");
+  ceph::condition_variable alloc_ckpt_cond;
+  bool alloc_ckpt_stop = false;
+
   PerfCounters *logger = nullptr;
 
   std::list<CollectionRef> removed_collections;
@@ -2459,6 +2620,9 @@ private:
 
   std::atomic<int> csum_type = {Checksummer::CSUM_CRC32C};
 
+  /// keep clean extent map shards of unpinned onodes in encoded form
+  std::atomic<bool> onode_pack_shards = {false};
+
   uint64_t block_size = 0;     ///< block size of block device (power of 2)
   uint64_t block_mask = 0;     ///< mask to get just the block offset
   size_t block_size_order = 0; ///< bits to shift to get block size
@@ -2489,6 +2653,9 @@ private:
   ///< size threshold for forced deferred writes
   std::atomic<uint64_t> prefer_deferred_size = {0};
 
+  ///< adaptive reduction of prefer_deferred_size, as a right shift
+  std::atomic<uint8_t> prefer_deferred_shift = {0};
+
   ///< approx cost per io, in bytes
   std::atomic<uint64_t> throttle_cost_per_io = {0};
 
@@ -2510,6 +2677,7 @@ private:
   double cache_kv_ratio = 0;     ///< cache ratio dedicated to kv (e.g., rocksdb)
   double cache_kv_onode_ratio = 0; ///< cache ratio dedicated to kv onodes (e.g., rocksdb onode CF)
   double cache_data_ratio = 0;   ///< cache ratio dedicated to object data
+  double cache_decompressed_ratio = 0; ///< cache ratio dedicated to decompressed blobs
   bool cache_autotune = false;   ///< cache autotune setting
   double cache_age_bin_interval = 0; ///< time to wait between cache age bin rotations
   double cache_autotune_interval = 0; ///< time to wait between cache rebalancing
@@ -2748,11 +2916,39 @@ private:
     };
     std::shared_ptr<DataCache> data_cache;
 
+    struct DecompressedDataCache : public MempoolCache {
+      uint32_t bin_count = 0;
+      DecompressedDataCache(BlueStore *s) : MempoolCache(s) {};
+
+      // Decompressed payloads can always be recreated from disk, so the
+      // cache doesn't age its entries and asks for memory only at the
+      // lowest priority.
+      virtual uint32_t get_bin_count() const {
+        return bin_count;
+      }
+      virtual void set_bin_count(uint32_t count) {
+        bin_count = count;
+      }
+      virtual uint64_t _get_used_bytes() const {
+        return store->decompressed_cache.bytes;
+      }
+      virtual void shift_bins() {
+      }
+      virtual uint64_t _sum_bins(uint32_t start, uint32_t end) const {
+        return 0;
+      }
+      virtual std::string get_cache_name() const {
+        return "BlueStore Decompressed Cache";
+      }
+    };
+    std::shared_ptr<DecompressedDataCache> decompressed_cache;
+
   public:
     explicit MempoolThread(BlueStore *s)
       : store(s),
         meta_cache(new MetaCache(s)),
-        data_cache(new DataCache(s)) {}
+        data_cache(new DataCache(s)),
+        decompressed_cache(new DecompressedDataCache(s)) {}
 
     void *entry() override;
     void init() {
@@ -2907,6 +3103,8 @@ private:
   void _txc_add_transaction(TransContext *txc, Transaction *t);
   void _txc_calc_cost(TransContext *txc);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
+  void _txc_prepare_kv(TransContext *txc);
+  void _txc_throttle(TransContext *txc, mono_clock::time_point tstart);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
 public:
@@ -2930,13 +3128,54 @@ private:
   void _kv_start();
   void _kv_stop();
   void _kv_sync_thread();
+  void _kv_sync_lane_thread(KVSyncLane *lane);
+  void _kv_queue_lane(TransContext *txc, KVSyncLane *lane);
+  void _kv_prepare_max(KeyValueDB::Transaction t,
+		       std::unique_lock<ceph::mutex>& max_lock,
+		       uint64_t *new_nid_max,
+		       uint64_t *new_blobid_max);
+  void _kv_commit_max(uint64_t new_nid_max, uint64_t new_blobid_max);
+  void _kv_queue_finalize(std::deque<TransContext*>& committed,
+			  std::deque<DeferredBatch*>& deferred_stable);
   void _kv_finalize_thread();
 
+  void _defrag_start();
+  void _defrag_stop();
+  void _defrag_thread();
+
+  void _txc_log_alloc_delta(TransContext *txc, KeyValueDB::Transaction t);
+  void _alloc_ckpt_start();
+  void _alloc_ckpt_stop();
+  void _alloc_ckpt_thread();
+  int _alloc_checkpoint();
+  int _alloc_delta_reset();
+  int _alloc_ckpt_drop();
+  bool _defrag_measure(OnodeRef& o, uint64_t *runs, uint64_t *bytes,
+		       interval_set<uint64_t> *data);
+
   bluestore_deferred_op_t *_get_deferred_op(TransContext *txc, uint64_t len);
   void _deferred_queue(TransContext *txc);
 public:
   void deferred_try_submit();
+  void tune_prefer_deferred_size();
+  /// the prefer_deferred_size shift to apply next, given the deferred and
+  /// direct write latencies seen since the previous tuning pass
+  static uint8_t next_prefer_deferred_shift(
+    uint8_t shift,
+    uint64_t deferred_cnt,
+    uint64_t deferred_avg,
+    uint64_t direct_avg,
+    int backlog,
+    int batch);
+  /// rewrite oid into contiguous allocations if its data is fragmented;
+  /// *rewritten is set to the number of bytes rewritten (0 if skipped)
+  int defrag_object(CollectionHandle& ch, const ghobject_t& oid,
+		    uint64_t *rewritten = nullptr);
 private:
+  /// counter snapshots from the previous tune_prefer_deferred_size() pass
+  std::pair<uint64_t, uint64_t> deferred_tune_lat = {0, 0};
+  std::pair<uint64_t, uint64_t> direct_tune_lat = {0, 0};
+
   void _deferred_submit_unlock(OpSequencer *osr);
   void _deferred_aio_finish(OpSequencer *osr);
   int _deferred_replay();
@@ -2950,6 +3189,22 @@ public:
   using  per_pool_statfs =
     mempool::bluestore_fsck::map<uint64_t, store_statfs_t>;
 
+  /// used blocks bitmap shared by parallel fsck workers, updated lock-free
+  struct fsck_shared_bitset_t {
+    mempool::bluestore_fsck::vector<uint64_t> blocks;
+    size_t num_bits = 0;
+
+    size_t size() const {
+      return num_bits;
+    }
+    /// set bit @pos, returns whether it was already set
+    bool test_and_set(size_t pos) {
+      uint64_t mask = 1ull << (pos % 64);
+      return std::atomic_ref<uint64_t>(blocks[pos / 64]).fetch_or(
+	mask, std::memory_order_relaxed) & mask;
+    }
+  };
+
   struct pool_fsck_stats_t {
     uint64_t num_objects = 0;
     uint64_t shared_blobs = 0;
@@ -2983,11 +3238,12 @@ public:
   };
 
 private:
+  template <typename Bitset>
   int _fsck_check_extents(
     std::string_view ctx_descr,
     const PExtentVector& extents,
     bool compressed,
-    mempool_dynamic_bitset &used_blocks,
+    Bitset &used_blocks,
     uint64_t granularity,
     BlueStoreRepairer* repairer,
     store_statfs_t& expected_statfs,
@@ -3583,9 +3839,6 @@ public:
     block_mask = ~(block_size - 1);
     block_size_order = std::countr_zero(block_size);
   }
-  void debug_set_prefer_deferred_size(uint64_t s) {
-    prefer_deferred_size = s;
-  }
   inline void log_latency(const char* name,
     int idx,
     const ceph::timespan& lat,
@@ -3685,6 +3938,7 @@ private:
     uint8_t csum_type = 0;          ///< checksum type for new blobs
     unsigned csum_order = 0;        ///< target checksum chunk order
     uint64_t target_blob_size = 0;  ///< target (max) blob size
+    uint64_t prefer_deferred_size = 0; ///< deferred write threshold
 
     old_extent_map_t old_extents;   ///< must deref these blobs
     interval_set<uint64_t> extents_to_gc; ///< extents for garbage collection
@@ -3733,6 +3987,7 @@ private:
       buffered = other.buffered;
       compress = other.compress;
       target_blob_size = other.target_blob_size;
+      prefer_deferred_size = other.prefer_deferred_size;
       csum_type = other.csum_type;
       csum_order = other.csum_order;
     }
@@ -3979,6 +4234,8 @@ public:
     uint64_t& num_spanning_blobs;
 
     mempool_dynamic_bitset* used_blocks;
+    /// replaces used_blocks when objects are checked in parallel
+    fsck_shared_bitset_t* shared_used_blocks = nullptr;
     uint64_t_btree_t* used_omap_head;
     std::vector<std::unordered_map<ghobject_t, uint64_t>> *zone_refs;
 
@@ -4131,10 +4388,15 @@ private:
 				      uint64_t  *p_extent_count, const void *v_header, BlueFS::FileReader *p_handle, uint64_t offset);
 
   int  copy_allocator(Allocator* src_alloc, Allocator *dest_alloc, uint64_t* p_num_entries);
+  int  __store_allocator_image(BlueFS::FileWriter *p_handle,
+				 std::function<void(std::function<void(uint64_t, uint64_t)>)> foreach_extent,
+				 uint64_t *p_extent_count, uint64_t *p_allocation_size);
   int  store_allocator(Allocator* allocator);
   int  invalidate_allocation_file_on_bluefs();
-  int  __restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes);
+  int  __restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes,
+			     const std::string& file_name);
   int  restore_allocator(Allocator* allocator, uint64_t *num, uint64_t *bytes);
+  int  restore_allocator_from_checkpoint(Allocator* allocator, uint64_t *num, uint64_t *bytes);
   int  read_allocation_from_drive_on_startup();
   int  reconstruct_allocations(SimpleBitmap *smbmp, read_alloc_stats_t &stats);
   int  read_allocation_from_onodes(SimpleBitmap *smbmp, read_alloc_stats_t& stats);
@@ -4155,6 +4417,17 @@ private:
 
   void _fsck_check_objects(FSCKDepth depth,
     FSCK_ObjectCtx& ctx);
+  void _fsck_check_objects_parallel(FSCKDepth depth,
+    FSCK_ObjectCtx& ctx,
+    size_t num_threads);
+  size_t _fsck_walk_objects(FSCKDepth depth,
+    FSCK_ObjectCtx& ctx,
+    KeyValueDB::Iterator& it,
+    const std::string& end,
+    uint64_t_btree_t& used_nids,
+    std::function<bool(int64_t, CollectionRef, const ghobject_t&,
+                       const std::string&, const ceph::buffer::list&)> offload,
+    std::atomic<uint64_t>* progress);
 };
 
 inline std::ostream& operator<<(std::ostream& out, const BlueStore::volatile_statfs& s) {
@@ -13,11 +13,154 @@
  *
  *
  */
+HybridAvlAllocator::HybridAvlAllocator(CephContext* cct,
+  int64_t device_size,
+  int64_t _block_size,
+  uint64_t max_mem,
+  std::string_view name) :
+    HybridAllocatorBase<AvlAllocator>(cct,
+      device_size, _block_size, max_mem, name)
+{
+  uint64_t chunk = cct->_conf.get_val<Option::size_t>(
+    "bluestore_hybrid_alloc_thread_cache_chunk");
+  auto shards = cct->_conf.get_val<uint64_t>(
+    "bluestore_hybrid_alloc_thread_cache_shards");
+  if (chunk && shards) {
+    chunk = std::max(p2roundup(chunk, uint64_t(_block_size)),
+      uint64_t(_block_size));
+    thread_cache = new ThreadExtentCache(shards, chunk);
+  }
+}
+
+HybridAvlAllocator::~HybridAvlAllocator()
+{
+  shutdown();
+}
+
 const char* HybridAvlAllocator::get_type() const
 {
   return "hybrid";
 }
 
+int64_t HybridAvlAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint,
+  PExtentVector* extents)
+{
+  ceph_assert(std::has_single_bit(unit));
+  ceph_assert(want % unit == 0);
+
+  uint64_t offs = 0;
+  if (thread_cache &&
+      thread_cache->try_get(want, unit, &offs,
+        [this](uint64_t unit, uint64_t rem_offs, uint64_t rem_len,
+               uint64_t* chunk_offs) {
+          return _reserve_chunk(unit, rem_offs, rem_len, chunk_offs);
+        })) {
+    ldout(get_context(), 10) << __func__ << std::hex
+      << " 0x" << want
+      << "/" << unit
+      << " from thread cache 0x" << offs
+      << std::dec << dendl;
+    extents->emplace_back(offs, want);
+    return want;
+  }
+  return HybridAllocatorBase<AvlAllocator>::allocate(want,
+    unit, max_alloc_size, hint, extents);
+}
+
+void HybridAvlAllocator::release(const release_set_t& release_set)
+{
+  if (!thread_cache) {
+    HybridAllocatorBase<AvlAllocator>::release(release_set);
+    return;
+  }
+  PExtentVector to_release;
+  thread_cache->put(release_set, &to_release);
+  if (!to_release.empty()) {
+    std::lock_guard l(get_lock());
+    _release(to_release);
+  }
+}
+
+bool HybridAvlAllocator::_reserve_chunk(uint64_t unit,
+  uint64_t remainder_offs,
+  uint64_t remainder_len,
+  uint64_t* chunk_offs)
+{
+  const uint64_t chunk_size = thread_cache->get_chunk_size();
+  PExtentVector extents;
+  std::lock_guard l(get_lock());
+  if (remainder_len) {
+    extents.emplace_back(remainder_offs, remainder_len);
+    _release(extents);
+    extents.clear();
+  }
+  if (chunk_size % unit != 0 || _get_free() < chunk_size) {
+    return false;
+  }
+  // a chunk is taken from the primary tree only, split ones are given back
+  // rather than making cached allocations fragmented too
+  auto r = AvlAllocator::_allocate(chunk_size, unit, chunk_size, -1, &extents);
+  if (r == (int64_t)chunk_size && extents.size() == 1) {
+    *chunk_offs = extents[0].offset;
+    return true;
+  }
+  if (r > 0) {
+    _release(extents);
+  }
+  return false;
+}
+
+void HybridAvlAllocator::_drain_thread_cache()
+{
+  if (thread_cache) {
+    PExtentVector to_release;
+    thread_cache->drain(&to_release);
+    if (!to_release.empty()) {
+      std::lock_guard l(get_lock());
+      _release(to_release);
+    }
+  }
+}
+
+void HybridAvlAllocator::dump()
+{
+  HybridAllocatorBase<AvlAllocator>::dump();
+  if (thread_cache) {
+    ldout(get_context(), 0) << __func__
+      << " thread cache: " << thread_cache->get_cached()
+      << " hits: " << thread_cache->get_hit_count()
+      << dendl;
+  }
+}
+
+void HybridAvlAllocator::foreach(
+  std::function<void(uint64_t, uint64_t)> notify)
+{
+  // cached extents are accounted as free,
+  // put them back to report them along with the rest
+  _drain_thread_cache();
+  HybridAllocatorBase<AvlAllocator>::foreach(notify);
+}
+
+void HybridAvlAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  _drain_thread_cache();
+  HybridAllocatorBase<AvlAllocator>::init_rm_free(offset, length);
+}
+
+void HybridAvlAllocator::shutdown()
+{
+  if (thread_cache) {
+    delete thread_cache;
+    thread_cache = nullptr;
+  }
+  HybridAllocatorBase<AvlAllocator>::shutdown();
+}
+
 /*
  * class HybridBtree2Allocator
  *
@@ -112,14 +112,42 @@ private:
 };
 
 class HybridAvlAllocator : public HybridAllocatorBase<AvlAllocator> {
+  Allocator::ThreadExtentCache* thread_cache = nullptr;
+
+  // replaces per-thread cache's chunk, see ThreadExtentCache::try_get
+  bool _reserve_chunk(uint64_t unit,
+    uint64_t remainder_offs,
+    uint64_t remainder_len,
+    uint64_t* chunk_offs);
+  void _drain_thread_cache();
+
 public:
   HybridAvlAllocator(CephContext* cct, int64_t device_size, int64_t _block_size,
     uint64_t max_mem,
-    std::string_view name) :
-    HybridAllocatorBase<AvlAllocator>(cct,
-      device_size, _block_size, max_mem, name) {
-  }
+    std::string_view name);
+  ~HybridAvlAllocator() override;
   const char* get_type() const override;
+
+  int64_t allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t  hint,
+    PExtentVector* extents) override;
+  using Allocator::release;
+  void release(const release_set_t& release_set) override;
+  uint64_t get_free() override {
+    return HybridAllocatorBase<AvlAllocator>::get_free() +
+      (thread_cache ? thread_cache->get_cached() : 0);
+  }
+  size_t get_thread_cache_hit_count() const {
+    return thread_cache ? thread_cache->get_hit_count() : 0;
+  }
+  void dump() override;
+  void foreach(
+    std::function<void(uint64_t, uint64_t)> notify) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+  void shutdown() override;
 };
 
 
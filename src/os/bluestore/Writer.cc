@@ -1223,7 +1223,7 @@ void BlueStore::Writer::_defer_or_allocate(uint32_t need_size)
     released_size += r.length;
   }
   uint32_t au_size = bstore->min_alloc_size;
-  do_deferred = need_size <= released_size && released_size < bstore->prefer_deferred_size;
+  do_deferred = need_size <= released_size && released_size < wctx->prefer_deferred_size;
   dout(15) << __func__ << " released=0x" << std::hex << released_size
     << " need=0x" << need_size << std::dec
     << (do_deferred ? " deferred" : " direct") << dendl;
@@ -81,7 +81,8 @@ bluefs_super_t::bluefs_super_t() : version(0), block_size(4096) {
 
 void bluefs_super_t::encode(bufferlist& bl) const
 {
-  ENCODE_START(3, 1, bl);
+  // compat 4 keeps BlueFS that does not know about incompat from mounting
+  ENCODE_START(4, incompat ? 4 : 1, bl);
   encode(uuid, bl);
   encode(osd_uuid, bl);
   encode(version, bl);
@@ -89,12 +90,13 @@ void bluefs_super_t::encode(bufferlist& bl) const
   encode(log_fnode, bl);
   encode(memorized_layout, bl);
   encode(bluefs_max_alloc_size, bl);
+  encode(incompat, bl);
   ENCODE_FINISH(bl);
 }
 
 void bluefs_super_t::decode(bufferlist::const_iterator& p)
 {
-  DECODE_START(3, p);
+  DECODE_START(4, p);
   decode(uuid, p);
   decode(osd_uuid, p);
   decode(version, p);
@@ -108,6 +110,11 @@ void bluefs_super_t::decode(bufferlist::const_iterator& p)
   } else {
     std::fill(bluefs_max_alloc_size.begin(), bluefs_max_alloc_size.end(), 0);
   }
+  if (struct_v >= 4) {
+    decode(incompat, p);
+  } else {
+    incompat = 0;
+  }
   DECODE_FINISH(p);
 }
 
@@ -120,6 +127,7 @@ void bluefs_super_t::dump(Formatter *f) const
   f->dump_object("log_fnode", log_fnode);
   for (auto& p : bluefs_max_alloc_size)
     f->dump_unsigned("max_alloc_size", p);
+  f->dump_unsigned("incompat", incompat);
 }
 
 void bluefs_super_t::generate_test_instances(list<bluefs_super_t*>& ls)
@@ -128,6 +136,9 @@ void bluefs_super_t::generate_test_instances(list<bluefs_super_t*>& ls)
   ls.push_back(new bluefs_super_t);
   ls.back()->version = 1;
   ls.back()->block_size = 4096;
+  ls.push_back(new bluefs_super_t);
+  ls.back()->version = 2;
+  ls.back()->incompat = bluefs_super_t::INCOMPAT_WAL_RING;
 }
 
 ostream& operator<<(ostream& out, const bluefs_super_t& s)
@@ -215,7 +226,7 @@ void bluefs_fnode_t::generate_test_instances(list<bluefs_fnode_t*>& ls)
   ls.back()->size = 1048576;
   ls.back()->mtime = utime_t(123,45);
   ls.back()->extents.push_back(bluefs_extent_t(0, 1048576, 4096));
-  ls.back()->__unused__ = 1;
+  ls.back()->flags = 1;
 }
 
 ostream& operator<<(ostream& out, const bluefs_fnode_t& file)
@@ -223,6 +234,7 @@ ostream& operator<<(ostream& out, const bluefs_fnode_t& file)
   return out << "file(ino " << file.ino
 	     << " size 0x" << std::hex << file.size << std::dec
 	     << " mtime " << file.mtime
+	     << (file.flags & bluefs_fnode_t::FLAG_WAL_RING ? " wal_ring" : "")
 	     << " allocated " << std::hex << file.allocated << std::dec
 	     << " alloc_commit " << std::hex << file.allocated_commited << std::dec
 	     << " extents " << file.extents
@@ -62,7 +62,7 @@ struct bluefs_fnode_t {
   uint64_t ino;
   uint64_t size;
   utime_t mtime;
-  uint8_t __unused__ = 0; // was prefer_bdev
+  uint8_t flags = 0;  // low bits were prefer_bdev, keep clear of them
   mempool::bluefs::vector<bluefs_extent_t> extents;
 
   // precalculated logical offsets for extents vector entries
@@ -77,11 +77,20 @@ struct bluefs_fnode_t {
     ino(_ino), size(_size), mtime(_mtime), allocated(0), allocated_commited(0) {}
   bluefs_fnode_t(const bluefs_fnode_t& other) :
     ino(other.ino), size(other.size), mtime(other.mtime),
+    flags(other.flags),
     allocated(other.allocated),
     allocated_commited(other.allocated_commited) {
     clone_extents(other);
   }
 
+  enum {
+    /// WAL file written into zeroed, preallocated space; its size is only
+    /// logged when it is closed, until then everything allocated is valid.
+    /// Older BlueFS ignores the bit, so bluefs_super_t::INCOMPAT_WAL_RING
+    /// is set before any fnode carries it.
+    FLAG_WAL_RING = 0x80,
+  };
+
   uint64_t get_allocated() const {
     return allocated;
   }
@@ -116,7 +125,7 @@ struct bluefs_fnode_t {
     denc_varint(v.ino, p);
     denc_varint(v.size, p);
     denc(v.mtime, p);
-    denc(v.__unused__, p);
+    denc(v.flags, p);
     denc(v.extents, p);
     DENC_FINISH(p);
   }
@@ -222,6 +231,15 @@ struct bluefs_super_t {
 
   std::vector<uint64_t> bluefs_max_alloc_size;
 
+  /// on-disk features older BlueFS must not mount with; while any is set
+  /// the superblock is encoded with a compat version they reject
+  enum {
+    /// the log may hold FLAG_WAL_RING fnodes, whose logged size is stale
+    INCOMPAT_WAL_RING = 1,
+    INCOMPAT_ALL = INCOMPAT_WAL_RING,
+  };
+  uint64_t incompat = 0;
+
   bluefs_super_t();
 
   uint64_t block_mask() const {
@@ -32,6 +32,7 @@
 #include "common/safe_io.h"
 #include "common/Formatter.h"
 #include "common/pretty_binary.h"
+#include "perfglue/heap_profiler.h"
 
 #define dout_context cct
 #define dout_subsys ceph_subsys_kstore
@@ -370,6 +371,41 @@ static void get_omap_tail(uint64_t id, string *out)
 
 
 
+// Cache
+
+int64_t KStore::Cache::request_cache_bytes(
+  PriorityCache::Priority pri, uint64_t total_cache) const
+{
+  int64_t assigned = get_cache_bytes(pri);
+  switch (pri) {
+  // onodes and stripes all go in at PRI1
+  case PriorityCache::Priority::PRI1:
+    {
+      int64_t request = get_used_bytes();
+      return (request > assigned) ? request - assigned : 0;
+    }
+  default:
+    break;
+  }
+  return -EOPNOTSUPP;
+}
+
+int64_t KStore::Cache::get_cache_bytes() const
+{
+  int64_t total = 0;
+  for (int i = 0; i < PriorityCache::Priority::LAST + 1; i++) {
+    total += get_cache_bytes(static_cast<PriorityCache::Priority>(i));
+  }
+  return total;
+}
+
+int64_t KStore::Cache::commit_cache_size(uint64_t total_cache)
+{
+  committed_bytes = PriorityCache::get_chunk(get_cache_bytes(), total_cache);
+  target_bytes = committed_bytes;
+  return committed_bytes;
+}
+
 // Onode
 
 #undef dout_prefix
@@ -445,7 +481,7 @@ void KStore::OnodeHashLRU::rename(const ghobject_t& old_oid,
   OnodeRef o = po->second;
 
   // install a non-existent onode it its place
-  po->second.reset(new Onode(cct, old_oid, o->key));
+  po->second.reset(new Onode(cct, cache, old_oid, o->key));
   lru.push_back(*po->second);
 
   // fix oid, key
@@ -489,34 +525,25 @@ int KStore::OnodeHashLRU::trim(int max)
 {
   std::lock_guard<std::mutex> l(lock);
   dout(20) << __func__ << " max " << max
-	   << " size " << onode_map.size() << dendl;
+	   << " size " << onode_map.size()
+	   << " cache " << cache->get_used_bytes()
+	   << "/" << cache->target_bytes << dendl;
   int trimmed = 0;
-  int num = onode_map.size() - max;
-  if (onode_map.size() == 0 || num <= 0)
-    return 0; // don't even try
-
-  lru_list_t::iterator p = lru.end();
-  if (num)
-    --p;
-  while (num > 0) {
-    Onode *o = &*p;
+  while (!lru.empty() &&
+	 ((int)onode_map.size() > max || cache->over_target())) {
+    Onode *o = &lru.back();
     int refs = o->nref.load();
     if (refs > 1) {
       dout(20) << __func__ << "  " << o->oid << " has " << refs
-	       << " refs; stopping with " << num << " left to trim" << dendl;
+	       << " refs; stopping with " << onode_map.size()
+	       << " onodes" << dendl;
       break;
     }
     dout(30) << __func__ << "  trim " << o->oid << dendl;
-    if (p != lru.begin()) {
-      lru.erase(p--);
-    } else {
-      lru.erase(p);
-      ceph_assert(num == 1);
-    }
+    lru.pop_back();
     o->get();  // paranoia
     onode_map.erase(o->oid);
     o->put();
-    --num;
     ++trimmed;
   }
   return trimmed;
@@ -533,7 +560,7 @@ KStore::Collection::Collection(KStore *ns, coll_t cid)
   : CollectionImpl(ns->cct, cid),
     store(ns),
     osr(new OpSequencer()),
-    onode_map(store->cct)
+    onode_map(store->cct, store->cache.get())
 {
 }
 
@@ -583,12 +610,12 @@ KStore::OnodeRef KStore::Collection::get_onode(
       return OnodeRef();
 
     // new
-    on = new Onode(store->cct, oid, key);
+    on = new Onode(store->cct, store->cache.get(), oid, key);
     on->dirty = true;
   } else {
     // loaded
     ceph_assert(r >=0);
-    on = new Onode(store->cct, oid, key);
+    on = new Onode(store->cct, store->cache.get(), oid, key);
     on->exists = true;
     auto p = v.cbegin();
     decode(on->onode, p);
@@ -619,6 +646,11 @@ KStore::KStore(CephContext *cct, const string& path)
     finisher(cct),
     kv_sync_thread(this),
     kv_stop(false),
+    kv_finalize_thread(this),
+    kv_finalize_stop(false),
+    cache(std::make_shared<Cache>()),
+    cache_tune_thread(this),
+    cache_tune_stop(false),
     logger(nullptr)
 {
   _init_logger();
@@ -642,6 +674,12 @@ void KStore::_init_logger()
   b.add_time_avg(l_kstore_state_kv_done_lat, "state_kv_done_lat", "Average kv_done state latency");
   b.add_time_avg(l_kstore_state_finishing_lat, "state_finishing_lat", "Average finishing state latency");
   b.add_time_avg(l_kstore_state_done_lat, "state_done_lat", "Average done state latency");
+  b.add_time_avg(l_kstore_kv_sync_lat, "kv_sync_lat", "Average kv sync latency");
+  b.add_u64_avg(l_kstore_kv_batch, "kv_batch", "Average number of transactions per kv sync");
+  b.add_u64(l_kstore_onodes, "onodes", "Number of onodes in cache");
+  b.add_u64(l_kstore_cache_bytes, "cache_bytes", "Bytes used by cached onodes and stripes");
+  b.add_u64_counter(l_kstore_stripe_hit, "stripe_hit", "Stripe reads served from cache");
+  b.add_u64_counter(l_kstore_stripe_miss, "stripe_miss", "Stripe reads that went to the kv store");
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 }
@@ -987,6 +1025,11 @@ int KStore::mount()
 
   finisher.start();
   kv_sync_thread.create("kstore_kv_sync");
+  kv_finalize_thread.create("kstore_kv_final");
+  cache->target_bytes = cct->_conf.get_val<Option::size_t>("kstore_cache_size");
+  if (cct->_conf.get_val<bool>("kstore_cache_autotune")) {
+    _cache_tune_start();
+  }
 
   mounted = true;
   return 0;
@@ -1009,6 +1052,7 @@ int KStore::umount()
   _reap_collections();
   coll_map.clear();
 
+  _cache_tune_stop();
   dout(20) << __func__ << " stopping kv thread" << dendl;
   _kv_stop();
   dout(20) << __func__ << " draining finisher" << dendl;
@@ -1036,11 +1080,19 @@ void KStore::_sync()
 {
   dout(10) << __func__ << dendl;
 
-  std::unique_lock<std::mutex> l(kv_lock);
-  while (!kv_committing.empty() ||
-	 !kv_queue.empty()) {
-    dout(20) << " waiting for kv to commit" << dendl;
-    kv_sync_cond.wait(l);
+  {
+    std::unique_lock<std::mutex> l(kv_lock);
+    while (!kv_committing.empty() ||
+	   !kv_queue.empty()) {
+      dout(20) << " waiting for kv to commit" << dendl;
+      kv_sync_cond.wait(l);
+    }
+  }
+  std::unique_lock<std::mutex> l(kv_finalize_lock);
+  while (!kv_finalizing.empty() ||
+	 !kv_committed.empty()) {
+    dout(20) << " waiting for kv to finalize" << dendl;
+    kv_finalize_sync_cond.wait(l);
   }
 
   dout(10) << __func__ << " done" << dendl;
@@ -1198,7 +1250,12 @@ int KStore::read(
   if (offset == length && offset == 0)
     length = o->onode.size;
 
-  r = _do_read(o, offset, length, bl, false, op_flags);
+  r = _do_read(o, offset, length, bl,
+	       !(op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+			     CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)),
+	       op_flags);
+  o.reset();
+  c->onode_map.trim(cct->_conf->kstore_onode_map_size);
 
  out:
   dout(10) << __func__ << " " << ch->cid << " " << oid
@@ -1235,8 +1292,7 @@ int KStore::_do_read(
     goto out;
   }
 
-  o->flush();
-
+  // no need to flush: anything written since o was loaded is cached
   stripe_off = offset % stripe_size;
   while (length > 0) {
     bufferlist stripe;
@@ -2094,7 +2150,6 @@ void KStore::_txc_finish(TransContext *txc)
     (*p)->flush_txns.erase(txc);
     if ((*p)->flush_txns.empty()) {
       (*p)->flush_cond.notify_all();
-      (*p)->clear_pending_stripes();
     }
   }
 
@@ -2161,37 +2216,139 @@ void KStore::_kv_sync_thread()
 
       dout(30) << __func__ << " committing txc " << kv_committing << dendl;
 
-      // one transaction to force a sync
-      KeyValueDB::Transaction t = db->get_transaction();
       if (!cct->_conf->kstore_sync_submit_transaction) {
-	for (std::deque<TransContext *>::iterator it = kv_committing.begin();
-	     it != kv_committing.end();
-	     ++it) {
-	  int r = db->submit_transaction((*it)->t);
+	// the last txc forces the sync for the whole batch
+	for (size_t i = 0; i + 1 < kv_committing.size(); ++i) {
+	  int r = db->submit_transaction(kv_committing[i]->t);
 	  ceph_assert(r == 0);
 	}
+	int r = db->submit_transaction_sync(kv_committing.back()->t);
+	ceph_assert(r == 0);
+      } else {
+	// one transaction to force a sync
+	KeyValueDB::Transaction t = db->get_transaction();
+	int r = db->submit_transaction_sync(t);
+	ceph_assert(r == 0);
       }
-      int r = db->submit_transaction_sync(t);
-      ceph_assert(r == 0);
       utime_t finish = ceph_clock_now();
       utime_t dur = finish - start;
       dout(20) << __func__ << " committed " << kv_committing.size()
 	       << " in " << dur << dendl;
-      while (!kv_committing.empty()) {
-	TransContext *txc = kv_committing.front();
+      logger->tinc(l_kstore_kv_sync_lat, dur);
+      logger->inc(l_kstore_kv_batch, kv_committing.size());
+
+      // hand them over so that we can start on the next batch
+      {
+	std::lock_guard<std::mutex> fl(kv_finalize_lock);
+	kv_committed.insert(kv_committed.end(),
+			    kv_committing.begin(), kv_committing.end());
+	kv_finalize_cond.notify_one();
+      }
+
+      l.lock();
+      kv_committing.clear();
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void KStore::_kv_finalize_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(kv_finalize_lock);
+  while (true) {
+    ceph_assert(kv_finalizing.empty());
+    if (kv_committed.empty()) {
+      if (kv_finalize_stop)
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      kv_finalize_sync_cond.notify_all();
+      kv_finalize_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+    } else {
+      kv_finalizing.swap(kv_committed);
+      l.unlock();
+
+      dout(20) << __func__ << " finalizing " << kv_finalizing.size() << dendl;
+      for (auto txc : kv_finalizing) {
 	_txc_state_proc(txc);
-	kv_committing.pop_front();
       }
 
       // this is as good a place as any ...
       _reap_collections();
+      refresh_perf_counters();
 
       l.lock();
+      kv_finalizing.clear();
     }
   }
   dout(10) << __func__ << " finish" << dendl;
 }
 
+void KStore::_cache_tune_start()
+{
+  cache_tune_thread.create("kstore_cache");
+}
+
+void KStore::_cache_tune_stop()
+{
+  if (!cache_tune_thread.is_started()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> l(cache_tune_lock);
+    cache_tune_stop = true;
+    cache_tune_cond.notify_all();
+  }
+  cache_tune_thread.join();
+  cache_tune_stop = false;
+}
+
+void KStore::_cache_tune_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  uint64_t base = cct->_conf.get_val<Option::size_t>("osd_memory_base");
+  double fragmentation =
+    cct->_conf.get_val<double>("osd_memory_expected_fragmentation");
+  uint64_t target = cct->_conf.get_val<Option::size_t>("osd_memory_target");
+  uint64_t min = cct->_conf.get_val<Option::size_t>("osd_memory_cache_min");
+  uint64_t max = min;
+
+  // same as bluestore: leave room for the base footprint and fragmentation
+  uint64_t ltarget = (1.0 - fragmentation) * target;
+  if (ltarget > base + min) {
+    max = ltarget - base;
+  }
+
+  auto pcm = std::make_shared<PriorityCache::Manager>(
+    cct, min, max, target, true, "kstore-pricache");
+  auto kv_cache = db->get_priority_cache();
+  double kv_ratio = 0;
+  if (kv_cache) {
+    kv_ratio = cct->_conf.get_val<double>("kstore_cache_kv_ratio");
+    kv_cache->set_cache_ratio(kv_ratio);
+    pcm->insert("kv", kv_cache, true);
+  }
+  cache->set_cache_ratio(1.0 - kv_ratio);
+  pcm->insert("onode", cache, true);
+
+  std::unique_lock<std::mutex> l(cache_tune_lock);
+  while (!cache_tune_stop) {
+    if (ceph_using_tcmalloc()) {
+      pcm->tune_memory();
+    }
+    pcm->balance();
+    dout(20) << __func__ << " onode cache target " << cache->target_bytes
+	     << " used " << cache->get_used_bytes() << dendl;
+    auto interval =
+      cct->_conf.get_val<double>("kstore_cache_autotune_interval");
+    cache_tune_cond.wait_for(
+      l, ceph::make_timespan(interval > 0 ? interval : 1.0));
+  }
+  pcm->clear();
+  dout(10) << __func__ << " finish" << dendl;
+}
+
 
 // ---------------------------
 // transactions
@@ -2660,28 +2817,23 @@ void KStore::_dump_onode(OnodeRef o)
 
 void KStore::_do_read_stripe(OnodeRef o, uint64_t offset, bufferlist *pbl, bool do_cache)
 {
-  if (!do_cache) {
-    string key;
-    get_data_key(o->onode.nid, offset, &key);
-    db->get(PREFIX_DATA, key, pbl);
+  if (o->get_cached_stripe(offset, pbl)) {
+    logger->inc(l_kstore_stripe_hit);
     return;
   }
- 
-  map<uint64_t,bufferlist>::iterator p = o->pending_stripes.find(offset);
-  if (p == o->pending_stripes.end()) {
-    string key;
-    get_data_key(o->onode.nid, offset, &key);
-    db->get(PREFIX_DATA, key, pbl);
-    o->pending_stripes[offset] = *pbl;
-  } else {
-    *pbl = p->second;
+  logger->inc(l_kstore_stripe_miss);
+  string key;
+  get_data_key(o->onode.nid, offset, &key);
+  db->get(PREFIX_DATA, key, pbl);
+  if (do_cache) {
+    o->set_cached_stripe(offset, *pbl);
   }
 }
 
 void KStore::_do_write_stripe(TransContext *txc, OnodeRef o,
 			      uint64_t offset, bufferlist& bl)
 {
-  o->pending_stripes[offset] = bl;
+  o->set_cached_stripe(offset, bl);
   string key;
   get_data_key(o->onode.nid, offset, &key);
   txc->t->set(PREFIX_DATA, key, bl);
@@ -2689,7 +2841,8 @@ void KStore::_do_write_stripe(TransContext *txc, OnodeRef o,
 
 void KStore::_do_remove_stripe(TransContext *txc, OnodeRef o, uint64_t offset)
 {
-  o->pending_stripes.erase(offset);
+  // keep an empty entry so reads don't go to the kv store before we commit
+  o->set_cached_stripe(offset, bufferlist());
   string key;
   get_data_key(o->onode.nid, offset, &key);
   txc->t->rmkey(PREFIX_DATA, key);
@@ -2875,8 +3028,6 @@ int KStore::_do_truncate(TransContext *txc, OnodeRef o, uint64_t offset)
 {
   uint64_t stripe_size = o->onode.stripe_size;
 
-  o->flush();
-
   // trim down stripes
   if (stripe_size) {
     uint64_t pos = offset;
@@ -2945,6 +3096,7 @@ int KStore::_do_remove(TransContext *txc,
   }
   o->exists = false;
   o->onode = kstore_onode_t();
+  o->clear_cached_stripes();
   txc->onodes.erase(o);
   get_object_key(cct, o->oid, &key);
   txc->t->rmkey(PREFIX_OBJ, key);
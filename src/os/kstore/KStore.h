@@ -26,6 +26,7 @@
 #include "include/ceph_assert.h"
 #include "include/unordered_map.h"
 #include "common/Finisher.h"
+#include "common/PriorityCache.h"
 #include "common/Throttle.h"
 #include "common/WorkQueue.h"
 #include "os/ObjectStore.h"
@@ -44,6 +45,12 @@ enum {
   l_kstore_state_kv_done_lat,
   l_kstore_state_finishing_lat,
   l_kstore_state_done_lat,
+  l_kstore_kv_sync_lat,
+  l_kstore_kv_batch,
+  l_kstore_onodes,
+  l_kstore_cache_bytes,
+  l_kstore_stripe_hit,
+  l_kstore_stripe_miss,
   l_kstore_last
 };
 
@@ -54,9 +61,63 @@ public:
 
   struct TransContext;
 
+  /// memory charged to onodes and their cached stripes, over all collections
+  struct Cache : public PriorityCache::PriCache {
+    std::atomic<uint64_t> num_onodes = {0};
+    std::atomic<uint64_t> onode_bytes = {0};
+    std::atomic<uint64_t> stripe_bytes = {0};
+    std::atomic<uint64_t> target_bytes = {0};  ///< trim onodes above this
+    int64_t cache_bytes[PriorityCache::Priority::LAST+1] = {0};
+    int64_t committed_bytes = 0;
+    double cache_ratio = 0;
+
+    uint64_t get_used_bytes() const {
+      return onode_bytes + stripe_bytes;
+    }
+    bool over_target() const {
+      return get_used_bytes() > target_bytes;
+    }
+
+    int64_t request_cache_bytes(
+      PriorityCache::Priority pri, uint64_t total_cache) const override;
+    int64_t get_cache_bytes(PriorityCache::Priority pri) const override {
+      return cache_bytes[pri];
+    }
+    int64_t get_cache_bytes() const override;
+    void set_cache_bytes(PriorityCache::Priority pri, int64_t bytes) override {
+      cache_bytes[pri] = bytes;
+    }
+    void add_cache_bytes(PriorityCache::Priority pri, int64_t bytes) override {
+      cache_bytes[pri] += bytes;
+    }
+    int64_t commit_cache_size(uint64_t total_cache) override;
+    int64_t get_committed_size() const override {
+      return committed_bytes;
+    }
+    double get_cache_ratio() const override {
+      return cache_ratio;
+    }
+    void set_cache_ratio(double ratio) override {
+      cache_ratio = ratio;
+    }
+    std::string get_cache_name() const override {
+      return "KStore Onode Cache";
+    }
+    void shift_bins() override {
+    }
+    void import_bins(const std::vector<uint64_t> &bins) override {
+    }
+    void set_bins(PriorityCache::Priority pri, uint64_t end_bin) override {
+    }
+    uint64_t get_bins(PriorityCache::Priority pri) const override {
+      return 0;
+    }
+  };
+
   /// an in-memory object
   struct Onode {
     CephContext* cct;
+    Cache* cache;
     std::atomic_int nref;  ///< reference count
 
     ghobject_t oid;
@@ -74,16 +135,29 @@ public:
     uint64_t tail_offset;
     ceph::buffer::list tail_bl;
 
-    std::map<uint64_t,ceph::buffer::list> pending_stripes;  ///< unwritten stripes
+    /// protect cached_stripes; readers only hold the collection lock shared
+    std::mutex cache_lock;
+    /// stripes written since we were loaded (committed or not) and clean
+    /// stripes we have read; removed stripes are kept as empty entries
+    std::map<uint64_t,ceph::buffer::list> cached_stripes;
 
-    Onode(CephContext* cct, const ghobject_t& o, const std::string& k)
+    Onode(CephContext* cct, Cache* cache, const ghobject_t& o,
+	  const std::string& k)
       : cct(cct),
+	cache(cache),
 	nref(0),
 	oid(o),
 	key(k),
 	dirty(false),
 	exists(false),
         tail_offset(0) {
+      cache->num_onodes++;
+      cache->onode_bytes += sizeof(Onode);
+    }
+    ~Onode() {
+      clear_cached_stripes();
+      cache->num_onodes--;
+      cache->onode_bytes -= sizeof(Onode);
     }
 
     void flush();
@@ -99,14 +173,36 @@ public:
       tail_offset = 0;
       tail_bl.clear();
     }
-    void clear_pending_stripes() {
-      pending_stripes.clear();
+
+    bool get_cached_stripe(uint64_t offset, ceph::buffer::list *pbl) {
+      std::lock_guard<std::mutex> l(cache_lock);
+      auto p = cached_stripes.find(offset);
+      if (p == cached_stripes.end()) {
+	return false;
+      }
+      *pbl = p->second;
+      return true;
+    }
+    void set_cached_stripe(uint64_t offset, const ceph::buffer::list& bl) {
+      std::lock_guard<std::mutex> l(cache_lock);
+      auto& cached = cached_stripes[offset];
+      cache->stripe_bytes -= cached.length();
+      cache->stripe_bytes += bl.length();
+      cached = bl;
+    }
+    void clear_cached_stripes() {
+      std::lock_guard<std::mutex> l(cache_lock);
+      for (auto& p : cached_stripes) {
+	cache->stripe_bytes -= p.second.length();
+      }
+      cached_stripes.clear();
     }
   };
   typedef boost::intrusive_ptr<Onode> OnodeRef;
 
   struct OnodeHashLRU {
     CephContext* cct;
+    Cache* cache;
     typedef boost::intrusive::list<
       Onode,
       boost::intrusive::member_hook<
@@ -118,7 +214,7 @@ public:
     ceph::unordered_map<ghobject_t,OnodeRef> onode_map;  ///< forward lookups
     lru_list_t lru;                                      ///< lru
 
-    OnodeHashLRU(CephContext* cct) : cct(cct) {}
+    OnodeHashLRU(CephContext* cct, Cache* cache) : cct(cct), cache(cache) {}
 
     void add(const ghobject_t& oid, OnodeRef o);
     void _touch(OnodeRef o);
@@ -126,6 +222,7 @@ public:
     void rename(const ghobject_t& old_oid, const ghobject_t& new_oid);
     void clear();
     bool get_next(const ghobject_t& after, std::pair<ghobject_t,OnodeRef> *next);
+    /// trim to at most max onodes, and while the store is over its cache target
     int trim(int max=-1);
   };
 
@@ -313,6 +410,24 @@ public:
     }
   };
 
+  struct KVFinalizeThread : public Thread {
+    KStore *store;
+    explicit KVFinalizeThread(KStore *s) : store(s) {}
+    void *entry() override {
+      store->_kv_finalize_thread();
+      return NULL;
+    }
+  };
+
+  struct CacheTuneThread : public Thread {
+    KStore *store;
+    explicit CacheTuneThread(KStore *s) : store(s) {}
+    void *entry() override {
+      store->_cache_tune_thread();
+      return NULL;
+    }
+  };
+
   // --------------------------------------------------------
   // members
 private:
@@ -342,6 +457,19 @@ private:
   bool kv_stop;
   std::deque<TransContext*> kv_queue, kv_committing;
 
+  // committed txcs are completed here so the next kv sync can start
+  KVFinalizeThread kv_finalize_thread;
+  std::mutex kv_finalize_lock;
+  std::condition_variable kv_finalize_cond, kv_finalize_sync_cond;
+  bool kv_finalize_stop;
+  std::deque<TransContext*> kv_committed, kv_finalizing;
+
+  std::shared_ptr<Cache> cache;
+  CacheTuneThread cache_tune_thread;
+  std::mutex cache_tune_lock;
+  std::condition_variable cache_tune_cond;
+  bool cache_tune_stop;
+
   //Logger *logger;
   PerfCounters *logger;
   std::mutex reap_lock;
@@ -387,6 +515,7 @@ private:
   void _osr_reap_done(OpSequencer *osr);
 
   void _kv_sync_thread();
+  void _kv_finalize_thread();
   void _kv_stop() {
     {
       std::lock_guard<std::mutex> l(kv_lock);
@@ -395,8 +524,19 @@ private:
     }
     kv_sync_thread.join();
     kv_stop = false;
+    {
+      std::lock_guard<std::mutex> l(kv_finalize_lock);
+      kv_finalize_stop = true;
+      kv_finalize_cond.notify_all();
+    }
+    kv_finalize_thread.join();
+    kv_finalize_stop = false;
   }
 
+  void _cache_tune_thread();
+  void _cache_tune_start();
+  void _cache_tune_stop();
+
   void _do_read_stripe(OnodeRef o, uint64_t offset, ceph::buffer::list *pbl, bool do_cache);
   void _do_write_stripe(TransContext *txc, OnodeRef o,
 			uint64_t offset, ceph::buffer::list& bl);
@@ -576,6 +716,8 @@ public:
     return objectstore_perf_stat_t();
   }
   void refresh_perf_counters() override {
+    logger->set(l_kstore_onodes, cache->num_onodes);
+    logger->set(l_kstore_cache_bytes, cache->get_used_bytes());
   }
   const PerfCounters* get_perf_counters() const override {
     return logger;
@@ -46,6 +46,8 @@ bool operator>(const MemStore::CollectionRef& l,
 
 int MemStore::mount()
 {
+  Page::set_thread_cache_pages(
+    cct->_conf.get_val<uint64_t>("memstore_page_cache_pages"));
   int r = _load();
   if (r < 0)
     return r;
@@ -1135,12 +1137,11 @@ int MemStore::_remove(const coll_t& cid, const ghobject_t& oid)
     return -ENOENT;
   std::lock_guard l{c->lock};
 
-  auto i = c->object_hash.find(oid);
-  if (i == c->object_hash.end())
+  ObjectRef o = c->_find_object(oid);
+  if (!o)
     return -ENOENT;
-  used_bytes -= i->second->get_size();
-  c->object_hash.erase(i);
-  c->object_map.erase(oid);
+  used_bytes -= o->get_size();
+  c->_remove_object(oid);
 
   return 0;
 }
@@ -1400,13 +1401,12 @@ int MemStore::_collection_add(const coll_t& cid, const coll_t& ocid, const ghobj
   std::scoped_lock l{std::min(&(*c), &(*oc))->lock,
 		     std::max(&(*c), &(*oc))->lock};
 
-  if (c->object_hash.count(oid))
+  if (c->_find_object(oid))
     return -EEXIST;
-  if (oc->object_hash.count(oid) == 0)
+  ObjectRef o = oc->_find_object(oid);
+  if (!o)
     return -ENOENT;
-  ObjectRef o = oc->object_hash[oid];
-  c->object_map[oid] = o;
-  c->object_hash[oid] = o;
+  c->_add_object(oid, o);
   return 0;
 }
 
@@ -1426,17 +1426,13 @@ int MemStore::_collection_move_rename(const coll_t& oldcid, const ghobject_t& ol
   ceph_assert(&(*c) == &(*oc));
 
   std::lock_guard l{c->lock};
-  if (c->object_hash.count(oid))
+  if (c->_find_object(oid))
     return -EEXIST;
-  if (oc->object_hash.count(oldoid) == 0)
+  ObjectRef o = oc->_find_object(oldoid);
+  if (!o)
     return -ENOENT;
-  {
-    ObjectRef o = oc->object_hash[oldoid];
-    c->object_map[oid] = o;
-    c->object_hash[oid] = o;
-    oc->object_map.erase(oldoid);
-    oc->object_hash.erase(oldoid);
-  }
+  c->_add_object(oid, o);
+  oc->_remove_object(oldoid);
   return 0;
 }
 
@@ -1459,10 +1455,9 @@ int MemStore::_split_collection(const coll_t& cid, uint32_t bits, uint32_t match
   while (p != sc->object_map.end()) {
     if (p->first.match(bits, match)) {
       dout(20) << " moving " << p->first << dendl;
-      dc->object_map.insert(std::make_pair(p->first, p->second));
-      dc->object_hash.insert(std::make_pair(p->first, p->second));
-      sc->object_hash.erase(p->first);
-      sc->object_map.erase(p++);
+      auto [oid, o] = *p++;
+      dc->_add_object(oid, o);
+      sc->_remove_object(oid);
     } else {
       ++p;
     }
@@ -1491,10 +1486,9 @@ int MemStore::_merge_collection(const coll_t& cid, uint32_t bits, coll_t dest)
     auto p = sc->object_map.begin();
     while (p != sc->object_map.end()) {
       dout(20) << " moving " << p->first << dendl;
-      dc->object_map.insert(std::make_pair(p->first, p->second));
-      dc->object_hash.insert(std::make_pair(p->first, p->second));
-      sc->object_hash.erase(p->first);
-      sc->object_map.erase(p++);
+      auto [oid, o] = *p++;
+      dc->_add_object(oid, o);
+      sc->_remove_object(oid);
     }
 
     dc->bits = bits;
@@ -1614,6 +1608,10 @@ int BufferlistObject::truncate(uint64_t size)
 // PageSetObject
 
 struct MemStore::PageSetObject : public Object {
+  // readers share the object, so page lookups of concurrent reads do not
+  // serialize; writers, truncates and clone targets take it exclusively
+  ceph::shared_mutex data_lock{
+    ceph::make_shared_mutex("MemStore::PageSetObject::data_lock", true, false)};
   PageSet data;
   uint64_t data_len;
 #if defined(__GLIBCXX__)
@@ -1665,6 +1663,7 @@ int MemStore::PageSetObject::read(uint64_t offset, uint64_t len, ceph::buffer::l
   const auto end = offset + len;
   auto remaining = len;
 
+  std::shared_lock l{data_lock};
   DEFINE_PAGE_VECTOR(tls_pages);
   data.get_range(offset, len, tls_pages);
 
@@ -1712,6 +1711,7 @@ int MemStore::PageSetObject::write(uint64_t offset, const ceph::buffer::list &sr
 {
   unsigned len = src.length();
 
+  std::lock_guard l{data_lock};
   DEFINE_PAGE_VECTOR(tls_pages);
   // make sure the page range is allocated
   data.alloc_range(offset, src.length(), tls_pages);
@@ -1740,7 +1740,20 @@ int MemStore::PageSetObject::clone(Object *src, uint64_t srcoff,
 {
   const int64_t delta = dstoff - srcoff;
 
-  auto &src_data = static_cast<PageSetObject*>(src)->data;
+  auto src_obj = static_cast<PageSetObject*>(src);
+  std::unique_lock dst_lock{data_lock, std::defer_lock};
+  std::shared_lock src_lock{src_obj->data_lock, std::defer_lock};
+  if (src_obj == this) {
+    dst_lock.lock();
+  } else if (src_obj < this) {
+    src_lock.lock();
+    dst_lock.lock();
+  } else {
+    dst_lock.lock();
+    src_lock.lock();
+  }
+
+  auto &src_data = src_obj->data;
   const uint64_t src_page_size = src_data.get_page_size();
 
   auto &dst_data = data;
@@ -1827,6 +1840,7 @@ int MemStore::PageSetObject::clone(Object *src, uint64_t srcoff,
 
 int MemStore::PageSetObject::truncate(uint64_t size)
 {
+  std::lock_guard l{data_lock};
   data.free_pages_after(size);
   data_len = size;
 
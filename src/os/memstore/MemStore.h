@@ -93,10 +93,17 @@ public:
     int bits = 0;
     CephContext *cct;
     bool use_page_set;
-    ceph::unordered_map<ghobject_t, ObjectRef> object_hash;  ///< for lookup
+    /// one stripe of the lookup table, with its own lock
+    struct ObjectHashShard {
+      ceph::shared_mutex lock{
+	ceph::make_shared_mutex("MemStore::Collection::ObjectHashShard::lock",
+				true, false)};
+      ceph::unordered_map<ghobject_t, ObjectRef> objects;
+    };
+    std::vector<ObjectHashShard> object_hash;  ///< for lookup
     std::map<ghobject_t, ObjectRef> object_map;        ///< for iteration
     std::map<std::string,ceph::buffer::ptr> xattr;
-    /// for object_{map,hash}
+    /// for object_map, and for adding to or removing from object_hash
     ceph::shared_mutex lock{
       ceph::make_shared_mutex("MemStore::Collection::lock", true, false)};
 
@@ -112,23 +119,59 @@ public:
     // contents of individual objects.  The osd is already sequencing
     // reads and writes, so we will never see them concurrently at this
     // level.
+    //
+    // Lookups only take the lock of the object_hash stripe the oid falls
+    // in, so they neither wait for nor bounce the collection lock.
+    // Changing which objects exist takes the collection lock exclusively
+    // and then the stripe lock.
+
+    ObjectHashShard& get_hash_shard(const ghobject_t& oid) {
+      return object_hash[std::hash<ghobject_t>{}(oid) % object_hash.size()];
+    }
 
-    ObjectRef get_object(ghobject_t oid) {
-      std::shared_lock l{lock};
-      auto o = object_hash.find(oid);
-      if (o == object_hash.end())
+    ObjectRef get_object(const ghobject_t& oid) {
+      auto& shard = get_hash_shard(oid);
+      std::shared_lock l{shard.lock};
+      auto o = shard.objects.find(oid);
+      if (o == shard.objects.end())
 	return ObjectRef();
       return o->second;
     }
 
-    ObjectRef get_or_create_object(ghobject_t oid) {
+    ObjectRef get_or_create_object(const ghobject_t& oid) {
+      if (auto o = get_object(oid); o) {
+	return o;
+      }
       std::lock_guard l{lock};
-      auto result = object_hash.emplace(oid, ObjectRef());
+      auto& shard = get_hash_shard(oid);
+      std::lock_guard sl{shard.lock};
+      auto result = shard.objects.emplace(oid, ObjectRef());
       if (result.second)
         object_map[oid] = result.first->second = create_object();
       return result.first->second;
     }
 
+    /// caller holds lock exclusively
+    ObjectRef _find_object(const ghobject_t& oid) {
+      return get_object(oid);
+    }
+    /// caller holds lock exclusively
+    void _add_object(const ghobject_t& oid, ObjectRef o) {
+      auto& shard = get_hash_shard(oid);
+      std::lock_guard sl{shard.lock};
+      shard.objects[oid] = o;
+      object_map[oid] = std::move(o);
+    }
+    /// caller holds lock exclusively
+    bool _remove_object(const ghobject_t& oid) {
+      auto& shard = get_hash_shard(oid);
+      std::lock_guard sl{shard.lock};
+      if (shard.objects.erase(oid) == 0)
+	return false;
+      object_map.erase(oid);
+      return true;
+    }
+
     void encode(ceph::buffer::list& bl) const {
       ENCODE_START(1, 1, bl);
       encode(xattr, bl);
@@ -152,8 +195,7 @@ public:
 	decode(k, p);
 	auto o = create_object();
 	o->decode(p);
-	object_map.insert(std::make_pair(k, o));
-	object_hash.insert(std::make_pair(k, o));
+	_add_object(k, o);
       }
       DECODE_FINISH(p);
     }
@@ -178,7 +220,9 @@ public:
     explicit Collection(CephContext *cct, coll_t c)
       : CollectionImpl(cct, c),
 	cct(cct),
-	use_page_set(cct->_conf->memstore_page_set) {}
+	use_page_set(cct->_conf->memstore_page_set),
+	object_hash(std::max<uint64_t>(
+	  1, cct->_conf->memstore_object_hash_shards)) {}
   };
   typedef Collection::Ref CollectionRef;
 
@@ -18,7 +18,6 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <mutex>
 #include <vector>
 #include <boost/intrusive/avl_set.hpp>
 #include <boost/intrusive_ptr.hpp>
@@ -29,6 +28,7 @@ struct Page {
   char *const data;
   boost::intrusive::avl_set_member_hook<> hook;
   uint64_t offset;
+  const size_t alloc_size; ///< size of the buffer holding data and Page
 
   // avoid RefCountedObject because it has a virtual destructor
   std::atomic<uint16_t> nrefs;
@@ -67,9 +67,15 @@ struct Page {
     const auto align = alignof(Page);
     page_size = (page_size + align - 1) & ~(align - 1);
     // allocate the Page and its data in a single buffer
-    auto buffer = new char[page_size + sizeof(Page)];
+    const size_t alloc_size = page_size + sizeof(Page);
+    auto buffer = alloc_buffer(alloc_size);
     // place the Page structure at the end of the buffer
-    return new (buffer + page_size) Page(buffer, offset);
+    return new (buffer + page_size) Page(buffer, offset, alloc_size);
+  }
+
+  /// number of freed page buffers each thread keeps for reuse
+  static void set_thread_cache_pages(unsigned n) {
+    thread_cache_pages = n;
   }
 
   // copy disabled
@@ -77,10 +83,67 @@ struct Page {
   const Page& operator=(const Page&) = delete;
 
  private: // private constructor, use create() instead
-  Page(char *data, uint64_t offset) : data(data), offset(offset), nrefs(1) {}
+  Page(char *data, uint64_t offset, size_t alloc_size)
+    : data(data), offset(offset), alloc_size(alloc_size), nrefs(1) {}
 
   static void operator delete(void *p) {
-    delete[] reinterpret_cast<Page*>(p)->data;
+    auto page = reinterpret_cast<Page*>(p);
+    free_buffer(page->data, page->alloc_size);
+  }
+
+  // Freed page buffers are kept by the thread that released them and
+  // handed out again to the next Page it creates, so the hot path of a
+  // busy store neither goes through the global heap nor hands memory
+  // across cores.
+  static inline std::atomic<unsigned> thread_cache_pages{0};
+
+  struct ThreadCache {
+    size_t alloc_size = 0;
+    std::vector<char*> buffers;
+    void clear() {
+      for (auto b : buffers)
+        delete[] b;
+      buffers.clear();
+    }
+    ~ThreadCache() {
+      clear();
+      thread_cache_gone = true;
+    }
+  };
+  // Pages may still be released by other thread_locals torn down after
+  // the cache is gone.  The flag has no destructor, so it stays readable
+  // until the thread is completely gone.
+  static inline thread_local bool thread_cache_gone = false;
+  static ThreadCache& thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+
+  static char* alloc_buffer(size_t alloc_size) {
+    if (!thread_cache_gone) {
+      auto& cache = thread_cache();
+      if (cache.alloc_size == alloc_size && !cache.buffers.empty()) {
+        auto b = cache.buffers.back();
+        cache.buffers.pop_back();
+        return b;
+      }
+    }
+    return new char[alloc_size];
+  }
+  static void free_buffer(char *b, size_t alloc_size) {
+    const unsigned max = thread_cache_pages.load(std::memory_order_relaxed);
+    if (max && !thread_cache_gone) {
+      auto& cache = thread_cache();
+      if (cache.alloc_size != alloc_size) {
+        cache.clear();
+        cache.alloc_size = alloc_size;
+      }
+      if (cache.buffers.size() < max) {
+        cache.buffers.push_back(b);
+        return;
+      }
+    }
+    delete[] b;
   }
 };
 
@@ -100,12 +163,11 @@ class PageSet {
 
   typedef typename page_set::iterator iterator;
 
+  // there is no lock here: the owner serializes modifications against
+  // each other and against lookups, and lookups may run in parallel
   page_set pages;
   uint64_t page_size;
 
-  typedef std::mutex lock_type;
-  lock_type mutex;
-
   void free_pages(iterator cur, iterator end) {
     while (cur != end) {
       Page *page = &*cur;
@@ -153,7 +215,6 @@ class PageSet {
     range.resize(count_pages(offset, length));
     auto out = range.rbegin();
 
-    std::lock_guard<lock_type> lock(mutex);
     iterator cur = pages.end();
     while (length) {
       const uint64_t page_offset = position & ~(page_size-1);
@@ -197,7 +258,6 @@ class PageSet {
   }
 
   void free_pages_after(uint64_t offset) {
-    std::lock_guard<lock_type> lock(mutex);
     auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
     if (cur == pages.end())
       return;
@@ -1446,6 +1446,7 @@ struct ECClassicalOp : ECCommon::RMWPipeline::Op {
       pgid,
       sinfo,
       remote_read_result,
+      delta_read_result,
       log_entries,
       written,
       transactions,
@@ -1689,6 +1690,16 @@ void ECBackend::objects_read_and_reconstruct(
     reads, fast_read, std::move(func));
 }
 
+void ECBackend::objects_read_shards(
+  const hobject_t &hoid,
+  const extent_set &to_read,
+  const std::set<int> &shards,
+  GenContextURef<ECCommon::ec_shard_extents_t &&> &&func)
+{
+  return read_pipeline.objects_read_shards(
+    hoid, to_read, shards, std::move(func));
+}
+
 void ECBackend::kick_reads() {
   read_pipeline.kick_reads();
 }
@@ -145,6 +145,12 @@ public:
     bool fast_read,
     GenContextURef<ECCommon::ec_extents_t &&> &&func) override;
 
+  void objects_read_shards(
+    const hobject_t &hoid,
+    const extent_set &to_read,
+    const std::set<int> &shards,
+    GenContextURef<ECCommon::ec_shard_extents_t &&> &&func) override;
+
   void objects_read_async(
     const hobject_t &hoid,
     const std::list<std::pair<ECCommon::ec_align_t,
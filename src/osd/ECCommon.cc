@@ -64,6 +64,7 @@ static ostream& _prefix(std::ostream *_dout,
   return *_dout;
 }
 static ostream& _prefix(std::ostream *_dout, struct ClientReadCompleter *read_completer);
+static ostream& _prefix(std::ostream *_dout, struct ShardReadCompleter *read_completer);
 
 ostream &operator<<(ostream &lhs, const ECCommon::RMWPipeline::pipeline_state_t &rhs) {
   switch (rhs.pipeline_state) {
@@ -164,6 +165,7 @@ ostream &operator<<(ostream &lhs, const ECCommon::RMWPipeline::Op &rhs)
       << " pending_read=" << rhs.pending_read
       << " remote_read=" << rhs.remote_read
       << " remote_read_result=" << rhs.remote_read_result
+      << " parity_delta=" << rhs.parity_delta
       << " pending_apply=" << rhs.pending_apply
       << " pending_commit=" << rhs.pending_commit
       << " plan.to_read=" << rhs.plan.to_read
@@ -666,6 +668,98 @@ void ECCommon::ReadPipeline::objects_read_and_reconstruct(
     std::make_unique<ClientReadCompleter>(*this, &(in_progress_client_reads.back())));
 }
 
+struct ShardReadCompleter : ECCommon::ReadCompleter {
+  ShardReadCompleter(ECCommon::ReadPipeline &read_pipeline,
+                     GenContextURef<ECCommon::ec_shard_extents_t &&> &&func)
+    : read_pipeline(read_pipeline),
+      func(std::move(func)) {}
+
+  void finish_single_request(
+    const hobject_t &hoid,
+    ECCommon::read_result_t &res,
+    list<ECCommon::ec_align_t> to_read,
+    set<int> wanted_to_read) override
+  {
+    auto* cct = read_pipeline.cct;
+    dout(20) << __func__ << " completing hoid=" << hoid
+             << " res=" << res << " to_read="  << to_read << dendl;
+    result.err = res.r;
+    if (res.r != 0)
+      return;
+    ceph_assert(res.returned.size() == to_read.size());
+    for (auto &&read: to_read) {
+      const auto chunk = read_pipeline.sinfo.chunk_aligned_offset_len_to_chunk(
+	make_pair(read.offset, read.size));
+      auto &returned = res.returned.front().get<2>();
+      // a failed shard may have been replaced by others to reconstruct
+      // from, but only the chunks actually stored on the wanted shards
+      // are of use here
+      for (auto shard : wanted_to_read) {
+	auto i = std::find_if(
+	  returned.begin(), returned.end(),
+	  [shard](const auto &p) { return p.first.shard == shard; });
+	if (i == returned.end() || i->second.length() != chunk.second) {
+	  dout(10) << __func__ << " missing shard " << shard
+		   << " for " << read << dendl;
+	  result.err = -EIO;
+	  return;
+	}
+	result.shards[shard].insert(
+	  chunk.first, chunk.second, std::move(i->second));
+      }
+      res.returned.pop_front();
+    }
+  }
+
+  void finish(int priority) && override
+  {
+    func.release()->complete(std::move(result));
+  }
+
+  ECCommon::ReadPipeline &read_pipeline;
+  GenContextURef<ECCommon::ec_shard_extents_t &&> func;
+  ECCommon::ec_shard_extents_t result{0, {}};
+};
+static ostream& _prefix(std::ostream *_dout, ShardReadCompleter *read_completer) {
+  return _prefix(_dout, &read_completer->read_pipeline);
+}
+
+void ECCommon::ReadPipeline::objects_read_shards(
+  const hobject_t &hoid,
+  const extent_set &to_read,
+  const set<int> &shards,
+  GenContextURef<ECCommon::ec_shard_extents_t &&> &&func)
+{
+  map<pg_shard_t, vector<pair<int, int>>> need;
+  for (auto &&pg_shard : get_parent()->get_acting_shards()) {
+    if (shards.contains(pg_shard.shard)) {
+      need[pg_shard].push_back(make_pair(0, ec_impl->get_sub_chunk_count()));
+    }
+  }
+  ceph_assert(need.size() == shards.size());
+
+  list<ec_align_t> extents;
+  for (auto &&extent : to_read) {
+    ceph_assert(sinfo.logical_offset_is_stripe_aligned(extent.first));
+    ceph_assert(sinfo.logical_offset_is_stripe_aligned(extent.second));
+    extents.emplace_back(ec_align_t{extent.first, extent.second, 0});
+  }
+  dout(20) << __func__ << " " << hoid << " " << to_read
+	   << " from " << need << dendl;
+
+  map<hobject_t, set<int>> obj_want_to_read;
+  obj_want_to_read.emplace(hoid, shards);
+  map<hobject_t, read_request_t> for_read_op;
+  for_read_op.emplace(hoid, read_request_t(extents, need, false));
+  start_read_op(
+    CEPH_MSG_PRIO_DEFAULT,
+    obj_want_to_read,
+    for_read_op,
+    OpRequestRef(),
+    false,
+    false,
+    std::make_unique<ShardReadCompleter>(*this, std::move(func)));
+}
 
 int ECCommon::ReadPipeline::send_all_remaining_reads(
   const hobject_t &hoid,
@@ -723,32 +817,37 @@ void ECCommon::RMWPipeline::start_rmw(OpRef op)
   check_ops();
 }
 
-bool ECCommon::RMWPipeline::try_state_to_reads()
+bool ECCommon::RMWPipeline::should_use_parity_delta(const Op &op)
 {
-  if (waiting_state.empty())
+  if (!cct->_conf->osd_ec_parity_delta_writes ||
+      !ec_impl->supports_parity_delta_writes() ||
+      !op.requires_rmw() ||
+      op.invalidates_cache() ||
+      op.plan.will_write.size() != 1) {
     return false;
-
-  Op *op = &(waiting_state.front());
-  if (op->requires_rmw() && pipeline_state.cache_invalid()) {
-    ceph_assert(get_parent()->get_pool().allows_ecoverwrites());
-    dout(20) << __func__ << ": blocking " << *op
-	     << " because it requires an rmw and the cache is invalid "
-	     << pipeline_state
-	     << dendl;
+  }
+  const hobject_t &hoid = op.plan.will_write.begin()->first;
+  auto shards = op.plan.delta_shards.find(hoid);
+  if (shards == op.plan.delta_shards.end()) {
     return false;
   }
-
-  if (!pipeline_state.caching_enabled()) {
-    op->using_cache = false;
-  } else if (op->invalidates_cache()) {
-    dout(20) << __func__ << ": invalidating cache after this op"
-	     << dendl;
-    pipeline_state.invalidate();
+  // pinned extents belong to writes not yet applied everywhere, only the
+  // cache has their contents
+  if (cache.has_pinned_extents(hoid)) {
+    return false;
   }
+  set<int> have;
+  for (auto &&pg_shard : get_parent()->get_acting_shards()) {
+    if (!get_parent()->get_shard_missing(pg_shard).is_missing(hoid)) {
+      have.insert(pg_shard.shard);
+    }
+  }
+  return std::includes(have.begin(), have.end(),
+		       shards->second.begin(), shards->second.end());
+}
 
-  waiting_state.pop_front();
-  waiting_reads.push_back(*op);
-
+void ECCommon::RMWPipeline::start_rmw_reads(Op *op)
+{
   if (op->using_cache) {
     cache.open_write_pin(op->pin);
 
@@ -793,6 +892,75 @@ bool ECCommon::RMWPipeline::try_state_to_reads()
 	check_ops();
       });
   }
+}
+
+bool ECCommon::RMWPipeline::try_state_to_reads()
+{
+  if (waiting_state.empty())
+    return false;
+
+  Op *op = &(waiting_state.front());
+  if (op->requires_rmw() && pipeline_state.cache_invalid()) {
+    ceph_assert(get_parent()->get_pool().allows_ecoverwrites());
+    dout(20) << __func__ << ": blocking " << *op
+	     << " because it requires an rmw and the cache is invalid "
+	     << pipeline_state
+	     << dendl;
+    return false;
+  }
+
+  // A parity delta op leaves nothing in the cache, so until its write is
+  // sent a later op on the same object could only read stale data.
+  for (auto &&rop : waiting_reads) {
+    if (rop.requires_rmw() && !rop.using_cache &&
+	(op->plan.will_write.count(rop.hoid) ||
+	 op->plan.to_read.count(rop.hoid))) {
+      dout(20) << __func__ << ": blocking " << *op
+	       << " behind parity delta op " << rop.tid
+	       << dendl;
+      return false;
+    }
+  }
+
+  if (!pipeline_state.caching_enabled()) {
+    op->using_cache = false;
+  } else if (op->invalidates_cache()) {
+    dout(20) << __func__ << ": invalidating cache after this op"
+	     << dendl;
+    pipeline_state.invalidate();
+  }
+
+  waiting_state.pop_front();
+  waiting_reads.push_back(*op);
+
+  if (!op->using_cache || !should_use_parity_delta(*op)) {
+    start_rmw_reads(op);
+    return true;
+  }
+
+  op->parity_delta = true;
+  op->using_cache = false;
+  const hobject_t &hoid = op->plan.will_write.begin()->first;
+  dout(10) << __func__ << ": parity delta " << *op
+	   << " reading shards " << op->plan.delta_shards[hoid]
+	   << dendl;
+  objects_read_shards(
+    hoid,
+    op->plan.will_write.begin()->second,
+    op->plan.delta_shards[hoid],
+    [op, hoid, this](ec_shard_extents_t &&result) {
+      if (result.err == 0) {
+	op->delta_read_result.emplace(hoid, std::move(result.shards));
+      } else {
+	// nothing was pinned for this object, so reading it back without
+	// the cache is what a regular rmw would do as well
+	dout(10) << "parity delta read failed with " << result.err
+		 << ", falling back to full stripe rmw" << dendl;
+	op->parity_delta = false;
+	start_rmw_reads(op);
+      }
+      check_ops();
+    });
 
   return true;
 }
@@ -866,7 +1034,8 @@ bool ECCommon::RMWPipeline::try_reads_to_commit()
     written_set[i.first] = i.second.get_interval_set();
   }
   dout(20) << __func__ << ": written_set: " << written_set << dendl;
-  ceph_assert(written_set == op->plan.will_write);
+  // parity delta ops write only some of the shards and cache nothing
+  ceph_assert(op->parity_delta || written_set == op->plan.will_write);
 
   if (op->using_cache) {
     for (auto &&hpair: written) {
@@ -876,6 +1045,7 @@ bool ECCommon::RMWPipeline::try_reads_to_commit()
   }
   op->remote_read.clear();
   op->remote_read_result.clear();
+  op->delta_read_result.clear();
 
   ObjectStore::Transaction empty;
   bool should_write_local = false;
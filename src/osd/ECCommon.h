@@ -222,6 +222,11 @@ struct ECCommon {
   };
   friend std::ostream &operator<<(std::ostream &lhs, const ec_extent_t &rhs);
   using ec_extents_t = std::map<hobject_t, ec_extent_t>;
+  /// raw chunk contents by shard, keyed by chunk offset
+  struct ec_shard_extents_t {
+    int err;
+    std::map<int, extent_map> shards;
+  };
 
   virtual ~ECCommon() = default;
 
@@ -238,6 +243,14 @@ struct ECCommon {
     bool fast_read,
     GenContextURef<ec_extents_t &&> &&func) = 0;
 
+  /// Read the chunks of the given stripe aligned logical extents from
+  /// exactly the shards in shards, without reconstructing anything
+  virtual void objects_read_shards(
+    const hobject_t &hoid,
+    const extent_set &to_read,
+    const std::set<int> &shards,
+    GenContextURef<ec_shard_extents_t &&> &&func) = 0;
+
   struct read_request_t {
     const std::list<ec_align_t> to_read;
     std::map<pg_shard_t, std::vector<std::pair<int, int>>> need;
@@ -383,6 +396,12 @@ struct ECCommon {
       bool fast_read,
       GenContextURef<ec_extents_t &&> &&func);
 
+    void objects_read_shards(
+      const hobject_t &hoid,
+      const extent_set &to_read,
+      const std::set<int> &shards,
+      GenContextURef<ec_shard_extents_t &&> &&func);
+
     template <class F, class G>
     void filter_read_op(
       const OSDMapRef& osdmap,
@@ -548,14 +567,25 @@ struct ECCommon {
       bool requires_rmw() const { return !plan.to_read.empty(); }
       bool invalidates_cache() const { return plan.invalidates_cache; }
 
-      // must be true if requires_rmw(), must be false if invalidates_cache()
+      // must be true if requires_rmw() unless parity delta was chosen,
+      // must be false if invalidates_cache()
       bool using_cache = true;
 
       /// In progress read state;
       std::map<hobject_t,extent_set> pending_read; // subset already being read
       std::map<hobject_t,extent_set> remote_read;  // subset we must read
       std::map<hobject_t,extent_map> remote_read_result;
+
+      /// Updating parity from the delta of the data chunks written,
+      /// see should_use_parity_delta
+      bool parity_delta = false;
+      /// old contents of the chunks a parity delta op rewrites
+      std::map<hobject_t,std::map<int,extent_map>> delta_read_result;
+
       bool read_in_progress() const {
+        if (parity_delta) {
+          return delta_read_result.empty();
+        }
         return !remote_read.empty() && remote_read_result.empty();
       }
 
@@ -643,6 +673,8 @@ struct ECCommon {
     eversion_t completed_to;
     eversion_t committed_to;
     void start_rmw(OpRef op);
+    bool should_use_parity_delta(const Op &op);
+    void start_rmw_reads(Op *op);
     bool try_state_to_reads();
     bool try_reads_to_commit();
     bool try_finish_rmw();
@@ -676,6 +708,21 @@ struct ECCommon {
         ECCommon::ec_extents_t &&, Func>(
             std::forward<Func>(on_complete)));
     }
+    template <typename Func>
+    void objects_read_shards(
+      const hobject_t &hoid,
+      const extent_set &to_read,
+      const std::set<int> &shards,
+      Func &&on_complete
+    ) {
+      ec_backend.objects_read_shards(
+        hoid,
+        to_read,
+        shards,
+        make_gen_lambda_context<
+        ECCommon::ec_shard_extents_t &&, Func>(
+            std::forward<Func>(on_complete)));
+    }
     void handle_sub_write(
       pg_shard_t from,
       OpRequestRef msg,
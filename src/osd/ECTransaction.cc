@@ -94,6 +94,104 @@ static void encode_and_write(
   }
 }
 
+void ECTransaction::encode_delta_and_write(
+  pg_t pgid,
+  const hobject_t &oid,
+  const ECUtil::stripe_info_t &sinfo,
+  ErasureCodeInterfaceRef &ecimpl,
+  uint64_t offset,
+  uint64_t length,
+  const extent_map &to_write,
+  const map<int, extent_map> &old_chunks,
+  uint32_t flags,
+  map<shard_id_t, ObjectStore::Transaction> *transactions,
+  DoutPrefixProvider *dpp)
+{
+  ceph_assert(sinfo.logical_offset_is_stripe_aligned(offset));
+  ceph_assert(sinfo.logical_offset_is_stripe_aligned(length));
+  ceph_assert(length);
+
+  const uint64_t stripe_width = sinfo.get_stripe_width();
+  const uint64_t chunk_size = sinfo.get_chunk_size();
+  const uint64_t chunk_off = sinfo.aligned_logical_offset_to_chunk_offset(offset);
+  const uint64_t chunk_len = sinfo.aligned_logical_offset_to_chunk_offset(length);
+  auto get_old = [&](int shard) {
+    auto i = old_chunks.find(shard);
+    ceph_assert(i != old_chunks.end());
+    auto old = i->second.intersect(chunk_off, chunk_len);
+    ceph_assert(old.ext_count() == 1);
+    ceph_assert(old.begin().get_off() == chunk_off);
+    ceph_assert(old.begin().get_len() == chunk_len);
+    bufferlist bl = old.begin().get_val();
+    return bl;
+  };
+
+  // the delta stripes start out zero, so untouched data chunks encode
+  // to nothing
+  bufferptr delta(buffer::create_aligned(length, CEPH_PAGE_SIZE));
+  delta.zero();
+  set<int> coding;
+  map<int, bufferlist> buffers;
+  for (auto &&[shard, _] : old_chunks) {
+    const unsigned raw = sinfo.get_raw_shard(shard);
+    if (raw >= sinfo.get_k()) {
+      coding.insert(shard);
+      continue;
+    }
+    bufferlist old = get_old(shard);
+    bufferptr data(buffer::create_aligned(chunk_len, CEPH_PAGE_SIZE));
+    old.begin().copy(chunk_len, data.c_str());
+    for (uint64_t s = 0; s < chunk_len / chunk_size; ++s) {
+      const uint64_t chunk_start = offset + s * stripe_width + raw * chunk_size;
+      for (auto &&extent : to_write.intersect(chunk_start, chunk_size)) {
+	extent.get_val().begin().copy(
+	  extent.get_len(),
+	  data.c_str() + s * chunk_size + extent.get_off() - chunk_start);
+      }
+      const char *o = old.c_str() + s * chunk_size;
+      const char *n = data.c_str() + s * chunk_size;
+      char *d = delta.c_str() + s * stripe_width + raw * chunk_size;
+      for (uint64_t j = 0; j < chunk_size; ++j) {
+	d[j] = o[j] ^ n[j];
+      }
+    }
+    buffers[shard].append(std::move(data));
+  }
+
+  bufferlist delta_bl;
+  delta_bl.append(std::move(delta));
+  map<int, bufferlist> coding_delta;
+  int r = ECUtil::encode(sinfo, ecimpl, delta_bl, coding, &coding_delta);
+  ceph_assert(r == 0);
+  for (auto shard : coding) {
+    bufferlist old = get_old(shard);
+    bufferptr parity(buffer::create_aligned(chunk_len, CEPH_PAGE_SIZE));
+    const char *o = old.c_str();
+    const char *d = coding_delta[shard].c_str();
+    char *p = parity.c_str();
+    for (uint64_t j = 0; j < chunk_len; ++j) {
+      p[j] = o[j] ^ d[j];
+    }
+    buffers[shard].append(std::move(parity));
+  }
+
+  ldpp_dout(dpp, 20) << __func__ << ": " << oid
+		     << " " << offset << "~" << length
+		     << " writing shards " << coding << " and data shards of "
+		     << to_write << dendl;
+  for (auto &&[shard, bl] : buffers) {
+    auto t = transactions->find(shard_id_t(shard));
+    ceph_assert(t != transactions->end());
+    t->second.write(
+      coll_t(spg_t(pgid, t->first)),
+      ghobject_t(oid, ghobject_t::NO_GEN, t->first),
+      chunk_off,
+      bl.length(),
+      bl,
+      flags);
+  }
+}
+
 void ECTransaction::generate_transactions(
   PGTransaction* _t,
   WritePlan &plan,
@@ -101,6 +199,7 @@ void ECTransaction::generate_transactions(
   pg_t pgid,
   const ECUtil::stripe_info_t &sinfo,
   const map<hobject_t,extent_map> &partial_extents,
+  const map<hobject_t,map<int,extent_map>> &delta_extents,
   vector<pg_log_entry_t> &entries,
   map<hobject_t,extent_map> *written_map,
   map<shard_id_t, ObjectStore::Transaction> *transactions,
@@ -541,6 +640,57 @@ void ECTransaction::generate_transactions(
       for (unsigned i = 0; i < ecimpl->get_chunk_count(); ++i) {
 	want.insert(i);
       }
+      auto delta_iter = delta_extents.find(oid);
+      if (delta_iter != delta_extents.end()) {
+	// parity delta update: to_write holds just the new data, the
+	// stripes it lands in are the ones planned for writing
+	ceph_assert(to_write.intersect(append_after,
+	  std::numeric_limits<uint64_t>::max() - append_after).empty());
+	to_write = to_write.intersect(0, append_after);
+	auto &stripes = plan.will_write.at(oid);
+	for (auto &&extent : stripes) {
+	  ceph_assert(extent.first + extent.second <= append_after);
+	  if (entry) {
+	    uint64_t restore_from = sinfo.aligned_logical_offset_to_chunk_offset(
+	      extent.first);
+	    uint64_t restore_len = sinfo.aligned_logical_offset_to_chunk_offset(
+	      extent.second);
+	    ldpp_dout(dpp, 20) << "generate_transactions: delta overwriting "
+			       << restore_from << "~" << restore_len
+			       << dendl;
+	    if (rollback_extents.empty()) {
+	      for (auto &&st : *transactions) {
+		st.second.touch(
+		  coll_t(spg_t(pgid, st.first)),
+		  ghobject_t(oid, entry->version.version, st.first));
+	      }
+	    }
+	    rollback_extents.emplace_back(make_pair(restore_from, restore_len));
+	    for (auto &&st : *transactions) {
+	      st.second.clone_range(
+		coll_t(spg_t(pgid, st.first)),
+		ghobject_t(oid, ghobject_t::NO_GEN, st.first),
+		ghobject_t(oid, entry->version.version, st.first),
+		restore_from,
+		restore_len,
+		restore_from);
+	    }
+	  }
+	  encode_delta_and_write(
+	    pgid,
+	    oid,
+	    sinfo,
+	    ecimpl,
+	    extent.first,
+	    extent.second,
+	    to_write,
+	    delta_iter->second,
+	    fadvise_flags,
+	    transactions,
+	    dpp);
+	}
+	to_write.clear();
+      }
       auto to_overwrite = to_write.intersect(0, append_after);
       ldpp_dout(dpp, 20) << "generate_transactions: to_overwrite: "
 			 << to_overwrite
@@ -28,6 +28,12 @@ namespace ECTransaction {
     std::map<hobject_t,extent_set> will_write; // superset of to_read
 
     std::map<hobject_t,ECUtil::HashInfoRef> hash_infos;
+
+    /// For objects whose partial-stripe writes only overwrite existing
+    /// stripes: the data shards they touch plus every coding shard, the
+    /// shards a parity delta update would read and write instead of
+    /// whole stripes.  Only worth it when that is at most k shards.
+    std::map<hobject_t,std::set<int>> delta_shards;
   };
 
   template <typename F>
@@ -157,6 +163,33 @@ namespace ECTransaction {
 	  projected_size = truncating_to;
 	}
 
+	if (op.is_none() && !op.truncate && plan.to_read.count(obj) &&
+	    projected_size == orig_size) {
+	  std::set<int> shards;
+	  for (auto extent = raw_write_set.begin();
+	       extent != raw_write_set.end();
+	       ++extent) {
+	    const auto [left, right] =
+	      sinfo.offset_length_to_data_chunk_indices(
+		extent.get_start(), extent.get_len());
+	    for (uint64_t c = left;
+		 c < right && c < left + sinfo.get_k();
+		 ++c) {
+	      shards.insert(sinfo.get_shard(c % sinfo.get_k()));
+	    }
+	  }
+	  if (shards.size() + sinfo.get_m() <= sinfo.get_k()) {
+	    for (unsigned raw = sinfo.get_k();
+		 raw < sinfo.get_k_plus_m();
+		 ++raw) {
+	      shards.insert(sinfo.get_shard(raw));
+	    }
+	    ldpp_dout(dpp, 20) << __func__ << ": parity delta candidate, shards "
+			       << shards << dendl;
+	    plan.delta_shards[obj] = std::move(shards);
+	  }
+	}
+
 	ldpp_dout(dpp, 20) << __func__ << ": " << obj
 			   << " projected size "
 			   << projected_size
@@ -176,6 +209,23 @@ namespace ECTransaction {
     return plan;
   }
 
+  /// Overwrite the stripes in offset~length with the new data in to_write
+  /// by updating the coding chunks with the encoded delta of the data
+  /// chunks it touches.  old_chunks holds the current contents of those
+  /// data chunks and of every coding chunk, by shard and chunk offset.
+  void encode_delta_and_write(
+    pg_t pgid,
+    const hobject_t &oid,
+    const ECUtil::stripe_info_t &sinfo,
+    ceph::ErasureCodeInterfaceRef &ecimpl,
+    uint64_t offset,
+    uint64_t length,
+    const extent_map &to_write,
+    const std::map<int, extent_map> &old_chunks,
+    uint32_t flags,
+    std::map<shard_id_t, ceph::os::Transaction> *transactions,
+    DoutPrefixProvider *dpp);
+
   void generate_transactions(
     PGTransaction* _t,
     WritePlan &plan,
@@ -183,6 +233,7 @@ namespace ECTransaction {
     pg_t pgid,
     const ECUtil::stripe_info_t &sinfo,
     const std::map<hobject_t,extent_map> &partial_extents,
+    const std::map<hobject_t,std::map<int,extent_map>> &delta_extents,
     std::vector<pg_log_entry_t> &entries,
     std::map<hobject_t,extent_map> *written,
     std::map<shard_id_t, ceph::os::Transaction> *transactions,
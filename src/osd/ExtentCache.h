@@ -473,6 +473,11 @@ public:
     write_pin &pin,
     const extent_map &extents);
 
+  /// true if an in flight write still pins extents of oid
+  bool has_pinned_extents(const hobject_t &oid) {
+    return get_if_exists(oid) != nullptr;
+  }
+
   /**
    * Release all buffers pinned by pin
    */
@@ -230,6 +230,7 @@ CompatSet OSD::get_osd_compat_set() {
   CompatSet compat =  get_osd_initial_compat_set();
   //Any features here can be set in code, but not in initial superblock
   compat.incompat.insert(CEPH_OSD_FEATURE_INCOMPAT_SHARDS);
+  compat.incompat.insert(CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH);
   return compat;
 }
 
@@ -246,6 +247,7 @@ OSDService::OSDService(OSD *osd, ceph::async::io_context_pool& poolctx) :
   monc(osd->monc),
   osd_max_object_size(cct->_conf, "osd_max_object_size"),
   osd_skip_data_digest(cct->_conf, "osd_skip_data_digest"),
+  osd_read_fast_path(cct->_conf, "osd_read_fast_path"),
   publish_lock{ceph::make_mutex("OSDService::publish_lock")},
   pre_publish_lock{ceph::make_mutex("OSDService::pre_publish_lock")},
   m_osd_scrub{cct, *this, cct->_conf},
@@ -8859,6 +8861,23 @@ void OSD::check_osdmap_features()
     }
   }
 
+  if (superblock.compat_features.incompat.contains(
+	CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH)) {
+    service.pg_log_dup_batches = true;
+  } else if (osdmap->require_osd_release >= ceph_release_t::squid) {
+    dout(0) << __func__ << " enabling on-disk PGLOG DUP BATCH compat feature" << dendl;
+    superblock.compat_features.incompat.insert(
+      CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH);
+    ObjectStore::Transaction t;
+    write_superblock(cct, superblock, t);
+    // older OSDs must refuse the store before a pg log holds a batch
+    t.register_on_commit(new LambdaContext([this](int) {
+      service.pg_log_dup_batches = true;
+    }));
+    int err = store->queue_transaction(service.meta_ch, std::move(t), NULL);
+    ceph_assert(err == 0);
+  }
+
   if (osdmap->require_osd_release < ceph_release_t::nautilus) {
     hb_front_server_messenger->set_require_authorizer(false);
     hb_back_server_messenger->set_require_authorizer(false);
@@ -11024,6 +11043,31 @@ OSDShard::OSDShard(
     context_queue(sdata_wait_lock, sdata_cond)
 {
   dout(0) << "using op scheduler " << *scheduler << dendl;
+  perf = build_osd_shard_perf(
+    cct, ceph::perf_counters::key_create(
+      "osd_shard", {{"shard", stringify(id)}}));
+  cct->get_perfcounters_collection()->add(perf);
+}
+
+OSDShard::~OSDShard()
+{
+  cct->get_perfcounters_collection()->remove(perf);
+  delete perf;
+}
+
+void OSDShard::_drain_ingress()
+{
+  ceph_assert(ceph_mutex_is_locked_by_me(shard_lock));
+  auto now = ceph::mono_clock::now();
+  unsigned n = ingress.drain(
+    [this, now](ceph::osd::scheduler::OpSchedulerItem&& item,
+		ceph::mono_time stamp) {
+      perf->tinc(osd_shard_queue_lat, now - stamp);
+      scheduler->enqueue(std::move(item));
+    });
+  if (n) {
+    perf->inc(osd_shard_ingress_batch, n);
+  }
 }
 
 
@@ -11071,19 +11115,27 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 
   // peek at spg_t
   sdata->shard_lock.lock();
+  sdata->_drain_ingress();
   if (sdata->scheduler->empty() &&
       (!is_smallest_thread_index || sdata->context_queue.empty())) {
     std::unique_lock wait_lock{sdata->sdata_wait_lock};
     if (is_smallest_thread_index && !sdata->context_queue.empty()) {
       // we raced with a context_queue addition, don't wait
       wait_lock.unlock();
+    } else if (!sdata->ingress.empty()) {
+      // we raced with an _enqueue, which doesn't take the shard_lock
+      wait_lock.unlock();
+      sdata->_drain_ingress();
     } else if (!sdata->stop_waiting) {
       dout(20) << __func__ << " empty q, waiting" << dendl;
       osd->cct->get_heartbeat_map()->clear_timeout(hb);
       sdata->shard_lock.unlock();
+      ++sdata->idle_threads;
       sdata->sdata_cond.wait(wait_lock);
+      --sdata->idle_threads;
       wait_lock.unlock();
       sdata->shard_lock.lock();
+      sdata->_drain_ingress();
       if (sdata->scheduler->empty() &&
          !(is_smallest_thread_index && !sdata->context_queue.empty())) {
 	sdata->shard_lock.unlock();
@@ -11107,6 +11159,7 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 
   WorkItem work_item;
   while (!std::get_if<OpSchedulerItem>(&work_item)) {
+    sdata->_drain_ingress();
     if (sdata->scheduler->empty()) {
       if (osd->is_stopping()) {
         sdata->shard_lock.unlock();
@@ -11409,16 +11462,13 @@ void OSD::ShardedOpWQ::_enqueue(OpSchedulerItem&& item) {
 
   dout(20) << fmt::format("{} {}", __func__, item) << dendl;
 
-  bool empty = true;
-  {
-    std::lock_guard l{sdata->shard_lock};
-    empty = sdata->scheduler->empty();
-    sdata->scheduler->enqueue(std::move(item));
-  }
+  // the shard's threads move it into the scheduler
+  bool empty = sdata->ingress.push(std::move(item));
 
   {
     std::lock_guard l{sdata->sdata_wait_lock};
-    if (empty) {
+    if (empty && sdata->idle_threads) {
+      // the scheduler ran dry and its threads went idle
       sdata->sdata_cond.notify_all();
     } else if (sdata->waiting_threads) {
       sdata->sdata_cond.notify_one();
@@ -11467,6 +11517,7 @@ void OSD::ShardedOpWQ::stop_for_fast_shutdown()
     auto& sdata = osd->shards[shard_index];
     ceph_assert(sdata);
     std::lock_guard l(sdata->shard_lock);
+    sdata->_drain_ingress();
     while (!sdata->scheduler->empty()) {
       sdata->scheduler->dequeue();
     }
@@ -117,6 +117,7 @@ public:
 
   md_config_cacher_t<Option::size_t> osd_max_object_size;
   md_config_cacher_t<bool> osd_skip_data_digest;
+  md_config_cacher_t<bool> osd_read_fast_path;
 
   void enqueue_back(OpSchedulerItem&& qi);
   void enqueue_front(OpSchedulerItem&& qi);
@@ -136,6 +137,9 @@ public:
 
   ceph::signedspan get_mnow() const;
 
+  /// pg logs may store dups in batch records, see PGLog
+  std::atomic<bool> pg_log_dup_batches = false;
+
 private:
   // -- superblock --
   ceph::mutex publish_lock, pre_publish_lock; // pre-publish orders before publish
@@ -981,6 +985,7 @@ struct OSDShard {
   ceph::mutex sdata_wait_lock;
   ceph::condition_variable sdata_cond;
   int waiting_threads = 0;
+  int idle_threads = 0;  ///< threads waiting for the scheduler to get work
 
   ceph::mutex osdmap_lock;  ///< protect shard_osdmap updates vs users w/o shard_lock
   OSDMapRef shard_osdmap;
@@ -990,6 +995,62 @@ struct OSDShard {
     return shard_osdmap;
   }
 
+  PerfCounters *perf = nullptr;
+
+  /// lock-free ingress for new items.  any number of threads push without
+  /// the shard_lock; the shard's threads move the items into the scheduler
+  /// (in push order) under the shard_lock before looking at it.
+  class Ingress {
+    struct Node {
+      ceph::osd::scheduler::OpSchedulerItem item;
+      ceph::mono_time stamp;  ///< when it was pushed
+      Node *next;
+    };
+    std::atomic<Node*> head = {nullptr};
+
+  public:
+    ~Ingress() {
+      drain([](ceph::osd::scheduler::OpSchedulerItem&&, ceph::mono_time) {});
+    }
+
+    /// @return true if the queue was empty
+    bool push(ceph::osd::scheduler::OpSchedulerItem&& item) {
+      Node *n = new Node{std::move(item), ceph::mono_clock::now(),
+			 head.load(std::memory_order_relaxed)};
+      while (!head.compare_exchange_weak(n->next, n,
+					 std::memory_order_release,
+					 std::memory_order_relaxed));
+      return n->next == nullptr;
+    }
+
+    bool empty() const {
+      return head.load(std::memory_order_acquire) == nullptr;
+    }
+
+    /// pass everything queued so far to f, oldest first, along with the
+    /// time each item was pushed
+    template <typename F>
+    unsigned drain(F&& f) {
+      Node *n = head.exchange(nullptr, std::memory_order_acquire);
+      Node *fifo = nullptr;
+      while (n) {
+	Node *next = n->next;
+	n->next = fifo;
+	fifo = n;
+	n = next;
+      }
+      unsigned count = 0;
+      while (fifo) {
+	Node *next = fifo->next;
+	f(std::move(fifo->item), fifo->stamp);
+	delete fifo;
+	fifo = next;
+	++count;
+      }
+      return count;
+    }
+  } ingress;
+
   std::string shard_lock_name;
   ceph::mutex shard_lock;   ///< protects remaining members below
 
@@ -1025,6 +1086,9 @@ struct OSDShard {
   void _attach_pg(OSDShardPGSlot *slot, PG *pg);
   void _detach_pg(OSDShardPGSlot *slot);
 
+  /// move items from the ingress queue into the scheduler
+  void _drain_ingress();
+
   void update_pg_epoch(OSDShardPGSlot *slot, epoch_t epoch);
   epoch_t get_min_pg_epoch();
   void wait_min_pg_epoch(epoch_t need);
@@ -1059,6 +1123,7 @@ struct OSDShard {
     OSD *osd,
     op_queue_type_t osd_op_queue,
     unsigned osd_op_queue_cut_off);
+  ~OSDShard();
 };
 
 class OSD : public Dispatcher,
@@ -1610,6 +1675,7 @@ protected:
 	ceph_assert(NULL != sdata);
 
 	std::scoped_lock l{sdata->shard_lock};
+	sdata->_drain_ingress();
 	f->open_object_section(queue_name);
 	sdata->scheduler->dump(*f);
 	f->close_section();
@@ -1621,6 +1687,9 @@ protected:
       auto &&sdata = osd->shards[shard_index];
       ceph_assert(sdata);
       std::lock_guard l(sdata->shard_lock);
+      if (!sdata->ingress.empty()) {
+	return false;
+      }
       if (thread_index < osd->num_shards) {
 	return sdata->scheduler->empty() && sdata->context_queue.empty();
       } else {
@@ -934,7 +934,8 @@ void PG::prepare_write(
     ceph_assert(ret == 0);
   }
   pglog.write_log_and_missing(
-    t, &km, coll, pgmeta_oid, pool.info.require_rollback());
+    t, &km, coll, pgmeta_oid, pool.info.require_rollback(),
+    osd->pg_log_dup_batches);
   if (!km.empty())
     t.omap_setkeys(coll, pgmeta_oid, km);
   if (!key_to_remove.empty())
@@ -19,11 +19,13 @@
 #include "include/unordered_map.h"
 #include "common/ceph_context.h"
 
+using std::list;
 using std::make_pair;
 using std::map;
 using std::ostream;
 using std::set;
 using std::string;
+using std::vector;
 
 using ceph::bufferlist;
 using ceph::decode;
@@ -48,8 +50,7 @@ void PGLog::IndexedLog::split_out_child(
 {
   unindex();
   *target = IndexedLog(pg_log_t::split_out_child(child_pgid, split_bits));
-  index();
-  target->index();
+  index(PGLOG_INDEXED_OBJECTS);
   reset_rollback_info_trimmed_to_riter();
 }
 
@@ -635,7 +636,8 @@ void PGLog::write_log_and_missing(
   map<string,bufferlist> *km,
   const coll_t& coll,
   const ghobject_t &log_oid,
-  bool require_rollback)
+  bool require_rollback,
+  bool batch_dups)
 {
   if (needs_write()) {
     dout(6) << "write_log_and_missing with: "
@@ -660,9 +662,11 @@ void PGLog::write_log_and_missing(
       dirty_to_dups,
       dirty_from_dups,
       write_from_dups,
+      batch_dups,
       &may_include_deletes_in_missing_dirty,
       (pg_log_debug ? &log_keys_debug : nullptr),
-      this);
+      this,
+      &legacy_dups_to);
     undirty();
   } else {
     dout(10) << "log is not dirty" << dendl;
@@ -677,6 +681,7 @@ void PGLog::write_log_and_missing_wo_missing(
     const coll_t& coll, const ghobject_t &log_oid,
     map<eversion_t, hobject_t> &divergent_priors,
     bool require_rollback,
+    bool batch_dups,
     const DoutPrefixProvider *dpp
     )
 {
@@ -684,7 +689,7 @@ void PGLog::write_log_and_missing_wo_missing(
     t, km, log, coll, log_oid,
     divergent_priors, eversion_t::max(), eversion_t(), eversion_t(),
     true, true, require_rollback,
-    eversion_t::max(), eversion_t(), eversion_t(), nullptr, dpp);
+    eversion_t::max(), eversion_t(), eversion_t(), batch_dups, nullptr, dpp);
 }
 
 // static
@@ -696,6 +701,7 @@ void PGLog::write_log_and_missing(
     const ghobject_t &log_oid,
     const pg_missing_tracker_t &missing,
     bool require_rollback,
+    bool batch_dups,
     bool *may_include_deletes_in_missing_dirty,
     const DoutPrefixProvider *dpp)
 {
@@ -711,9 +717,208 @@ void PGLog::write_log_and_missing(
     eversion_t::max(),
     eversion_t(),
     eversion_t(),
+    batch_dups,
     may_include_deletes_in_missing_dirty, nullptr, dpp);
 }
 
+// static
+string PGLog::get_dup_batch_key(const eversion_t &batch)
+{
+  return "dup_b" + batch.get_key_name();
+}
+
+// static
+void PGLog::encode_dup_batch(
+  const vector<const pg_log_dup_t*> &dups,
+  bufferlist &bl)
+{
+  ENCODE_START(1, 1, bl);
+  encode((uint32_t)dups.size(), bl);
+  for (auto dup : dups) {
+    encode(*dup, bl);
+  }
+  ENCODE_FINISH(bl);
+}
+
+// static
+void PGLog::decode_dup_batch(
+  bufferlist::const_iterator &bp,
+  list<pg_log_dup_t> *dups)
+{
+  DECODE_START(1, bp);
+  uint32_t n;
+  decode(n, bp);
+  while (n--) {
+    dups->emplace_back();
+    decode(dups->back(), bp);
+  }
+  DECODE_FINISH(bp);
+}
+
+// static
+eversion_t PGLog::merge_read_dups(
+  list<pg_log_dup_t> &dups,
+  list<pg_log_dup_t> &&batched_dups)
+{
+  if (!batched_dups.empty()) {
+    for (auto p = std::next(batched_dups.begin());
+	 p != batched_dups.end();
+	 ++p) {
+      ceph_assert(std::prev(p)->version <= p->version);
+    }
+    // a batch holds every dup of its window, so per-key dups from that
+    // window on are leftovers of a log written before batching
+    const auto& first = batched_dups.front().version;
+    while (!dups.empty() && dups.back().version >= first) {
+      dups.pop_back();
+    }
+  }
+  eversion_t legacy_to = dups.empty() ? eversion_t() : dups.back().version;
+  dups.splice(dups.end(), batched_dups);
+  return legacy_to;
+}
+
+// static
+void PGLog::_write_dups(
+  ObjectStore::Transaction& t,
+  map<string,bufferlist> *km,
+  set<string> *to_remove,
+  const pg_log_t &log,
+  const coll_t& coll, const ghobject_t &log_oid,
+  eversion_t dirty_to_dups,
+  eversion_t dirty_from_dups,
+  eversion_t write_from_dups,
+  const set<string> &trimmed_dups,
+  bool batch,
+  eversion_t *legacy_dups_to,
+  const DoutPrefixProvider *dpp)
+{
+  const eversion_t legacy_to =
+    legacy_dups_to ? *legacy_dups_to : eversion_t();
+  if (batch && legacy_to != eversion_t() && dirty_to_dups != eversion_t()) {
+    // rewriting the oldest dups as batches would leave per-key dups
+    // newer than them, which the reader would drop; convert it all
+    dirty_to_dups = eversion_t::max();
+  }
+
+  // batches whose record must be rewritten (or removed if empty)
+  set<eversion_t> dirty;
+  if (dirty_to_dups != eversion_t()) {
+    pg_log_dup_t min, dirty_to_dup;
+    dirty_to_dup.version = dirty_to_dups;
+    ldpp_dout(dpp, 10) << __func__ << " remove dups min=" << min.get_key_name()
+		       << " to dirty_to_dup=" << dirty_to_dup.get_key_name() << dendl;
+    t.omap_rmkeyrange(
+      coll, log_oid,
+      min.get_key_name(), dirty_to_dup.get_key_name());
+    if (batch) {
+      // the batch holding dirty_to_dups may also hold newer dups, it is
+      // rewritten below rather than removed
+      const eversion_t end = dirty_to_dups == eversion_t::max() ?
+	eversion_t::max() : get_dup_batch(dirty_to_dups);
+      t.omap_rmkeyrange(
+	coll, log_oid,
+	get_dup_batch_key(eversion_t()), get_dup_batch_key(end));
+      if (dirty_to_dups != eversion_t::max()) {
+	dirty.insert(end);
+      }
+    }
+    for (const auto& entry : log.dups) {
+      if (entry.version > dirty_to_dups)
+	break;
+      if (batch) {
+	dirty.insert(get_dup_batch(entry.version));
+      } else {
+	bufferlist bl;
+	encode(entry, bl);
+	(*km)[entry.get_key_name()] = std::move(bl);
+      }
+    }
+  }
+  if (dirty_to_dups != eversion_t::max() && dirty_from_dups != eversion_t::max()) {
+    pg_log_dup_t max, dirty_from_dup;
+    max.version = eversion_t::max();
+    dirty_from_dup.version = dirty_from_dups;
+    ldpp_dout(dpp, 10) << __func__ << " remove dups dirty_from_dup="
+		       << dirty_from_dup.get_key_name()
+		       << " to max=" << max.get_key_name() << dendl;
+    t.omap_rmkeyrange(
+      coll, log_oid,
+      dirty_from_dup.get_key_name(), max.get_key_name());
+    if (batch) {
+      t.omap_rmkeyrange(
+	coll, log_oid,
+	get_dup_batch_key(get_dup_batch(dirty_from_dups)),
+	get_dup_batch_key(eversion_t::max()));
+      dirty.insert(get_dup_batch(dirty_from_dups));
+    }
+  }
+  for (auto p = log.dups.rbegin();
+       p != log.dups.rend() &&
+	 (p->version >= dirty_from_dups || p->version >= write_from_dups) &&
+	 p->version >= dirty_to_dups;
+       ++p) {
+    if (batch) {
+      dirty.insert(get_dup_batch(p->version));
+    } else {
+      bufferlist bl;
+      encode(*p, bl);
+      (*km)[p->get_key_name()] = std::move(bl);
+    }
+  }
+
+  if (!batch) {
+    // not every OSD may read batches yet, each dup keeps its own key
+    to_remove->insert(trimmed_dups.begin(), trimmed_dups.end());
+    if (legacy_dups_to) {
+      *legacy_dups_to =
+	log.dups.empty() ? eversion_t() : log.dups.back().version;
+    }
+    return;
+  }
+
+  for (const auto& key : trimmed_dups) {
+    // "dup_" + eversion_t::get_key_name(), i.e. "%010u.%020llu"
+    eversion_t v(strtoul(key.c_str() + 4, nullptr, 10),
+		 strtoull(key.c_str() + 15, nullptr, 10));
+    if (v <= legacy_to) {
+      to_remove->insert(key);
+    }
+    if (legacy_to == eversion_t() ||
+	get_dup_batch(v) >= get_dup_batch(legacy_to)) {
+      dirty.insert(get_dup_batch(v));
+    }
+  }
+
+  ldpp_dout(dpp, 10) << __func__ << " log.dups.size()=" << log.dups.size()
+		     << " dirty batches=" << dirty.size() << dendl;
+  if (!dirty.empty()) {
+    map<eversion_t, vector<const pg_log_dup_t*>> batches;
+    for (auto b : dirty) {
+      batches[b];
+    }
+    for (auto p = log.dups.begin(); p != log.dups.end(); ++p) {
+      auto b = batches.find(get_dup_batch(p->version));
+      if (b != batches.end()) {
+	b->second.push_back(&*p);
+      }
+    }
+    for (auto& [b, dups] : batches) {
+      if (dups.empty()) {
+	to_remove->insert(get_dup_batch_key(b));
+	continue;
+      }
+      encode_dup_batch(dups, (*km)[get_dup_batch_key(b)]);
+    }
+  }
+
+  if (legacy_dups_to &&
+      (dirty_to_dups == eversion_t::max() ||
+       log.dups.empty() || log.dups.front().version > legacy_to)) {
+    *legacy_dups_to = eversion_t();
+  }
+}
+
 // static
 void PGLog::_write_log_and_missing_wo_missing(
   ObjectStore::Transaction& t,
@@ -730,6 +935,7 @@ void PGLog::_write_log_and_missing_wo_missing(
   eversion_t dirty_to_dups,
   eversion_t dirty_from_dups,
   eversion_t write_from_dups,
+  bool batch_dups,
   set<string> *log_keys_debug,
   const DoutPrefixProvider *dpp
   )
@@ -785,49 +991,13 @@ void PGLog::_write_log_and_missing_wo_missing(
 
   // process dups after log_keys_debug is filled, so dups do not
   // end up in that set
-  if (dirty_to_dups != eversion_t()) {
-    pg_log_dup_t min, dirty_to_dup;
-    dirty_to_dup.version = dirty_to_dups;
-    ldpp_dout(dpp, 10) << __func__ << " remove dups min=" << min.get_key_name()
-		       << " to dirty_to_dup=" << dirty_to_dup.get_key_name() << dendl;
-    t.omap_rmkeyrange(
-      coll, log_oid,
-      min.get_key_name(), dirty_to_dup.get_key_name());
-  }
-  if (dirty_to_dups != eversion_t::max() && dirty_from_dups != eversion_t::max()) {
-    pg_log_dup_t max, dirty_from_dup;
-    max.version = eversion_t::max();
-    dirty_from_dup.version = dirty_from_dups;
-    ldpp_dout(dpp, 10) << __func__ << " remove dups dirty_from_dup="
-		       << dirty_from_dup.get_key_name()
-		       << " to max=" << max.get_key_name() << dendl;
-    t.omap_rmkeyrange(
-      coll, log_oid,
-      dirty_from_dup.get_key_name(), max.get_key_name());
-  }
-
-  ldpp_dout(dpp, 10) << __func__ << " going to encode log.dups.size()="
-		     << log.dups.size() << dendl;
-  for (const auto& entry : log.dups) {
-    if (entry.version > dirty_to_dups)
-      break;
-    bufferlist bl;
-    encode(entry, bl);
-    (*km)[entry.get_key_name()] = std::move(bl);
-  }
-  ldpp_dout(dpp, 10) << __func__ << " 1st round encoded log.dups.size()="
-		     << log.dups.size() << dendl;
-  for (auto p = log.dups.rbegin();
-       p != log.dups.rend() &&
-	 (p->version >= dirty_from_dups || p->version >= write_from_dups) &&
-	 p->version >= dirty_to_dups;
-       ++p) {
-    bufferlist bl;
-    encode(*p, bl);
-    (*km)[p->get_key_name()] = std::move(bl);
+  set<string> to_remove;
+  _write_dups(t, km, &to_remove, log, coll, log_oid,
+	      dirty_to_dups, dirty_from_dups, write_from_dups,
+	      set<string>(), batch_dups, nullptr, dpp);
+  if (!to_remove.empty()) {
+    t.omap_rmkeys(coll, log_oid, to_remove);
   }
-  ldpp_dout(dpp, 10) << __func__ << " 2st round encoded log.dups.size()="
-		     << log.dups.size() << dendl;
 
   if (dirty_divergent_priors) {
     ldpp_dout(dpp, 10) << "write_log_and_missing: writing divergent_priors"
@@ -863,9 +1033,11 @@ void PGLog::_write_log_and_missing(
   eversion_t dirty_to_dups,
   eversion_t dirty_from_dups,
   eversion_t write_from_dups,
+  bool batch_dups,
   bool *may_include_deletes_in_missing_dirty, // in/out param
   set<string> *log_keys_debug,
-  const DoutPrefixProvider *dpp
+  const DoutPrefixProvider *dpp,
+  eversion_t *legacy_dups_to
   ) {
   ldpp_dout(dpp, 10) << __func__ << " clearing up to " << dirty_to
 		     << " dirty_to_dups=" << dirty_to_dups
@@ -873,7 +1045,6 @@ void PGLog::_write_log_and_missing(
 		     << " write_from_dups=" << write_from_dups
 		     << " trimmed_dups.size()=" << trimmed_dups.size() << dendl;
   set<string> to_remove;
-  to_remove.swap(trimmed_dups);
   for (auto& t : trimmed) {
     string key = t.get_key_name();
     if (log_keys_debug) {
@@ -933,50 +1104,9 @@ void PGLog::_write_log_and_missing(
 
   // process dups after log_keys_debug is filled, so dups do not
   // end up in that set
-  if (dirty_to_dups != eversion_t()) {
-    pg_log_dup_t min, dirty_to_dup;
-    dirty_to_dup.version = dirty_to_dups;
-    ldpp_dout(dpp, 10) << __func__ << " remove dups min=" << min.get_key_name()
-		       << " to dirty_to_dup=" << dirty_to_dup.get_key_name() << dendl;
-    t.omap_rmkeyrange(
-      coll, log_oid,
-      min.get_key_name(), dirty_to_dup.get_key_name());
-  }
-  if (dirty_to_dups != eversion_t::max() && dirty_from_dups != eversion_t::max()) {
-    pg_log_dup_t max, dirty_from_dup;
-    max.version = eversion_t::max();
-    dirty_from_dup.version = dirty_from_dups;
-    ldpp_dout(dpp, 10) << __func__ << " remove dups dirty_from_dup="
-		       << dirty_from_dup.get_key_name()
-		       << " to max=" << max.get_key_name() << dendl;
-    t.omap_rmkeyrange(
-      coll, log_oid,
-      dirty_from_dup.get_key_name(), max.get_key_name());
-  }
-
-  ldpp_dout(dpp, 10) << __func__ << " going to encode log.dups.size()="
-		     << log.dups.size() << dendl;
-  for (const auto& entry : log.dups) {
-    if (entry.version > dirty_to_dups)
-      break;
-    bufferlist bl;
-    encode(entry, bl);
-    (*km)[entry.get_key_name()] = std::move(bl);
-  }
-  ldpp_dout(dpp, 10) << __func__ << " 1st round encoded log.dups.size()="
-		     << log.dups.size() << dendl;
-
-  for (auto p = log.dups.rbegin();
-       p != log.dups.rend() &&
-	 (p->version >= dirty_from_dups || p->version >= write_from_dups) &&
-	 p->version >= dirty_to_dups;
-       ++p) {
-    bufferlist bl;
-    encode(*p, bl);
-    (*km)[p->get_key_name()] = std::move(bl);
-  }
-  ldpp_dout(dpp, 10) << __func__ << " 2st round encoded log.dups.size()="
-		     << log.dups.size() << dendl;
+  _write_dups(t, km, &to_remove, log, coll, log_oid,
+	      dirty_to_dups, dirty_from_dups, write_from_dups,
+	      trimmed_dups, batch_dups, legacy_dups_to, dpp);
 
   if (clear_divergent_priors) {
     ldpp_dout(dpp, 10) << "write_log_and_missing: writing divergent_priors"
@@ -1081,6 +1211,7 @@ namespace {
     std::set<std::string>* log_keys_debug = NULL;
     pg_missing_tracker_t &missing;
     const DoutPrefixProvider *dpp;
+    eversion_t *legacy_dups_to;
 
     eversion_t on_disk_can_rollback_to;
     eversion_t on_disk_rollback_info_trimmed_to;
@@ -1089,6 +1220,7 @@ namespace {
     bool must_rebuild = false;
     std::list<pg_log_entry_t> entries;
     std::list<pg_log_dup_t> dups;
+    std::list<pg_log_dup_t> batched_dups;
 
     std::optional<std::string> next;
 
@@ -1118,6 +1250,8 @@ namespace {
           ceph_assert(missing.may_include_deletes);
         }
         missing.add(oid, std::move(item));
+      } else if (PGLog::is_dup_batch_key(key)) {
+        PGLog::decode_dup_batch(bp, &batched_dups);
       } else if (key.substr(0, 4) == std::string("dup_")) {
         pg_log_dup_t dup;
         decode(dup, bp);
@@ -1172,6 +1306,11 @@ namespace {
               assert(on_disk_rollback_info_trimmed_to == eversion_t());
               on_disk_rollback_info_trimmed_to = info.last_update;
             }
+            eversion_t legacy_to = PGLog::merge_read_dups(
+              dups, std::move(batched_dups));
+            if (legacy_dups_to) {
+              *legacy_dups_to = legacy_to;
+            }
             log = PGLog::IndexedLog(
                  info.last_update,
                  info.log_tail,
@@ -1193,14 +1332,15 @@ seastar::future<> PGLog::read_log_and_missing_crimson(
   std::set<std::string>* log_keys_debug,
   pg_missing_tracker_t &missing,
   ghobject_t pgmeta_oid,
-  const DoutPrefixProvider *dpp)
+  const DoutPrefixProvider *dpp,
+  eversion_t *legacy_dups_to)
 {
   ldpp_dout(dpp, 20) << "read_log_and_missing coll "
                      << ch->get_cid()
                      << " " << pgmeta_oid << dendl;
   return seastar::do_with(FuturizedShardStoreLogReader{
       store, info, log, log_keys_debug,
-      missing, dpp},
+      missing, dpp, legacy_dups_to},
     [ch, pgmeta_oid](FuturizedShardStoreLogReader& reader) {
     return reader.read(ch, pgmeta_oid);
   });
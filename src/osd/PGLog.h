@@ -17,6 +17,9 @@
 #pragma once
 
 // re-include our assert to clobber boost's
+#include <boost/unordered/unordered_flat_map.hpp>
+#include <boost/unordered/unordered_flat_set.hpp>
+
 #include "include/ceph_assert.h"
 #include "include/common_fwd.h"
 #include "osd_types.h"
@@ -66,6 +69,19 @@
  *
  *   version: 3100 2101 2100 101 [ pg log entries ] [ pg log dups ]
  *
+ * On disk each log entry has its own omap key, while dups are batched:
+ * all dups of one epoch whose version falls in the same
+ * PGLOG_DUP_BATCH_SPAN wide window share one "dup_b<epoch>.<window>"
+ * key, so trimming rewrites or drops a few batches instead of touching
+ * one key per dup.  Keying on the epoch too keeps the batches in
+ * eversion order after a PG merge interleaves versions from different
+ * epochs.  Older releases
+ * cannot read batches, so they are only written once the OSD has set
+ * CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH (see
+ * OSD::check_osdmap_features()); until then each dup keeps its own
+ * "dup_<version>" key.  Such keys are still read, and are removed as
+ * they are trimmed or the log is rewritten.
+ *
  * (3) means tracking the previous state of an object, so that we can
  * rollback to that prior state if necessary. It's only used for
  * erasure coding. Consider an erasure code of 4+2, for example.
@@ -112,6 +128,9 @@ constexpr auto PGLOG_INDEXED_ALL              = PGLOG_INDEXED_OBJECTS
                                               | PGLOG_INDEXED_EXTRA_CALLER_OPS 
                                               | PGLOG_INDEXED_DUPS;
 
+/// number of consecutive versions of an epoch whose dups share one omap record
+constexpr uint64_t PGLOG_DUP_BATCH_SPAN = 64;
+
 struct PGLog : DoutPrefixProvider {
   std::ostream& gen_prefix(std::ostream& out) const override {
     return out;
@@ -145,11 +164,46 @@ public:
    * IndexLog - adds in-memory index of the log, by oid.
    * plus some methods to manipulate it all.
    */
+  /**
+   * The indexes below are open-addressing tables charged to the
+   * osd_pglog mempool.  The object index holds only entry pointers and
+   * is keyed by the entry's own soid, so an indexed object costs a
+   * pointer rather than a second copy of its hobject_t.
+   */
+  struct entry_soid_hash {
+    using is_transparent = void;
+    size_t operator()(const hobject_t &oid) const {
+      return std::hash<hobject_t>()(oid);
+    }
+    size_t operator()(const pg_log_entry_t *e) const {
+      return (*this)(e->soid);
+    }
+  };
+  struct entry_soid_equal {
+    using is_transparent = void;
+    bool operator()(const pg_log_entry_t *l, const pg_log_entry_t *r) const {
+      return l->soid == r->soid;
+    }
+    bool operator()(const hobject_t &l, const pg_log_entry_t *r) const {
+      return l == r->soid;
+    }
+    bool operator()(const pg_log_entry_t *l, const hobject_t &r) const {
+      return l->soid == r;
+    }
+  };
+  using object_index_t = boost::unordered_flat_set<
+    pg_log_entry_t*, entry_soid_hash, entry_soid_equal,
+    mempool::osd_pglog::pool_allocator<pg_log_entry_t*>>;
+  template <typename T>
+  using reqid_index_t = boost::unordered_flat_map<
+    osd_reqid_t, T*, std::hash<osd_reqid_t>, std::equal_to<osd_reqid_t>,
+    mempool::osd_pglog::pool_allocator<std::pair<const osd_reqid_t, T*>>>;
+
   struct IndexedLog : public pg_log_t {
-    mutable ceph::unordered_map<hobject_t,pg_log_entry_t*> objects;  // ptrs into log.  be careful!
-    mutable ceph::unordered_map<osd_reqid_t,pg_log_entry_t*> caller_ops;
+    mutable object_index_t objects;  // ptrs into log.  be careful!
+    mutable reqid_index_t<pg_log_entry_t> caller_ops;
     mutable ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*> extra_caller_ops;
-    mutable ceph::unordered_map<osd_reqid_t,pg_log_dup_t*> dup_index;
+    mutable reqid_index_t<pg_log_dup_t> dup_index;
 
     // recovery pointers
     std::list<pg_log_entry_t>::iterator complete_to; // not inclusive of referenced item
@@ -219,7 +273,9 @@ public:
       rollback_info_trimmed_to_riter(log.rbegin())
     {
       reset_rollback_info_trimmed_to_riter();
-      index();
+      // caller_ops and dups are only needed for dup detection on the
+      // primary; get_request() and logged_req() build them on demand
+      index(PGLOG_INDEXED_OBJECTS);
     }
 
     IndexedLog(const IndexedLog &rhs) :
@@ -260,7 +316,7 @@ public:
 
     mempool::osd_pglog::list<pg_log_entry_t> rewind_from_head(eversion_t newhead) {
       auto divergent = pg_log_t::rewind_from_head(newhead);
-      index();
+      index(indexed_data | PGLOG_INDEXED_OBJECTS);
       reset_rollback_info_trimmed_to_riter();
       return divergent;
     }
@@ -289,7 +345,7 @@ public:
       *this = IndexedLog(o);
 
       skip_can_rollback_to_to_head();
-      index();
+      index(PGLOG_INDEXED_OBJECTS);
     }
 
     void split_out_child(
@@ -349,8 +405,7 @@ public:
       if (!(indexed_data & PGLOG_INDEXED_CALLER_OPS)) {
         index_caller_ops();
       }
-      auto p = caller_ops.find(r);
-      if (p != caller_ops.end()) {
+      if (auto p = caller_ops.find(r); p != caller_ops.end()) {
 	*version = p->second->version;
 	*user_version = p->second->user_version;
 	*return_code = p->second->return_code;
@@ -363,7 +418,7 @@ public:
       if (!(indexed_data & PGLOG_INDEXED_EXTRA_CALLER_OPS)) {
         index_extra_caller_ops();
       }
-      p = extra_caller_ops.find(r);
+      auto p = extra_caller_ops.find(r);
       if (p != extra_caller_ops.end()) {
 	uint32_t idx = 0;
 	for (auto i = p->second->extra_reqids.begin();
@@ -458,6 +513,7 @@ public:
 	extra_caller_ops.clear();
       if (to_index & PGLOG_INDEXED_DUPS) {
 	dup_index.clear();
+	dup_index.reserve(dups.size());
 	for (auto& i : dups) {
 	  dup_index[i.reqid] = const_cast<pg_log_dup_t*>(&i);
 	}
@@ -469,10 +525,14 @@ public:
 	PGLOG_INDEXED_EXTRA_CALLER_OPS;
 
       if (to_index & any_log_entry_index) {
+	if (to_index & PGLOG_INDEXED_OBJECTS)
+	  objects.reserve(log.size());
+	if (to_index & PGLOG_INDEXED_CALLER_OPS)
+	  caller_ops.reserve(log.size());
 	for (auto i = log.begin(); i != log.end(); ++i) {
 	  if (to_index & PGLOG_INDEXED_OBJECTS) {
 	    if (i->object_is_indexed()) {
-	      objects[i->soid] = const_cast<pg_log_entry_t*>(&(*i));
+	      set_object(const_cast<pg_log_entry_t*>(&(*i)));
 	    }
 	  }
 
@@ -500,6 +560,22 @@ public:
       index(PGLOG_INDEXED_OBJECTS);
     }
 
+    /// point the object index for e->soid at e
+    void set_object(pg_log_entry_t *e) const {
+      auto [it, inserted] = objects.insert(e);
+      if (!inserted) {
+	// the key is the entry's soid, so swap the element itself
+	objects.erase(it);
+	objects.insert(e);
+      }
+    }
+
+    /// latest indexed entry for oid, or nullptr
+    pg_log_entry_t *get_object_entry(const hobject_t &oid) const {
+      auto it = objects.find(oid);
+      return it == objects.end() ? nullptr : *it;
+    }
+
     void index_caller_ops() const {
       index(PGLOG_INDEXED_CALLER_OPS);
     }
@@ -514,9 +590,9 @@ public:
 
     void index(pg_log_entry_t& e) {
       if ((indexed_data & PGLOG_INDEXED_OBJECTS) && e.object_is_indexed()) {
-        if (objects.count(e.soid) == 0 ||
-            objects[e.soid]->version < e.version)
-          objects[e.soid] = &e;
+        auto it = objects.find(e.soid);
+        if (it == objects.end() || (*it)->version < e.version)
+          set_object(&e);
       }
       if (indexed_data & PGLOG_INDEXED_CALLER_OPS) {
 	// divergent merge_log indexes new before unindexing old
@@ -545,7 +621,7 @@ public:
       // NOTE: this only works if we remove from the _tail_ of the log!
       if (indexed_data & PGLOG_INDEXED_OBJECTS) {
 	auto it = objects.find(e.soid);
-        if (it != objects.end() && it->second->version == e.version)
+        if (it != objects.end() && (*it)->version == e.version)
           objects.erase(it);
       }
       if (e.reqid_is_indexed()) {
@@ -609,7 +685,7 @@ public:
 
       // to our index
       if ((indexed_data & PGLOG_INDEXED_OBJECTS) && e.object_is_indexed()) {
-        objects[e.soid] = &(log.back());
+        set_object(&(log.back()));
       }
       if (indexed_data & PGLOG_INDEXED_CALLER_OPS) {
         if (e.reqid_is_indexed()) {
@@ -655,6 +731,7 @@ protected:
   eversion_t dirty_from_dups;  ///< must clear/writeout all dups >= dirty_from_dups
   eversion_t write_from_dups;  ///< must write keys >= write_from_dups
   std::set<std::string> trimmed_dups;    ///< must clear keys in trimmed_dups
+  eversion_t legacy_dups_to;   ///< newest dup still stored under its own key
   CephContext *cct;
   bool pg_log_debug;
   /// Log is clean on [dirty_to, dirty_from)
@@ -1051,20 +1128,20 @@ protected:
 		       << " last_divergent_update: " << last_divergent_update
 		       << dendl;
 
-    auto objiter = log.objects.find(hoid);
-    if (objiter != log.objects.end() &&
-	objiter->second->version >= first_divergent_update) {
+    auto latest = log.get_object_entry(hoid);
+    if (latest &&
+	latest->version >= first_divergent_update) {
       /// Case 1)
       ldpp_dout(dpp, 10) << __func__ << ": more recent entry found: "
-			 << *objiter->second << ", already merged" << dendl;
+			 << *latest << ", already merged" << dendl;
 
-      ceph_assert(objiter->second->version > last_divergent_update);
+      ceph_assert(latest->version > last_divergent_update);
 
       // ensure missing has been updated appropriately
-      if (objiter->second->is_update() ||
-	  (missing.may_include_deletes && objiter->second->is_delete())) {
+      if (latest->is_update() ||
+	  (missing.may_include_deletes && latest->is_delete())) {
 	ceph_assert(missing.is_missing(hoid) &&
-	       missing.get_items().at(hoid).need == objiter->second->version);
+	       missing.get_items().at(hoid).need == latest->version);
       } else {
 	ceph_assert(!missing.is_missing(hoid));
       }
@@ -1326,7 +1403,8 @@ public:
     std::map<std::string,ceph::buffer::list> *km,
     const coll_t& coll,
     const ghobject_t &log_oid,
-    bool require_rollback);
+    bool require_rollback,
+    bool batch_dups);
 
   static void write_log_and_missing_wo_missing(
     ObjectStore::Transaction& t,
@@ -1335,6 +1413,7 @@ public:
     const coll_t& coll,
     const ghobject_t &log_oid, std::map<eversion_t, hobject_t> &divergent_priors,
     bool require_rollback,
+    bool batch_dups,
     const DoutPrefixProvider *dpp = nullptr);
 
   static void write_log_and_missing(
@@ -1345,9 +1424,46 @@ public:
     const ghobject_t &log_oid,
     const pg_missing_tracker_t &missing,
     bool require_rollback,
+    bool batch_dups,
     bool *rebuilt_missing_set_with_deletes,
     const DoutPrefixProvider *dpp = nullptr);
 
+  static std::string get_dup_batch_key(const eversion_t &batch);
+  /// the batch a dup belongs to: its epoch and the start of its version
+  /// window, so batch keys sort in eversion order even when a merged log
+  /// holds dups whose versions go backwards as the epoch rises
+  static eversion_t get_dup_batch(const eversion_t &v) {
+    return eversion_t(v.epoch, v.version - v.version % PGLOG_DUP_BATCH_SPAN);
+  }
+  static bool is_dup_batch_key(const std::string &key) {
+    return key.compare(0, 5, "dup_b") == 0;
+  }
+  static void encode_dup_batch(
+    const std::vector<const pg_log_dup_t*> &dups,
+    ceph::buffer::list &bl);
+  static void decode_dup_batch(
+    ceph::buffer::list::const_iterator &bp,
+    std::list<pg_log_dup_t> *dups);
+  /// append the batched dups read from disk to the per-key (legacy) ones,
+  /// returning the newest legacy dup that is still in use
+  static eversion_t merge_read_dups(
+    std::list<pg_log_dup_t> &dups,
+    std::list<pg_log_dup_t> &&batched_dups);
+
+  static void _write_dups(
+    ObjectStore::Transaction& t,
+    std::map<std::string,ceph::buffer::list>* km,
+    std::set<std::string> *to_remove,
+    const pg_log_t &log,
+    const coll_t& coll, const ghobject_t &log_oid,
+    eversion_t dirty_to_dups,
+    eversion_t dirty_from_dups,
+    eversion_t write_from_dups,
+    const std::set<std::string> &trimmed_dups,
+    bool batch,
+    eversion_t *legacy_dups_to,
+    const DoutPrefixProvider *dpp);
+
   static void _write_log_and_missing_wo_missing(
     ObjectStore::Transaction& t,
     std::map<std::string,ceph::buffer::list>* km,
@@ -1363,6 +1479,7 @@ public:
     eversion_t dirty_to_dups,
     eversion_t dirty_from_dups,
     eversion_t write_from_dups,
+    bool batch_dups,
     std::set<std::string> *log_keys_debug,
     const DoutPrefixProvider *dpp = nullptr
     );
@@ -1384,9 +1501,11 @@ public:
     eversion_t dirty_to_dups,
     eversion_t dirty_from_dups,
     eversion_t write_from_dups,
+    bool batch_dups,
     bool *may_include_deletes_in_missing_dirty,
     std::set<std::string> *log_keys_debug,
-    const DoutPrefixProvider *dpp = nullptr
+    const DoutPrefixProvider *dpp = nullptr,
+    eversion_t *legacy_dups_to = nullptr
     );
 
   void read_log_and_missing(
@@ -1405,7 +1524,8 @@ public:
       &clear_divergent_priors,
       this,
       (pg_log_debug ? &log_keys_debug : nullptr),
-      debug_verify_stored_missing);
+      debug_verify_stored_missing,
+      &legacy_dups_to);
   }
 
   template <typename missing_type>
@@ -1422,7 +1542,8 @@ public:
     bool *clear_divergent_priors = nullptr,
     const DoutPrefixProvider *dpp = nullptr,
     std::set<std::string> *log_keys_debug = nullptr,
-    bool debug_verify_stored_missing = false
+    bool debug_verify_stored_missing = false,
+    eversion_t *legacy_dups_to = nullptr
     ) {
     ldpp_dout(dpp, 10) << "read_log_and_missing coll " << ch->cid
 		       << " " << pgmeta_oid << dendl;
@@ -1444,6 +1565,7 @@ public:
     missing.may_include_deletes = false;
     std::list<pg_log_entry_t> entries;
     std::list<pg_log_dup_t> dups;
+    std::list<pg_log_dup_t> batched_dups;
     const auto NUM_DUPS_WARN_THRESHOLD = 2*cct->_conf->osd_pg_log_dups_tracked;
     if (p) {
       using ceph::decode;
@@ -1475,6 +1597,10 @@ public:
 	    ceph_assert(missing.may_include_deletes);
 	  }
 	  missing.add(oid, std::move(item));
+	} else if (is_dup_batch_key(p->key())) {
+	  auto n = batched_dups.size();
+	  decode_dup_batch(bp, &batched_dups);
+	  total_dups += batched_dups.size() - n;
 	} else if (p->key().substr(0, 4) == std::string("dup_")) {
 	  ++total_dups;
 	  pg_log_dup_t dup;
@@ -1511,6 +1637,11 @@ public:
       assert(on_disk_rollback_info_trimmed_to == eversion_t());
       on_disk_rollback_info_trimmed_to = info.last_update;
     }
+    {
+      eversion_t legacy_to = merge_read_dups(dups, std::move(batched_dups));
+      if (legacy_dups_to)
+	*legacy_dups_to = legacy_to;
+    }
     log = IndexedLog(
       info.last_update,
       info.log_tail,
@@ -1684,7 +1815,7 @@ public:
     return read_log_and_missing_crimson(
       store, ch, info,
       log, (pg_log_debug ? &log_keys_debug : nullptr),
-      missing, pgmeta_oid, this);
+      missing, pgmeta_oid, this, &legacy_dups_to);
   }
 
   static seastar::future<> read_log_and_missing_crimson(
@@ -1695,7 +1826,8 @@ public:
     std::set<std::string>* log_keys_debug,
     pg_missing_tracker_t &missing,
     ghobject_t pgmeta_oid,
-    const DoutPrefixProvider *dpp = nullptr);
+    const DoutPrefixProvider *dpp = nullptr,
+    eversion_t *legacy_dups_to = nullptr);
 
 #endif
 
@@ -20,6 +20,7 @@
 #include <sstream>
 #include <utility>
 
+#include <boost/container/small_vector.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -427,7 +428,7 @@ void PrimaryLogPG::on_local_recover(
   if (!is_delete && recovery_state.get_pg_log().get_missing().is_missing(recovery_info.soid) &&
       recovery_state.get_pg_log().get_missing().get_items().find(recovery_info.soid)->second.need > recovery_info.version) {
     ceph_assert(is_primary());
-    const pg_log_entry_t *latest = recovery_state.get_pg_log().get_log().objects.find(recovery_info.soid)->second;
+    const pg_log_entry_t *latest = recovery_state.get_pg_log().get_log().get_object_entry(recovery_info.soid);
     if (latest->op == pg_log_entry_t::LOST_REVERT &&
 	latest->reverting_to == recovery_info.version) {
       dout(10) << " got old revert version " << recovery_info.version
@@ -2462,6 +2463,10 @@ void PrimaryLogPG::do_op(OpRequestRef& op)
 
   dout(25) << __func__ << " oi " << obc->obs.oi << dendl;
 
+  if (r == 0 && maybe_do_fast_read(op, obc)) {
+    return;
+  }
+
   OpContext *ctx = new OpContext(op, m->get_reqid(), &m->ops, obc, this);
 
   if (m->has_flag(CEPH_OSD_FLAG_SKIPRWLOCKS)) {
@@ -2542,6 +2547,211 @@ void PrimaryLogPG::do_op(OpRequestRef& op)
   maybe_force_recovery();
 }
 
+// Clamp the length of a READ or SPARSE_READ to the object size, or to
+// the truncate size when the client has seen a newer truncate than the
+// object.  A READ of length 0 reads the whole object.  Returns true if
+// the length was trimmed.
+static bool trim_read_extent(const object_info_t& oi,
+			     const ceph_osd_op& op,
+			     uint64_t *length)
+{
+  uint64_t size = oi.size;
+  // are we beyond truncate_size?
+  if ((oi.truncate_seq < op.extent.truncate_seq) &&
+      (op.extent.offset + op.extent.length > op.extent.truncate_size) &&
+      (size > op.extent.truncate_size)) {
+    size = op.extent.truncate_size;
+  }
+
+  *length = op.extent.length;
+  if (op.op == CEPH_OSD_OP_READ && *length == 0) {
+    // length is zero mean read the whole object
+    *length = size;
+  }
+
+  if (op.extent.offset >= size) {
+    *length = 0;
+    return true;
+  } else if (op.extent.offset + *length > size) {
+    *length = size - op.extent.offset;
+    return true;
+  }
+  return false;
+}
+
+// If bl holds the whole object and the object has a data digest, check
+// it, optionally reporting a mismatch to the cluster log.  Returns -EIO
+// on a mismatch.
+int PrimaryLogPG::check_full_read_digest(const object_info_t& oi,
+					 const bufferlist& bl,
+					 bool report)
+{
+  if (bl.length() != oi.size || !oi.is_data_digest()) {
+    return 0;
+  }
+  uint32_t crc = bl.crc32c(-1);
+  if (oi.data_digest == crc) {
+    return 0;
+  }
+  if (report) {
+    osd->clog->error() << info.pgid << std::hex
+		       << " full-object read crc 0x" << crc
+		       << " != expected 0x" << oi.data_digest
+		       << std::dec << " on " << oi.soid;
+  }
+  return -EIO;
+}
+
+bool PrimaryLogPG::maybe_do_fast_read(OpRequestRef& op, ObjectContextRef& obc)
+{
+  MOSDOp *m = static_cast<MOSDOp*>(op->get_nonconst_req());
+  const object_info_t& oi = obc->obs.oi;
+  const hobject_t& soid = oi.soid;
+
+  if (!*osd->osd_read_fast_path ||
+      pool.info.is_erasure() ||
+      !op->may_read() || op->may_write() || op->may_cache() ||
+      op->rwordered() ||
+      m->get_snapid() != CEPH_NOSNAP ||
+      m->has_flag(CEPH_OSD_FLAG_SKIPRWLOCKS) ||
+      m->has_flag(CEPH_OSD_FLAG_FLUSH) ||
+      m->ops.empty() ||
+      !soid.is_head() ||
+      !obc->obs.exists ||
+      oi.is_whiteout() ||
+      oi.is_lost() ||
+      oi.has_manifest()) {
+    return false;
+  }
+  for (auto& osd_op : m->ops) {
+    switch (osd_op.op.op) {
+    case CEPH_OSD_OP_READ:
+    case CEPH_OSD_OP_SPARSE_READ:
+    case CEPH_OSD_OP_GETXATTR:
+      break;
+    default:
+      return false;
+    }
+  }
+
+  ObcLockManager lock_manager;
+  if (!lock_manager.try_get_read_lock(soid, obc)) {
+    return false;
+  }
+
+  dout(20) << __func__ << " " << soid << " " << m->ops << dendl;
+
+  // results are staged here so that a failed read leaves m->ops as
+  // do_osd_ops expects to find it
+  boost::container::small_vector<uint64_t, 4> lengths;
+  object_stat_sum_t delta_stats;
+  std::optional<uint64_t> data_off;
+  uint64_t bytes_read = 0;
+  int r = 0;
+  for (auto& osd_op : m->ops) {
+    auto& op = osd_op.op;
+    if (op.op == CEPH_OSD_OP_GETXATTR) {
+      string aname;
+      auto bp = osd_op.indata.cbegin();
+      bp.copy(op.xattr.name_len, aname);
+      r = getattr_maybe_cache(obc, "_" + aname, &osd_op.outdata);
+      if (r < 0) {
+	break;
+      }
+      lengths.push_back(osd_op.outdata.length());
+    } else {
+      uint64_t offset = op.extent.offset;
+      uint64_t length;
+      trim_read_extent(oi, op, &length);
+
+      if (op.op == CEPH_OSD_OP_READ) {
+	if (!data_off) {
+	  data_off = op.extent.offset;
+	}
+	if (length > 0) {
+	  r = pgbackend->objects_read_sync(
+	    soid, offset, length, op.flags, &osd_op.outdata);
+	  if (r < 0) {
+	    break;
+	  }
+	  // whole object with a bad digest: let the regular path report
+	  // and repair it
+	  if (offset == 0 &&
+	      check_full_read_digest(oi, osd_op.outdata, false) < 0) {
+	    r = -EIO;
+	    break;
+	  }
+	  length = r;
+	}
+	lengths.push_back(length);
+      } else {
+	map<uint64_t, uint64_t> extents;
+	r = osd->store->fiemap(ch, ghobject_t(soid, ghobject_t::NO_GEN,
+					      info.pgid.shard),
+			       offset, length, extents);
+	if (r < 0) {
+	  break;
+	}
+	bufferlist data_bl;
+	r = pgbackend->objects_readv_sync(soid, extents, op.flags, &data_bl);
+	if (r < 0) {
+	  break;
+	}
+	if (check_full_read_digest(oi, data_bl, false) < 0) {
+	  r = -EIO;
+	  break;
+	}
+	lengths.push_back(r);
+	encode(extents, osd_op.outdata);
+	::encode_destructively(data_bl, osd_op.outdata);
+      }
+    }
+    delta_stats.num_rd_kb += shift_round_up(lengths.back(), 10);
+    delta_stats.num_rd++;
+  }
+  release_object_locks(lock_manager);
+
+  if (r < 0) {
+    dout(10) << __func__ << " " << soid << " got " << cpp_strerror(r)
+	     << ", falling back to full op" << dendl;
+    for (auto& osd_op : m->ops) {
+      osd_op.outdata.clear();
+    }
+    return false;
+  }
+
+  op->mark_started();
+
+  auto length = lengths.begin();
+  for (auto& osd_op : m->ops) {
+    if (osd_op.op.op == CEPH_OSD_OP_GETXATTR) {
+      osd_op.op.xattr.value_len = *length++;
+    } else {
+      osd_op.op.extent.length = *length++;
+    }
+    osd_op.rval = 0;
+    bytes_read += osd_op.outdata.length();
+  }
+  unstable_stats.add(delta_stats);
+
+  MOSDOpReply *reply = new MOSDOpReply(m, 0, get_osdmap_epoch(), 0, false);
+  reply->get_header().data_off = data_off ? *data_off : 0;
+  reply->set_reply_versions(eversion_t(), oi.user_version);
+  reply->add_flags(CEPH_OSD_FLAG_ACK | CEPH_OSD_FLAG_ONDISK);
+
+  log_op_stats(*op, 0, bytes_read);
+  publish_stats_to_osd();
+  osd->logger->inc(l_osd_op_r_fast);
+
+  utime_t prepare_latency = ceph_clock_now();
+  prepare_latency -= op->get_dequeued_time();
+  osd->logger->tinc(l_osd_op_prepare_lat, prepare_latency);
+  osd->logger->tinc(l_osd_op_r_prepare_lat, prepare_latency);
+
+  osd->send_message_osd_client(reply, m->get_connection());
+  return true;
+}
+
 PrimaryLogPG::cache_result_t PrimaryLogPG::maybe_handle_manifest_detail(
   OpRequestRef op,
   bool write_ordered,
@@ -5832,31 +6042,15 @@ int PrimaryLogPG::do_read(OpContext *ctx, OSDOp& osd_op) {
   auto& op = osd_op.op;
   auto& oi = ctx->new_obs.oi;
   auto& soid = oi.soid;
-  __u32 seq = oi.truncate_seq;
-  uint64_t size = oi.size;
-  bool trimmed_read = false;
 
   dout(30) << __func__ << " oi.size: " << oi.size << dendl;
   dout(30) << __func__ << " oi.truncate_seq: " << oi.truncate_seq << dendl;
   dout(30) << __func__ << " op.extent.truncate_seq: " << op.extent.truncate_seq << dendl;
   dout(30) << __func__ << " op.extent.truncate_size: " << op.extent.truncate_size << dendl;
 
-  // are we beyond truncate_size?
-  if ( (seq < op.extent.truncate_seq) &&
-       (op.extent.offset + op.extent.length > op.extent.truncate_size) &&
-       (size > op.extent.truncate_size) )
-    size = op.extent.truncate_size;
-
-  if (op.extent.length == 0) //length is zero mean read the whole object
-    op.extent.length = size;
-
-  if (op.extent.offset >= size) {
-    op.extent.length = 0;
-    trimmed_read = true;
-  } else if (op.extent.offset + op.extent.length > size) {
-    op.extent.length = size - op.extent.offset;
-    trimmed_read = true;
-  }
+  uint64_t length;
+  bool trimmed_read = trim_read_extent(oi, op, &length);
+  op.extent.length = length;
 
   dout(30) << __func__ << "op.extent.length is now " << op.extent.length << dendl;
 
@@ -5892,15 +6086,8 @@ int PrimaryLogPG::do_read(OpContext *ctx, OSDOp& osd_op) {
       soid, op.extent.offset, op.extent.length, op.flags, &osd_op.outdata);
     // whole object?  can we verify the checksum?
     if (r >= 0 && op.extent.offset == 0 &&
-        (uint64_t)r == oi.size && oi.is_data_digest()) {
-      uint32_t crc = osd_op.outdata.crc32c(-1);
-      if (oi.data_digest != crc) {
-        osd->clog->error() << info.pgid << std::hex
-                           << " full-object read crc 0x" << crc
-                           << " != expected 0x" << oi.data_digest
-                           << std::dec << " on " << soid;
-        r = -EIO; // try repair later
-      }
+	check_full_read_digest(oi, osd_op.outdata, true) < 0) {
+      r = -EIO; // try repair later
     }
     if (r == -EIO) {
       r = rep_repair_primary_object(soid, ctx);
@@ -5928,22 +6115,9 @@ int PrimaryLogPG::do_sparse_read(OpContext *ctx, OSDOp& osd_op) {
   auto& op = osd_op.op;
   auto& oi = ctx->new_obs.oi;
   auto& soid = oi.soid;
-  uint64_t size = oi.size;
   uint64_t offset = op.extent.offset;
-  uint64_t length = op.extent.length;
-
-  // are we beyond truncate_size?
-  if ((oi.truncate_seq < op.extent.truncate_seq) &&
-       (op.extent.offset + op.extent.length > op.extent.truncate_size) &&
-       (size > op.extent.truncate_size)) {
-    size = op.extent.truncate_size;
-  }
-
-  if (offset > size) {
-    length = 0;
-  } else if (offset + length > size) {
-    length = size - offset;
-  }
+  uint64_t length;
+  trim_read_extent(oi, op, &length);
 
   ++ctx->num_read;
   if (pool.info.is_erasure()) {
@@ -5989,17 +6163,10 @@ int PrimaryLogPG::do_sparse_read(OpContext *ctx, OSDOp& osd_op) {
     // Maybe at first, there is no much whole objects. With continued use, more
     // and more whole object exist. So from this point, for spare-read add
     // checksum make sense.
-    if ((uint64_t)r == oi.size && oi.is_data_digest()) {
-      uint32_t crc = data_bl.crc32c(-1);
-      if (oi.data_digest != crc) {
-        osd->clog->error() << info.pgid << std::hex
-          << " full-object read crc 0x" << crc
-          << " != expected 0x" << oi.data_digest
-          << std::dec << " on " << soid;
-        r = rep_repair_primary_object(soid, ctx);
-	if (r < 0) {
-	  return r;
-	}
+    if (check_full_read_digest(oi, data_bl, true) < 0) {
+      r = rep_repair_primary_object(soid, ctx);
+      if (r < 0) {
+	return r;
       }
     }
 
@@ -11810,13 +11977,13 @@ void PrimaryLogPG::check_blocklisted_obc_watchers(ObjectContextRef obc)
 void PrimaryLogPG::populate_obc_watchers(ObjectContextRef obc)
 {
   ceph_assert(is_primary() && is_active());
-  auto it_objects = recovery_state.get_pg_log().get_log().objects.find(obc->obs.oi.soid);
+  auto latest = recovery_state.get_pg_log().get_log().get_object_entry(obc->obs.oi.soid);
   ceph_assert((recovering.count(obc->obs.oi.soid) ||
 	  !is_missing_object(obc->obs.oi.soid)) ||
-	 (it_objects != recovery_state.get_pg_log().get_log().objects.end() && // or this is a revert... see recover_primary()
-	  it_objects->second->op ==
+	 (latest && // or this is a revert... see recover_primary()
+	  latest->op ==
 	    pg_log_entry_t::LOST_REVERT &&
-	  it_objects->second->reverting_to ==
+	  latest->reverting_to ==
 	    obc->obs.oi.version));
 
   dout(10) << "populate_obc_watchers " << obc->obs.oi.soid << dendl;
@@ -11938,12 +12105,12 @@ ObjectContextRef PrimaryLogPG::get_object_context(
   bool can_create,
   const map<string, bufferlist, less<>> *attrs)
 {
-  auto it_objects = recovery_state.get_pg_log().get_log().objects.find(soid);
+  auto latest = recovery_state.get_pg_log().get_log().get_object_entry(soid);
   ceph_assert(
     attrs || !recovery_state.get_pg_log().get_missing().is_missing(soid) ||
     // or this is a revert... see recover_primary()
-    (it_objects != recovery_state.get_pg_log().get_log().objects.end() &&
-      it_objects->second->op ==
+    (latest &&
+      latest->op ==
       pg_log_entry_t::LOST_REVERT));
   ObjectContextRef obc = object_contexts.lookup(soid);
   osd->logger->inc(l_osd_object_ctx_cache_total);
@@ -13507,13 +13674,11 @@ uint64_t PrimaryLogPG::recover_primary(uint64_t max, ThreadPool::TPHandle &handl
     hobject_t soid;
     version_t v = p->first;
 
-    auto it_objects = recovery_state.get_pg_log().get_log().objects.find(p->second);
-    if (it_objects != recovery_state.get_pg_log().get_log().objects.end()) {
-      latest = it_objects->second;
+    latest = recovery_state.get_pg_log().get_log().get_object_entry(p->second);
+    if (latest) {
       ceph_assert(latest->is_update() || latest->is_delete());
       soid = latest->soid;
     } else {
-      latest = 0;
       soid = p->second;
     }
     const pg_missing_item& item = missing.get_items().find(p->second)->second;
@@ -1448,6 +1448,9 @@ protected:
 
   int do_read(OpContext *ctx, OSDOp& osd_op);
   int do_sparse_read(OpContext *ctx, OSDOp& osd_op);
+  int check_full_read_digest(const object_info_t& oi,
+			     const ceph::buffer::list& bl,
+			     bool report);
   int do_writesame(OpContext *ctx, OSDOp& osd_op);
 
   bool pgls_filter(const PGLSFilter& filter, const hobject_t& sobj);
@@ -1546,6 +1549,8 @@ public:
     OpRequestRef& op,
     ThreadPool::TPHandle &handle) override;
   void do_op(OpRequestRef& op);
+  /// serve a read-only op on a head object without an OpContext
+  bool maybe_do_fast_read(OpRequestRef& op, ObjectContextRef& obc);
   void record_write_error(OpRequestRef op, const hobject_t &soid,
 			  MOSDOpReply *orig_reply, int r,
 			  OpContext *ctx_for_op_returns=nullptr);
@@ -1494,10 +1494,10 @@ void ReplicatedBackend::prepare_pull(
 	     << " rather than at version " << v << dendl;
     v = pmissing.get_items().find(soid)->second.have;
     ceph_assert(get_parent()->get_log().get_log().objects.count(soid) &&
-	   (get_parent()->get_log().get_log().objects.find(soid)->second->op ==
+	   (get_parent()->get_log().get_log().get_object_entry(soid)->op ==
 	    pg_log_entry_t::LOST_REVERT) &&
-	   (get_parent()->get_log().get_log().objects.find(
-	     soid)->second->reverting_to ==
+	   (get_parent()->get_log().get_log().get_object_entry(
+	     soid)->reverting_to ==
 	    v));
   }
 
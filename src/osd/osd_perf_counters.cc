@@ -80,6 +80,9 @@ PerfCounters *build_osd_logger(CephContext *cct) {
   osd_plb.add_time_avg(
     l_osd_op_r_prepare_lat, "op_r_prepare_latency",
     "Latency of read operations (excluding queue time and wait for finished)");
+  osd_plb.add_u64_counter(
+    l_osd_op_r_fast, "op_r_fast",
+    "Client read operations served by the read fast path");
   osd_plb.add_u64_counter(
     l_osd_op_w, "op_w", "Client write operations");
   osd_plb.add_u64_counter(
@@ -433,3 +436,13 @@ PerfCounters *build_scrub_labeled_perf(CephContext *cct, std::string label)
 
   return scrub_perf.create_perf_counters();
 }
+
+PerfCounters *build_osd_shard_perf(CephContext *cct, std::string label)
+{
+  PerfCountersBuilder shard_perf(cct, label, osd_shard_first, osd_shard_last);
+
+  shard_perf.add_time_avg(osd_shard_queue_lat, "queue_latency", "time from enqueue until a shard thread moves it into the scheduler");
+  shard_perf.add_u64_avg(osd_shard_ingress_batch, "ingress_batch", "items moved from the ingress queue to the scheduler per drain");
+
+  return shard_perf.create_perf_counters();
+}
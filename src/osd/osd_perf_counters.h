@@ -22,6 +22,7 @@ enum {
   l_osd_op_r_lat_outb_hist,
   l_osd_op_r_process_lat,
   l_osd_op_r_prepare_lat,
+  l_osd_op_r_fast,
   l_osd_op_w,
   l_osd_op_w_inb,
   l_osd_op_w_lat,
@@ -238,3 +239,17 @@ enum {
 };
 
 PerfCounters *build_scrub_labeled_perf(CephContext *cct, std::string label);
+
+// Per op shard counters, labeled with the shard id
+enum {
+  osd_shard_first = 20600,
+
+  /// time from creating an op queue item until a shard thread dequeues it
+  osd_shard_queue_lat,
+  /// items moved from the ingress queue into the scheduler per drain
+  osd_shard_ingress_batch,
+
+  osd_shard_last,
+};
+
+PerfCounters *build_osd_shard_perf(CephContext *cct, std::string label);
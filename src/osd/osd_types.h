@@ -72,6 +72,7 @@
 #define CEPH_OSD_FEATURE_INCOMPAT_FASTINFO CompatSet::Feature(15, "fastinfo pg attr")
 #define CEPH_OSD_FEATURE_INCOMPAT_RECOVERY_DELETES CompatSet::Feature(16, "deletes in missing set")
 #define CEPH_OSD_FEATURE_INCOMPAT_SNAPMAPPER2 CompatSet::Feature(17, "new snapmapper key structure")
+#define CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH CompatSet::Feature(18, "batched pg log dups")
 
 
 /// pool priority range set by user
@@ -1122,6 +1123,7 @@ public:
      * completion if there are no other in progress writes.
      */
     PCT_UPDATE_DELAY,
+    PREFER_DEFERRED_SIZE, // bluestore deferred write threshold
   };
 
   enum type_t {
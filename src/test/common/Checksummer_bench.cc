@@ -0,0 +1,136 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Checksummer benchmarks.
+ *
+ * Times Checksummer::calculate and verify for every csum type over a few
+ * block sizes and buffer layouts, next to a plain one-block-at-a-time
+ * loop over Alg::calc for comparison.
+ */
+#include <iostream>
+#include <iomanip>
+#include <gtest/gtest.h>
+
+#include "include/types.h"
+#include "common/ceph_time.h"
+#include "common/Checksummer.h"
+
+using namespace std;
+
+static constexpr size_t total = 16 * 1024 * 1024;
+static constexpr int rounds = 32;
+
+// 0 = csum block size, 1 = buffer size (0 for one contiguous buffer)
+class ChecksummerBench
+  : public ::testing::TestWithParam<std::vector<int>> {
+public:
+  size_t csum_block_size = 0;
+  size_t buffer_size = 0;
+  bufferlist data;
+
+  void SetUp() override {
+    std::vector param = GetParam();
+    csum_block_size = param[0];
+    buffer_size = param[1];
+    bufferptr bp(total);
+    for (size_t i = 0; i < total; ++i) {
+      bp.c_str()[i] = (i * 131 + 7) & 0xff;
+    }
+    if (buffer_size == 0) {
+      data.append(bp);
+    } else {
+      for (size_t off = 0; off < total; off += buffer_size) {
+	data.append(bufferptr(bp, off, std::min(buffer_size, total - off)));
+      }
+    }
+  }
+
+  static double mbsec(ceph::timespan dur) {
+    return (double)rounds * total / 1000000.0 /
+      std::chrono::duration<double>(dur).count();
+  }
+
+  template<class Alg>
+  void run(const char* name);
+};
+
+template<class Alg>
+void ChecksummerBench::run(const char* name)
+{
+  size_t blocks = total / csum_block_size;
+  bufferptr csum(blocks * sizeof(typename Alg::value_t));
+  bufferptr base(blocks * sizeof(typename Alg::value_t));
+
+  // baseline: one Alg::calc per block, as calculate did before batching
+  auto start = ceph::mono_clock::now();
+  for (int r = 0; r < rounds; ++r) {
+    typename Alg::state_t state;
+    Alg::init(&state);
+    auto p = data.cbegin();
+    auto pv = reinterpret_cast<typename Alg::value_t*>(base.c_str());
+    for (size_t i = 0; i < blocks; ++i) {
+      *pv++ = Alg::calc(state, -1, csum_block_size, p);
+    }
+    Alg::fini(&state);
+  }
+  auto per_block = ceph::mono_clock::now() - start;
+
+  start = ceph::mono_clock::now();
+  for (int r = 0; r < rounds; ++r) {
+    Checksummer::calculate<Alg>(csum_block_size, 0, total, data, &csum);
+  }
+  auto calculate = ceph::mono_clock::now() - start;
+  ASSERT_EQ(0, memcmp(csum.c_str(), base.c_str(), csum.length()));
+
+  start = ceph::mono_clock::now();
+  for (int r = 0; r < rounds; ++r) {
+    ASSERT_EQ(-1, Checksummer::verify<Alg>(
+      csum_block_size, 0, total, data, csum, nullptr));
+  }
+  auto verify = ceph::mono_clock::now() - start;
+
+  std::cout << std::setw(8) << name
+	    << " block " << std::setw(6) << csum_block_size
+	    << " buffers " << std::setw(8)
+	    << (buffer_size ? std::to_string(buffer_size) : "1")
+	    << std::fixed << std::setprecision(0)
+	    << "  per-block " << std::setw(6) << mbsec(per_block)
+	    << "  calculate " << std::setw(6) << mbsec(calculate)
+	    << "  verify " << std::setw(6) << mbsec(verify)
+	    << " MB/sec" << std::endl;
+}
+
+TEST_P(ChecksummerBench, crc32c)
+{
+  run<Checksummer::crc32c>("crc32c");
+}
+
+TEST_P(ChecksummerBench, crc32c_16)
+{
+  run<Checksummer::crc32c_16>("crc32c_16");
+}
+
+TEST_P(ChecksummerBench, crc32c_8)
+{
+  run<Checksummer::crc32c_8>("crc32c_8");
+}
+
+TEST_P(ChecksummerBench, xxhash32)
+{
+  run<Checksummer::xxhash32>("xxhash32");
+}
+
+TEST_P(ChecksummerBench, xxhash64)
+{
+  run<Checksummer::xxhash64>("xxhash64");
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  Checksummer,
+  ChecksummerBench,
+  ::testing::Values(
+    std::vector<int>({4096, 0}),
+    std::vector<int>({4096, 64 * 1024}),
+    std::vector<int>({4096, 4096 + 512}),
+    std::vector<int>({65536, 0}),
+    std::vector<int>({65536, 1024 * 1024})));
@@ -44,6 +44,36 @@ TEST(Crc32c, Big) {
   free(a);
 }
 
+TEST(Crc32c, Multi) {
+  unsigned len = 65 * 4096 + 13;
+  unsigned char *a = (unsigned char *)malloc(len);
+  for (unsigned i = 0; i < len; i++)
+    a[i] = (i * 131 + 7) & 0xff;
+  unsigned block_lens[] = { 1, 3, 8, 13, 512, 4096 };
+  unsigned counts[] = { 0, 1, 3, 4, 5, 7, 8, 9, 65 };
+  for (unsigned bl : block_lens) {
+    for (unsigned n : counts) {
+      if (bl * n > len)
+	continue;
+      for (unsigned off : { 0u, 1u }) {
+	if (off + bl * n > len)
+	  continue;
+	for (uint32_t crc : { 0u, 1234u, 0xffffffffu }) {
+	  std::vector<uint32_t> out(n + 1, 0xdeadbeef);
+	  ceph_crc32c_multi(crc, a + off, bl, n, out.data());
+	  for (unsigned i = 0; i < n; i++) {
+	    ASSERT_EQ(ceph_crc32c(crc, a + off + i * bl, bl), out[i])
+	      << "block_len " << bl << " nblocks " << n << " block " << i;
+	  }
+	  // nothing past the last block is written
+	  ASSERT_EQ(0xdeadbeefu, out[n]);
+	}
+      }
+    }
+  }
+  free(a);
+}
+
 TEST(Crc32c, Performance) {
   int len = 1000 * 1024 * 1024;
   char *a = (char *)malloc(len);
@@ -10,6 +10,7 @@
 #include "include/encoding.h"
 #include "include/err.h"
 #include "include/scope_guard.h"
+#include "json_spirit/json_spirit.h"
 #include "test/librados/test_cxx.h"
 #include "test/librados/testcase_cxx.h"
 
@@ -507,6 +508,128 @@ TEST_F(LibRadosIoPP, CrcZeroWrite) {
   ASSERT_EQ(0, ioctx.operate("foo", &read, &bl));
 }
 
+// op_r_fast of the OSD acting as primary for oid
+static void get_op_r_fast(Rados& cluster, const std::string& pool_name,
+			  const std::string& nspace, const std::string& oid,
+			  uint64_t *count)
+{
+  bufferlist inbl, outbl;
+  string outs;
+  string cmd = "{\"prefix\": \"osd map\", \"pool\": \"" + pool_name +
+    "\", \"object\": \"" + oid + "\", \"nspace\": \"" + nspace +
+    "\", \"format\": \"json\"}";
+  ASSERT_EQ(0, cluster.mon_command(cmd, inbl, &outbl, &outs));
+  json_spirit::Value v;
+  ASSERT_TRUE(json_spirit::read(outbl.to_str(), v)) << outbl.to_str();
+  int primary =
+    json_spirit::find_value(v.get_obj(), "acting_primary").get_int();
+
+  outbl.clear();
+  cmd = "{\"prefix\": \"perf dump\", \"logger\": \"osd\", "
+    "\"counter\": \"op_r_fast\"}";
+  ASSERT_EQ(0, cluster.osd_command(primary, cmd, inbl, &outbl, &outs));
+  ASSERT_TRUE(json_spirit::read(outbl.to_str(), v)) << outbl.to_str();
+  auto& osd = json_spirit::find_value(v.get_obj(), "osd");
+  ASSERT_EQ(json_spirit::obj_type, osd.type()) << outbl.to_str();
+  *count = json_spirit::find_value(osd.get_obj(), "op_r_fast").get_uint64();
+}
+
+TEST_F(LibRadosIoPP, FastReadPP) {
+  SKIP_IF_CRIMSON();
+  char buf[128];
+  for (size_t i = 0; i < sizeof(buf); ++i) {
+    buf[i] = i;
+  }
+  bufferlist bl;
+  bl.append(buf, sizeof(buf));
+  ASSERT_EQ(0, ioctx.write_full("foo", bl));
+  bufferlist attr;
+  attr.append("bar");
+  ASSERT_EQ(0, ioctx.setxattr("foo", "attr", attr));
+
+  uint64_t before;
+  ASSERT_NO_FATAL_FAILURE(get_op_r_fast(cluster, pool_name, nspace, "foo",
+					&before));
+  uint64_t fast_reads = 0;
+  {
+    // whole object, verified against the data digest
+    bufferlist read_bl;
+    ASSERT_EQ((int)sizeof(buf), ioctx.read("foo", read_bl, 0, 0));
+    ASSERT_TRUE(bl.contents_equal(read_bl));
+    ++fast_reads;
+  }
+  {
+    // trimmed to the object size, with xattr and sparse read alongside
+    bufferlist read_bl, attr_bl, sparse_bl;
+    std::map<uint64_t, uint64_t> extents;
+    int read_rval = -1, attr_rval = -1, sparse_rval = -1;
+    ObjectReadOperation op;
+    op.read(sizeof(buf) / 2, sizeof(buf), &read_bl, &read_rval);
+    op.getxattr("attr", &attr_bl, &attr_rval);
+    op.sparse_read(0, 2 * sizeof(buf), &extents, &sparse_bl, &sparse_rval);
+    ASSERT_EQ(0, ioctx.operate("foo", &op, nullptr));
+    ASSERT_EQ(0, read_rval);
+    ASSERT_EQ(sizeof(buf) / 2, read_bl.length());
+    ASSERT_EQ(0, memcmp(read_bl.c_str(), buf + sizeof(buf) / 2,
+			sizeof(buf) / 2));
+    ASSERT_EQ(0, attr_rval);
+    ASSERT_TRUE(attr.contents_equal(attr_bl));
+    ASSERT_EQ(0, sparse_rval);
+    assert_eq_sparse(bl, extents, sparse_bl);
+    ++fast_reads;
+  }
+  {
+    // past the end of the object
+    bufferlist read_bl;
+    ASSERT_EQ(0, ioctx.read("foo", read_bl, sizeof(buf), 2 * sizeof(buf)));
+    ASSERT_EQ(0u, read_bl.length());
+    ++fast_reads;
+  }
+  {
+    // a newer truncate_seq than the object's clamps to truncate_size
+    bufferlist expected;
+    expected.append(buf, sizeof(buf) / 4);
+    std::map<uint64_t, uint64_t> extents;
+    bufferlist read_bl;
+    int rval = -1;
+    ObjectReadOperation op;
+    op.sparse_read(0, sizeof(buf), &extents, &read_bl, &rval,
+		   sizeof(buf) / 4, 1);
+    ASSERT_EQ(0, ioctx.operate("foo", &op, nullptr));
+    ASSERT_EQ(0, rval);
+    assert_eq_sparse(expected, extents, read_bl);
+    ++fast_reads;
+  }
+  {
+    // a truncate_size beyond the object changes nothing
+    std::map<uint64_t, uint64_t> extents;
+    bufferlist read_bl;
+    int rval = -1;
+    ObjectReadOperation op;
+    op.sparse_read(0, sizeof(buf), &extents, &read_bl, &rval,
+		   2 * sizeof(buf), 1);
+    ASSERT_EQ(0, ioctx.operate("foo", &op, nullptr));
+    ASSERT_EQ(0, rval);
+    assert_eq_sparse(bl, extents, read_bl);
+    ++fast_reads;
+  }
+  // errors fall back to the full read path, which reports them
+  {
+    bufferlist attr_bl;
+    ASSERT_EQ(-ENODATA, ioctx.getxattr("foo", "missing", attr_bl));
+  }
+  {
+    bufferlist read_bl;
+    ASSERT_EQ(-ENOENT, ioctx.read("missing", read_bl, 0, 0));
+  }
+
+  uint64_t after;
+  ASSERT_NO_FATAL_FAILURE(get_op_r_fast(cluster, pool_name, nspace, "foo",
+					&after));
+  // other clients may be reading from the same OSD
+  ASSERT_LE(before + fast_reads, after);
+}
+
 TEST_F(LibRadosIoECPP, SimpleWritePP) {
   SKIP_IF_CRIMSON();
   char buf[128];
@@ -27,6 +27,26 @@ using namespace std;
 #include "global/global_init.h"
 #include "os/ObjectStore.h"
 
+// count what goes through operator new, so each op can report the heap
+// allocations it made; the benchmark is single threaded
+static uint64_t alloc_count = 0;
+
+void* operator new(size_t size)
+{
+  ++alloc_count;
+  if (void *p = malloc(size))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
 class Transaction {
  private:
   ObjectStore::Transaction t;
@@ -35,55 +55,83 @@ class Transaction {
   struct Tick {
     uint64_t ticks;
     uint64_t count;
-    Tick(): ticks(0), count(0) {}
-    void add(uint64_t a) {
+    uint64_t allocs;
+    Tick(): ticks(0), count(0), allocs(0) {}
+    void add(uint64_t a, uint64_t n) {
       ticks += a;
+      allocs += n;
       count++;
     }
+    double allocs_per_op() const {
+      return count ? (double)allocs / count : 0;
+    }
   };
   static Tick write_ticks, setattr_ticks, omap_setkeys_ticks, omap_rmkey_ticks;
   static Tick encode_ticks, decode_ticks, iterate_ticks;
 
   void write(coll_t cid, const ghobject_t& oid, uint64_t off, uint64_t len,
              const bufferlist& data) {
+    uint64_t start_allocs = alloc_count;
     uint64_t start_time = Cycles::rdtsc();
     t.write(cid, oid, off, len, data);
-    write_ticks.add(Cycles::rdtsc() - start_time);
+    write_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
+  }
+  void write(coll_t cid, const ghobject_t& oid, uint64_t off, uint64_t len,
+             bufferlist&& data) {
+    uint64_t start_allocs = alloc_count;
+    uint64_t start_time = Cycles::rdtsc();
+    t.write(cid, oid, off, len, std::move(data));
+    write_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
   }
   void setattr(coll_t cid, const ghobject_t& oid, const string &name,
                bufferlist& val) {
+    uint64_t start_allocs = alloc_count;
     uint64_t start_time = Cycles::rdtsc();
     t.setattr(cid, oid, name, val);
-    setattr_ticks.add(Cycles::rdtsc() - start_time);
+    setattr_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
+  }
+  void setattr(coll_t cid, const ghobject_t& oid, const string &name,
+               bufferlist&& val) {
+    uint64_t start_allocs = alloc_count;
+    uint64_t start_time = Cycles::rdtsc();
+    t.setattr(cid, oid, name, std::move(val));
+    setattr_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
   }
   void omap_setkeys(coll_t cid, const ghobject_t &oid,
                     const map<string, bufferlist> &attrset) {
 
+    uint64_t start_allocs = alloc_count;
     uint64_t start_time = Cycles::rdtsc();
     t.omap_setkeys(cid, oid, attrset);
-    omap_setkeys_ticks.add(Cycles::rdtsc() - start_time);
+    omap_setkeys_ticks.add(Cycles::rdtsc() - start_time,
+                           alloc_count - start_allocs);
   }
   void omap_rmkey(coll_t cid, const ghobject_t &oid,
                    const string &key) {
+    uint64_t start_allocs = alloc_count;
     uint64_t start_time = Cycles::rdtsc();
     t.omap_rmkey(cid, oid, key);
-    omap_rmkey_ticks.add(Cycles::rdtsc() - start_time);
+    omap_rmkey_ticks.add(Cycles::rdtsc() - start_time,
+                         alloc_count - start_allocs);
   }
 
   void apply_encode_decode() {
     bufferlist bl;
     ObjectStore::Transaction d;
+    uint64_t start_allocs = alloc_count;
     uint64_t start_time = Cycles::rdtsc();
     t.encode(bl);
-    encode_ticks.add(Cycles::rdtsc() - start_time);
+    encode_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
 
     auto bliter = bl.cbegin();
+    start_allocs = alloc_count;
     start_time = Cycles::rdtsc();
     d.decode(bliter);
-    decode_ticks.add(Cycles::rdtsc() - start_time);
+    decode_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
   }
 
   void apply_iterate() {
+    uint64_t start_allocs = alloc_count;
     uint64_t start_time = Cycles::rdtsc();
     ObjectStore::Transaction::iterator i = t.begin();
     while (i.have_op()) {
@@ -123,17 +171,26 @@ class Transaction {
         break;
       }
     }
-    iterate_ticks.add(Cycles::rdtsc() - start_time);
+    iterate_ticks.add(Cycles::rdtsc() - start_time, alloc_count - start_allocs);
   }
 
+  static void dump_tick(const char *name, const Tick& tick) {
+    cerr << " " << name << " op: " << Cycles::to_microseconds(tick.ticks)
+         << "us count: " << tick.count
+         << " allocs/op: " << tick.allocs_per_op() << std::endl;
+  }
   static void dump_stat() {
-    cerr << " write op: " << Cycles::to_microseconds(write_ticks.ticks) << "us count: " << write_ticks.count << std::endl;
-    cerr << " setattr op: " << Cycles::to_microseconds(setattr_ticks.ticks) << "us count: " << setattr_ticks.count << std::endl;
-    cerr << " omap_setkeys op: " << Cycles::to_microseconds(Transaction::omap_setkeys_ticks.ticks) << "us count: " << Transaction::omap_setkeys_ticks.count << std::endl;
-    cerr << " omap_rmkey op: " << Cycles::to_microseconds(Transaction::omap_rmkey_ticks.ticks) << "us count: " << Transaction::omap_rmkey_ticks.count << std::endl;
-    cerr << " encode op: " << Cycles::to_microseconds(Transaction::encode_ticks.ticks) << "us count: " << Transaction::encode_ticks.count << std::endl;
-    cerr << " decode op: " << Cycles::to_microseconds(Transaction::decode_ticks.ticks) << "us count: " << Transaction::decode_ticks.count << std::endl;
-    cerr << " iterate op: " << Cycles::to_microseconds(Transaction::iterate_ticks.ticks) << "us count: " << Transaction::iterate_ticks.count << std::endl;
+    dump_tick("write", write_ticks);
+    dump_tick("setattr", setattr_ticks);
+    dump_tick("omap_setkeys", omap_setkeys_ticks);
+    dump_tick("omap_rmkey", omap_rmkey_ticks);
+    dump_tick("encode", encode_ticks);
+    dump_tick("decode", decode_ticks);
+    dump_tick("iterate", iterate_ticks);
+  }
+  static void reset_stat() {
+    write_ticks = setattr_ticks = omap_setkeys_ticks = omap_rmkey_ticks = Tick();
+    encode_ticks = decode_ticks = iterate_ticks = Tick();
   }
 };
 
@@ -187,7 +244,9 @@ class PerfCase {
     data[info_info_attr] = generate_random(560, 1);
   }
 
-  uint64_t rados_write_4k(int times) {
+  // with move_payload the data and attrs are handed over to the
+  // transaction, as the OSD does with buffers it built for it
+  uint64_t rados_write_4k(int times, bool move_payload) {
     uint64_t ticks = 0;
     uint64_t len = Kib *4;
     for (int i = 0; i < times; i++) {
@@ -195,10 +254,20 @@ class PerfCase {
       {
         Transaction t;
         ghobject_t oid = create_object();
-        start_time = Cycles::rdtsc();
-        t.write(cid, oid, 0, len, data["4k"]);
-        t.setattr(cid, oid, attr, data[attr]);
-        t.setattr(cid, oid, snapset_attr, data[snapset_attr]);
+        if (move_payload) {
+          bufferlist payload = data["4k"];
+          bufferlist attr_bl = data[attr];
+          bufferlist snapset_bl = data[snapset_attr];
+          start_time = Cycles::rdtsc();
+          t.write(cid, oid, 0, len, std::move(payload));
+          t.setattr(cid, oid, attr, std::move(attr_bl));
+          t.setattr(cid, oid, snapset_attr, std::move(snapset_bl));
+        } else {
+          start_time = Cycles::rdtsc();
+          t.write(cid, oid, 0, len, data["4k"]);
+          t.setattr(cid, oid, attr, data[attr]);
+          t.setattr(cid, oid, snapset_attr, data[snapset_attr]);
+        }
         t.apply_encode_decode();
         t.apply_iterate();
         ticks += Cycles::rdtsc() - start_time;
@@ -258,9 +327,14 @@ int main(int argc, char **argv)
 
   uint64_t times = atoi(args[0]);
   PerfCase c;
-  uint64_t ticks = c.rados_write_4k(times);
-  Transaction::dump_stat();
-  cerr << " Total rados op " << times << " run time " << Cycles::to_microseconds(ticks) << "us." << std::endl;
+  for (bool move_payload : {false, true}) {
+    Transaction::reset_stat();
+    uint64_t ticks = c.rados_write_4k(times, move_payload);
+    cerr << (move_payload ? "payload moved:" : "payload referenced:")
+         << std::endl;
+    Transaction::dump_stat();
+    cerr << " Total rados op " << times << " run time " << Cycles::to_microseconds(ticks) << "us." << std::endl;
+  }
 
   return 0;
 }
@@ -0,0 +1,333 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * BlueStore::Writer benchmarks.
+ *
+ * Drives synthetic write patterns through BlueStore::Writer on an
+ * unmounted BlueStore instance. The disk is replaced with the Writer's
+ * test divertors and the allocator with a counting wrapper, so only the
+ * write logic itself is measured.
+ */
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <gtest/gtest.h>
+
+#include "include/types.h"
+#include "common/ceph_argparse.h"
+#include "global/global_init.h"
+#include "global/global_context.h"
+#include "os/bluestore/BlueStore.h"
+#include "os/bluestore/Writer.h"
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int.hpp>
+typedef boost::mt11213b gen_type;
+
+using namespace std;
+
+// Forwards to a real allocator and counts what the Writer asks for.
+class CountingAllocator : public Allocator {
+  Allocator* alloc;
+public:
+  uint64_t allocate_calls = 0;
+  uint64_t allocated_extents = 0;
+  uint64_t allocated_bytes = 0;
+  uint64_t released_bytes = 0;
+
+  CountingAllocator(Allocator* _alloc)
+    : Allocator("writer_bench", _alloc->get_capacity(),
+		_alloc->get_block_size()),
+      alloc(_alloc) {}
+  ~CountingAllocator() override {
+    delete alloc;
+  }
+  void reset_counters() {
+    allocate_calls = allocated_extents = allocated_bytes = released_bytes = 0;
+  }
+  const char* get_type() const override {
+    return "counting";
+  }
+  int64_t allocate(uint64_t want_size, uint64_t block_size,
+		   uint64_t max_alloc_size, int64_t hint,
+		   PExtentVector *extents) override {
+    size_t prev = extents->size();
+    int64_t r = alloc->allocate(want_size, block_size, max_alloc_size,
+				hint, extents);
+    ++allocate_calls;
+    if (r > 0) {
+      allocated_extents += extents->size() - prev;
+      allocated_bytes += r;
+    }
+    return r;
+  }
+  void release(const release_set_t& release_set) override {
+    released_bytes += release_set.size();
+    alloc->release(release_set);
+  }
+  void dump() override {
+    alloc->dump();
+  }
+  void foreach(
+    std::function<void(uint64_t offset, uint64_t length)> notify) override {
+    alloc->foreach(notify);
+  }
+  void init_add_free(uint64_t offset, uint64_t length) override {
+    alloc->init_add_free(offset, length);
+  }
+  void init_rm_free(uint64_t offset, uint64_t length) override {
+    alloc->init_rm_free(offset, length);
+  }
+  uint64_t get_free() override {
+    return alloc->get_free();
+  }
+  double get_fragmentation() override {
+    return alloc->get_fragmentation();
+  }
+  void shutdown() override {
+    alloc->shutdown();
+  }
+};
+
+// Stands in for the block device; only accounts for the IO it is given.
+struct CountingDevice : public BlueStore::Writer::write_divertor,
+			public BlueStore::Writer::read_divertor {
+  uint64_t direct_ops = 0;
+  uint64_t direct_bytes = 0;
+  uint64_t deferred_ops = 0;
+  uint64_t deferred_bytes = 0;
+  uint64_t read_ops = 0;
+  uint64_t read_bytes = 0;
+
+  void write(
+    uint64_t disk_offset, const bufferlist& data, bool deferred) override {
+    if (deferred) {
+      ++deferred_ops;
+      deferred_bytes += data.length();
+    } else {
+      ++direct_ops;
+      direct_bytes += data.length();
+    }
+  }
+  bufferlist read(uint32_t object_offset, uint32_t object_length) override {
+    ++read_ops;
+    read_bytes += object_length;
+    bufferlist bl;
+    bl.append_zero(object_length);
+    return bl;
+  }
+};
+
+static uint64_t thread_cpu_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+enum class pattern_t {
+  overwrite,  // random overwrites of a preallocated object
+  append,     // sequential appends
+  punch_hole, // random overwrites mixed with zeroing ranges
+};
+
+static const char* pattern_name(pattern_t p)
+{
+  switch (p) {
+  case pattern_t::overwrite: return "overwrite";
+  case pattern_t::append: return "append";
+  case pattern_t::punch_hole: return "punch_hole";
+  }
+  return "???";
+}
+
+// 0 = au_size, 1 = block_size, 2 = blob size, 3 = max write size
+class WriterBench : public ::testing::TestWithParam<std::vector<int>> {
+public:
+  BlueStore* store = nullptr;
+  BlueStore::OnodeCacheShard *oc = nullptr;
+  BlueStore::BufferCacheShard *bc = nullptr;
+  BlueStore::CollectionRef coll;
+  CountingAllocator* alloc = nullptr;
+  uint32_t au_size = 0;
+  uint32_t block_size = 0;
+  uint32_t blob_size = 0;
+  uint32_t max_write = 0;
+  uint64_t prefer_deferred_size = 0;
+
+  static constexpr uint32_t object_size = 4 * 1024 * 1024;
+  static constexpr unsigned num_ops = 20000;
+
+  void SetUp() override {
+    std::vector param = GetParam();
+    au_size = param[0];
+    block_size = param[1];
+    blob_size = param[2];
+    max_write = param[3];
+    prefer_deferred_size =
+      g_ceph_context->_conf->bluestore_prefer_deferred_size_hdd;
+    store = new BlueStore(g_ceph_context, "", au_size);
+    oc = BlueStore::OnodeCacheShard::create(g_ceph_context, "lru", NULL);
+    bc = BlueStore::BufferCacheShard::create(store, "lru", NULL);
+    coll = ceph::make_ref<BlueStore::Collection>(store, oc, bc, coll_t());
+    store->debug_set_block_size(block_size);
+    uint64_t disk_size = (uint64_t)1024 * 1024 * 1024 * 1024;
+    alloc = new CountingAllocator(
+      Allocator::create(g_ceph_context, "avl", disk_size, au_size));
+    alloc->init_add_free(0, disk_size);
+    store->debug_get_alloc() = alloc;
+  }
+  void TearDown() override {
+    coll.reset(nullptr);
+    delete bc;
+    delete oc;
+    store->debug_get_alloc() = nullptr;
+    delete alloc;
+    delete store;
+  }
+
+  void run(pattern_t pattern);
+};
+
+void WriterBench::run(pattern_t pattern)
+{
+  gen_type rng(0);
+  boost::uniform_int<> u_off(0, object_size - 1);
+  boost::uniform_int<> u_len(1, max_write);
+  boost::uniform_int<> u_op(0, 3);
+
+  BlueStore::OnodeRef o = new BlueStore::Onode(coll.get(), ghobject_t(), "");
+  CountingDevice dev;
+  uint64_t cpu_ns = 0;
+  uint64_t ops = 0;
+  uint64_t bytes = 0;
+  uint64_t append_pos = 0;
+
+  auto do_one = [&](uint32_t offset, uint32_t length, bool zero) {
+    BlueStore::TransContext txc(g_ceph_context, coll.get(), nullptr, nullptr);
+    BlueStore::WriteContext wctx;
+    wctx.target_blob_size = blob_size;
+    wctx.prefer_deferred_size = prefer_deferred_size;
+    wctx.csum_type = Checksummer::CSUM_CRC32C;
+    wctx.csum_order = std::countr_zero(block_size);
+    bufferlist data;
+    data.append(std::string(length, 'a' + ops % 26));
+
+    uint64_t start = thread_cpu_ns();
+    if (zero) {
+      PExtentVector released;
+      std::vector<BlueStore::BlobRef> pruned_blobs;
+      BlueStore::volatile_statfs statfs_delta;
+      store->debug_punch_hole_2(coll, o, offset, length, released,
+	pruned_blobs, txc.shared_blobs, statfs_delta);
+      for (auto& e : released) {
+	txc.released.insert(e.offset, e.length);
+      }
+    } else {
+      BlueStore::Writer w(store, &txc, &wctx, o);
+      w.test_write_divertor = &dev;
+      w.test_read_divertor = &dev;
+      w.do_write(offset, data);
+    }
+    o->extent_map.compress_extent_map(offset, length);
+    cpu_ns += thread_cpu_ns() - start;
+
+    if (!txc.released.empty()) {
+      alloc->release(txc.released);
+    }
+    ++ops;
+    bytes += length;
+  };
+
+  if (pattern != pattern_t::append) {
+    // lay the object down first, it is not part of the measurement
+    for (uint32_t off = 0; off < object_size; off += blob_size) {
+      do_one(off, blob_size, false);
+    }
+    dev = CountingDevice();
+    alloc->reset_counters();
+    cpu_ns = ops = bytes = 0;
+  }
+  for (unsigned i = 0; i < num_ops; ++i) {
+    uint32_t length = u_len(rng);
+    switch (pattern) {
+    case pattern_t::overwrite:
+      do_one(std::min<uint32_t>(u_off(rng), object_size - length), length,
+	     false);
+      break;
+    case pattern_t::append:
+      if (append_pos + length > object_size) {
+	append_pos = 0;
+      }
+      do_one(append_pos, length, false);
+      append_pos += length;
+      break;
+    case pattern_t::punch_hole:
+      do_one(std::min<uint32_t>(u_off(rng), object_size - length), length,
+	     u_op(rng) == 0);
+      break;
+    }
+  }
+
+  std::set<BlueStore::Blob*> blobs;
+  for (auto& e : o->extent_map.extent_map) {
+    blobs.insert(e.blob.get());
+  }
+  std::cout << std::setw(10) << pattern_name(pattern)
+	    << std::hex
+	    << " au=0x" << au_size
+	    << " block=0x" << block_size
+	    << " blob=0x" << blob_size
+	    << " max_write=0x" << max_write
+	    << std::dec << std::endl
+	    << "  ops " << ops << " bytes " << bytes
+	    << " cpu " << (ops ? cpu_ns / ops : 0) << " ns/op" << std::endl
+	    << "  allocations " << alloc->allocate_calls
+	    << " extents " << alloc->allocated_extents
+	    << " allocated " << alloc->allocated_bytes
+	    << " released " << alloc->released_bytes << std::endl
+	    << "  direct " << dev.direct_ops << "/" << dev.direct_bytes
+	    << " deferred " << dev.deferred_ops << "/" << dev.deferred_bytes
+	    << " read " << dev.read_ops << "/" << dev.read_bytes
+	    << " (ops/bytes)" << std::endl
+	    << "  blobs " << blobs.size()
+	    << " extents " << o->extent_map.extent_map.size()
+	    << " write amplification "
+	    << (bytes ? double(dev.direct_bytes + dev.deferred_bytes) / bytes : 0)
+	    << std::endl;
+  o->extent_map.clear();
+}
+
+TEST_P(WriterBench, overwrite)
+{
+  run(pattern_t::overwrite);
+}
+
+TEST_P(WriterBench, append)
+{
+  run(pattern_t::append);
+}
+
+TEST_P(WriterBench, punch_hole)
+{
+  run(pattern_t::punch_hole);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  BlueStore,
+  WriterBench,
+  ::testing::Values(
+    std::vector<int>({4096, 4096, 64 * 1024, 16 * 1024}),
+    std::vector<int>({4096, 4096, 64 * 1024, 128 * 1024}),
+    std::vector<int>({65536, 4096, 64 * 1024, 16 * 1024}),
+    std::vector<int>({65536, 4096, 512 * 1024, 128 * 1024})));
+
+int main(int argc, char **argv) {
+  auto args = argv_to_vec(argc, argv);
+  auto cct =
+      global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY,
+                  CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
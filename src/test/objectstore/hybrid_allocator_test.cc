@@ -288,3 +288,61 @@ TEST(HybridAllocator, fragmentation)
     ASSERT_EQ(0.5 * 7 / 8 + 1.0 / 8, ha.get_fragmentation());
   }
 }
+
+TEST(HybridAllocator, thread_cache)
+{
+  g_ceph_context->_conf.set_val_or_die(
+    "bluestore_hybrid_alloc_thread_cache_chunk", "1048576");
+  g_ceph_context->_conf.set_val_or_die(
+    "bluestore_hybrid_alloc_thread_cache_shards", "4");
+  {
+    uint64_t block_size = 0x1000;
+    uint64_t capacity = 0x1000 * _1m; // = 4GB
+    TestHybridAllocator ha(g_ceph_context, capacity, block_size,
+      _1m, "test_hybrid_allocator");
+    ha.init_add_free(0, _4m);
+    ASSERT_EQ(_4m, ha.get_free());
+
+    // small allocations are carved from the reserved chunk
+    PExtentVector extents;
+    for (size_t i = 0; i < 16; i++) {
+      EXPECT_EQ(0x4000, ha.allocate(0x4000, block_size, 0, 0, &extents));
+    }
+    ASSERT_EQ(16u, extents.size());
+    for (size_t i = 1; i < extents.size(); i++) {
+      ASSERT_EQ(extents[i - 1].end(), extents[i].offset);
+    }
+    ASSERT_EQ(16u, ha.get_thread_cache_hit_count());
+    ASSERT_EQ(_4m - _1m, ha.get_avl_free());
+    ASSERT_EQ(_4m - 16 * 0x4000, ha.get_free());
+
+    // large ones bypass the cache
+    PExtentVector big;
+    EXPECT_EQ(_1m, ha.allocate(_1m, block_size, 0, 0, &big));
+    ASSERT_EQ(16u, ha.get_thread_cache_hit_count());
+    ASSERT_EQ(_4m - _1m - 16 * 0x4000, ha.get_free());
+
+    // released small extents are kept and reused first
+    release_set_t rs;
+    rs.insert(extents[3].offset, extents[3].length);
+    ha.release(rs);
+    ASSERT_EQ(_4m - _1m - 15 * 0x4000, ha.get_free());
+    PExtentVector again;
+    EXPECT_EQ(0x4000, ha.allocate(0x4000, block_size, 0, 0, &again));
+    ASSERT_EQ(extents[3].offset, again[0].offset);
+
+    // everything cached is reported and returned on enumeration,
+    // extents[3] is the one allocated again
+    ha.release(big);
+    ha.release(extents);
+    uint64_t total = 0;
+    ha.foreach([&](uint64_t o, uint64_t l) {
+      total += l;
+    });
+    ASSERT_EQ(_4m, total);
+    ASSERT_EQ(_4m, ha.get_free());
+    ASSERT_EQ(_4m, ha.get_avl_free());
+  }
+  g_ceph_context->_conf.rm_val("bluestore_hybrid_alloc_thread_cache_chunk");
+  g_ceph_context->_conf.rm_val("bluestore_hybrid_alloc_thread_cache_shards");
+}
@@ -8576,6 +8576,88 @@ TEST_P(StoreTestSpecificAUSize, DeferredOnBigOverwrite1) {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, AdaptiveDeferredSparseWrites) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  StartDeferred(block_size);
+  SetVal(g_conf(), "bluestore_max_blob_size", "131072");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "65536");
+  // a few deferred writes never fill a batch, they sit in the queue
+  // until the periodic force submit
+  SetVal(g_conf(), "bluestore_deferred_batch_ops", "64");
+  SetVal(g_conf(), "bluestore_max_defer_interval", "1");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size_adaptive", "true");
+  // tune by hand only
+  SetVal(g_conf(), "bluestore_prefer_deferred_size_adaptive_interval", "0");
+  g_conf().apply_changes(nullptr);
+
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t("test", "", CEPH_NOSNAP, 0, -1, ""));
+  ghobject_t hoid2(hobject_t("test2", "", CEPH_NOSNAP, 0, -1, ""));
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  ASSERT_TRUE(bstore);
+  const PerfCounters* logger = store->get_perf_counters();
+
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(block_size * 32, 'a'));
+    t.write(cid, hoid, 0, bl.length(), bl, CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->tune_prefer_deferred_size();
+  ASSERT_EQ(0u, logger->get(l_bluestore_deferred_size_shift));
+
+  auto submitted = logger->get(l_bluestore_submitted_deferred_writes);
+  for (unsigned i = 0; i < 4; ++i) {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(block_size, 'b'));
+    t.write(cid, hoid, i * block_size * 8, bl.length(), bl,
+	    CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(block_size * 32, 'c'));
+    t.write(cid, hoid2, 0, bl.length(), bl, CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // makes sure deferred has been submitted
+  sleep(g_conf().get_val<double>("bluestore_max_defer_interval") + 2);
+  ASSERT_LT(submitted, logger->get(l_bluestore_submitted_deferred_writes));
+
+  // the writes waited a second or more in the queue, but that is batching
+  // rather than the deferred path falling behind
+  bstore->tune_prefer_deferred_size();
+  ASSERT_EQ(0u, logger->get(l_bluestore_deferred_size_shift));
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTestSpecificAUSize, DeferredOnBigOverwrite2) {
 
   if (string(GetParam()) != "bluestore")
@@ -9281,6 +9363,74 @@ TEST_P(StoreTestSpecificAUSize, DeferredAndClone2) {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, DeferredPerPoolThreshold) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t alloc_size = 4096;
+  // v2 writer only defers overwrites, the checks below write fresh objects
+  SetVal(g_conf(), "bluestore_write_v2", "false");
+  SetVal(g_conf(), "bluestore_write_v2_random", "false");
+  StartDeferred(alloc_size);
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "65536");
+  g_conf().apply_changes(nullptr);
+
+  int r;
+  coll_t cid;
+  ObjectStore::CollectionHandle ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const PerfCounters* logger = store->get_perf_counters();
+  unsigned n = 0;
+  // writes 'length' bytes into a fresh object, returns whether it was deferred
+  auto write_new = [&](uint32_t length) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(n++),
+                                        CEPH_NOSNAP)));
+    auto deferred = logger->get(l_bluestore_issued_deferred_writes);
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(length, 'a'));
+    t.write(cid, hoid, 0, bl.length(), bl, CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    r = queue_transaction(store, ch, std::move(t));
+    EXPECT_EQ(r, 0);
+    return logger->get(l_bluestore_issued_deferred_writes) != deferred;
+  };
+
+  // global threshold applies while the pool does not override it
+  ASSERT_TRUE(write_new(0x4000));
+
+  pool_opts_t opts;
+  opts.set(pool_opts_t::PREFER_DEFERRED_SIZE, static_cast<int64_t>(0));
+  ASSERT_EQ(store->set_collection_opts(ch, opts), 0);
+  ASSERT_FALSE(write_new(0x1000));
+  ASSERT_FALSE(write_new(0x4000));
+
+  opts.set(pool_opts_t::PREFER_DEFERRED_SIZE, static_cast<int64_t>(0x2000));
+  ASSERT_EQ(store->set_collection_opts(ch, opts), 0);
+  ASSERT_TRUE(write_new(0x1000));
+  ASSERT_FALSE(write_new(0x4000));
+
+  opts.unset(pool_opts_t::PREFER_DEFERRED_SIZE);
+  ASSERT_EQ(store->set_collection_opts(ch, opts), 0);
+  ASSERT_TRUE(write_new(0x4000));
+
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < n; ++i) {
+      t.remove(cid, ghobject_t(hobject_t(sobject_t("Object " + stringify(i),
+                                                   CEPH_NOSNAP))));
+    }
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTestSpecificAUSize, BlobReuseOnOverwriteReverse) {
 
   if (string(GetParam()) != "bluestore")
@@ -9987,6 +10137,273 @@ namespace {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, BluestoreParallelFsck) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  StartDeferred(0x10000);
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+
+  // a collection per pool, so that partitions get different pools
+  const int64_t first_pool = 555;
+  const int64_t num_pools = 8;
+  bufferlist bl;
+  bl.append(std::string(0x18000, 'a'));
+  for (int64_t pool = first_pool; pool < first_pool + num_pools; ++pool) {
+    coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (unsigned i = 0; i < 16; ++i) {
+      string name = "Object " + stringify(i);
+      ghobject_t hoid = make_object(name.c_str(), pool);
+      t.write(cid, hoid, 0, bl.length(), bl);
+      t.omap_setheader(cid, hoid, bl);
+    }
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->umount();
+
+  SetVal(g_conf(), "bluestore_fsck_threads", "4");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(bstore->fsck(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+
+  // misreference across partitions
+  bstore->mount();
+  coll_t cid_first(spg_t(pg_t(0, first_pool), shard_id_t::NO_SHARD));
+  coll_t cid_last(spg_t(pg_t(0, first_pool + num_pools - 1),
+                        shard_id_t::NO_SHARD));
+  bstore->inject_misreference(
+    cid_first, make_object("Object 0", first_pool),
+    cid_last, make_object("Object 0", first_pool + num_pools - 1),
+    0);
+  bstore->umount();
+
+  SetVal(g_conf(), "bluestore_fsck_threads", "0");
+  g_conf().apply_changes(nullptr);
+  int serial_errors = bstore->fsck(false);
+  ASSERT_GT(serial_errors, 0);
+  SetVal(g_conf(), "bluestore_fsck_threads", "4");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(bstore->fsck(false), serial_errors);
+
+  // repair runs single-threaded regardless of the setting
+  ASSERT_EQ(bstore->repair(false), 0);
+  ASSERT_EQ(bstore->fsck(false), 0);
+  ASSERT_EQ(bstore->mount(), 0);
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreDefragObject) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  StartDeferred(0x1000);
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  const PerfCounters* logger = store->get_perf_counters();
+
+  int r;
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  const unsigned chunks = 16;
+  bufferlist expected;
+  // interleave allocations of two objects so that hoid ends up
+  // scattered over one extent per chunk
+  for (unsigned i = 0; i < chunks; ++i) {
+    ObjectStore::Transaction t;
+    bufferlist bl, bl2;
+    bl.append(std::string(0x1000, 'a' + i));
+    bl2.append(std::string(0x1000, 'z'));
+    expected.append(bl);
+    t.write(cid, hoid, i * 0x1000, bl.length(), bl);
+    t.write(cid, hoid2, i * 0x1000, bl2.length(), bl2);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid2);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // not fragmented enough by these settings
+  SetVal(g_conf(), "bluestore_defrag_min_extent_size", "4096");
+  g_conf().apply_changes(nullptr);
+  uint64_t rewritten = 0;
+  ASSERT_EQ(bstore->defrag_object(ch, hoid, &rewritten), 0);
+  ASSERT_EQ(rewritten, 0u);
+  ASSERT_EQ(logger->get(l_bluestore_defrag_scanned), 1u);
+  ASSERT_EQ(logger->get(l_bluestore_defrag_rewritten), 0u);
+
+  SetVal(g_conf(), "bluestore_defrag_min_extent_size", "65536");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(bstore->defrag_object(ch, hoid, &rewritten), 0);
+  ASSERT_EQ(rewritten, chunks * 0x1000u);
+  ASSERT_EQ(logger->get(l_bluestore_defrag_rewritten), 1u);
+  ASSERT_EQ(logger->get(l_bluestore_defrag_rewritten_bytes), chunks * 0x1000u);
+  ASSERT_GE(logger->get(l_bluestore_defrag_extents_before), 4u);
+  ASSERT_LT(logger->get(l_bluestore_defrag_extents_after),
+	    logger->get(l_bluestore_defrag_extents_before));
+
+  // already contiguous, nothing to do the second time
+  ASSERT_EQ(bstore->defrag_object(ch, hoid, &rewritten), 0);
+  ASSERT_EQ(rewritten, 0u);
+  ASSERT_EQ(bstore->defrag_object(ch, hoid2, &rewritten), -ENOENT);
+
+  bufferlist in;
+  r = store->read(ch, hoid, 0, chunks * 0x1000, in);
+  ASSERT_EQ(r, (int)(chunks * 0x1000));
+  ASSERT_TRUE(bl_eq(expected, in));
+
+  // and it survives a remount
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->mount(), 0);
+  ch = store->open_collection(cid);
+  in.clear();
+  r = store->read(ch, hoid, 0, chunks * 0x1000, in);
+  ASSERT_EQ(r, (int)(chunks * 0x1000));
+  ASSERT_TRUE(bl_eq(expected, in));
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, BluestoreAllocCheckpoint) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  if (!g_conf()->bluestore_allocation_from_file)
+    return;
+
+  SetVal(g_conf(), "bluestore_allocation_checkpoint_interval", "1");
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "0");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(0x1000);
+  const PerfCounters* logger = store->get_perf_counters();
+
+  int r;
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const unsigned objects = 32;
+  auto write_objects = [&](unsigned from, unsigned to) {
+    for (unsigned i = from; i < to; ++i) {
+      ObjectStore::Transaction t;
+      bufferlist bl;
+      bl.append(std::string(0x10000, 'a' + i % 26));
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i), CEPH_NOSNAP)));
+      t.write(cid, hoid, 0, bl.length(), bl);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  };
+  write_objects(0, objects / 2);
+
+  // wait for at least one checkpoint to cover the first half
+  for (unsigned i = 0; i < 300; ++i) {
+    if (logger->get_tavg_ns(l_bluestore_alloc_checkpoint_lat).second > 0) {
+      break;
+    }
+    usleep(100 * 1000);
+  }
+  ASSERT_GT(logger->get_tavg_ns(l_bluestore_alloc_checkpoint_lat).second, 0u);
+
+  // no more checkpoints for a while (but maybe one right after the change),
+  // these are in the delta log
+  SetVal(g_conf(), "bluestore_allocation_checkpoint_interval", "3600");
+  g_conf().apply_changes(nullptr);
+  write_objects(objects / 2, objects);
+  for (unsigned i = 0; i < objects; i += 4) {
+    ObjectStore::Transaction t;
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i), CEPH_NOSNAP)));
+    t.remove(cid, hoid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // losing the allocation file makes both fsck and mount
+  // load the checkpoint and replay the deltas
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "1");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+  ch = store->open_collection(cid);
+  for (unsigned i = 0; i < objects; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i), CEPH_NOSNAP)));
+    bufferlist in;
+    r = store->read(ch, hoid, 0, 0x10000, in);
+    if (i % 4 == 0) {
+      ASSERT_EQ(r, -ENOENT);
+    } else {
+      ASSERT_EQ(r, 0x10000);
+      bufferlist expected;
+      expected.append(std::string(0x10000, 'a' + i % 26));
+      ASSERT_TRUE(bl_eq(expected, in));
+    }
+  }
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "0");
+  g_conf().apply_changes(nullptr);
+
+  // pausing checkpoints drops the delta log and stops it from growing
+  {
+    BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+    auto* kv = bstore->get_kv();
+
+    // to be inline with BlueStore.cc
+    const string PREFIX_ALLOC_DELTA = "a";
+
+    auto count_deltas = [&]() {
+      size_t cnt = 0;
+      auto it = kv->get_iterator(PREFIX_ALLOC_DELTA);
+      ceph_assert(it);
+      for (it->lower_bound(string()); it->valid(); it->next()) {
+	++cnt;
+      }
+      return cnt;
+    };
+    write_objects(objects, objects + 4);
+    ASSERT_GT(count_deltas(), 0u);
+
+    SetVal(g_conf(), "bluestore_allocation_checkpoint_interval", "0");
+    g_conf().apply_changes(nullptr);
+    for (unsigned i = 0; i < 300 && count_deltas() > 0; ++i) {
+      usleep(100 * 1000);
+    }
+    ASSERT_EQ(count_deltas(), 0u);
+    write_objects(objects + 4, objects + 8);
+    ASSERT_EQ(count_deltas(), 0u);
+  }
+
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+}
+
 TEST_P(StoreTestSpecificAUSize, BluestoreRepairTest) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -10608,6 +11025,393 @@ TEST_P(StoreTest, BluestoreStatistics) {
   cout << std::endl;
 }
 
+TEST_P(StoreTest, BluestoreKVSyncLanes) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_kv_sync_lanes", "4");
+  // small preallocation so that several lanes race to bump nid_max
+  SetVal(g_conf(), "bluestore_nid_prealloc", "16");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  int r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+
+  const unsigned num_colls = 8;
+  const unsigned num_objs = 64;
+  vector<coll_t> cids;
+  vector<ObjectStore::CollectionHandle> chs;
+  for (unsigned i = 0; i < num_colls; ++i) {
+    coll_t cid(spg_t(pg_t(i, 7), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    cids.push_back(cid);
+    chs.push_back(ch);
+  }
+  auto obj = [](unsigned c, unsigned o) {
+    return ghobject_t(hobject_t(sobject_t("lane_obj_" + stringify(c) +
+					   "_" + stringify(o), CEPH_NOSNAP)));
+  };
+  // interleave the collections so that all lanes have work queued
+  for (unsigned o = 0; o < num_objs; ++o) {
+    for (unsigned c = 0; c < num_colls; ++c) {
+      bufferlist bl;
+      bl.append(string(4096, 'a' + (c + o) % 26));
+      ObjectStore::Transaction t;
+      t.write(cids[c], obj(c, o), 0, bl.length(), bl);
+      r = store->queue_transaction(chs[c], std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+  chs.clear();
+
+  r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+
+  for (unsigned c = 0; c < num_colls; ++c) {
+    auto ch = store->open_collection(cids[c]);
+    ASSERT_TRUE(ch);
+    for (unsigned o = 0; o < num_objs; ++o) {
+      bufferlist bl;
+      r = store->read(ch, obj(c, o), 0, 4096, bl);
+      ASSERT_EQ(4096, r);
+      ASSERT_EQ(string(4096, 'a' + (c + o) % 26), bl.to_str());
+    }
+    ObjectStore::Transaction t;
+    for (unsigned o = 0; o < num_objs; ++o) {
+      t.remove(cids[c], obj(c, o));
+    }
+    t.remove_collection(cids[c]);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestorePackedShards) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_onode_pack_shards", "true");
+  SetVal(g_conf(), "bluestore_extent_map_shard_min_size", "60");
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "300");
+  SetVal(g_conf(), "bluestore_extent_map_shard_target_size", "150");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  int r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("packed_shards", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // write every other block so that the extent map needs many shards
+  const unsigned block = 4096;
+  const unsigned num_blocks = 256;
+  string expected;
+  for (unsigned i = 0; i < num_blocks; ++i) {
+    if (i % 2 == 0) {
+      bufferlist bl;
+      bl.append(string(block, 'a' + i % 26));
+      ObjectStore::Transaction t;
+      t.write(cid, hoid, i * block, bl.length(), bl);
+      r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+      expected.append(string(block, 'a' + i % 26));
+    } else {
+      expected.append(block, '\0');
+    }
+  }
+  auto packs = logger->get(l_bluestore_onode_shard_packs);
+  ASSERT_GT(packs, 0u);
+
+  // reads materialize the packed shards again
+  auto unpacks = logger->get(l_bluestore_onode_shard_unpacks);
+  {
+    bufferlist bl;
+    r = store->read(ch, hoid, 0, num_blocks * block, bl);
+    ASSERT_EQ((int)(num_blocks * block), r);
+    ASSERT_EQ(expected, bl.to_str());
+  }
+  ASSERT_GT(logger->get(l_bluestore_onode_shard_unpacks), unpacks);
+
+  // overwrite some blocks that live in packed shards
+  for (unsigned i = 1; i < num_blocks; i += 16) {
+    bufferlist bl;
+    bl.append(string(block, 'Z'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, i * block, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    expected.replace(i * block, block, string(block, 'Z'));
+  }
+  {
+    bufferlist bl;
+    r = store->read(ch, hoid, 0, num_blocks * block, bl);
+    ASSERT_EQ((int)(num_blocks * block), r);
+    ASSERT_EQ(expected, bl.to_str());
+  }
+
+  ch.reset();
+  r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+  ch = store->open_collection(cid);
+  {
+    bufferlist bl;
+    r = store->read(ch, hoid, 0, num_blocks * block, bl);
+    ASSERT_EQ((int)(num_blocks * block), r);
+    ASSERT_EQ(expected, bl.to_str());
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreOnodeConcurrentLookup) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  // tiny cache so that lookups keep racing with evictions
+  SetVal(g_conf(), "bluestore_cache_size_ssd", "0");
+  SetVal(g_conf(), "bluestore_cache_size_hdd", "0");
+  SetVal(g_conf(), "bluestore_cache_size", "0");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  int r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto obj = [](const string& prefix, unsigned i) {
+    return ghobject_t(hobject_t(sobject_t(prefix + stringify(i),
+					  CEPH_NOSNAP)));
+  };
+  const unsigned num_hot = 16;
+  bufferlist attr;
+  attr.append("hot");
+  for (unsigned i = 0; i < num_hot; ++i) {
+    ObjectStore::Transaction t;
+    t.touch(cid, obj("hot_", i));
+    t.setattr(cid, obj("hot_", i), "a", attr);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  std::atomic<bool> stop = false;
+  std::atomic<unsigned> errors = 0;
+  std::vector<std::thread> readers;
+  for (unsigned n = 0; n < 4; ++n) {
+    readers.emplace_back([&, n] {
+      unsigned i = n;
+      while (!stop) {
+	bufferptr bp;
+	if (store->getattr(ch, obj("hot_", i % num_hot), "a", bp) < 0 ||
+	    string(bp.c_str(), bp.length()) != "hot") {
+	  ++errors;
+	}
+	++i;
+      }
+    });
+  }
+  // churn the cache with inserts, renames and removals
+  for (unsigned i = 0; i < 256; ++i) {
+    ObjectStore::Transaction t;
+    t.touch(cid, obj("cold_", i));
+    if (i % 2) {
+      t.collection_move_rename(cid, obj("cold_", i), cid, obj("moved_", i));
+    }
+    if (i % 3 == 0) {
+      t.remove(cid, i % 2 ? obj("moved_", i) : obj("cold_", i));
+    }
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  stop = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  ASSERT_EQ(0u, errors);
+
+  for (unsigned i = 0; i < 256; ++i) {
+    struct stat st;
+    bool moved = i % 2;
+    bool removed = i % 3 == 0;
+    ASSERT_EQ(removed ? -ENOENT : 0,
+	      store->stat(ch, moved ? obj("moved_", i) : obj("cold_", i), &st));
+    if (moved) {
+      ASSERT_EQ(-ENOENT, store->stat(ch, obj("cold_", i), &st));
+    }
+  }
+}
+
+TEST_P(StoreTest, BluestoreDecompressedCache) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_compression_algorithm", "snappy");
+  SetVal(g_conf(), "bluestore_compression_mode", "force");
+  SetVal(g_conf(), "bluestore_cache_decompressed_ratio", "0.1");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  int r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("decompressed_cache", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  const unsigned size = 256 * 1024;
+  string expected;
+  for (unsigned i = 0; i < size / 4096; ++i) {
+    expected.append(4096, 'a' + i % 26);
+  }
+  {
+    bufferlist bl;
+    bl.append(expected);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto check_read = [&](unsigned off, unsigned len) {
+    bufferlist bl;
+    int r = store->read(ch, hoid, off, len, bl,
+			CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    ASSERT_EQ((int)len, r);
+    ASSERT_EQ(expected.substr(off, len), bl.to_str());
+  };
+  // the cache gets its size from the mempool thread, give it a moment
+  auto hits = logger->get(l_bluestore_decompressed_hit_bytes);
+  for (unsigned i = 0;
+       i < 50 && logger->get(l_bluestore_decompressed_hit_bytes) == hits;
+       ++i) {
+    check_read(1000, 3000);
+    usleep(100 * 1000);
+  }
+  ASSERT_GT(logger->get(l_bluestore_decompressed_hit_bytes), hits);
+
+  // small random reads are served from the cache
+  for (unsigned i = 0; i < 100; ++i) {
+    unsigned off = rand() % (size - 1);
+    check_read(off, std::min<unsigned>(size - off, 1 + rand() % 8192));
+  }
+
+  // overwrites release the compressed blobs, which drops their entries
+  {
+    string z(64 * 1024, 'z');
+    bufferlist bl;
+    bl.append(z);
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 64 * 1024, bl.length(), bl);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    expected.replace(64 * 1024, z.size(), z);
+  }
+  for (unsigned i = 0; i < 100; ++i) {
+    unsigned off = rand() % (size - 1);
+    check_read(off, std::min<unsigned>(size - off, 1 + rand() % 8192));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreReadMerge) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_max_blob_size", "65536");
+  SetVal(g_conf(), "bluestore_compression_mode", "none");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  int r = store->umount();
+  ASSERT_EQ(r, 0);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("read_merge", CEPH_NOSNAP)));
+  auto ch = store->create_new_collection(cid);
+  const unsigned size = 1024 * 1024;
+  string expected;
+  for (unsigned i = 0; i < size / 4096; ++i) {
+    expected.append(4096, 'a' + i % 26);
+  }
+  {
+    // one write, so blobs are allocated next to each other
+    bufferlist bl;
+    bl.append(expected);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl, CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto check_read = [&](unsigned off, unsigned len) {
+    bufferlist bl;
+    int r = store->read(ch, hoid, off, len, bl,
+			CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    ASSERT_EQ((int)len, r);
+    ASSERT_EQ(expected.substr(off, len), bl.to_str());
+  };
+
+  auto merged = logger->get(l_bluestore_read_merged);
+  check_read(0, size);
+  check_read(0x1000, size - 0x3000);
+  ASSERT_GT(logger->get(l_bluestore_read_merged), merged);
+
+  SetVal(g_conf(), "bluestore_read_merge_max_bytes", "0");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  merged = logger->get(l_bluestore_read_merged);
+  check_read(0, size);
+  check_read(0x1000, size - 0x3000);
+  ASSERT_EQ(logger->get(l_bluestore_read_merged), merged);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, BluestoreStrayOmapDetection)
 {
   if (string(GetParam()) != "bluestore")
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <thread>
 #include <gtest/gtest.h>
 #include "global/global_init.h"
 #include "global/global_context.h"
@@ -91,6 +92,68 @@ TEST(KernelDevice, Ticket45337) {
   b->close();
 }
 
+TEST(KernelDevice, IoringBatchSubmit) {
+  // concurrent aio_submit() callers coalesced into shared submissions,
+  // with small writes going through registered buffers.  falls back to
+  // libaio when io_uring is not available, which must behave the same.
+  uint64_t size = 1048576ull * 64;
+  TempBdev bdev{ size };
+
+  g_ceph_context->_conf.set_val("bdev_ioring", "true");
+  g_ceph_context->_conf.set_val("bdev_ioring_batch_submit", "true");
+  g_ceph_context->_conf.set_val("bdev_ioring_fixed_buffers", "8");
+  g_ceph_context->_conf.set_val("bdev_ioring_fixed_buffer_size", "8192");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  int r = b->open(bdev.path);
+  ASSERT_EQ(r, 0);
+
+  const unsigned num_threads = 8;
+  const unsigned ios_per_thread = 64;
+  const uint64_t io_size = 0x1000;
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      for (unsigned i = 0; i < ios_per_thread; ++i) {
+	uint64_t off = (t * ios_per_thread + i) * io_size * 2;
+	// alternate between writes that fit in a registered buffer
+	// and writes that do not
+	uint64_t len = (i % 2) ? io_size : io_size * 2;
+	bufferlist bl;
+	bl.append(string(len, 'a' + (t + i) % 26));
+	IOContext ioc(g_ceph_context, NULL);
+	ASSERT_EQ(0, b->aio_write(off, bl, &ioc, false));
+	b->aio_submit(&ioc);
+	ioc.aio_wait();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (unsigned t = 0; t < num_threads; ++t) {
+    for (unsigned i = 0; i < ios_per_thread; ++i) {
+      uint64_t off = (t * ios_per_thread + i) * io_size * 2;
+      uint64_t len = (i % 2) ? io_size : io_size * 2;
+      bufferlist bl;
+      IOContext ioc(g_ceph_context, NULL);
+      ASSERT_EQ(0, b->read(off, len, &bl, &ioc, false));
+      ASSERT_EQ(string(len, 'a' + (t + i) % 26), bl.to_str());
+    }
+  }
+  b->close();
+
+  g_ceph_context->_conf.rm_val("bdev_ioring");
+  g_ceph_context->_conf.rm_val("bdev_ioring_batch_submit");
+  g_ceph_context->_conf.rm_val("bdev_ioring_fixed_buffers");
+  g_ceph_context->_conf.rm_val("bdev_ioring_fixed_buffer_size");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   map<string,string> defaults = {
@@ -825,6 +825,157 @@ TEST(BlueFS, test_replay_growth) {
   fs.umount();
 }
 
+TEST(BlueFS, test_replay_readahead) {
+  uint64_t size = 1048576LL * (2 * 1024 + 128);
+  TempBdev bdev{size};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_alloc_size", "4096");
+  conf.SetVal("bluefs_shared_alloc_size", "4096");
+  conf.SetVal("bluefs_compact_log_sync", "false");
+  conf.SetVal("bluefs_min_log_runway", "32768");
+  conf.SetVal("bluefs_max_log_runway", "65536");
+  conf.SetVal("bluefs_allocator", "stupid");
+  conf.SetVal("bluefs_sync_write", "true");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+
+  // lots of small records while the log keeps growing new extents
+  char data[2000] = {'x'};
+  BlueFS::FileWriter *h;
+  ASSERT_EQ(0, fs.open_for_write("dir", "file", &h, false));
+  for (size_t i = 0; i < 5000; i++) {
+    h->append(data, 2000);
+    fs.fsync(h);
+  }
+  fs.close_writer(h);
+  fs.umount(true); //do not compact on exit!
+
+  // replay serially and with readahead smaller, and larger, than a
+  // log extent; all must end up in the same place
+  uint64_t records = 0;
+  for (auto readahead : {"0", "8192", "16777216"}) {
+    conf.SetVal("bluefs_log_replay_readahead", readahead);
+    conf.ApplyChanges();
+    ASSERT_EQ(0, fs.mount());
+    uint64_t file_size;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("dir", "file", &file_size, &mtime));
+    ASSERT_EQ(5000u * 2000, file_size);
+    auto *logger = fs.get_perf_counters();
+    if (!records) {
+      records = logger->get(l_bluefs_replay_records);
+      ASSERT_GT(records, 5000u);
+    } else {
+      ASSERT_EQ(records, logger->get(l_bluefs_replay_records));
+    }
+    fs.umount(true);
+  }
+}
+
+TEST(BlueFS, test_wal_ring) {
+  uint64_t size = 1048576 * 256;
+  TempBdev bdev{size};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_wal_ring_size", "8388608");
+  conf.SetVal("bluefs_wal_ring_chunk_size", "1048576");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("db"));
+  // enough for a file to cross into its second chunk
+  auto wait_for_ring = [&]() {
+    for (int i = 0; i < 100; i++) {
+      if (fs.get_perf_counters()->get(l_bluefs_wal_ring_avail_bytes) >=
+	  2 * 1048576) {
+	return true;
+      }
+      usleep(100000);
+    }
+    return false;
+  };
+  ASSERT_TRUE(wait_for_ring());
+
+  char data[4000];
+  memset(data, 'w', sizeof(data));
+  // past the first chunk, so that another one is taken
+  const unsigned num_appends = 400;
+  BlueFS::FileWriter *h;
+  ASSERT_EQ(0, fs.open_for_write("db", "000001.log", &h, false));
+  h->append(data, sizeof(data));
+  fs.fsync(h);
+  auto *logger = fs.get_perf_counters();
+  uint64_t log_writes = logger->get(l_bluefs_log_write_count);
+  for (unsigned i = 1; i < num_appends; i++) {
+    h->append(data, sizeof(data));
+    fs.fsync(h);
+  }
+  // only crossing into the second chunk had to touch the log
+  ASSERT_LE(logger->get(l_bluefs_log_write_count), log_writes + 1);
+  ASSERT_GE(logger->get(l_bluefs_wal_ring_fsyncs), num_appends - 2);
+  ASSERT_EQ(0u, logger->get(l_bluefs_wal_ring_misses));
+
+  // go down without closing it, as a crash would
+  fs.umount(true);
+  ASSERT_EQ(0, fs.mount());
+  uint64_t file_size;
+  utime_t mtime;
+  ASSERT_EQ(0, fs.stat("db", "000001.log", &file_size, &mtime));
+  ASSERT_EQ(2u * 1048576, file_size);
+  {
+    BlueFS::FileReader *r;
+    ASSERT_EQ(0, fs.open_for_read("db", "000001.log", &r));
+    bufferlist bl;
+    ASSERT_EQ((int64_t)file_size, fs.read(r, 0, file_size, &bl, NULL));
+    const char *p = bl.c_str();
+    for (uint64_t i = 0; i < file_size; i++) {
+      ASSERT_EQ(i < num_appends * sizeof(data) ? 'w' : 0, p[i]);
+    }
+    delete r;
+  }
+  fs.close_writer(h);
+
+  // closing the way rocksdb does logs the exact size
+  ASSERT_TRUE(wait_for_ring());
+  ASSERT_EQ(0, fs.open_for_write("db", "000002.log", &h, false));
+  h->append(data, sizeof(data));
+  fs.fsync(h);
+  ASSERT_EQ(0, fs.truncate(h, h->pos));
+  fs.fsync(h);
+  fs.close_writer(h);
+  fs.umount(true);
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.stat("db", "000002.log", &file_size, &mtime));
+  ASSERT_EQ(sizeof(data), file_size);
+  fs.umount();
+
+  // BlueFS without WAL ring support must not mount this any more
+  {
+    bufferlist bl;
+    std::string err;
+    ASSERT_EQ(0, bl.read_file(bdev.path.c_str(), &err));
+    bufferlist super_bl;
+    super_bl.substr_of(bl, 4096, 4096);
+    auto p = super_bl.cbegin();
+    bluefs_super_t super;
+    decode(super, p);
+    ASSERT_TRUE(super.incompat & bluefs_super_t::INCOMPAT_WAL_RING);
+    // encoded with a compat version older decoders refuse
+    ASSERT_EQ(4u, (unsigned)(uint8_t)super_bl[1]);
+  }
+}
+
 TEST(BlueFS, test_tracker_50965) {
   uint64_t size_wal = 1048576 * 64;
   TempBdev bdev_wal{size_wal};
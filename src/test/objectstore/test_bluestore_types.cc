@@ -393,6 +393,63 @@ TEST(bluestore_blob_t, calc_csum) {
   }
 }
 
+TEST(bluestore_blob_t, calc_csum_fragmented) {
+  // more blocks than one Checksummer batch, with buffer boundaries both on
+  // and off block boundaries
+  const unsigned block = 4096;
+  const unsigned blocks = 150;
+  bufferptr bp(block * blocks);
+  for (unsigned i = 0; i < bp.length(); ++i)
+    bp.c_str()[i] = (i * 31 + i / block) & 0xff;
+  bufferlist flat;
+  flat.append(bp);
+  bufferlist frag;
+  for (unsigned off = 0, i = 0; off < bp.length(); ++i) {
+    unsigned len = std::min<unsigned>(
+      (i % 3 == 0) ? block * 5 : 1000 + i * 7, bp.length() - off);
+    frag.append(bufferptr(bp, off, len));
+    off += len;
+  }
+  ASSERT_TRUE(frag.get_num_buffers() > 1);
+
+  for (unsigned csum_type = Checksummer::CSUM_NONE + 1;
+       csum_type < Checksummer::CSUM_MAX; ++csum_type) {
+    cout << "csum_type " << Checksummer::get_csum_type_string(csum_type)
+         << std::endl;
+    bluestore_blob_t a, b;
+    a.init_csum(csum_type, 12, flat.length());
+    b.init_csum(csum_type, 12, frag.length());
+    a.calc_csum(0, flat);
+    b.calc_csum(0, frag);
+    ASSERT_EQ(a.csum_data.length(), b.csum_data.length());
+    ASSERT_EQ(0, memcmp(a.csum_data.c_str(), b.csum_data.c_str(),
+			a.csum_data.length()));
+    for (unsigned i = 0; i < blocks; ++i) {
+      bufferlist one;
+      one.substr_of(flat, i * block, block);
+      bluestore_blob_t c;
+      c.init_csum(csum_type, 12, flat.length());
+      c.calc_csum(i * block, one);
+      ASSERT_EQ(c.get_csum_item(i), a.get_csum_item(i));
+    }
+
+    int bad_off;
+    uint64_t bad_csum;
+    ASSERT_EQ(0, a.verify_csum(0, frag, &bad_off, &bad_csum));
+    ASSERT_EQ(-1, bad_off);
+    ASSERT_EQ(0, b.verify_csum(0, flat, &bad_off, &bad_csum));
+    ASSERT_EQ(-1, bad_off);
+
+    for (unsigned bad : { 0u, 63u, 64u, 101u, blocks - 1 }) {
+      bufferlist copy;
+      copy.append(bp.c_str(), bp.length());
+      copy.c_str()[bad * block + 17] ^= 0x5a;
+      ASSERT_EQ(-1, a.verify_csum(0, copy, &bad_off, &bad_csum));
+      ASSERT_EQ((int)(bad * block), bad_off);
+    }
+  }
+}
+
 TEST(bluestore_blob_t, csum_bench) {
   bufferlist bl;
   bufferptr bp(10485760);
@@ -2352,7 +2409,6 @@ TEST_P(BlueStoreWriteFixture, deferred_check)
   uint64_t disk_size = (uint64_t)1024 * 1024 * 1024 * 1024;
   store->debug_get_alloc() = Allocator::create(g_ceph_context, "avl", disk_size, au_size);
   store->debug_get_alloc()->init_add_free(0, disk_size);
-  store->debug_set_prefer_deferred_size(65536);
   uint64_t needless_deferred = 0;
   uint64_t needless_deferred_cnt = 0;
   for (int i = 0; i < 1000; i++) {
@@ -2360,6 +2416,7 @@ TEST_P(BlueStoreWriteFixture, deferred_check)
     BlueStore::WriteContext wctx;
     wctx.csum_type = checksum_type;
     wctx.csum_order = checksum_order;
+    wctx.prefer_deferred_size = 65536;
     BlueStore::Onode* o = new BlueStore::Onode(coll.get(), ghobject_t(), "");
     BlueStore::Writer w(store, &txc, &wctx, o);
     check_writer pw;
@@ -3959,6 +4016,31 @@ TEST(bluestore_blob_use_tracker_t, mempool_stats_test) {
   }
 }
 
+TEST(BlueStore, next_prefer_deferred_shift) {
+  // args: shift, deferred ops, deferred avg ns, direct avg ns, backlog, batch
+
+  // deferred writes much slower than direct ones halve the threshold
+  ASSERT_EQ(1u, BlueStore::next_prefer_deferred_shift(0, 10, 5000, 1000, 0, 16));
+  ASSERT_EQ(3u, BlueStore::next_prefer_deferred_shift(2, 10, 5000, 1000, 0, 16));
+  // so does a backlog of two batches or more
+  ASSERT_EQ(1u, BlueStore::next_prefer_deferred_shift(0, 10, 1000, 1000, 32, 16));
+  ASSERT_EQ(1u, BlueStore::next_prefer_deferred_shift(0, 10, 1000, 0, 2, 0));
+  // the shift is capped
+  ASSERT_EQ(16u, BlueStore::next_prefer_deferred_shift(16, 10, 5000, 1000, 0, 16));
+
+  // once deferred writes keep up the threshold grows back
+  ASSERT_EQ(1u, BlueStore::next_prefer_deferred_shift(2, 10, 1000, 1000, 0, 16));
+  ASSERT_EQ(1u, BlueStore::next_prefer_deferred_shift(2, 10, 1000, 0, 8, 16));
+  ASSERT_EQ(0u, BlueStore::next_prefer_deferred_shift(0, 10, 1000, 1000, 0, 16));
+  // but not while they are only moderately slower or somewhat backlogged
+  ASSERT_EQ(2u, BlueStore::next_prefer_deferred_shift(2, 10, 3000, 1000, 0, 16));
+  ASSERT_EQ(2u, BlueStore::next_prefer_deferred_shift(2, 10, 1000, 1000, 20, 16));
+
+  // an idle interval lets it grow back as well
+  ASSERT_EQ(1u, BlueStore::next_prefer_deferred_shift(2, 0, 0, 1000, 0, 16));
+  ASSERT_EQ(0u, BlueStore::next_prefer_deferred_shift(0, 0, 0, 0, 0, 16));
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   auto cct =
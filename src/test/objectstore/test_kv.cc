@@ -359,6 +359,52 @@ TEST_P(KVTest, ShardingRMRange) {
 }
 
 
+TEST_P(KVTest, MultiGet) {
+  if(string(GetParam()) != "rocksdb")
+    return;
+  // "O" is sharded over column families, "P" lives in the default one
+  std::string cfs("O(3)");
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (size_t i = 0; i < 100; i += 2) {
+      bufferlist value;
+      value.append("value" + stringify(i));
+      t->set("O", "key" + stringify(i), value);
+      t->set("P", "key" + stringify(i), value);
+    }
+    db->submit_transaction_sync(t);
+  }
+  for (auto prefix : {"O", "P"}) {
+    // unsorted, with misses and duplicates
+    vector<string> keys;
+    for (size_t i = 0; i < 100; ++i) {
+      keys.push_back("key" + stringify((i * 37) % 100));
+    }
+    keys.push_back("key10");
+    vector<bufferlist> values(3);
+    vector<int> rs;
+    db->multi_get(prefix, keys, &values, &rs);
+    ASSERT_EQ(keys.size(), values.size());
+    ASSERT_EQ(keys.size(), rs.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      bufferlist v;
+      int r = db->get(prefix, keys[i], &v);
+      ASSERT_EQ(r, rs[i]);
+      ASSERT_EQ(_bl_to_str(v), _bl_to_str(values[i]));
+    }
+
+    std::set<string> kset(keys.begin(), keys.end());
+    std::map<string, bufferlist> out;
+    ASSERT_EQ(0, db->get(prefix, kset, &out));
+    ASSERT_EQ(50u, out.size());
+    for (auto& [k, v] : out) {
+      ASSERT_EQ("value" + k.substr(3), _bl_to_str(v));
+    }
+  }
+  fini();
+}
+
 TEST_P(KVTest, RocksDBColumnFamilyTest) {
   if(string(GetParam()) != "rocksdb")
     return;
@@ -1248,6 +1294,161 @@ TEST_F(RocksDBResharding, prevent_incomplete_hash_change) {
   db->close();
 }
 
+bool online_reshard_running(RocksDBStore* db) {
+  JSONFormatter f;
+  db->dump_online_reshard(&f);
+  std::stringstream ss;
+  f.flush(ss);
+  return ss.str().find("\"running\"") != std::string::npos;
+}
+
+TEST_F(RocksDBResharding, online) {
+  g_conf().set_val_or_die("rocksdb_online_reshard_keys_per_batch", "100");
+  g_conf().set_val_or_die("rocksdb_online_reshard_bytes_per_sec", "0");
+  ASSERT_EQ(0, db->create_and_open(cout, "D(2) Evade(4)"));
+  generate_data();
+  data_to_db();
+  check_db();
+  std::stringstream ss;
+  ASSERT_EQ(db->start_online_reshard("Evade(6,0-8)", ss), 0);
+  ASSERT_EQ(db->start_online_reshard("Evade(2)", ss), -EBUSY);
+  // keep updating the column while it is being moved
+  std::vector<std::string> keys;
+  for (auto& d : data) {
+    if (d.first.compare(0, 6, RocksDBStore::combine_strings("Evade", "")) == 0) {
+      keys.push_back(d.first);
+    }
+  }
+  for (int i = 0; i < 300; i++) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    auto& k = keys[rand() % keys.size()];
+    string prefix;
+    string key;
+    RocksDBStore::split_key(k, &prefix, &key);
+    if (i % 3 == 0 && data.count(k)) {
+      t->rmkey(prefix, key);
+      data.erase(k);
+    } else {
+      std::string value = randoms[rand() % R] + stringify(i);
+      bufferlist v;
+      v.append(value);
+      t->set(prefix, key, v);
+      data[k] = value;
+    }
+    ASSERT_EQ(db->submit_transaction_sync(t), 0);
+    bufferlist out;
+    ASSERT_EQ(db->get(prefix, key, &out), data.count(k) ? 0 : -ENOENT);
+  }
+  while (online_reshard_running(db.get())) {
+    usleep(10000);
+  }
+  check_db();
+  db->close();
+  // the stored sharding now describes the new columns
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  db->close();
+  g_conf().rm_val("rocksdb_online_reshard_keys_per_batch");
+  g_conf().rm_val("rocksdb_online_reshard_bytes_per_sec");
+}
+
+TEST_F(RocksDBResharding, online_submit_after_finish) {
+  // the mover pauses for about a second after its first key, the
+  // transactions below are built while the old layout is still in use
+  g_conf().set_val_or_die("rocksdb_online_reshard_keys_per_batch", "1");
+  g_conf().set_val_or_die("rocksdb_online_reshard_bytes_per_sec", "40");
+  ASSERT_EQ(0, db->create_and_open(cout, "D(2) Evade(4)"));
+  generate_data();
+  data_to_db();
+  check_db();
+  // created before the reshard starts, first written to after it
+  KeyValueDB::Transaction early = db->get_transaction();
+  std::stringstream ss;
+  ASSERT_EQ(db->start_online_reshard("Evade(6,0-8)", ss), 0);
+  KeyValueDB::Transaction t = db->get_transaction();
+  int i = 0;
+  for (auto& [k, v] : data) {
+    string prefix;
+    string key;
+    RocksDBStore::split_key(k, &prefix, &key);
+    if (prefix != "Evade") {
+      continue;
+    }
+    v = "updated" + stringify(i);
+    bufferlist bl;
+    bl.append(v);
+    (i++ % 2 ? t : early)->set(prefix, key, bl);
+  }
+  ASSERT_TRUE(online_reshard_running(db.get()));
+  g_conf().set_val_or_die("rocksdb_online_reshard_keys_per_batch", "1000");
+  g_conf().set_val_or_die("rocksdb_online_reshard_bytes_per_sec", "0");
+  while (online_reshard_running(db.get())) {
+    usleep(10000);
+  }
+  // the old layout was retired after the batches were routed
+  ASSERT_EQ(db->submit_transaction_sync(early), 0);
+  ASSERT_EQ(db->submit_transaction_sync(t), 0);
+  check_db();
+  db->close();
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  db->close();
+  g_conf().rm_val("rocksdb_online_reshard_keys_per_batch");
+  g_conf().rm_val("rocksdb_online_reshard_bytes_per_sec");
+}
+
+TEST_F(RocksDBResharding, online_resume_after_close) {
+  // slow enough for the close below to interrupt the move
+  g_conf().set_val_or_die("rocksdb_online_reshard_keys_per_batch", "1");
+  g_conf().set_val_or_die("rocksdb_online_reshard_bytes_per_sec", "40");
+  ASSERT_EQ(0, db->create_and_open(cout, "D(2) Evade(4)"));
+  generate_data();
+  data_to_db();
+  check_db();
+  std::stringstream ss;
+  ASSERT_EQ(db->start_online_reshard("Evade(6,0-8)", ss), 0);
+  usleep(100000);
+  int i = 0;
+  KeyValueDB::Transaction t = db->get_transaction();
+  for (auto& [k, v] : data) {
+    string prefix;
+    string key;
+    RocksDBStore::split_key(k, &prefix, &key);
+    if (prefix == "Evade" && i++ % 3 == 0) {
+      v = "updated" + stringify(i);
+      bufferlist bl;
+      bl.append(v);
+      t->set(prefix, key, bl);
+    }
+  }
+  ASSERT_EQ(db->submit_transaction_sync(t), 0);
+  ASSERT_TRUE(online_reshard_running(db.get()));
+  db->close();
+
+  // both layouts are read while the move is pending
+  ASSERT_EQ(db->open_read_only(cout), 0);
+  check_db();
+  db->close();
+
+  g_conf().set_val_or_die("rocksdb_online_reshard_keys_per_batch", "1000");
+  g_conf().set_val_or_die("rocksdb_online_reshard_bytes_per_sec", "0");
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  while (online_reshard_running(db.get())) {
+    usleep(10000);
+  }
+  check_db();
+  std::string sharding;
+  ASSERT_TRUE(db->get_sharding(sharding));
+  ASSERT_NE(sharding.find("Evade(6,0-8)"), std::string::npos);
+  db->close();
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  db->close();
+  g_conf().rm_val("rocksdb_online_reshard_keys_per_batch");
+  g_conf().rm_val("rocksdb_online_reshard_bytes_per_sec");
+}
+
 TEST_F(RocksDBResharding, change_reshard) {
   ASSERT_EQ(0, db->create_and_open(cout, "Ad(4)"));
   generate_data();
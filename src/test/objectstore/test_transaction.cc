@@ -175,6 +175,96 @@ TEST(Transaction, GetNumBytes)
   ASSERT_TRUE(a.get_encoded_bytes() == a.get_encoded_bytes_test());
 }
 
+TEST(Transaction, ObjectIndex)
+{
+  // enough objects and collections to go past the linear scan, added out
+  // of key order and referenced more than once
+  auto a = ObjectStore::Transaction{};
+  std::vector<coll_t> colls;
+  std::vector<ghobject_t> oids;
+  for (int i = 0; i < 40; ++i) {
+    colls.push_back(coll_t(spg_t(pg_t(i % 20, 1), shard_id_t::NO_SHARD)));
+    oids.push_back(ghobject_t(hobject_t(
+      "obj" + stringify(1000 - i % 30), "", CEPH_NOSNAP, i % 30, 1, "")));
+  }
+  for (int i = 0; i < 40; ++i) {
+    a.touch(colls[i], oids[i]);
+    a.clone(colls[i], oids[i], oids[39 - i]);
+  }
+
+  auto check = [&](ObjectStore::Transaction& t) {
+    auto i = t.begin();
+    for (int n = 0; n < 40; ++n) {
+      auto op = i.decode_op();
+      ASSERT_EQ(ObjectStore::Transaction::OP_TOUCH, op->op);
+      ASSERT_EQ(colls[n], i.get_cid(op->cid));
+      ASSERT_EQ(oids[n], i.get_oid(op->oid));
+      op = i.decode_op();
+      ASSERT_EQ(ObjectStore::Transaction::OP_CLONE, op->op);
+      ASSERT_EQ(oids[n], i.get_oid(op->oid));
+      ASSERT_EQ(oids[39 - n], i.get_oid(op->dest_oid));
+    }
+    ASSERT_FALSE(i.have_op());
+    ASSERT_EQ(20u, i.colls.size());
+    ASSERT_EQ(30u, i.objects.size());
+  };
+  check(a);
+  ASSERT_EQ(a.get_encoded_bytes(), a.get_encoded_bytes_test());
+
+  bufferlist bl;
+  encode(a, bl);
+  auto p = bl.cbegin();
+  ObjectStore::Transaction b(p);
+  check(b);
+
+  // the same ids are found again after decode and after append
+  b.touch(colls[7], oids[7]);
+  auto c = ObjectStore::Transaction{};
+  c.touch(colls[3], oids[3]);
+  c.append(b);
+  auto i = c.begin();
+  ASSERT_EQ(20u, i.colls.size());
+  ASSERT_EQ(30u, i.objects.size());
+
+  // encode/decode is stable
+  bufferlist bl2;
+  encode(b, bl2);
+  auto p2 = bl2.cbegin();
+  ObjectStore::Transaction d(p2);
+  bufferlist bl3;
+  encode(d, bl3);
+  ASSERT_TRUE(bl2.contents_equal(bl3));
+}
+
+TEST(Transaction, WriteMove)
+{
+  coll_t c(spg_t(pg_t(1,2), shard_id_t::NO_SHARD));
+  ghobject_t o(hobject_t("obj", "", 123, 456, -1, ""));
+  bufferlist bl;
+  bl.append("some data");
+  bufferlist attr;
+  attr.append("some attr");
+
+  auto a = ObjectStore::Transaction{};
+  a.write(c, o, 1, bl.length(), bl);
+  a.setattr(c, o, "_", attr);
+
+  auto b = ObjectStore::Transaction{};
+  bufferlist moved = bl;
+  bufferlist moved_attr = attr;
+  b.write(c, o, 1, moved.length(), std::move(moved));
+  b.setattr(c, o, std::string("_"), std::move(moved_attr));
+  ASSERT_EQ(0u, moved.length());
+  ASSERT_EQ(0u, moved_attr.length());
+
+  bufferlist abl, bbl;
+  encode(a, abl);
+  encode(b, bbl);
+  ASSERT_TRUE(abl.contents_equal(bbl));
+  ASSERT_EQ(a.get_data_offset(), b.get_data_offset());
+  ASSERT_EQ(a.get_data_length(), b.get_data_length());
+}
+
 void bench_num_bytes(bool legacy)
 {
   const int max = 2500000;
@@ -33,7 +33,9 @@ static void usage()
       "	 --threads\n"
       "	       number of threads to carry out this workload\n"
       "	 --multi-object\n"
-    "	       have each thread write to a separate object\n" << std::endl;
+    "	       have each thread write to a separate object\n"
+      "	 --small-objects\n"
+    "	       write each block to a new object in its own transaction\n" << std::endl;
   generic_server_usage();
 }
 
@@ -77,10 +79,11 @@ struct Config {
   int repeats;
   int threads;
   bool multi_object;
+  bool small_objects;
   Config()
     : size(1048576), block_size(4096),
       repeats(1), threads(1),
-      multi_object(false) {}
+      multi_object(false), small_objects(false) {}
 };
 
 class C_NotifyCond : public Context {
@@ -148,6 +151,42 @@ void osbench_worker(ObjectStore *os, const Config &cfg,
   }
 }
 
+// one transaction per object, all in flight at once, so that the store
+// gets to batch their commits
+void osbench_small_object_worker(ObjectStore *os, const Config &cfg,
+				 const coll_t cid, int thread)
+{
+  bufferlist data;
+  data.append(buffer::create(cfg.block_size));
+
+  size_t count = cfg.size / cfg.block_size;
+  dout(0) << "Writing " << count << " objects of " << cfg.block_size << dendl;
+
+  ObjectStore::CollectionHandle ch = os->open_collection(cid);
+  ceph_assert(ch);
+
+  for (int i = 0; i < cfg.repeats; ++i) {
+    std::cout << "Write cycle " << i << std::endl;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+    for (size_t n = 0; n < count; ++n) {
+      std::stringstream oss;
+      oss << "osbench-" << thread << "-" << n;
+      ghobject_t oid(hobject_t(sobject_t(oss.str(), CEPH_NOSNAP)));
+      ObjectStore::Transaction t;
+      t.write(cid, oid, 0, cfg.block_size, data);
+      if (n + 1 == count) {
+	// commits complete in order within a collection
+	t.register_on_commit(new C_NotifyCond(&mutex, &cond, &done));
+      }
+      os->queue_transaction(ch, std::move(t));
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&done](){ return done; });
+  }
+}
+
 int main(int argc, const char *argv[])
 {
   // command-line arguments
@@ -191,6 +230,8 @@ int main(int argc, const char *argv[])
       cfg.threads = atoi(val.c_str());
     } else if (ceph_argparse_flag(args, i, "--multi-object", (char*)nullptr)) {
       cfg.multi_object = true;
+    } else if (ceph_argparse_flag(args, i, "--small-objects", (char*)nullptr)) {
+      cfg.small_objects = true;
     } else {
       derr << "Error: can't understand argument: " << *i << "\n" << dendl;
       exit(1);
@@ -207,6 +248,7 @@ int main(int argc, const char *argv[])
   dout(0) << "block-size " << cfg.block_size << dendl;
   dout(0) << "repeats " << cfg.repeats << dendl;
   dout(0) << "threads " << cfg.threads << dendl;
+  dout(0) << "small-objects " << cfg.small_objects << dendl;
 
   auto os =
       ObjectStore::create(g_ceph_context,
@@ -302,6 +344,11 @@ int main(int argc, const char *argv[])
   using namespace std::chrono;
   auto t1 = high_resolution_clock::now();
   for (int i = 0; i < cfg.threads; i++) {
+    if (cfg.small_objects) {
+      workers.emplace_back(osbench_small_object_worker, os.get(),
+			   std::ref(cfg), cid, i);
+      continue;
+    }
     const auto &oid = cfg.multi_object ? oids[i] : oids[0];
     workers.emplace_back(osbench_worker, os.get(), std::ref(cfg),
                          cid, oid, i * cfg.size / cfg.threads);
@@ -323,6 +370,15 @@ int main(int argc, const char *argv[])
   ObjectStore::Transaction t;
   for (const auto &oid : oids)
     t.remove(cid, oid);
+  if (cfg.small_objects) {
+    for (int i = 0; i < cfg.threads; i++) {
+      for (size_t n = 0; n < cfg.size / cfg.block_size; ++n) {
+	std::stringstream oss;
+	oss << "osbench-" << i << "-" << n;
+	t.remove(cid, ghobject_t(hobject_t(sobject_t(oss.str(), CEPH_NOSNAP))));
+      }
+    }
+  }
   os->queue_transaction(ch, std::move(t));
 
   os->umount();
@@ -0,0 +1,157 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "osd/OSD.h"
+#include "osd/scheduler/OpSchedulerItem.h"
+
+using namespace ceph::osd::scheduler;
+
+using Ingress = OSDShard::Ingress;
+
+namespace {
+
+std::atomic<unsigned> live_items = 0;
+
+struct MockItem : public PGOpQueueable {
+  MockItem() : PGOpQueueable(spg_t()) {
+    ++live_items;
+  }
+  ~MockItem() override {
+    --live_items;
+  }
+
+  std::ostream &print(std::ostream &rhs) const final { return rhs; }
+
+  std::string print() const final {
+    return std::string();
+  }
+
+  std::optional<OpRequestRef> maybe_get_op() const final {
+    return std::nullopt;
+  }
+
+  op_scheduler_class get_scheduler_class() const final {
+    return op_scheduler_class::client;
+  }
+
+  void run(OSD *osd, OSDShard *sdata, PGRef& pg,
+	   ThreadPool::TPHandle &handle) final {}
+};
+
+// the producer goes in the owner and its sequence number in the epoch
+OpSchedulerItem create_item(uint64_t producer, epoch_t seq)
+{
+  return OpSchedulerItem(
+    std::make_unique<MockItem>(), 1, 1, utime_t(), producer, seq);
+}
+
+} // anonymous namespace
+
+TEST(OSDShardIngress, fifo)
+{
+  Ingress ingress;
+  ASSERT_TRUE(ingress.empty());
+  ASSERT_EQ(0u, ingress.drain([](OpSchedulerItem&&, ceph::mono_time) {
+    FAIL();
+  }));
+
+  constexpr epoch_t count = 100;
+  auto before = ceph::mono_clock::now();
+  for (epoch_t i = 0; i < count; ++i) {
+    // only the first push finds the queue empty
+    ASSERT_EQ(i == 0, ingress.push(create_item(0, i)));
+    ASSERT_FALSE(ingress.empty());
+  }
+
+  auto after = ceph::mono_clock::now();
+
+  // each item carries the time it was pushed
+  epoch_t expected = 0;
+  auto last = before;
+  ASSERT_EQ(count, ingress.drain([&](OpSchedulerItem&& item,
+				     ceph::mono_time stamp) {
+    ASSERT_EQ(expected, item.get_map_epoch());
+    ASSERT_LE(last, stamp);
+    ASSERT_LE(stamp, after);
+    last = stamp;
+    ++expected;
+  }));
+  ASSERT_EQ(count, expected);
+  ASSERT_TRUE(ingress.empty());
+  ASSERT_EQ(0u, live_items.load());
+
+  // and again after the queue has been emptied
+  ASSERT_TRUE(ingress.push(create_item(0, count)));
+  ASSERT_FALSE(ingress.push(create_item(0, count + 1)));
+  expected = count;
+  ASSERT_EQ(2u, ingress.drain([&](OpSchedulerItem&& item, ceph::mono_time) {
+    ASSERT_EQ(expected, item.get_map_epoch());
+    ++expected;
+  }));
+  ASSERT_TRUE(ingress.empty());
+}
+
+TEST(OSDShardIngress, release_undrained)
+{
+  {
+    Ingress ingress;
+    for (epoch_t i = 0; i < 10; ++i) {
+      ingress.push(create_item(0, i));
+    }
+    ASSERT_EQ(10u, live_items.load());
+  }
+  ASSERT_EQ(0u, live_items.load());
+}
+
+TEST(OSDShardIngress, concurrent_producers)
+{
+  constexpr unsigned producers = 4;
+  constexpr epoch_t per_producer = 50000;
+  Ingress ingress;
+  std::atomic<unsigned> done = 0;
+
+  std::vector<std::thread> threads;
+  for (unsigned p = 0; p < producers; ++p) {
+    threads.emplace_back([&ingress, &done, p] {
+      for (epoch_t i = 0; i < per_producer; ++i) {
+	ingress.push(create_item(p, i));
+      }
+      ++done;
+    });
+  }
+
+  // each producer's items must come out in the order it pushed them,
+  // every one of them exactly once
+  std::vector<epoch_t> next(producers, 0);
+  unsigned drained = 0;
+  bool in_order = true;
+  auto consume = [&](OpSchedulerItem&& item, ceph::mono_time) {
+    auto p = item.get_owner();
+    if (p >= producers || item.get_map_epoch() != next[p]) {
+      in_order = false;
+      return;
+    }
+    ++next[p];
+  };
+  while (done < producers) {
+    drained += ingress.drain(consume);
+  }
+  drained += ingress.drain(consume);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  ASSERT_TRUE(in_order);
+  ASSERT_EQ(producers * per_producer, drained);
+  for (unsigned p = 0; p < producers; ++p) {
+    ASSERT_EQ(per_producer, next[p]);
+  }
+  ASSERT_TRUE(ingress.empty());
+  ASSERT_EQ(0u, live_items.load());
+}
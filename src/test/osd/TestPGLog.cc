@@ -2234,7 +2234,7 @@ TEST_F(PGLogTest, ErrorNotIndexedByObject) {
   log.add(modify);
 
   EXPECT_TRUE(log.logged_object(oid));
-  pg_log_entry_t *entry = log.objects[oid];
+  pg_log_entry_t *entry = log.get_object_entry(oid);
   EXPECT_EQ(modify.op, entry->op);
   EXPECT_EQ(modify.version, entry->version);
   EXPECT_EQ(modify.prior_version, entry->prior_version);
@@ -2248,7 +2248,7 @@ TEST_F(PGLogTest, ErrorNotIndexedByObject) {
   log.add(del);
 
   EXPECT_TRUE(log.logged_object(oid));
-  entry = log.objects[oid];
+  entry = log.get_object_entry(oid);
   EXPECT_EQ(del.op, entry->op);
   EXPECT_EQ(del.version, entry->version);
   EXPECT_EQ(del.prior_version, entry->prior_version);
@@ -2261,7 +2261,7 @@ TEST_F(PGLogTest, ErrorNotIndexedByObject) {
 		   utime_t(20,1), -ENOENT));
 
   EXPECT_TRUE(log.logged_object(oid));
-  entry = log.objects[oid];
+  entry = log.get_object_entry(oid);
   EXPECT_EQ(del.op, entry->op);
   EXPECT_EQ(del.version, entry->version);
   EXPECT_EQ(del.prior_version, entry->prior_version);
@@ -2466,7 +2466,7 @@ public:
     hoid.oid = "log";
     ghobject_t log_oid(hoid);
     map<string, bufferlist> km;
-    write_log_and_missing(t, &km, test_coll, log_oid, false);
+    write_log_and_missing(t, &km, test_coll, log_oid, false, true);
     if (!km.empty()) {
       t.omap_setkeys(test_coll, log_oid, km);
     }
@@ -2487,6 +2487,54 @@ public:
     }
   }
 
+  ghobject_t dups_oid() const {
+    hobject_t hoid;
+    hoid.pool = 1;
+    hoid.oid = "log";
+    return ghobject_t(hoid);
+  }
+
+  /// write the dirty dups, returning the keys that were (re)written
+  set<string> write_dups(bool batch) {
+    ObjectStore::Transaction t;
+    map<string, bufferlist> km;
+    write_log_and_missing(t, &km, test_coll, dups_oid(), false, batch);
+    set<string> written;
+    for (auto& [key, bl] : km) {
+      written.insert(key);
+    }
+    t.omap_setkeys(test_coll, dups_oid(), km);
+    auto ch = store->open_collection(test_coll);
+    EXPECT_EQ(0, store->queue_transaction(ch, std::move(t)));
+    return written;
+  }
+
+  /// dup keys on disk, with the number of dups each one holds
+  map<string, unsigned> read_dup_keys() {
+    auto ch = store->open_collection(test_coll);
+    map<string, unsigned> keys;
+    auto it = store->get_omap_iterator(ch, dups_oid());
+    for (it->seek_to_first(); it->valid(); it->next()) {
+      if (is_dup_batch_key(it->key())) {
+	list<pg_log_dup_t> dups;
+	bufferlist bl = it->value();
+	auto bp = bl.cbegin();
+	decode_dup_batch(bp, &dups);
+	keys[it->key()] = dups.size();
+      } else if (it->key().compare(0, 4, "dup_") == 0) {
+	keys[it->key()] = 1;
+      }
+    }
+    return keys;
+  }
+
+  void trim_dups(unsigned n) {
+    while (n--) {
+      trimmed_dups.insert(log.dups.front().get_key_name());
+      log.dups.pop_front();
+    }
+  }
+
   coll_t test_coll;
 };
 
@@ -2674,6 +2722,189 @@ TEST_F(PGLogMergeDupsTest, Superset) {
 }
 
 
+TEST_F(PGLogMergeDupsTest, LegacyDupKeys) {
+  hobject_t hoid;
+  hoid.pool = 1;
+  hoid.oid = "log";
+  ghobject_t log_oid(hoid);
+  auto ch = store->open_collection(test_coll);
+
+  // a log written before dups were batched, with one key per dup
+  {
+    ObjectStore::Transaction t;
+    map<string, bufferlist> km;
+    for (unsigned v = 1; v <= 200; ++v) {
+      auto dup = create_dup_entry(1, v);
+      encode(dup, km[dup.get_key_name()]);
+    }
+    t.touch(test_coll, log_oid);
+    t.omap_setkeys(test_coll, log_oid, km);
+    ASSERT_EQ(0, store->queue_transaction(ch, std::move(t)));
+  }
+  ostringstream err;
+  read_log_and_missing(store.get(), ch, log_oid, pg_info_t(), err, false);
+  ASSERT_EQ(200u, log.dups.size());
+
+  // trim the oldest 100 dups and add 100 newer ones
+  for (unsigned i = 0; i < 100; ++i) {
+    trimmed_dups.insert(log.dups.front().get_key_name());
+    log.dups.pop_front();
+  }
+  for (unsigned v = 201; v <= 300; ++v) {
+    add_dups(1, v);
+  }
+  {
+    ObjectStore::Transaction t;
+    map<string, bufferlist> km;
+    write_log_and_missing(t, &km, test_coll, log_oid, false, true);
+    t.omap_setkeys(test_coll, log_oid, km);
+    ASSERT_EQ(0, store->queue_transaction(ch, std::move(t)));
+  }
+
+  // trimmed per-key dups are gone, the new ones went into batches
+  set<string> keys;
+  ASSERT_EQ(0, store->omap_get_keys(ch, log_oid, &keys));
+  unsigned legacy = 0, batches = 0;
+  for (auto& key : keys) {
+    if (is_dup_batch_key(key)) {
+      ++batches;
+    } else if (key.compare(0, 4, "dup_") == 0) {
+      ++legacy;
+    }
+  }
+  EXPECT_EQ(100u, legacy);
+  EXPECT_EQ(2u, batches);
+
+  auto orig_dups = log.dups;
+  clear();
+  read_log_and_missing(store.get(), ch, log_oid, pg_info_t(), err, false);
+  ASSERT_EQ(orig_dups, log.dups);
+  EXPECT_EQ(eversion_t(1, 191), legacy_dups_to);
+}
+
+TEST_F(PGLogMergeDupsTest, DupKeysUntilBatchesAllowed) {
+  for (unsigned v = 1; v <= 100; ++v) {
+    add_dups(1, v);
+  }
+  write_dups(false);
+  trim_dups(30);
+  add_dups(1, 101);
+  write_dups(false);
+
+  auto keys = read_dup_keys();
+  EXPECT_EQ(71u, keys.size());
+  for (auto& [key, n] : keys) {
+    EXPECT_FALSE(is_dup_batch_key(key));
+  }
+  EXPECT_EQ(eversion_t(1, 101), legacy_dups_to);
+}
+
+TEST_F(PGLogMergeDupsTest, BatchedTrim) {
+  // batches 1'0 to 1'192 hold versions 1-63, 64-127, 128-191 and 192-200
+  for (unsigned v = 1; v <= 200; ++v) {
+    add_dups(1, v);
+  }
+  auto written = write_dups(true);
+  EXPECT_EQ(4u, written.size());
+
+  // a trim empties batch 1'0 and cuts into 1'64, new dups land in
+  // 1'192; 1'128 is left alone
+  trim_dups(70);
+  for (unsigned v = 201; v <= 210; ++v) {
+    add_dups(1, v);
+  }
+  written = write_dups(true);
+  EXPECT_EQ(
+    set<string>({get_dup_batch_key(eversion_t(1, 64)),
+		 get_dup_batch_key(eversion_t(1, 192))}),
+    written);
+
+  auto keys = read_dup_keys();
+  EXPECT_EQ(
+    (map<string, unsigned>{{get_dup_batch_key(eversion_t(1, 64)), 57},
+			    {get_dup_batch_key(eversion_t(1, 128)), 64},
+			    {get_dup_batch_key(eversion_t(1, 192)), 19}}),
+    keys);
+
+  auto orig_dups = log.dups;
+  clear();
+  ostringstream err;
+  auto ch = store->open_collection(test_coll);
+  read_log_and_missing(store.get(), ch, dups_oid(), pg_info_t(), err, false);
+  ASSERT_EQ(orig_dups, log.dups);
+}
+
+TEST_F(PGLogMergeDupsTest, BatchedDirtyFrom) {
+  for (unsigned v = 1; v <= 200; ++v) {
+    add_dups(1, v);
+  }
+  write_dups(true);
+
+  // dups from 150 on are replaced, as merging a divergent log would
+  while (log.dups.back().version >= eversion_t(1, 150)) {
+    log.dups.pop_back();
+  }
+  add_dups(2, 160);
+  dirty_from_dups = eversion_t(1, 150);
+  auto written = write_dups(true);
+  EXPECT_EQ(
+    set<string>({get_dup_batch_key(eversion_t(1, 128)),
+		 get_dup_batch_key(eversion_t(2, 128))}),
+    written);
+
+  // the new epoch starts a batch of its own
+  auto keys = read_dup_keys();
+  EXPECT_EQ(
+    (map<string, unsigned>{{get_dup_batch_key(eversion_t(1, 0)), 63},
+			    {get_dup_batch_key(eversion_t(1, 64)), 64},
+			    {get_dup_batch_key(eversion_t(1, 128)), 22},
+			    {get_dup_batch_key(eversion_t(2, 128)), 1}}),
+    keys);
+
+  auto orig_dups = log.dups;
+  clear();
+  ostringstream err;
+  auto ch = store->open_collection(test_coll);
+  read_log_and_missing(store.get(), ch, dups_oid(), pg_info_t(), err, false);
+  ASSERT_EQ(orig_dups, log.dups);
+}
+
+TEST_F(PGLogMergeDupsTest, BatchedMergedLog) {
+  // a PG merge sorts the dups of both logs by eversion, so the version
+  // can go backwards when the epoch moves on
+  add_dups(5, 10);
+  add_dups(5, 200);
+  add_dups(6, 100);
+  add_dups(6, 101);
+  add_dups(7, 20);
+  write_dups(true);
+
+  auto keys = read_dup_keys();
+  EXPECT_EQ(
+    (map<string, unsigned>{{get_dup_batch_key(eversion_t(5, 0)), 1},
+			    {get_dup_batch_key(eversion_t(5, 192)), 1},
+			    {get_dup_batch_key(eversion_t(6, 64)), 2},
+			    {get_dup_batch_key(eversion_t(7, 0)), 1}}),
+    keys);
+
+  auto orig_dups = log.dups;
+  clear();
+  ostringstream err;
+  auto ch = store->open_collection(test_coll);
+  read_log_and_missing(store.get(), ch, dups_oid(), pg_info_t(), err, false);
+  ASSERT_EQ(orig_dups, log.dups);
+
+  // trimming up to the middle of epoch 6 only touches its batch
+  trim_dups(3);
+  auto written = write_dups(true);
+  EXPECT_EQ(set<string>({get_dup_batch_key(eversion_t(6, 64))}), written);
+  keys = read_dup_keys();
+  EXPECT_EQ(
+    (map<string, unsigned>{{get_dup_batch_key(eversion_t(6, 64)), 1},
+			    {get_dup_batch_key(eversion_t(7, 0)), 1}}),
+    keys);
+}
+
 struct PGLogTrimTest :
   public ::testing::Test,
   public PGLogTestBase,
@@ -2912,6 +3143,53 @@ TEST_F(PGLogTrimTest, TestGetRequest) {
   EXPECT_FALSE(result);
 }
 
+TEST_F(PGLogTrimTest, TestLazyRequestIndex) {
+  SetUp(20);
+  entity_name_t client = entity_name_t::CLIENT(777);
+
+  mempool::osd_pglog::list<pg_log_entry_t> entries;
+  entries.push_back(mk_ple_mod(mk_obj(1), mk_evt(10, 100), mk_evt(8, 70),
+			       osd_reqid_t(client, 8, 1)));
+  entries.push_back(mk_ple_mod(mk_obj(2), mk_evt(10, 101), mk_evt(8, 71),
+			       osd_reqid_t(client, 8, 2)));
+  entries.push_back(mk_ple_mod(mk_obj(1), mk_evt(10, 102), mk_evt(10, 100),
+			       osd_reqid_t(client, 8, 3)));
+  mempool::osd_pglog::list<pg_log_dup_t> dups;
+  dups.push_back(pg_log_dup_t(mk_evt(9, 90), 90, osd_reqid_t(client, 7, 1), 0));
+
+  PGLog::IndexedLog log(mk_evt(10, 102), mk_evt(9, 90), mk_evt(10, 102),
+			mk_evt(10, 102), std::move(entries), std::move(dups));
+
+  // only the object index is built up front
+  EXPECT_EQ(2u, log.objects.size());
+  EXPECT_EQ(mk_evt(10, 102), log.get_object_entry(mk_obj(1))->version);
+  EXPECT_EQ(mk_evt(10, 101), log.get_object_entry(mk_obj(2))->version);
+  EXPECT_EQ(nullptr, log.get_object_entry(mk_obj(3)));
+  EXPECT_EQ(0u, log.caller_ops.size());
+  EXPECT_EQ(0u, log.dup_index.size());
+
+  eversion_t version;
+  version_t user_version;
+  int return_code;
+  vector<pg_log_op_return_item_t> op_returns;
+
+  EXPECT_TRUE(log.get_request(osd_reqid_t(client, 8, 2), &version,
+			      &user_version, &return_code, &op_returns));
+  EXPECT_EQ(mk_evt(10, 101), version);
+  EXPECT_EQ(3u, log.caller_ops.size());
+
+  EXPECT_TRUE(log.get_request(osd_reqid_t(client, 7, 1), &version,
+			      &user_version, &return_code, &op_returns));
+  EXPECT_EQ(mk_evt(9, 90), version);
+  EXPECT_EQ(1u, log.dup_index.size());
+
+  // requests added after the index is built are found too
+  log.add(mk_ple_mod(mk_obj(3), mk_evt(11, 103), mk_evt(10, 90),
+		     osd_reqid_t(client, 8, 4)));
+  EXPECT_EQ(3u, log.objects.size());
+  EXPECT_TRUE(log.logged_req(osd_reqid_t(client, 8, 4)));
+}
+
 TEST_F(PGLogTest, _merge_object_divergent_entries) {
   {
     // Test for issue 20843
@@ -16,6 +16,7 @@
 #include "osd/PGTransaction.h"
 #include "osd/ECTransaction.h"
 #include "common/debug.h"
+#include "erasure-code/ErasureCodePlugin.h"
 
 #include "test/unit.cc"
 
@@ -123,3 +124,191 @@ TEST(ectransaction, many_writes)
   ASSERT_EQ(0u, plan.to_read.size());
   ASSERT_EQ(1u, plan.will_write.size());
 }
+
+TEST(ectransaction, parity_delta_candidates)
+{
+  hobject_t h;
+  ECUtil::stripe_info_t sinfo(4, 2, 16384);
+  auto get_hinfo = [&](const hobject_t &i) {
+    ECUtil::HashInfoRef ref(new ECUtil::HashInfo(6));
+    ref->set_projected_total_logical_size(sinfo, 65536);
+    return ref;
+  };
+
+  // a small overwrite within one data chunk only needs that chunk and
+  // the two coding chunks
+  {
+    PGTransactionUPtr t(new PGTransaction);
+    bufferlist a;
+    a.append_zero(100);
+    t->write(h, 16384 + 4096 + 10, a.length(), a, 0);
+
+    auto plan = ECTransaction::get_write_plan(sinfo, *t, get_hinfo, &dpp);
+    generic_derr << "to_read " << plan.to_read << dendl;
+    generic_derr << "delta_shards " << plan.delta_shards << dendl;
+
+    ASSERT_EQ(1u, plan.to_read.size());
+    ASSERT_EQ(1u, plan.delta_shards.size());
+    ASSERT_EQ(std::set<int>({1, 4, 5}), plan.delta_shards[h]);
+  }
+
+  // touching three of four data chunks reads more than the stripe
+  {
+    PGTransactionUPtr t(new PGTransaction);
+    bufferlist a;
+    a.append_zero(8192);
+    t->write(h, 2048, a.length(), a, 0);
+
+    auto plan = ECTransaction::get_write_plan(sinfo, *t, get_hinfo, &dpp);
+    ASSERT_EQ(1u, plan.to_read.size());
+    ASSERT_EQ(0u, plan.delta_shards.size());
+  }
+
+  // growing the object is never a delta update
+  {
+    PGTransactionUPtr t(new PGTransaction);
+    bufferlist a;
+    a.append_zero(100);
+    t->write(h, 65536 - 50, a.length(), a, 0);
+
+    auto plan = ECTransaction::get_write_plan(sinfo, *t, get_hinfo, &dpp);
+    ASSERT_EQ(0u, plan.delta_shards.size());
+  }
+}
+
+/// the data written to each shard by a transaction of nothing but writes
+static std::map<int, std::pair<uint64_t, bufferlist>> get_shard_writes(
+  std::map<shard_id_t, ceph::os::Transaction> &transactions)
+{
+  std::map<int, std::pair<uint64_t, bufferlist>> writes;
+  for (auto &&[shard, t] : transactions) {
+    auto i = t.begin();
+    while (i.have_op()) {
+      auto op = i.decode_op();
+      EXPECT_EQ((uint32_t)ceph::os::Transaction::OP_WRITE, op->op);
+      bufferlist bl;
+      i.decode_bl(bl);
+      EXPECT_EQ(0u, writes.count(shard));
+      writes[shard] = std::make_pair(op->off, bl);
+    }
+  }
+  return writes;
+}
+
+static void check_parity_delta(
+  const char *plugin,
+  ErasureCodeProfile profile,
+  uint64_t write_off,
+  uint64_t write_len)
+{
+  SCOPED_TRACE(std::string(plugin) + " " + std::to_string(write_off) +
+	       "~" + std::to_string(write_len));
+  ErasureCodeInterfaceRef ec;
+  ASSERT_EQ(0, ErasureCodePluginRegistry::instance().factory(
+	      plugin,
+	      g_conf().get_val<std::string>("erasure_code_dir"),
+	      profile, &ec, &std::cerr));
+  ASSERT_TRUE(ec->supports_parity_delta_writes());
+  const unsigned k = ec->get_data_chunk_count();
+  const unsigned m = ec->get_coding_chunk_count();
+  const uint64_t chunk_size = 4096;
+  ECUtil::stripe_info_t sinfo(k, m, k * chunk_size);
+  const uint64_t stripe_width = sinfo.get_stripe_width();
+  const uint64_t object_size = 3 * stripe_width;
+
+  // an object of three stripes, and the same object after the overwrite
+  bufferptr before(object_size);
+  for (uint64_t i = 0; i < object_size; ++i) {
+    before[i] = rand();
+  }
+  bufferptr after(before.c_str(), object_size);
+  bufferptr update(write_len);
+  for (uint64_t i = 0; i < write_len; ++i) {
+    update[i] = rand();
+  }
+  memcpy(after.c_str() + write_off, update.c_str(), write_len);
+
+  std::set<int> want;
+  for (unsigned i = 0; i < k + m; ++i) {
+    want.insert(i);
+  }
+  std::map<int, bufferlist> old_encoded, new_encoded;
+  {
+    bufferlist bl;
+    bl.append(before);
+    ASSERT_EQ(0, ECUtil::encode(sinfo, ec, bl, want, &old_encoded));
+  }
+  {
+    bufferlist bl;
+    bl.append(after);
+    ASSERT_EQ(0, ECUtil::encode(sinfo, ec, bl, want, &new_encoded));
+  }
+
+  // what the read before a delta write would return: the touched data
+  // chunks and every coding chunk of the stripes the write spans
+  const uint64_t offset = sinfo.logical_to_prev_stripe_offset(write_off);
+  const uint64_t length =
+    sinfo.logical_to_next_stripe_offset(write_off + write_len) - offset;
+  const uint64_t chunk_off = sinfo.aligned_logical_offset_to_chunk_offset(offset);
+  const uint64_t chunk_len = sinfo.aligned_logical_offset_to_chunk_offset(length);
+  std::set<int> touched;
+  for (uint64_t i = write_off; i < write_off + write_len; ++i) {
+    touched.insert((i % stripe_width) / chunk_size);
+  }
+  std::map<int, extent_map> old_chunks;
+  for (unsigned shard = 0; shard < k + m; ++shard) {
+    if (shard < k && !touched.count(shard)) {
+      continue;
+    }
+    bufferlist bl;
+    bl.substr_of(old_encoded[shard], chunk_off, chunk_len);
+    old_chunks[shard].insert(chunk_off, chunk_len, bl);
+  }
+
+  extent_map to_write;
+  {
+    bufferlist bl;
+    bl.append(update);
+    to_write.insert(write_off, write_len, bl);
+  }
+  std::map<shard_id_t, ceph::os::Transaction> transactions;
+  for (unsigned shard = 0; shard < k + m; ++shard) {
+    transactions[shard_id_t(shard)];
+  }
+  hobject_t h;
+  ECTransaction::encode_delta_and_write(
+    pg_t(1, 1), h, sinfo, ec, offset, length, to_write, old_chunks, 0,
+    &transactions, &dpp);
+
+  // only the touched data chunks and the coding chunks are written, and
+  // they match a full re-encode of the new stripes
+  auto writes = get_shard_writes(transactions);
+  ASSERT_EQ(touched.size() + m, writes.size());
+  for (auto &&[shard, write] : writes) {
+    SCOPED_TRACE("shard " + std::to_string(shard));
+    ASSERT_TRUE(shard >= (int)k || touched.count(shard));
+    ASSERT_EQ(chunk_off, write.first);
+    bufferlist expected;
+    expected.substr_of(new_encoded[shard], chunk_off, chunk_len);
+    ASSERT_TRUE(expected.contents_equal(write.second));
+  }
+}
+
+TEST(ectransaction, parity_delta_matches_encode)
+{
+  std::vector<std::pair<const char*, ErasureCodeProfile>> codes = {
+    {"jerasure", {{"technique", "reed_sol_van"}, {"k", "4"}, {"m", "2"}}},
+#ifdef WITH_EC_ISA_PLUGIN
+    {"isa", {{"technique", "reed_sol_van"}, {"k", "4"}, {"m", "2"}}},
+    {"isa", {{"technique", "cauchy"}, {"k", "4"}, {"m", "2"}}},
+#endif
+  };
+  for (auto &[plugin, profile] : codes) {
+    // within one chunk, at a non-zero offset in the second stripe
+    check_parity_delta(plugin, profile, 16384 + 4096 + 10, 100);
+    // the whole of one chunk in the last stripe
+    check_parity_delta(plugin, profile, 2 * 16384 + 3 * 4096, 4096);
+    // the last chunk of the first stripe and the first of the second
+    check_parity_delta(plugin, profile, 16384 - 200, 500);
+  }
+}
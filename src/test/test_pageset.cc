@@ -281,3 +281,36 @@ TEST(PageSet, FreeHoles)
   pages.get_range(0, 8, range);
   ASSERT_EQ(0u, range.size());
 }
+
+TEST(PageSet, ThreadCache)
+{
+  Page::set_thread_cache_pages(2);
+  char *data;
+  {
+    PageSet pages(16);
+    PageSet::page_vector range;
+    pages.alloc_range(0, 16, range);
+    ASSERT_EQ(1u, range.size());
+    data = range[0]->data;
+    range.clear();
+    // freed into this thread's cache
+    pages.free_pages_after(0);
+  }
+  {
+    // the next page of the same size reuses the buffer
+    PageSet pages(16);
+    PageSet::page_vector range;
+    pages.alloc_range(32, 16, range);
+    ASSERT_EQ(1u, range.size());
+    ASSERT_EQ(data, range[0]->data);
+    ASSERT_EQ(32u, range[0]->offset);
+  }
+  {
+    // more pages than the cache holds go back to the heap
+    PageSet pages(16);
+    PageSet::page_vector range;
+    pages.alloc_range(0, 64, range);
+    ASSERT_EQ(4u, range.size());
+  }
+  Page::set_thread_cache_pages(0);
+}
@@ -612,7 +612,8 @@ typedef map<eversion_t, hobject_t> divergent_priors_t;
 int write_pg(ObjectStore::Transaction &t, epoch_t epoch, pg_info_t &info,
 	     pg_log_t &log, PastIntervals &past_intervals,
 	     divergent_priors_t &divergent,
-	     pg_missing_t &missing)
+	     pg_missing_t &missing,
+	     bool batch_dups)
 {
   cout << __func__ << " epoch " << epoch << " info " << info << std::endl;
   int ret = write_info(t, epoch, info, past_intervals);
@@ -626,13 +627,14 @@ int write_pg(ObjectStore::Transaction &t, epoch_t epoch, pg_info_t &info,
     ceph_assert(missing.get_items().empty());
     PGLog::write_log_and_missing_wo_missing(
       t, &km, log, coll, info.pgid.make_pgmeta_oid(), divergent,
-      require_rollback);
+      require_rollback, batch_dups);
   } else {
     pg_missing_tracker_t tmissing(missing);
     bool rebuilt_missing_set_with_deletes = missing.may_include_deletes;
     PGLog::write_log_and_missing(
       t, &km, log, coll, info.pgid.make_pgmeta_oid(), tmissing,
       require_rollback,
+      batch_dups,
       &rebuilt_missing_set_with_deletes);
   }
   t.omap_setkeys(coll, info.pgid.make_pgmeta_oid(), km);
@@ -771,10 +773,14 @@ int do_trim_pg_log_dups(ObjectStore *store, const coll_t &coll,
 	 << " the trimming will never stop!" << std::endl;
   }
 
-  set<string> keys_to_keep;
   size_t num_removed = 0;
   do {
+    // dup keys kept so far, with the number of dups each one holds: one
+    // for a per-key dup, up to PGLOG_DUP_BATCH_SPAN for a batch record
+    map<string, size_t> keys_to_keep;
+    size_t dups_kept = 0;
     set<string> keys_to_trim;
+    bool complete = false;
     {
     ObjectMap::ObjectMapIterator p = store->get_omap_iterator(ch, oid);
     if (!p)
@@ -794,16 +800,28 @@ int do_trim_pg_log_dups(ObjectStore *store, const coll_t &coll,
 	continue;
       if (p->key().substr(0, 4) != string("dup_"))
 	continue;
-      keys_to_keep.insert(p->key());
-      if (keys_to_keep.size() > max_dup_entries) {
+      size_t count = 1;
+      if (PGLog::is_dup_batch_key(p->key())) {
+	list<pg_log_dup_t> dups;
+	bufferlist bl = p->value();
+	auto bp = bl.cbegin();
+	PGLog::decode_dup_batch(bp, &dups);
+	count = dups.size();
+      }
+      keys_to_keep[p->key()] = count;
+      dups_kept += count;
+      // drop whole keys as long as enough dups remain
+      while (dups_kept - keys_to_keep.begin()->second >= max_dup_entries) {
 	auto oldest_to_keep = keys_to_keep.begin();
-      	keys_to_trim.emplace(*oldest_to_keep);
+	dups_kept -= oldest_to_keep->second;
+	keys_to_trim.emplace(oldest_to_keep->first);
 	keys_to_keep.erase(oldest_to_keep);
       }
       if (keys_to_trim.size() >= max_chunk_size) {
 	break;
       }
     }
+    complete = !p->valid();
     } // deconstruct ObjectMapIterator
     // delete the keys
     num_removed = keys_to_trim.size();
@@ -814,6 +832,37 @@ int do_trim_pg_log_dups(ObjectStore *store, const coll_t &coll,
       store->queue_transaction(ch, std::move(t));
       ch->flush();
     }
+    // the oldest batch kept may still hold more dups than needed
+    if (!dry_run && complete && dups_kept > max_dup_entries) {
+      const string key = keys_to_keep.begin()->first;
+      ceph_assert(PGLog::is_dup_batch_key(key));
+      bufferlist bl;
+      set<string> to_get = {key};
+      map<string, bufferlist> got;
+      r = store->omap_get_values(ch, oid, to_get, &got);
+      ceph_assert(r == 0 && got.count(key));
+      list<pg_log_dup_t> dups;
+      auto bp = got[key].cbegin();
+      PGLog::decode_dup_batch(bp, &dups);
+      vector<const pg_log_dup_t*> keep;
+      size_t skip = dups_kept - max_dup_entries;
+      for (auto& dup : dups) {
+	if (skip) {
+	  --skip;
+	} else {
+	  keep.push_back(&dup);
+	}
+      }
+      cout << "Rewriting key " << key << " with " << keep.size()
+	   << " of " << dups.size() << " dups" << std::endl;
+      PGLog::encode_dup_batch(keep, bl);
+      map<string, bufferlist> km;
+      km[key] = std::move(bl);
+      ObjectStore::Transaction t;
+      t.omap_setkeys(coll, oid, km);
+      store->queue_transaction(ch, std::move(t));
+      ch->flush();
+    }
   } while (num_removed == max_chunk_size);
 
   // compact the db since we just removed a bunch of data
@@ -1123,7 +1172,8 @@ int expand_log(
   ObjectStore *fs,
   spg_t pgid,
   pg_info_t &info,
-  eversion_t target_version)
+  eversion_t target_version,
+  bool batch_dups)
 {
   try {
     bufferlist bl;
@@ -1182,7 +1232,8 @@ int expand_log(
       &km,
       coll_t(pgid),
       pgid.make_pgmeta_oid(),
-      pool_info->require_rollback());
+      pool_info->require_rollback(),
+      batch_dups);
 
     for (auto &ent : km) {
       std::cout << "km key: " << ent.first << std::endl;
@@ -2227,7 +2278,9 @@ int ObjectStoreTool::do_import(ObjectStore *store, OSDSuperblock& sb,
       newlog,
       ms.past_intervals,
       ms.divergent_priors,
-      ms.missing);
+      ms.missing,
+      sb.compat_features.incompat.contains(
+	CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH));
     if (ret) return ret;
   }
 
@@ -4751,7 +4804,9 @@ int main(int argc, char **argv)
 
       dump_log(formatter, cout, log, missing);
     } else if (op == "extend-log-with-fake-entries") {
-      ret = expand_log(cct.get(), fs.get(), pgid, info, target_version);
+      ret = expand_log(cct.get(), fs.get(), pgid, info, target_version,
+		       superblock->compat_features.incompat.contains(
+			 CEPH_OSD_FEATURE_INCOMPAT_PGLOG_DUP_BATCH));
       if (ret < 0)
 	goto out;
     } else if (op == "mark-complete") {